@@ -13,11 +13,24 @@
 #include <sys/types.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <linux/fs.h> 
+#include <pthread.h>
+#include <time.h>
 #include "device.h"
 
+#define BUF_PREFIX "buf:"
+#define EMU_PREFIX "emu:"
+#define STRIPE_PREFIX "stripe:"
+#define STRIPE_MAX 16
+#define DEVICE_IOV 64    /* pieces per system call */
+#define POOL_CLASSES 11  /* DEVICE_ALIGN << 0 ... DEVICE_ALIGN << 10 */
+#define POOL_KEEP 8      /* free buffers kept per class */
+#define EMU_SPIN_NS 20000 /* sleep no closer than this to a deadline */
+#define NAME_LEN 48
+
 /**
  * Needs:
  *   fstat()
@@ -26,16 +39,130 @@
  *   ioctl()
  *   open()
  *   close()
- *   pread()
- *   pwrite()
+ *   preadv()
+ *   pwritev()
+ *   fdatasync()
+ *   pthread_cond_timedwait()
+ *   ftruncate()
+ *   posix_fadvise()
+ *   sync_file_range()
+ */
+
+/**
+ * An emulated device stands in for a volume when the pathname starts with
+ * "emu:". Its bytes live in memory or in a sparse file opened without
+ * O_DIRECT, and every operation is held until it would complete on a
+ * modeled device: a fixed latency per operation, a data path shared at a
+ * fixed bandwidth, at most depth operations in flight and, seeded and so
+ * reproducible, an occasional latency spike. Writes can be set to fail past
+ * a byte count, to exercise the error paths above.
+ */
+
+struct emu {
+	char *mem;         /* NULL ==> file backed */
+	uint64_t read_ns;  /* per operation */
+	uint64_t write_ns;
+	uint64_t mbps;     /* data path, 0 ==> unlimited */
+	uint64_t depth;    /* operations in flight */
+	uint64_t spike_n;  /* one operation in spike_n, 0 ==> never */
+	uint64_t spike_ns;
+	uint64_t seed;
+	uint64_t wfail;    /* bytes written before writes fail, 0 ==> never */
+	uint64_t written;
+	uint64_t inflight;
+	uint64_t channel;  /* ns, the data path is busy until */
+	pthread_mutex_t mutex;
+	pthread_cond_t slot;
+};
+
+/**
+ * A striped device spreads its units round-robin over member devices: unit
+ * u lives on member u % n at offset u / n. A range is therefore one
+ * contiguous range per member. Each member has a lane, a thread serving a
+ * queue of its share of the calls that span more than one member, so the
+ * members of a call transfer in parallel.
+ */
+
+struct task {
+	struct task *next;
+	struct job *job;
+};
+
+struct job {
+	const struct iovec *iov;
+	int count;
+	uint64_t off;
+	uint64_t len;
+	int op;      /* DEVICE_OP_* */
+	int pending; /* lanes */
+	int e;
+};
+
+struct lane {
+	struct device *device;
+	struct task *head; /* queue */
+	struct task *tail;
+	pthread_t thread;
+	pthread_cond_t work;
+	struct stripe *stripe;
+};
+
+struct stripe {
+	int done;
+	int n;
+	uint64_t unit; /* immutable */
+	struct lane lanes[STRIPE_MAX];
+	pthread_mutex_t mutex;
+	pthread_cond_t complete;
+};
+
+/**
+ * The buffer pool hands out DEVICE_ALIGN aligned buffers in power of two
+ * classes, each with a header just below it, and keeps a few free ones per
+ * class for the next caller.
+ */
+
+struct buffer {
+	struct buffer *next;
+	void *raw;
+	int class_; /* -1 ==> not pooled */
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer *pool_free[POOL_CLASSES];
+static int pool_n[POOL_CLASSES];
+
+/**
+ * Every device counts its operations: bytes, a latency histogram per kind,
+ * the queue depth each operation found, and the time at least one was in
+ * flight. The monitor, when running, prints the open devices periodically.
  */
 
 struct device {
 	int fd;
-	uint64_t size;  /* immutable */
-	uint64_t block; /* immutable */
+	int buffered;          /* through the page cache, not O_DIRECT */
+	uint64_t size;         /* immutable */
+	uint64_t block;        /* immutable */
+	uint64_t align;        /* immutable, of buffers, offsets and lengths */
+	struct emu *emu;       /* NULL unless emulated */
+	struct stripe *stripe; /* NULL unless striped */
+	char name[NAME_LEN];   /* immutable, the pathname, cut short */
+	uint64_t opened;       /* immutable, ns */
+	uint64_t inflight;
+	uint64_t busy;         /* ns, the current busy period began */
+	struct device_stats stats;
+	struct device_stats last;  /* monitor, at the previous print */
+	struct device *next;       /* monitor, open devices */
+	pthread_mutex_t mutex;
 };
 
+static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+static struct device *monitor_devices;
+static pthread_t monitor_thread;
+static uint64_t monitor_period; /* ms, 0 ==> stopped */
+static FILE *monitor_file;
+
 static int
 geometry(struct device *device)
 {
@@ -69,6 +196,612 @@ geometry(struct device *device)
 	}
 	device->size = u64 / u32 * u32;
 	device->block = u32;
+	device->align = device->buffered ? 1 : u32;
+	return 0;
+}
+
+static int
+number(const char *s, uint64_t *n)
+{
+	char *end;
+
+	/* decimal with an optional K, M or G */
+
+	(*n) = strtoul(s, &end, 10);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		(*n) <<= 10;
+		++end;
+		break;
+	case 'm':
+	case 'M':
+		(*n) <<= 20;
+		++end;
+		break;
+	case 'g':
+	case 'G':
+		(*n) <<= 30;
+		++end;
+		break;
+	default:
+		break;
+	}
+	return ((end == s) || ((*end) && (',' != (*end)))) ? -1 : 0;
+}
+
+static int
+configure(struct device *device, const char *spec, char *file, size_t len)
+{
+	struct emu *emu;
+	const char *p;
+	uint64_t n;
+	size_t i;
+	int e;
+
+	/* key=value,... */
+
+	emu = device->emu;
+	for (p=spec, e=0; (*p) && !e; p+=(',' == (*p)) ? 1 : 0) {
+		if (!strncmp(p, "file=", 5)) {
+			for (p+=5, i=0; (*p) && (',' != (*p)); ++p) {
+				if ((i + 1) < len) {
+					file[i++] = (*p);
+				}
+			}
+			file[i] = 0;
+			continue;
+		}
+		if (!strncmp(p, "size=", 5)) {
+			e = number(p += 5, &device->size);
+		}
+		else if (!strncmp(p, "block=", 6)) {
+			e = number(p += 6, &device->block);
+		}
+		else if (!strncmp(p, "lat=", 4)) {
+			e = number(p += 4, &n);
+			emu->read_ns = emu->write_ns = n * 1000;
+		}
+		else if (!strncmp(p, "rlat=", 5)) {
+			e = number(p += 5, &n);
+			emu->read_ns = n * 1000;
+		}
+		else if (!strncmp(p, "wlat=", 5)) {
+			e = number(p += 5, &n);
+			emu->write_ns = n * 1000;
+		}
+		else if (!strncmp(p, "bw=", 3)) {
+			e = number(p += 3, &emu->mbps);
+		}
+		else if (!strncmp(p, "qd=", 3)) {
+			e = number(p += 3, &emu->depth);
+		}
+		else if (!strncmp(p, "spike=", 6)) {
+			e = number(p += 6, &emu->spike_n);
+		}
+		else if (!strncmp(p, "spike_us=", 9)) {
+			e = number(p += 9, &n);
+			emu->spike_ns = n * 1000;
+		}
+		else if (!strncmp(p, "seed=", 5)) {
+			e = number(p += 5, &emu->seed);
+		}
+		else if (!strncmp(p, "wfail=", 6)) {
+			e = number(p += 6, &emu->wfail);
+		}
+		else {
+			e = -1;
+		}
+		while ((*p) && (',' != (*p))) {
+			++p;
+		}
+	}
+	if (e) {
+		TRACE("bad emulated device");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+emulate(struct device *device, const char *spec)
+{
+	struct stat st;
+	struct emu *emu;
+	char file[256];
+
+	if (!(emu = malloc(sizeof (struct emu)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(emu, 0, sizeof (struct emu));
+	if (pthread_mutex_init(&emu->mutex, NULL) ||
+	    pthread_cond_init(&emu->slot, NULL)) {
+		FREE(emu);
+		TRACE("pthread_*()");
+		return -1;
+	}
+	device->emu = emu;
+	device->block = 4096;
+	emu->depth = 32;
+	emu->seed = 1;
+	file[0] = 0;
+	if (configure(device, spec, file, sizeof (file))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* the backing bytes, a sparse file keeps its size unless given one */
+
+	if (file[0]) {
+		if (0 >= (device->fd = open(file, O_RDWR | O_CREAT, 0644))) {
+			TRACE("open()");
+			return -1;
+		}
+		if (device->size) {
+			if (ftruncate(device->fd, (off_t)device->size)) {
+				TRACE("ftruncate()");
+				return -1;
+			}
+		}
+		else if (!fstat(device->fd, &st)) {
+			device->size = (uint64_t)st.st_size;
+		}
+	}
+	if (!device->block ||
+	    (device->block & (device->block - 1)) ||
+	    (device->size < device->block) ||
+	    !emu->depth ||
+	    !emu->seed) {
+		TRACE("bad device geometry");
+		return -1;
+	}
+	device->size = device->size / device->block * device->block;
+	device->align = device->block;
+	if (!file[0] && !(emu->mem = calloc(1, device->size))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+await(uint64_t t)
+{
+	uint64_t now;
+
+	/* sleep most of the way, spin the rest */
+
+	while ((now = ref_time_ns()) < t) {
+		if ((t - now) > EMU_SPIN_NS) {
+			us_sleep((t - now - EMU_SPIN_NS) / 1000);
+		}
+	}
+}
+
+static int
+transfer(int fd, const struct iovec *iov, int count, uint64_t off, int write)
+{
+	uint64_t len;
+	ssize_t n;
+	int i, k;
+
+	/* DEVICE_IOV pieces per system call */
+
+	for (; 0<count; count-=k, iov+=k, off+=len) {
+		k = MIN(count, DEVICE_IOV);
+		for (len=0, i=0; i<k; ++i) {
+			len += iov[i].iov_len;
+		}
+		n = write ?
+			pwritev(fd, iov, k, (off_t)off) :
+			preadv(fd, iov, k, (off_t)off);
+		if (len != (uint64_t)n) {
+			TRACE(write ? "pwritev()" : "preadv()");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+emulate_io(struct device *device,
+	   const struct iovec *iov,
+	   int count,
+	   uint64_t off,
+	   uint64_t len,
+	   int write)
+{
+	struct emu *emu;
+	uint64_t t, n;
+	int i, e;
+
+	/* a queue slot, then a turn on the data path */
+
+	emu = device->emu;
+	pthread_mutex_lock(&emu->mutex);
+	while (emu->inflight >= emu->depth) {
+		pthread_cond_wait(&emu->slot, &emu->mutex);
+	}
+	++emu->inflight;
+	e = 0;
+	if (write && emu->wfail) {
+		if ((emu->written + len) > emu->wfail) {
+			e = -1;
+		}
+		else {
+			emu->written += len;
+		}
+	}
+	t = MAX(ref_time_ns(), emu->channel);
+	t += emu->mbps ? (len * 1000 / emu->mbps) : 0;
+	emu->channel = t;
+	t += write ? emu->write_ns : emu->read_ns;
+	if (emu->spike_n) {
+		emu->seed ^= emu->seed << 13;
+		emu->seed ^= emu->seed >> 7;
+		emu->seed ^= emu->seed << 17;
+		t += (emu->seed % emu->spike_n) ? 0 : emu->spike_ns;
+	}
+	pthread_mutex_unlock(&emu->mutex);
+
+	/* the bytes move at once, completion waits for the model */
+
+	if (!e && emu->mem) {
+		for (n=off, i=0; i<count; n+=iov[i].iov_len, ++i) {
+			if (write) {
+				memcpy(emu->mem + n,
+				       iov[i].iov_base,
+				       iov[i].iov_len);
+			}
+			else {
+				memcpy(iov[i].iov_base,
+				       emu->mem + n,
+				       iov[i].iov_len);
+			}
+		}
+	}
+	else if (!e) {
+		e = transfer(device->fd, iov, count, off, write);
+	}
+	await(t);
+	pthread_mutex_lock(&emu->mutex);
+	--emu->inflight;
+	pthread_cond_signal(&emu->slot);
+	pthread_mutex_unlock(&emu->mutex);
+	if (e) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+extent(const struct stripe *stripe,
+       int m,
+       uint64_t off,
+       uint64_t len,
+       uint64_t *a, /* out, the first unit on member m */
+       uint64_t *b) /* out, the last unit on member m */
+{
+	uint64_t u0, u1, n;
+
+	/* the units of [off, off + len) on member m, 0 if none */
+
+	n = (uint64_t)stripe->n;
+	u0 = off / stripe->unit;
+	u1 = (off + len - 1) / stripe->unit;
+	(*a) = u0 + ((uint64_t)m + n - (u0 % n)) % n;
+	(*b) = u1 - ((u1 % n) + n - (uint64_t)m) % n;
+	return len && ((*a) <= u1) && ((*b) >= u0);
+}
+
+static int
+member(const struct stripe *stripe,
+       int m,
+       uint64_t off,
+       uint64_t len,
+       uint64_t *off_, /* out, on member m */
+       uint64_t *len_) /* out */
+{
+	uint64_t a, b, end;
+
+	/* the one contiguous range of [off, off + len) on member m */
+
+	if (!extent(stripe, m, off, len, &a, &b)) {
+		return 0;
+	}
+	(*off_) = (a / stripe->n) * stripe->unit;
+	(*off_) += (a == (off / stripe->unit)) ? (off % stripe->unit) : 0;
+	end = (b / stripe->n) * stripe->unit;
+	end += (b == ((off + len - 1) / stripe->unit)) ?
+		((off + len - 1) % stripe->unit + 1) :
+		stripe->unit;
+	(*len_) = end - (*off_);
+	return 1;
+}
+
+static int vector(struct device *device,
+		  const struct iovec *iov,
+		  int count,
+		  uint64_t off,
+		  int op);
+
+static int
+lane_io(struct lane *lane, int m, const struct job *job)
+{
+	struct iovec iov[DEVICE_IOV];
+	const struct stripe *stripe;
+	uint64_t u, a, b, lo, hi, at, n, off, len;
+	int i, k;
+
+	/* member m's units of the job, one vector on the member */
+
+	if (DEVICE_OP_FLUSH == job->op) {
+		return device_flush(lane->device);
+	}
+	stripe = lane->stripe;
+	if (!member(stripe, m, job->off, job->len, &off, &len) ||
+	    !extent(stripe, m, job->off, job->len, &a, &b)) {
+		return 0;
+	}
+	at = job->off; /* where job piece i starts */
+	for (len=0, k=0, i=0, u=a; u<=b; u+=stripe->n) {
+		lo = MAX(job->off, u * stripe->unit);
+		hi = MIN(job->off + job->len, (u + 1) * stripe->unit);
+		while (lo < hi) {
+			while ((at + job->iov[i].iov_len) <= lo) {
+				at += job->iov[i++].iov_len;
+			}
+			assert( i < job->count );
+
+			if (DEVICE_IOV == k) {
+				if (vector(lane->device,
+					   iov,
+					   k,
+					   off,
+					   job->op)) {
+					TRACE(0);
+					return -1;
+				}
+				off += len;
+				len = k = 0;
+			}
+			n = MIN(hi, at + job->iov[i].iov_len) - lo;
+			iov[k].iov_base = (char *)job->iov[i].iov_base +
+				(lo - at);
+			iov[k++].iov_len = n;
+			len += n;
+			lo += n;
+		}
+	}
+	if (vector(lane->device, iov, k, off, job->op)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+lane_run(void *arg)
+{
+	struct stripe *stripe;
+	struct lane *lane;
+	struct task *task;
+	int e;
+
+	lane = (struct lane *)arg;
+	stripe = lane->stripe;
+	pthread_mutex_lock(&stripe->mutex);
+	for (;;) {
+		if (!(task = lane->head)) {
+			if (stripe->done) {
+				break;
+			}
+			pthread_cond_wait(&lane->work, &stripe->mutex);
+			continue;
+		}
+		if (!(lane->head = task->next)) {
+			lane->tail = NULL;
+		}
+		pthread_mutex_unlock(&stripe->mutex);
+		e = lane_io(lane, (int)(lane - stripe->lanes), task->job);
+		pthread_mutex_lock(&stripe->mutex);
+		task->job->e |= e;
+		if (!--task->job->pending) {
+			pthread_cond_broadcast(&stripe->complete);
+		}
+	}
+	pthread_mutex_unlock(&stripe->mutex);
+	return NULL;
+}
+
+static int
+stripe_io(struct device *device,
+	  const struct iovec *iov,
+	  int count,
+	  uint64_t off,
+	  uint64_t len,
+	  int op)
+{
+	struct task tasks[STRIPE_MAX];
+	struct stripe *stripe;
+	uint64_t a, b;
+	struct job job;
+	int m, last;
+
+	stripe = device->stripe;
+	job.iov = iov;
+	job.count = count;
+	job.off = off;
+	job.len = len;
+	job.op = op;
+	job.pending = 0;
+	job.e = 0;
+
+	/* one member is done in place, more are queued on their lanes */
+
+	for (last=-1, m=0; m<stripe->n; ++m) {
+		if ((DEVICE_OP_FLUSH == op) ||
+		    extent(stripe, m, off, len, &a, &b)) {
+			last = m;
+			++job.pending;
+		}
+	}
+	if (!job.pending) {
+		return 0;
+	}
+	if (1 == job.pending) {
+		return lane_io(&stripe->lanes[last], last, &job);
+	}
+	pthread_mutex_lock(&stripe->mutex);
+	for (m=0; m<stripe->n; ++m) {
+		if ((DEVICE_OP_FLUSH != op) &&
+		    !extent(stripe, m, off, len, &a, &b)) {
+			continue;
+		}
+		tasks[m].next = NULL;
+		tasks[m].job = &job;
+		if (stripe->lanes[m].tail) {
+			stripe->lanes[m].tail->next = &tasks[m];
+		}
+		else {
+			stripe->lanes[m].head = &tasks[m];
+		}
+		stripe->lanes[m].tail = &tasks[m];
+		pthread_cond_signal(&stripe->lanes[m].work);
+	}
+	while (job.pending) {
+		pthread_cond_wait(&stripe->complete, &stripe->mutex);
+	}
+	pthread_mutex_unlock(&stripe->mutex);
+	if (job.e) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+assemble(struct device *device, const char *spec)
+{
+	struct stripe *stripe;
+	struct lane *lane;
+	char pathname[1024];
+	pthread_t thread;
+	uint64_t size, n;
+	const char *p;
+	int m;
+
+	if (!(stripe = malloc(sizeof (struct stripe)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(stripe, 0, sizeof (struct stripe));
+	if (pthread_mutex_init(&stripe->mutex, NULL) ||
+	    pthread_cond_init(&stripe->complete, NULL)) {
+		FREE(stripe);
+		TRACE("pthread_*()");
+		return -1;
+	}
+	device->stripe = stripe;
+
+	/* [unit=N,]member+member+... */
+
+	stripe->unit = 64 * 1024;
+	if (!strncmp(spec, "unit=", 5)) {
+		if (number(spec + 5, &stripe->unit) || !strchr(spec, ',')) {
+			TRACE("bad striped device");
+			return -1;
+		}
+		spec = strchr(spec, ',') + 1;
+	}
+	for (p=spec; (*p) && (STRIPE_MAX > stripe->n); ++stripe->n) {
+		for (n=0; (*p) && ('+' != (*p)); ++p) {
+			if ((n + 1) < sizeof (pathname)) {
+				pathname[n++] = (*p);
+			}
+		}
+		pathname[n] = 0;
+		p += ('+' == (*p)) ? 1 : 0;
+		lane = &stripe->lanes[stripe->n];
+		if (!n || !(lane->device = device_open(pathname))) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if ((*p) || (2 > stripe->n)) {
+		TRACE("bad striped device");
+		return -1;
+	}
+
+	/* the geometry every member can hold */
+
+	size = UINT64_MAX;
+	for (m=0; m<stripe->n; ++m) {
+		device->block = MAX(device->block,
+				    device_block(stripe->lanes[m].device));
+		device->align = MAX(device->align,
+				    device_align(stripe->lanes[m].device));
+		size = MIN(size, device_size(stripe->lanes[m].device));
+	}
+	if (!stripe->unit ||
+	    (stripe->unit % device->block) ||
+	    (size < stripe->unit)) {
+		TRACE("bad device geometry");
+		return -1;
+	}
+	device->size = size / stripe->unit * stripe->unit * stripe->n;
+	for (m=0; m<stripe->n; ++m) {
+		stripe->lanes[m].stripe = stripe;
+		if (pthread_cond_init(&stripe->lanes[m].work, NULL) ||
+		    pthread_create(&thread,
+				   NULL,
+				   lane_run,
+				   &stripe->lanes[m])) {
+			TRACE("pthread_*()");
+			return -1;
+		}
+		stripe->lanes[m].thread = thread;
+	}
+	return 0;
+}
+
+static int
+attach(struct device *device, const char *pathname)
+{
+	if (!strncmp(pathname, EMU_PREFIX, strlen(EMU_PREFIX))) {
+		if (emulate(device, pathname + strlen(EMU_PREFIX))) {
+			TRACE(0);
+			return -1;
+		}
+		return 0;
+	}
+	if (!strncmp(pathname, STRIPE_PREFIX, strlen(STRIPE_PREFIX))) {
+		if (assemble(device, pathname + strlen(STRIPE_PREFIX))) {
+			TRACE(0);
+			return -1;
+		}
+		return 0;
+	}
+	if (!strncmp(pathname, BUF_PREFIX, strlen(BUF_PREFIX))) {
+		pathname += strlen(BUF_PREFIX);
+		device->buffered = 1;
+	}
+	if (0 >= (device->fd = open(pathname,
+				    O_RDWR |
+				    (device->buffered ? 0 : O_DIRECT)))) {
+		if (EACCES == errno) {
+			TRACE("no volume access");
+			return -1;
+		}
+		TRACE("open()");
+		return -1;
+	}
+	if (geometry(device)) {
+		TRACE(0);
+		return -1;
+	}
 	return 0;
 }
 
@@ -76,6 +809,7 @@ struct device *
 device_open(const char *pathname)
 {
 	struct device *device;
+	uint64_t n;
 
 	assert( safe_strlen(pathname) );
 
@@ -84,72 +818,316 @@ device_open(const char *pathname)
 		return NULL;
 	}
 	memset(device, 0, sizeof (struct device));
-	if (0 >= (device->fd = open(pathname, O_RDWR | O_DIRECT))) {
-		if (EACCES == errno) {
-			device_close(device);
-			TRACE("no volume access");
-			return NULL;
-		}
-		device_close(device);
-		TRACE("open()");
+	if (pthread_mutex_init(&device->mutex, NULL)) {
+		FREE(device);
+		TRACE("pthread_mutex_init()");
 		return NULL;
 	}
-	if (geometry(device)) {
+	n = MIN(safe_strlen(pathname), NAME_LEN - 1);
+	memcpy(device->name, pathname, n);
+	device->opened = ref_time_ns();
+	if (attach(device, pathname)) {
 		device_close(device);
 		TRACE(0);
 		return NULL;
 	}
+
+	/* visible to the monitor */
+
+	pthread_mutex_lock(&monitor_mutex);
+	device->next = monitor_devices;
+	monitor_devices = device;
+	pthread_mutex_unlock(&monitor_mutex);
 	return device;
 }
 
+static void
+disassemble(struct stripe *stripe)
+{
+	int m;
+
+	pthread_mutex_lock(&stripe->mutex);
+	stripe->done = 1;
+	for (m=0; m<stripe->n; ++m) {
+		if (stripe->lanes[m].thread) {
+			pthread_cond_signal(&stripe->lanes[m].work);
+		}
+	}
+	pthread_mutex_unlock(&stripe->mutex);
+	for (m=0; m<stripe->n; ++m) {
+		if (stripe->lanes[m].thread) {
+			pthread_join(stripe->lanes[m].thread, NULL);
+			pthread_cond_destroy(&stripe->lanes[m].work);
+		}
+		device_close(stripe->lanes[m].device);
+	}
+	pthread_mutex_destroy(&stripe->mutex);
+	pthread_cond_destroy(&stripe->complete);
+}
+
 void
 device_close(struct device *device)
 {
+	struct device **p;
+
 	if (device) {
+		pthread_mutex_lock(&monitor_mutex);
+		for (p=&monitor_devices; (*p); p=&(*p)->next) {
+			if (device == (*p)) {
+				(*p) = device->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&monitor_mutex);
 		if (0 < device->fd) {
 			if (close(device->fd)) {
 				TRACE("close()");
 			}
 		}
+		if (device->emu) {
+			pthread_mutex_destroy(&device->emu->mutex);
+			pthread_cond_destroy(&device->emu->slot);
+			FREE(device->emu->mem);
+			FREE(device->emu);
+		}
+		if (device->stripe) {
+			disassemble(device->stripe);
+			FREE(device->stripe);
+		}
+		pthread_mutex_destroy(&device->mutex);
 		memset(device, 0, sizeof (struct device));
 	}
 	FREE(device);
 }
 
-int
-device_read(struct device *device, void *buf, uint64_t off, uint64_t len)
+static uint64_t
+begin(struct device *device)
+{
+	uint64_t t;
+
+	/* a busy period starts with the first operation in flight */
+
+	t = ref_time_ns();
+	pthread_mutex_lock(&device->mutex);
+	if (!device->inflight++) {
+		device->busy = t;
+	}
+	hist_add(&device->stats.depth, device->inflight);
+	pthread_mutex_unlock(&device->mutex);
+	return t;
+}
+
+static void
+end(struct device *device, int op, uint64_t len, uint64_t t)
 {
-	assert( !len || buf );
-	assert( 0 == (off % device->block) );
-	assert( 0 == (len % device->block) );
+	uint64_t now;
+
+	now = ref_time_ns();
+	pthread_mutex_lock(&device->mutex);
+	device->stats.ops[op].bytes += len;
+	hist_add(&device->stats.ops[op].latency, now - t);
+	if (!--device->inflight) {
+		device->stats.busy += now - device->busy;
+	}
+	pthread_mutex_unlock(&device->mutex);
+}
+
+static int
+vector(struct device *device,
+       const struct iovec *iov,
+       int count,
+       uint64_t off,
+       int op)
+{
+	uint64_t len, t;
+	int i, e;
+
+	for (len=0, i=0; i<count; ++i) {
+		assert( !iov[i].iov_len || iov[i].iov_base );
+		assert( 0 == (iov[i].iov_len % device->align) );
+
+		len += iov[i].iov_len;
+	}
+	assert( 0 == (off % device->align) );
 	assert( (off + len) <= device->size );
 
-	if (len != (uint64_t)pread(device->fd, buf, (size_t)len, (off_t)off)) {
-		TRACE("pread()");
+	if (!len) {
+		return 0;
+	}
+	t = begin(device);
+	if (device->emu) {
+		e = emulate_io(device,
+			       iov,
+			       count,
+			       off,
+			       len,
+			       DEVICE_OP_WRITE == op);
+	}
+	else if (device->stripe) {
+		e = stripe_io(device, iov, count, off, len, op);
+	}
+	else {
+		e = transfer(device->fd,
+			     iov,
+			     count,
+			     off,
+			     DEVICE_OP_WRITE == op);
+	}
+	end(device, op, len, t);
+	if (e) {
+		TRACE(0);
 		return -1;
 	}
 	return 0;
 }
 
+static int
+vectors(struct device *device,
+	void * const *bufs,
+	const uint64_t *lens,
+	int count,
+	uint64_t off,
+	int op)
+{
+	struct iovec iov[DEVICE_IOV];
+	int i, k;
+
+	/* DEVICE_IOV pieces at a time */
+
+	for (; 0<count; count-=k, bufs+=k, lens+=k) {
+		k = MIN(count, DEVICE_IOV);
+		for (i=0; i<k; ++i) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = (size_t)lens[i];
+		}
+		if (vector(device, iov, k, off, op)) {
+			TRACE(0);
+			return -1;
+		}
+		for (i=0; i<k; ++i) {
+			off += lens[i];
+		}
+	}
+	return 0;
+}
+
+int
+device_read(struct device *device, void *buf, uint64_t off, uint64_t len)
+{
+	return vectors(device, &buf, &len, 1, off, DEVICE_OP_READ);
+}
+
 int
 device_write(struct device *device,
 	     const void *buf,
 	     uint64_t off,
 	     uint64_t len)
 {
-	assert( !len || buf );
-	assert( 0 == (off % device->block) );
-	assert( 0 == (len % device->block) );
-	assert( (off + len) <= device->size );
+	return vectors(device,
+		       (void * const *)&buf,
+		       &len,
+		       1,
+		       off,
+		       DEVICE_OP_WRITE);
+}
 
-	if (len != (uint64_t)pwrite(device->fd,
-				    buf,
-				    (size_t)len,
-				    (off_t)off)) {
-		TRACE("pwrite()");
-		return -1;
+int
+device_readv(struct device *device,
+	     void * const *bufs,
+	     const uint64_t *lens,
+	     int count,
+	     uint64_t off)
+{
+	assert( device );
+	assert( !count || (bufs && lens) );
+
+	return vectors(device, bufs, lens, count, off, DEVICE_OP_READ);
+}
+
+int
+device_writev(struct device *device,
+	      const void * const *bufs,
+	      const uint64_t *lens,
+	      int count,
+	      uint64_t off)
+{
+	assert( device );
+	assert( !count || (bufs && lens) );
+
+	return vectors(device,
+		       (void * const *)bufs,
+		       lens,
+		       count,
+		       off,
+		       DEVICE_OP_WRITE);
+}
+
+void *
+device_alloc(uint64_t len)
+{
+	struct buffer *buffer;
+	uint64_t size;
+	char *raw;
+	int k;
+
+	/* the smallest class that fits, or the exact size beyond them */
+
+	for (k=0, size=DEVICE_ALIGN; (k<POOL_CLASSES) && (size<len); ++k) {
+		size *= 2;
+	}
+	if (POOL_CLASSES == k) {
+		k = -1;
+		size = len;
+	}
+	buffer = NULL;
+	if (0 <= k) {
+		pthread_mutex_lock(&pool_mutex);
+		if ((buffer = pool_free[k])) {
+			pool_free[k] = buffer->next;
+			--pool_n[k];
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	if (!buffer) {
+		size += sizeof (struct buffer) + DEVICE_ALIGN;
+		if (!(raw = malloc(size))) {
+			TRACE("out of memory");
+			return NULL;
+		}
+		buffer = (struct buffer *)
+			((char *)memory_align(raw + sizeof (struct buffer),
+					      DEVICE_ALIGN) -
+			 sizeof (struct buffer));
+		buffer->raw = raw;
+		buffer->class_ = k;
+	}
+	buffer->next = NULL;
+	return buffer + 1;
+}
+
+void
+device_free(void *buf)
+{
+	struct buffer *buffer;
+	int k;
+
+	if (buf) {
+		buffer = (struct buffer *)buf - 1;
+		k = buffer->class_;
+		if (0 <= k) {
+			pthread_mutex_lock(&pool_mutex);
+			if (POOL_KEEP > pool_n[k]) {
+				buffer->next = pool_free[k];
+				pool_free[k] = buffer;
+				++pool_n[k];
+				buffer = NULL;
+			}
+			pthread_mutex_unlock(&pool_mutex);
+		}
+		if (buffer) {
+			free(buffer->raw);
+		}
 	}
-	return 0;
 }
 
 uint64_t
@@ -167,3 +1145,291 @@ device_block(const struct device *device)
 
 	return device->block;
 }
+
+uint64_t
+device_align(const struct device *device)
+{
+	assert( device );
+
+	return device->align;
+}
+
+void
+device_advise(struct device *device, uint64_t off, uint64_t len, int advice)
+{
+	uint64_t off_, len_;
+	int m;
+
+	assert( device );
+	assert( (off + len) <= device->size );
+
+	/* advisory, a failure costs nothing but the hint */
+
+	for (m=0; device->stripe && (m<device->stripe->n); ++m) {
+		if (member(device->stripe, m, off, len, &off_, &len_)) {
+			device_advise(device->stripe->lanes[m].device,
+				      off_,
+				      len_,
+				      advice);
+		}
+	}
+	if (device->buffered) {
+		if (posix_fadvise(device->fd,
+				  (off_t)off,
+				  (off_t)len,
+				  (DEVICE_ADVISE_SEQUENTIAL == advice) ?
+				  POSIX_FADV_SEQUENTIAL :
+				  (DEVICE_ADVISE_WILLNEED == advice) ?
+				  POSIX_FADV_WILLNEED :
+				  POSIX_FADV_DONTNEED)) {
+			/* ignore */
+		}
+	}
+}
+
+void
+device_writeback(struct device *device, uint64_t off, uint64_t len)
+{
+	uint64_t off_, len_;
+	int m;
+
+	assert( device );
+	assert( (off + len) <= device->size );
+
+	/* start writeback, do not wait for it */
+
+	for (m=0; device->stripe && (m<device->stripe->n); ++m) {
+		if (member(device->stripe, m, off, len, &off_, &len_)) {
+			device_writeback(device->stripe->lanes[m].device,
+					 off_,
+					 len_);
+		}
+	}
+	if (device->buffered) {
+		if (sync_file_range(device->fd,
+				    (off64_t)off,
+				    (off64_t)len,
+				    SYNC_FILE_RANGE_WRITE)) {
+			/* ignore */
+		}
+	}
+}
+
+int
+device_flush(struct device *device)
+{
+	uint64_t t;
+	int e;
+
+	assert( device );
+
+	t = begin(device);
+	e = 0;
+	if (device->stripe) {
+		e = stripe_io(device, NULL, 0, 0, 0, DEVICE_OP_FLUSH);
+	}
+	else if (0 < device->fd) {
+		if (fdatasync(device->fd)) {
+			TRACE("fdatasync()");
+			e = -1;
+		}
+	}
+	end(device, DEVICE_OP_FLUSH, 0, t);
+	if (e) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+void
+device_stats(struct device *device, struct device_stats *stats)
+{
+	uint64_t now;
+
+	assert( device );
+	assert( stats );
+
+	now = ref_time_ns();
+	pthread_mutex_lock(&device->mutex);
+	memcpy(stats, &device->stats, sizeof (struct device_stats));
+	stats->busy += device->inflight ? (now - device->busy) : 0;
+	pthread_mutex_unlock(&device->mutex);
+	stats->elapsed = now - device->opened;
+}
+
+void
+device_stats_merge(struct device_stats *stats,
+		   const struct device_stats *other)
+{
+	int op;
+
+	assert( stats );
+	assert( other );
+
+	for (op=0; op<DEVICE_OP_END; ++op) {
+		stats->ops[op].bytes += other->ops[op].bytes;
+		hist_merge(&stats->ops[op].latency, &other->ops[op].latency);
+	}
+	hist_merge(&stats->depth, &other->depth);
+	stats->busy += other->busy;
+	stats->elapsed = MAX(stats->elapsed, other->elapsed);
+}
+
+void
+device_stats_print(const struct device_stats *stats,
+		   const char *name,
+		   FILE *file)
+{
+	static const char * const NAMES[] = { "read", "write", "flush" };
+	const struct hist *hist;
+	int op;
+
+	assert( stats );
+	assert( name );
+	assert( file );
+
+	for (op=0; op<DEVICE_OP_END; ++op) {
+		hist = &stats->ops[op].latency;
+		if (!hist->count) {
+			continue;
+		}
+		fprintf(file,
+			"%s %-5s: %lu calls, %.1f MB, %.1f MB/s, "
+			"us mean %.1f p50 %.1f p99 %.1f max %.1f\n",
+			name,
+			NAMES[op],
+			(unsigned long)hist->count,
+			stats->ops[op].bytes / 1e6,
+			stats->elapsed ?
+			stats->ops[op].bytes * 1e3 / stats->elapsed : 0.0,
+			hist->sum * 1e-3 / hist->count,
+			hist_percentile(hist, 0.5) * 1e-3,
+			hist_percentile(hist, 0.99) * 1e-3,
+			hist->max * 1e-3);
+	}
+	fprintf(file,
+		"%s depth: mean %.1f max %lu, %.1f%% busy\n",
+		name,
+		stats->depth.count ?
+		(double)stats->depth.sum / stats->depth.count : 0.0,
+		(unsigned long)stats->depth.max,
+		stats->elapsed ? 100.0 * stats->busy / stats->elapsed : 0.0);
+}
+
+static void
+interval(struct hist *hist, const struct hist *now, const struct hist *last)
+{
+	int i;
+
+	/* the samples added since last, max is the all-time one */
+
+	hist->count = now->count - last->count;
+	hist->sum = now->sum - last->sum;
+	hist->max = now->max;
+	for (i=0; i<HIST_LEN; ++i) {
+		hist->buckets[i] = now->buckets[i] - last->buckets[i];
+	}
+}
+
+static void
+report(struct device *device, struct device_stats *now, struct hist *hist)
+{
+	struct device_stats *last;
+	double dt, busy;
+	int op;
+
+	/* the rates since the previous report */
+
+	device_stats(device, now);
+	last = &device->last;
+	dt = (now->elapsed - last->elapsed) * 1e-9;
+	busy = (double)(now->busy - last->busy);
+	fprintf(monitor_file, "%s:", device->name);
+	for (op=0; op<DEVICE_OP_END; ++op) {
+		interval(hist, &now->ops[op].latency, &last->ops[op].latency);
+		fprintf(monitor_file,
+			" %c %.0f/s %.1f MB/s p99 %.0f us%s",
+			"rwf"[op],
+			dt ? hist->count / dt : 0.0,
+			dt ? (now->ops[op].bytes - last->ops[op].bytes) /
+			(dt * 1e6) : 0.0,
+			hist->count ? hist_percentile(hist, 0.99) * 1e-3 : 0.0,
+			((DEVICE_OP_END - 1) == op) ? "" : ",");
+	}
+	interval(hist, &now->depth, &last->depth);
+	fprintf(monitor_file,
+		"; depth %.1f, %.0f%% busy\n",
+		hist->count ? (double)hist->sum / hist->count : 0.0,
+		dt ? busy * 1e-7 / dt : 0.0);
+	fflush(monitor_file);
+	memcpy(last, now, sizeof (struct device_stats));
+}
+
+static void *
+monitor_run(void *arg)
+{
+	struct device_stats *now;
+	struct device *device;
+	struct timespec ts;
+	struct hist *hist;
+	uint64_t t;
+
+	(void)arg;
+	now = malloc(sizeof (struct device_stats));
+	hist = malloc(sizeof (struct hist));
+	pthread_mutex_lock(&monitor_mutex);
+	while (monitor_period) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		t = (uint64_t)ts.tv_nsec + monitor_period * 1000000;
+		ts.tv_sec += (time_t)(t / 1000000000);
+		ts.tv_nsec = (long)(t % 1000000000);
+		if (ETIMEDOUT != pthread_cond_timedwait(&monitor_cond,
+							&monitor_mutex,
+							&ts)) {
+			continue; /* stopped or changed */
+		}
+		for (device=monitor_devices; device; device=device->next) {
+			if (now && hist) {
+				report(device, now, hist);
+			}
+		}
+	}
+	pthread_mutex_unlock(&monitor_mutex);
+	FREE(now);
+	FREE(hist);
+	return NULL;
+}
+
+int
+device_monitor(FILE *file, uint64_t period)
+{
+	struct device *device;
+	pthread_t thread;
+	int running;
+
+	assert( !period || file );
+
+	pthread_mutex_lock(&monitor_mutex);
+	running = monitor_period ? 1 : 0;
+	thread = monitor_thread;
+	monitor_period = period;
+	monitor_file = file;
+	pthread_cond_signal(&monitor_cond);
+	if (period && !running) {
+		for (device=monitor_devices; device; device=device->next) {
+			device_stats(device, &device->last);
+		}
+		if (pthread_create(&monitor_thread, NULL, monitor_run, NULL)) {
+			monitor_period = 0;
+			pthread_mutex_unlock(&monitor_mutex);
+			TRACE("pthread_create()");
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&monitor_mutex);
+	if (!period && running) {
+		pthread_join(thread, NULL);
+	}
+	return 0;
+}
@@ -10,10 +10,61 @@
 #ifndef _P_DEVICE_H_
 #define _P_DEVICE_H_
 
-#include "system.h"
+#include "hist.h"
+
+#define DEVICE_ALIGN 4096 /* of device_alloc() buffers */
+
+#define DEVICE_ADVISE_SEQUENTIAL 0
+#define DEVICE_ADVISE_WILLNEED 1
+#define DEVICE_ADVISE_DONTNEED 2
+
+#define DEVICE_OP_READ 0
+#define DEVICE_OP_WRITE 1
+#define DEVICE_OP_FLUSH 2
+#define DEVICE_OP_END 3
 
 struct device;
 
+/**
+ * Always-on counters of a device since it was opened. Busy time is the
+ * time at least one operation was in flight, busy / elapsed the
+ * utilization. A striped device counts the calls made on it, its members
+ * count their own shares.
+ */
+
+struct device_stats {
+	struct {
+		uint64_t bytes;
+		struct hist latency; /* ns, latency.count is the call count */
+	} ops[DEVICE_OP_END];
+	struct hist depth;           /* operations in flight, at submission */
+	uint64_t busy;               /* ns */
+	uint64_t elapsed;            /* ns */
+};
+
+/**
+ * Opens a regular file or a block device with O_DIRECT. A pathname of the
+ * form "buf:pathname" opens it through the page cache instead, lifting the
+ * alignment requirements, see device_align(). A pathname of the form
+ * "emu:key=value,..." opens an emulated device:
+ *
+ *   size    : bytes, K, M and G suffixes allowed (required unless file has one)
+ *   block   : bytes, default 4096
+ *   file    : a sparse backing file, default memory
+ *   lat     : us per operation, rlat and wlat for reads or writes alone
+ *   bw      : MB/s on a data path shared by all operations, default unlimited
+ *   qd      : operations in flight, more wait, default 32
+ *   spike   : one operation in spike is delayed spike_us more, default never
+ *   seed    : of the spike sequence, default 1
+ *   wfail   : bytes written before every further write fails, default never
+ *
+ * A pathname of the form "stripe:[unit=N,]member+member+..." opens up to 16
+ * member devices, any of the above, as one device striped in units of N
+ * bytes, default 64K.
+ *
+ * return: an opaque device handle, NULL on error
+ */
+
 struct device *device_open(const char *pathname);
 
 void device_close(struct device *device);
@@ -25,8 +76,100 @@ int device_write(struct device *device,
 		 uint64_t off,
 		 uint64_t len);
 
+/**
+ * Vectored transfers: count buffers read from or written to consecutive
+ * device bytes starting at off, one system call per 64 pieces. Every length
+ * is a multiple of device_align().
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int device_readv(struct device *device,
+		 void * const *bufs,
+		 const uint64_t *lens,
+		 int count,
+		 uint64_t off);
+
+int device_writev(struct device *device,
+		  const void * const *bufs,
+		  const uint64_t *lens,
+		  int count,
+		  uint64_t off);
+
+/**
+ * DEVICE_ALIGN aligned buffers from a process-wide pool. Freed buffers are
+ * kept for reuse, so the layers above need no per-request malloc and
+ * alignment of their own.
+ *
+ * return: the buffer, NULL on error
+ */
+
+void *device_alloc(uint64_t len);
+
+void device_free(void *buf);
+
 uint64_t device_size(const struct device *device);
 
 uint64_t device_block(const struct device *device);
 
+/**
+ * The alignment of buffers, offsets and lengths passed to device_read()
+ * and device_write(): the block size, or 1 through the page cache.
+ */
+
+uint64_t device_align(const struct device *device);
+
+/**
+ * Page cache hints, no-ops unless opened with "buf:". device_advise() tells
+ * the kernel how a range will be read, device_writeback() starts writing a
+ * range out without waiting for it.
+ */
+
+void device_advise(struct device *device,
+		   uint64_t off,
+		   uint64_t len,
+		   int advice);
+
+void device_writeback(struct device *device, uint64_t off, uint64_t len);
+
+/**
+ * Waits until the bytes written so far are durable: fdatasync() on a file
+ * or a block device, every member at once when striped, nothing in memory.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int device_flush(struct device *device);
+
+/**
+ * Reports the counters of a device. device_stats_merge() sums two reports,
+ * e.g. of the devices under a sharded store.
+ */
+
+void device_stats(struct device *device, struct device_stats *stats);
+
+void device_stats_merge(struct device_stats *stats,
+			const struct device_stats *other);
+
+/**
+ * Prints one line per operation kind: calls, bytes, MB/s, mean, p50, p99
+ * and max latency, then the queue depth and utilization.
+ *
+ * name: a label for the lines, e.g. the pathname
+ */
+
+void device_stats_print(const struct device_stats *stats,
+			const char *name,
+			FILE *file);
+
+/**
+ * Starts a thread printing, every period milliseconds, one line per open
+ * device with the interval's read, write and flush rates and p99 latency,
+ * queue depth and utilization. A period of 0 stops it. Off by default.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int device_monitor(FILE *file, uint64_t period);
+
 #endif /* _DEVICE_H_ */
@@ -0,0 +1,443 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * dindex.c
+ */
+
+#include "device.h"
+#include "index.h"
+#include "dindex.h"
+
+#define MIN_FRAMES 4
+#define PRIMARY 0.875 /* fraction of pages used as primary buckets */
+
+/**
+ * The device is an array of block sized pages. Pages [0, buckets) are the
+ * primary buckets, the remaining pages are handed out as overflow pages
+ * linked from a full bucket through page->next. Pages that were never
+ * written since open are known to be empty and are never read.
+ */
+
+struct page {
+	uint32_t count;
+	uint32_t next; /* overflow page, 0 if none */
+	uint64_t pad;
+	struct {
+		uint64_t key;
+		uint64_t off;
+	} maps[1];
+};
+
+struct frame {
+	int dirty;
+	int ref;
+	uint64_t page; /* UINT64_MAX if unused */
+	struct frame *next;
+	struct page *buf;
+};
+
+struct dindex {
+	uint64_t block;    /* immutable */
+	uint64_t pages;    /* immutable */
+	uint64_t buckets;  /* immutable */
+	uint64_t entries;  /* immutable, per page */
+	uint64_t overflow; /* next free overflow page */
+	uint64_t size;
+	uint64_t lookups;
+	uint64_t probes;
+	uint64_t probe_max;
+	struct device *device;
+	struct {
+		uint64_t bits;  /* immutable, per bucket */
+		uint8_t *bitmap;
+	} filter;
+	uint8_t *written;  /* one bit per page */
+	struct {
+		uint64_t hand;
+		uint64_t size; /* immutable */
+		void *buf;
+		struct frame *frames;
+		struct frame **heads;
+	} cache;
+};
+
+static void
+probed(struct dindex *dindex, uint64_t n)
+{
+	++dindex->lookups;
+	dindex->probes += n;
+	dindex->probe_max = MAX(dindex->probe_max, n);
+}
+
+static uint64_t
+mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
+}
+
+static int
+filter_test(const struct dindex *dindex, uint64_t bucket, uint64_t key)
+{
+	const uint8_t *bitmap;
+	uint64_t h, a, b;
+
+	if (!dindex->filter.bits) {
+		return 1;
+	}
+	h = mix(key);
+	a = (h & 0xffffffff) % dindex->filter.bits;
+	b = (h >> 32) % dindex->filter.bits;
+	bitmap = dindex->filter.bitmap + bucket * (dindex->filter.bits / 8);
+	return ((bitmap[a / 8] >> (a % 8)) & 1) &&
+		((bitmap[b / 8] >> (b % 8)) & 1);
+}
+
+static void
+filter_set(struct dindex *dindex, uint64_t bucket, uint64_t key)
+{
+	uint8_t *bitmap;
+	uint64_t h, a, b;
+
+	if (!dindex->filter.bits) {
+		return;
+	}
+	h = mix(key);
+	a = (h & 0xffffffff) % dindex->filter.bits;
+	b = (h >> 32) % dindex->filter.bits;
+	bitmap = dindex->filter.bitmap + bucket * (dindex->filter.bits / 8);
+	bitmap[a / 8] |= (uint8_t)(1 << (a % 8));
+	bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+}
+
+static int
+writeback(struct dindex *dindex, struct frame *frame)
+{
+	if (frame->dirty) {
+		if (device_write(dindex->device,
+				 frame->buf,
+				 frame->page * dindex->block,
+				 dindex->block)) {
+			TRACE(0);
+			return -1;
+		}
+		dindex->written[frame->page / 8] |=
+			(uint8_t)(1 << (frame->page % 8));
+		frame->dirty = 0;
+	}
+	return 0;
+}
+
+static struct frame *
+victim(struct dindex *dindex)
+{
+	struct frame *frame, **link;
+
+	/* clock */
+
+	for (;;) {
+		frame = &dindex->cache.frames[dindex->cache.hand];
+		dindex->cache.hand =
+			(dindex->cache.hand + 1) % dindex->cache.size;
+		if (!frame->ref) {
+			break;
+		}
+		frame->ref = 0;
+	}
+	if (UINT64_MAX != frame->page) {
+		if (writeback(dindex, frame)) {
+			TRACE(0);
+			return NULL;
+		}
+		link = &dindex->cache.heads[frame->page % dindex->cache.size];
+		while ((*link) != frame) {
+			link = &(*link)->next;
+		}
+		(*link) = frame->next;
+		frame->page = UINT64_MAX;
+		frame->next = NULL;
+	}
+	return frame;
+}
+
+static struct page *
+fetch(struct dindex *dindex, uint64_t page, int dirty)
+{
+	struct frame *frame, **head;
+
+	assert( page < dindex->pages );
+
+	head = &dindex->cache.heads[page % dindex->cache.size];
+	for (frame=(*head); frame; frame=frame->next) {
+		if (page == frame->page) {
+			frame->ref = 1;
+			frame->dirty |= dirty;
+			return frame->buf;
+		}
+	}
+	if (!(frame = victim(dindex))) {
+		TRACE(0);
+		return NULL;
+	}
+	if ((dindex->written[page / 8] >> (page % 8)) & 1) {
+		if (device_read(dindex->device,
+				frame->buf,
+				page * dindex->block,
+				dindex->block)) {
+			TRACE(0);
+			return NULL;
+		}
+	}
+	else {
+		memset(frame->buf, 0, dindex->block);
+	}
+	frame->page = page;
+	frame->ref = 1;
+	frame->dirty = dirty;
+	frame->next = (*head);
+	(*head) = frame;
+	return frame->buf;
+}
+
+static uint64_t
+key_of(const void *key_, uint64_t key_len)
+{
+	uint64_t key;
+
+	key = index_hash(key_, key_len);
+	return key ? key : (key + 1);
+}
+
+struct dindex *
+dindex_open(const char *pathname, uint64_t memory)
+{
+	struct dindex *dindex;
+	uint64_t i, n;
+
+	assert( safe_strlen(pathname) );
+
+	if (!(dindex = malloc(sizeof (struct dindex)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(dindex, 0, sizeof (struct dindex));
+	if (!(dindex->device = device_open(pathname))) {
+		dindex_close(dindex);
+		TRACE(0);
+		return NULL;
+	}
+	dindex->block = device_block(dindex->device);
+	dindex->pages = device_size(dindex->device) / dindex->block;
+	dindex->pages = MIN(dindex->pages, (uint64_t)UINT32_MAX);
+	dindex->buckets = (uint64_t)(dindex->pages * PRIMARY);
+	dindex->entries = (dindex->block - offsetof(struct page, maps)) /
+		sizeof (dindex->cache.frames[0].buf->maps[0]);
+	dindex->overflow = dindex->buckets;
+	if (!dindex->buckets ||
+	    (dindex->buckets == dindex->pages) ||
+	    (DEVICE_ALIGN % device_align(dindex->device)) ||
+	    !dindex->entries) {
+		dindex_close(dindex);
+		TRACE("bad index device geometry");
+		return NULL;
+	}
+
+	/* half the budget for filters (8 bits per entry at most) */
+
+	n = (memory / 2) / dindex->buckets;
+	n = MIN(n, dindex->entries);
+	dindex->filter.bits = n * 8;
+	memory -= MIN(memory, n * dindex->buckets);
+
+	/* what remains goes to the page cache */
+
+	n = (dindex->pages + 7) / 8;
+	memory -= MIN(memory, n);
+	dindex->cache.size = memory / (dindex->block + sizeof (struct frame));
+	dindex->cache.size = MAX(dindex->cache.size, MIN_FRAMES);
+	dindex->cache.size = MIN(dindex->cache.size, dindex->pages);
+	if (!(dindex->written = malloc(n)) ||
+	    !(dindex->filter.bitmap = malloc(dindex->filter.bits / 8 *
+					     dindex->buckets + 1)) ||
+	    !(dindex->cache.buf = device_alloc(dindex->cache.size *
+					       dindex->block)) ||
+	    !(dindex->cache.frames = malloc(dindex->cache.size *
+					    sizeof (struct frame))) ||
+	    !(dindex->cache.heads = malloc(dindex->cache.size *
+					   sizeof (struct frame *)))) {
+		dindex_close(dindex);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(dindex->written, 0, n);
+	memset(dindex->filter.bitmap,
+	       0,
+	       dindex->filter.bits / 8 * dindex->buckets + 1);
+	memset(dindex->cache.heads,
+	       0,
+	       dindex->cache.size * sizeof (struct frame *));
+	for (i=0; i<dindex->cache.size; ++i) {
+		dindex->cache.frames[i].dirty = 0;
+		dindex->cache.frames[i].ref = 0;
+		dindex->cache.frames[i].page = UINT64_MAX;
+		dindex->cache.frames[i].next = NULL;
+		dindex->cache.frames[i].buf = (struct page *)
+			((char *)dindex->cache.buf + i * dindex->block);
+	}
+	return dindex;
+}
+
+void
+dindex_close(struct dindex *dindex)
+{
+	if (dindex) {
+		device_close(dindex->device);
+		FREE(dindex->written);
+		FREE(dindex->filter.bitmap);
+		device_free(dindex->cache.buf);
+		FREE(dindex->cache.frames);
+		FREE(dindex->cache.heads);
+		memset(dindex, 0, sizeof (struct dindex));
+	}
+	FREE(dindex);
+}
+
+uint64_t *
+dindex_update(struct dindex *dindex, const void *key_, uint64_t key_len)
+{
+	uint64_t key, bucket, page, i, n;
+	struct page *p;
+
+	assert( dindex );
+	assert( key_ && key_len );
+
+	key = key_of(key_, key_len);
+	bucket = key % dindex->buckets;
+	filter_set(dindex, bucket, key);
+	page = bucket;
+	for (n=1; ; ++n) {
+		if (!(p = fetch(dindex, page, 0))) {
+			TRACE(0);
+			return NULL;
+		}
+		for (i=0; i<p->count; ++i) {
+			if (key == p->maps[i].key) { /* update */
+				fetch(dindex, page, 1);
+				probed(dindex, n);
+				return &p->maps[i].off;
+			}
+		}
+		if (p->count < dindex->entries) { /* insert */
+			fetch(dindex, page, 1);
+			probed(dindex, n);
+			++dindex->size;
+			p->maps[p->count].key = key;
+			p->maps[p->count].off = 0;
+			return &p->maps[p->count++].off;
+		}
+		if (!p->next) { /* chain a new overflow page */
+			if (dindex->overflow >= dindex->pages) {
+				TRACE("index full");
+				return NULL;
+			}
+			fetch(dindex, page, 1);
+			p->next = (uint32_t)dindex->overflow++;
+		}
+		page = p->next;
+	}
+	return NULL;
+}
+
+uint64_t *
+dindex_lookup(struct dindex *dindex, const char *key_, uint64_t key_len)
+{
+	uint64_t key, bucket, page, i, n;
+	struct page *p;
+
+	assert( dindex );
+	assert( key_ && key_len );
+
+	key = key_of(key_, key_len);
+	bucket = key % dindex->buckets;
+	if (!filter_test(dindex, bucket, key)) {
+		probed(dindex, 0); /* filtered, no page visited */
+		return NULL;
+	}
+	page = bucket;
+	n = 0;
+	do {
+		++n;
+		if (!(p = fetch(dindex, page, 0))) {
+			TRACE(0);
+			return NULL;
+		}
+		for (i=0; i<p->count; ++i) {
+			if (key == p->maps[i].key) {
+				probed(dindex, n);
+				return &p->maps[i].off;
+			}
+		}
+	} while ((page = p->next));
+	probed(dindex, n);
+	return NULL;
+}
+
+uint64_t
+dindex_pages(const struct dindex *dindex)
+{
+	assert( dindex );
+
+	return dindex->overflow; /* primary buckets, then overflow pages */
+}
+
+uint64_t
+dindex_entries(const struct dindex *dindex)
+{
+	assert( dindex );
+
+	return dindex->entries;
+}
+
+int
+dindex_page(struct dindex *dindex,
+	    uint64_t page,
+	    uint64_t *offs,
+	    uint64_t *n)
+{
+	struct page *p;
+	uint64_t i;
+
+	assert( dindex );
+	assert( page < dindex->overflow );
+	assert( offs && n );
+
+	(*n) = 0;
+	if (!(p = fetch(dindex, page, 0))) {
+		TRACE(0);
+		return -1;
+	}
+	for (i=0; i<p->count; ++i) {
+		offs[(*n)++] = p->maps[i].off;
+	}
+	return 0;
+}
+
+void
+dindex_stats(const struct dindex *dindex, struct index_stats *stats)
+{
+	assert( dindex );
+	assert( stats );
+
+	stats->size = dindex->size;
+	stats->capacity = dindex->pages * dindex->entries;
+	stats->lookups = dindex->lookups;
+	stats->probes = dindex->probes;
+	stats->probe_max = dindex->probe_max;
+}
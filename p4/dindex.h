@@ -0,0 +1,82 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * dindex.h
+ */
+
+#ifndef _DINDEX_H_
+#define _DINDEX_H_
+
+#include "index.h"
+
+struct dindex;
+
+/**
+ * Opens an on-device hash index using the block device specified in
+ * pathname for its bucket pages. Hot pages are cached in RAM and every
+ * primary bucket carries a small in-memory filter so that lookups of
+ * absent keys avoid device I/O. The index starts out empty.
+ *
+ * pathname: the pathname of the block device holding the bucket pages
+ * memory  : the RAM budget in bytes for page cache and filters
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct dindex *dindex_open(const char *pathname, uint64_t memory);
+
+/**
+ * Closes a previously opened dindex handle.
+ *
+ * dindex: an opaque handle previously obtained by calling dindex_open()
+ *
+ * Note: dindex may be NULL.
+ */
+
+void dindex_close(struct dindex *dindex);
+
+/**
+ * Same as index_update(). The returned reference points into a cached page
+ * and is only valid until the next call on dindex.
+ */
+
+uint64_t *dindex_update(struct dindex *dindex,
+			const void *key,
+			uint64_t key_len);
+
+/**
+ * Same as index_lookup(). The returned reference points into a cached page
+ * and is only valid until the next call on dindex.
+ */
+
+uint64_t *dindex_lookup(struct dindex *dindex,
+			const char *key,
+			uint64_t key_len);
+
+/**
+ * Pages that may hold entries are [0, dindex_pages()), a page holds at most
+ * dindex_entries() of them. dindex_page() copies the references held by one
+ * page into offs and their number into n.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+uint64_t dindex_pages(const struct dindex *dindex);
+
+uint64_t dindex_entries(const struct dindex *dindex);
+
+int dindex_page(struct dindex *dindex,
+		uint64_t page,
+		uint64_t *offs,
+		uint64_t *n);
+
+/**
+ * Same as index_stats(), probes count bucket and overflow pages visited.
+ */
+
+void dindex_stats(const struct dindex *dindex, struct index_stats *stats);
+
+#endif /* _DINDEX_H_ */
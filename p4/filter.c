@@ -0,0 +1,611 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * filter.c
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include "filter.h"
+
+#define MAX_DEPTH 64
+#define MAX_DIGITS 18
+#define MAX_OFFSET (1024 * 1024 * 1024)
+#define PATH_LEN 256
+
+/**
+ * Needs:
+ *   mkdtemp()
+ *   fork()
+ *   execvp()
+ *   waitpid()
+ *   dlopen()
+ *   dlsym()
+ *   dlclose()
+ */
+
+typedef int (*kernel_t)(const unsigned char *v, uint64_t n);
+
+struct filter {
+	void *handle;
+	kernel_t kernel;
+	uint64_t width;
+};
+
+/* the expression, translated to a fully parenthesized C expression */
+
+struct parse {
+	const char *s;
+	int depth;
+	uint64_t width;
+	struct {
+		char *buf;
+		uint64_t len;
+		uint64_t capacity;
+	} out;
+};
+
+static const struct {
+	const char *name;
+	uint64_t size;
+	int real;
+} FIELDS[] = {
+	{ "i8", 1, 0 }, { "u8", 1, 0 },
+	{ "i16", 2, 0 }, { "u16", 2, 0 },
+	{ "i32", 4, 0 }, { "u32", 4, 0 },
+	{ "i64", 8, 0 }, { "u64", 8, 0 },
+	{ "f32", 4, 1 }, { "f64", 8, 1 }
+};
+
+static int
+insert(struct parse *p, uint64_t at, const char *s)
+{
+	uint64_t n, capacity;
+	char *buf;
+
+	n = safe_strlen(s);
+	if ((p->out.len + n + 1) > p->out.capacity) {
+		capacity = MAX(p->out.len + n + 1, p->out.capacity * 2);
+		capacity = MAX(capacity, 256);
+		if (!(buf = realloc(p->out.buf, capacity))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		p->out.buf = buf;
+		p->out.capacity = capacity;
+	}
+	memmove(p->out.buf + at + n, p->out.buf + at, p->out.len - at);
+	memcpy(p->out.buf + at, s, n);
+	p->out.len += n;
+	p->out.buf[p->out.len] = '\0';
+	return 0;
+}
+
+static int
+put(struct parse *p, const char *s)
+{
+	return insert(p, p->out.len, s);
+}
+
+static void
+skip(struct parse *p)
+{
+	while (isspace((unsigned char)(*p->s))) {
+		++p->s;
+	}
+}
+
+static int
+accept(struct parse *p, const char *token)
+{
+	uint64_t n;
+
+	skip(p);
+	n = safe_strlen(token);
+	if (!strncmp(p->s, token, n)) {
+		p->s += n;
+		return 1;
+	}
+	return 0;
+}
+
+static int expr(struct parse *p, int *real);
+
+static int
+number(struct parse *p, int *real)
+{
+	const char *s;
+	char buf[64];
+	uint64_t n;
+
+	/* digits[.digits][e[+-]digits], integers lose leading zeros (octal) */
+
+	s = p->s;
+	while (isdigit((unsigned char)(*s))) {
+		++s;
+	}
+	if ((s == p->s) && !isdigit((unsigned char)s[1])) {
+		TRACE("filter: bad number");
+		return -1;
+	}
+	(*real) = 0;
+	if ('.' == (*s)) {
+		(*real) = 1;
+		for (++s; isdigit((unsigned char)(*s)); ++s);
+	}
+	if (('e' == (*s)) || ('E' == (*s))) {
+		(*real) = 1;
+		++s;
+		s += (('+' == (*s)) || ('-' == (*s))) ? 1 : 0;
+		if (!isdigit((unsigned char)(*s))) {
+			TRACE("filter: bad exponent");
+			return -1;
+		}
+		while (isdigit((unsigned char)(*s))) {
+			++s;
+		}
+	}
+	if (isalnum((unsigned char)(*s)) || ('_' == (*s)) || ('.' == (*s))) {
+		TRACE("filter: bad number");
+		return -1;
+	}
+	n = (uint64_t)(s - p->s);
+	if (!(*real)) {
+		while ((1 < n) && ('0' == (*p->s))) {
+			++p->s;
+			--n;
+		}
+	}
+	if ((*real) ? (n >= sizeof (buf)) : (MAX_DIGITS < n)) {
+		TRACE("filter: number too long");
+		return -1;
+	}
+	if (*real) {
+		safe_sprintf(buf, sizeof (buf), "%.*s", (int)n, p->s);
+	}
+	else {
+		safe_sprintf(buf, sizeof (buf), "INT64_C(%.*s)", (int)n, p->s);
+	}
+	p->s = s;
+	return put(p, buf);
+}
+
+static int
+field(struct parse *p, int *real)
+{
+	uint64_t i, n, off;
+	char buf[64];
+
+	/* type@offset */
+
+	for (n=0; isalnum((unsigned char)p->s[n]); ++n);
+	for (i=0; i<ARRAY_SIZE(FIELDS); ++i) {
+		if ((safe_strlen(FIELDS[i].name) == n) &&
+		    !strncmp(FIELDS[i].name, p->s, n)) {
+			break;
+		}
+	}
+	if (ARRAY_SIZE(FIELDS) == i) {
+		TRACE("filter: unknown field type");
+		return -1;
+	}
+	p->s += n;
+	if (('@' != (*p->s)) || !isdigit((unsigned char)p->s[1])) {
+		TRACE("filter: expected @offset");
+		return -1;
+	}
+	for (off=0, ++p->s; isdigit((unsigned char)(*p->s)); ++p->s) {
+		if (MAX_OFFSET < (off = off * 10 + ((*p->s) - '0'))) {
+			TRACE("filter: offset too large");
+			return -1;
+		}
+	}
+	p->width = MAX(p->width, off + FIELDS[i].size);
+	(*real) = FIELDS[i].real;
+	safe_sprintf(buf,
+		     sizeof (buf),
+		     "%s_(v + %lu)",
+		     FIELDS[i].name,
+		     (unsigned long)off);
+	return put(p, buf);
+}
+
+static int
+primary(struct parse *p, int *real)
+{
+	if (accept(p, "(")) {
+		if (put(p, "(") || expr(p, real)) {
+			return -1;
+		}
+		if (!accept(p, ")")) {
+			TRACE("filter: expected )");
+			return -1;
+		}
+		return put(p, ")");
+	}
+	if (isdigit((unsigned char)(*p->s)) || ('.' == (*p->s))) {
+		return number(p, real);
+	}
+	if (isalpha((unsigned char)(*p->s))) {
+		return field(p, real);
+	}
+	TRACE("filter: expected a number, a field or (");
+	return -1;
+}
+
+static int
+unary(struct parse *p, int *real)
+{
+	int r;
+
+	if (MAX_DEPTH < ++p->depth) {
+		TRACE("filter: expression too deep");
+		return -1;
+	}
+	if (accept(p, "-")) {
+		r = put(p, "(-") || unary(p, real) || put(p, ")");
+	}
+	else if (accept(p, "!")) {
+		r = put(p, "(!") || unary(p, real) || put(p, ")");
+		(*real) = 0;
+	}
+	else {
+		r = primary(p, real);
+	}
+	--p->depth;
+	return r ? -1 : 0;
+}
+
+static int
+product(struct parse *p, int *real)
+{
+	const char *prefix;
+	uint64_t at;
+	int op, other;
+
+	/* "/" and "%" go through helpers that guard against zero */
+
+	at = p->out.len;
+	if (unary(p, real)) {
+		return -1;
+	}
+	for (;;) {
+		if (accept(p, "*")) {
+			op = '*';
+		}
+		else if (accept(p, "/")) {
+			op = '/';
+		}
+		else if (accept(p, "%")) {
+			op = '%';
+		}
+		else {
+			return 0;
+		}
+		if (put(p, ('*' == op) ? " * " : ", ") || unary(p, &other)) {
+			return -1;
+		}
+		if (('%' == op) && ((*real) || other)) {
+			TRACE("filter: % takes integers");
+			return -1;
+		}
+		(*real) |= other;
+		if ('*' == op) {
+			prefix = "(";
+		}
+		else if ('/' == op) {
+			prefix = (*real) ? "dvr_(" : "dvi_(";
+		}
+		else {
+			prefix = "mdi_(";
+		}
+		if (insert(p, at, prefix) || put(p, ")")) {
+			return -1;
+		}
+	}
+}
+
+static int
+sum(struct parse *p, int *real)
+{
+	uint64_t at;
+	int other;
+	char op;
+
+	at = p->out.len;
+	if (product(p, real)) {
+		return -1;
+	}
+	for (;;) {
+		if (accept(p, "+")) {
+			op = '+';
+		}
+		else if (accept(p, "-")) {
+			op = '-';
+		}
+		else {
+			return 0;
+		}
+		if (put(p, ('+' == op) ? " + " : " - ") ||
+		    product(p, &other) ||
+		    insert(p, at, "(") ||
+		    put(p, ")")) {
+			return -1;
+		}
+		(*real) |= other;
+	}
+}
+
+static int
+compare(struct parse *p, int *real)
+{
+	static const char * const OPS[] = { "<=", ">=", "==", "!=", "<", ">" };
+	char buf[8];
+	uint64_t at, i;
+	int other;
+
+	/* longer operators first, "<=" before "<" */
+
+	at = p->out.len;
+	if (sum(p, real)) {
+		return -1;
+	}
+	for (i=0; i<ARRAY_SIZE(OPS); ++i) {
+		if (accept(p, OPS[i])) {
+			safe_sprintf(buf, sizeof (buf), " %s ", OPS[i]);
+			if (put(p, buf) ||
+			    sum(p, &other) ||
+			    insert(p, at, "(") ||
+			    put(p, ")")) {
+				return -1;
+			}
+			(*real) = 0;
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+and(struct parse *p, int *real)
+{
+	uint64_t at;
+
+	at = p->out.len;
+	if (compare(p, real)) {
+		return -1;
+	}
+	while (accept(p, "&&")) {
+		if (put(p, " && ") ||
+		    compare(p, real) ||
+		    insert(p, at, "(") ||
+		    put(p, ")")) {
+			return -1;
+		}
+		(*real) = 0;
+	}
+	return 0;
+}
+
+static int
+expr(struct parse *p, int *real)
+{
+	uint64_t at;
+
+	at = p->out.len;
+	if (and(p, real)) {
+		return -1;
+	}
+	while (accept(p, "||")) {
+		if (put(p, " || ") ||
+		    and(p, real) ||
+		    insert(p, at, "(") ||
+		    put(p, ")")) {
+			return -1;
+		}
+		(*real) = 0;
+	}
+	return 0;
+}
+
+static int
+generate(const struct parse *p, const char *pathname)
+{
+	static const char * const HELPERS[] = {
+		"#include <stdint.h>",
+		"#include <string.h>",
+		"",
+		"#define FIELD(f, t, r) static inline r f(const void *p) "
+		"{ t x; memcpy(&x, p, sizeof (x)); return (r)x; }",
+		"FIELD(i8_, int8_t, int64_t)",
+		"FIELD(u8_, uint8_t, int64_t)",
+		"FIELD(i16_, int16_t, int64_t)",
+		"FIELD(u16_, uint16_t, int64_t)",
+		"FIELD(i32_, int32_t, int64_t)",
+		"FIELD(u32_, uint32_t, int64_t)",
+		"FIELD(i64_, int64_t, int64_t)",
+		"FIELD(u64_, uint64_t, int64_t)",
+		"FIELD(f32_, float, double)",
+		"FIELD(f64_, double, double)",
+		"",
+		"static inline int64_t dvi_(int64_t a, int64_t b)",
+		"{ return b ? ((-1 == b) ? -a : (a / b)) : 0; }",
+		"static inline int64_t mdi_(int64_t a, int64_t b)",
+		"{ return ((0 == b) || (-1 == b)) ? 0 : (a % b); }",
+		"static inline double dvr_(double a, double b)",
+		"{ return b ? (a / b) : 0.0; }",
+		""
+	};
+	FILE *file;
+	uint64_t i;
+	int e;
+
+	if (!(file = fopen(pathname, "w"))) {
+		TRACE("fopen()");
+		return -1;
+	}
+	for (i=0; i<ARRAY_SIZE(HELPERS); ++i) {
+		fprintf(file, "%s\n", HELPERS[i]);
+	}
+	fprintf(file, "int kernel(const unsigned char *v, uint64_t n)\n");
+	fprintf(file, "{\n");
+	fprintf(file, "\tif (n < %luu)\n", (unsigned long)p->width);
+	fprintf(file, "\t\treturn 0;\n");
+	fprintf(file, "\treturn !!%s;\n", p->out.buf);
+	fprintf(file, "}\n");
+	e = ferror(file);
+	if (fclose(file) || e) {
+		TRACE("fprintf()");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+build(const char *input, const char *output)
+{
+	char *args[9];
+	pid_t pid;
+	int status;
+
+	/* -fwrapv: integer overflow in the expression wraps, as documented */
+
+	args[0] = "gcc";
+	args[1] = "-O2";
+	args[2] = "-fpic";
+	args[3] = "-shared";
+	args[4] = "-fwrapv";
+	args[5] = "-o";
+	args[6] = (char *)output;
+	args[7] = (char *)input;
+	args[8] = NULL;
+	if (0 > (pid = fork())) {
+		TRACE("fork()");
+		return -1;
+	}
+	if (!pid) {
+		execvp(args[0], args);
+		_exit(127);
+	}
+	while (0 > waitpid(pid, &status, 0)) {
+		if (EINTR != errno) {
+			TRACE("waitpid()");
+			return -1;
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		TRACE("filter: compiler failed");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+load(struct filter *filter, const char *pathname)
+{
+	void *symbol;
+
+	if (!(filter->handle = dlopen(pathname, RTLD_NOW | RTLD_LOCAL))) {
+		TRACE("dlopen()");
+		return -1;
+	}
+	if (!(symbol = dlsym(filter->handle, "kernel"))) {
+		TRACE("dlsym()");
+		return -1;
+	}
+	memcpy(&filter->kernel, &symbol, sizeof (filter->kernel));
+	return 0;
+}
+
+struct filter *
+filter_open(const char *expr_)
+{
+	char dir[PATH_LEN], input[PATH_LEN], output[PATH_LEN];
+	struct filter *filter;
+	struct parse p;
+	int real, e;
+
+	assert( expr_ );
+
+	/* parse */
+
+	memset(&p, 0, sizeof (struct parse));
+	p.s = expr_;
+	if (put(&p, "") || expr(&p, &real)) {
+		FREE(p.out.buf);
+		TRACE(0);
+		return NULL;
+	}
+	skip(&p);
+	if (*p.s) {
+		FREE(p.out.buf);
+		TRACE("filter: trailing characters");
+		return NULL;
+	}
+
+	/* generate C, compile and load, in a private directory */
+
+	if (!(filter = malloc(sizeof (struct filter)))) {
+		FREE(p.out.buf);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(filter, 0, sizeof (struct filter));
+	filter->width = p.width;
+	safe_sprintf(dir, sizeof (dir), "%s/cs238-filter-XXXXXX", P_tmpdir);
+	if (!mkdtemp(dir)) {
+		FREE(p.out.buf);
+		FREE(filter);
+		TRACE("mkdtemp()");
+		return NULL;
+	}
+	safe_sprintf(input, sizeof (input), "%s/kernel.c", dir);
+	safe_sprintf(output, sizeof (output), "%s/kernel.so", dir);
+	e = generate(&p, input) || build(input, output) || load(filter, output);
+	unlink(input);
+	unlink(output);
+	rmdir(dir);
+	FREE(p.out.buf);
+	if (e) {
+		filter_close(filter);
+		TRACE(0);
+		return NULL;
+	}
+	return filter;
+}
+
+void
+filter_close(struct filter *filter)
+{
+	if (filter) {
+		if (filter->handle) {
+			dlclose(filter->handle);
+		}
+		memset(filter, 0, sizeof (struct filter));
+	}
+	FREE(filter);
+}
+
+int
+filter_match(const struct filter *filter, const void *val, uint64_t val_len)
+{
+	assert( filter );
+	assert( !val_len || val );
+
+	return filter->kernel((const unsigned char *)val, val_len);
+}
+
+uint64_t
+filter_width(const struct filter *filter)
+{
+	assert( filter );
+
+	return filter->width;
+}
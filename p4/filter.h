@@ -0,0 +1,80 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * filter.h
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include "system.h"
+
+/**
+ * A predicate over the fixed layout of a value, compiled to native code.
+ * The expression is checked and translated to C, the C is built into a
+ * shared object by the system compiler (gcc) and the object is loaded, once
+ * per filter. Matching is then a direct call, no interpretation.
+ *
+ *   expr    : and { "||" and }
+ *   and     : compare { "&&" compare }
+ *   compare : sum [ ("<" | "<=" | ">" | ">=" | "==" | "!=") sum ]
+ *   sum     : product { ("+" | "-") product }
+ *   product : unary { ("*" | "/" | "%") unary }
+ *   unary   : ("-" | "!") unary | primary
+ *   primary : number | field | "(" expr ")"
+ *   field   : type "@" offset
+ *   type    : i8 | u8 | i16 | u16 | i32 | u32 | i64 | u64 | f32 | f64
+ *
+ * A field reads its type at a byte offset into the value, in host byte
+ * order, no alignment needed. Integers evaluate as 64-bit signed (u64
+ * wraps above 2^63), floats as double, with the usual C promotions. A
+ * division by zero yields 0, "%" takes integers only. A value too short
+ * for any field of the expression does not match. For example:
+ *
+ *   u32@0 >= 18 && f64@8 * 1.1 < 250.0
+ */
+
+struct filter;
+
+/**
+ * expr: the predicate, see above
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct filter *filter_open(const char *expr);
+
+/**
+ * filter: an opaque handle previously obtained by calling filter_open()
+ *
+ * Note: filter may be NULL
+ */
+
+void filter_close(struct filter *filter);
+
+/**
+ * Evaluates the predicate against one value. Safe to call from several
+ * threads at once.
+ *
+ * filter : an opaque handle previously obtained by calling filter_open()
+ * val    : the value
+ * val_len: the number of bytes in val
+ *
+ * return: nonzero if the value matches
+ */
+
+int filter_match(const struct filter *filter,
+		 const void *val,
+		 uint64_t val_len);
+
+/**
+ * Returns the smallest value length that can match, the end of the
+ * furthest field.
+ */
+
+uint64_t filter_width(const struct filter *filter);
+
+#endif /* _FILTER_H_ */
@@ -0,0 +1,83 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * hist.c
+ */
+
+#include "hist.h"
+
+static int
+bucket(uint64_t v)
+{
+	int e;
+
+	if (HIST_SUB > v) {
+		return (int)v;
+	}
+	for (e=63; !(v & ((uint64_t)1 << e)); --e);
+	return (e - 3) * HIST_SUB + (int)((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+static uint64_t
+midpoint(int i)
+{
+	uint64_t lo;
+	int e;
+
+	if (HIST_SUB > i) {
+		return (uint64_t)i;
+	}
+	e = i / HIST_SUB + 3;
+	lo = (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - 4);
+	return lo + ((uint64_t)1 << (e - 4)) / 2;
+}
+
+void
+hist_add(struct hist *hist, uint64_t v)
+{
+	assert( hist );
+
+	++hist->buckets[bucket(v)];
+	++hist->count;
+	hist->sum += v;
+	hist->max = MAX(hist->max, v);
+}
+
+void
+hist_merge(struct hist *hist, const struct hist *other)
+{
+	int i;
+
+	assert( hist );
+	assert( other );
+
+	for (i=0; i<HIST_LEN; ++i) {
+		hist->buckets[i] += other->buckets[i];
+	}
+	hist->count += other->count;
+	hist->sum += other->sum;
+	hist->max = MAX(hist->max, other->max);
+}
+
+uint64_t
+hist_percentile(const struct hist *hist, double p)
+{
+	uint64_t n, rank;
+	int i;
+
+	assert( hist );
+	assert( (0.0 <= p) && (1.0 >= p) );
+
+	rank = (uint64_t)(p * hist->count);
+	rank += (rank < (p * hist->count)) ? 1 : 0; /* ceil */
+	rank = MAX(rank, 1);
+	for (n=0, i=0; i<HIST_LEN; ++i) {
+		if ((n += hist->buckets[i]) >= rank) {
+			return MIN(midpoint(i), hist->max);
+		}
+	}
+	return hist->max;
+}
@@ -0,0 +1,45 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * hist.h
+ */
+
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include "system.h"
+
+#define HIST_SUB 16
+#define HIST_LEN (64 * HIST_SUB)
+
+/**
+ * A log-linear histogram of 64-bit samples in the manner of HdrHistogram.
+ * Values below HIST_SUB are exact, larger values fall into one of HIST_SUB
+ * buckets per power of two (about 6% wide). Adding a sample is a handful of
+ * instructions and no allocation. Zero-initialize before use.
+ */
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_LEN];
+};
+
+void hist_add(struct hist *hist, uint64_t v);
+
+void hist_merge(struct hist *hist, const struct hist *other);
+
+/**
+ * Returns the value at or below which the fraction p of the samples fall,
+ * as the midpoint of its bucket.
+ *
+ * p: [0.0, 1.0], e.g. 0.5, 0.99, 0.999
+ */
+
+uint64_t hist_percentile(const struct hist *hist, double p);
+
+#endif /* _HIST_H_ */
@@ -10,18 +10,44 @@
 #include "index.h"
 
 #define LOAD 0.70
+#define HEADER 4096
+#define MAGIC 0x314d4353584449 /* "IDXSCM1" */
+
+/*
+ * The slots live in malloc'd memory or, opened with index_open_scm(), in a
+ * file mapped shared: storage class memory, a DAX or tmpfs file, or any
+ * file the page cache can hold. The file is a header page, the slots, and
+ * once saved the caller's bytes. Every resize maps a fresh file under the
+ * same pathname, the old one is unlinked once rehashed. The header says
+ * saved only between index_save_scm() and the next index_attach_scm(), so
+ * a table in use, or one a crash left behind, is never attached.
+ */
+
+struct header {
+	uint64_t magic;
+	uint64_t saved;
+	uint64_t capacity;
+	uint64_t size;
+	uint64_t extra; /* bytes saved after the slots */
+};
 
 struct index {
+	char *pathname; /* NULL ==> in memory */
+	struct header *header;
+	uint64_t mapped;
 	uint64_t size;
 	uint64_t capacity;
+	uint64_t lookups;
+	uint64_t probes;
+	uint64_t probe_max;
 	struct {
 		uint64_t key;
 		uint64_t off;
 	} *maps;
 };
 
-static uint64_t
-hash(const void *buf, uint64_t len)
+uint64_t
+index_hash(const void *buf, uint64_t len)
 {
 	uint64_t i, a, b, c, d;
 	const char *p;
@@ -53,18 +79,38 @@ hash(const void *buf, uint64_t len)
 static void
 destroy(struct index *index)
 {
-	FREE(index->maps);
+	/* the pathname is the handle's, see index_close() */
+
+	if (index->pathname) {
+		file_unmap(index->header, index->mapped);
+	}
+	else {
+		FREE(index->maps);
+	}
 	memset(index, 0, sizeof (struct index));
 }
 
 static int
-create(struct index *index, uint64_t capacity)
+create(struct index *index, uint64_t capacity, char *pathname)
 {
 	uint64_t n;
 
 	memset(index, 0, sizeof (struct index));
+	index->pathname = pathname;
 	index->capacity = capacity;
 	n = index->capacity * sizeof (index->maps[0]);
+	if (pathname) {
+		index->mapped = HEADER + n;
+		if (!(index->header = file_map(pathname, index->mapped))) {
+			destroy(index);
+			TRACE(0);
+			return -1;
+		}
+		index->header->magic = MAGIC;
+		index->header->capacity = capacity;
+		index->maps = (void *)((char *)index->header + HEADER);
+		return 0;
+	}
 	if (!(index->maps = malloc(n))) {
 		destroy(index);
 		TRACE("out of memory");
@@ -74,6 +120,14 @@ create(struct index *index, uint64_t capacity)
 	return 0;
 }
 
+static void
+probed(struct index *index, uint64_t n)
+{
+	++index->lookups;
+	index->probes += n;
+	index->probe_max = MAX(index->probe_max, n);
+}
+
 static uint64_t *
 update(struct index *index, uint64_t key)
 {
@@ -81,6 +135,9 @@ update(struct index *index, uint64_t key)
 
 	for (i=0; i<index->capacity; ++i) {
 		j = (key + i) % index->capacity;
+		if (!index->maps[j].key || (index->maps[j].key == key)) {
+			probed(index, i + 1);
+		}
 		if (!index->maps[j].key) { /* insert */
 			index->maps[j].key = key;
 			index->maps[j].off = 0;
@@ -97,26 +154,40 @@ update(struct index *index, uint64_t key)
 }
 
 static int
-grow(struct index *index)
+resize(struct index *index, uint64_t capacity)
 {
 	struct index index_;
-	double load;
 	uint64_t i;
 
+	if (create(&index_, capacity, index->pathname)) {
+		TRACE(0);
+		return -1;
+	}
+	for (i=0; i<index->capacity; ++i) {
+		if (index->maps[i].key) {
+			*(update(&index_, index->maps[i].key)) =
+				index->maps[i].off;
+		}
+	}
+	index_.lookups = index->lookups; /* the rehash does not count */
+	index_.probes = index->probes;
+	index_.probe_max = index->probe_max;
+	destroy(index);
+	(*index) = index_;
+	return 0;
+}
+
+static int
+grow(struct index *index)
+{
+	double load;
+
 	load = index->capacity ? ((double)index->size / index->capacity) : 1.0;
 	if (LOAD < load) {
-		if (create(&index_, (index->capacity + 97) * 3 / 2)) {
+		if (resize(index, (index->capacity + 97) * 3 / 2)) {
 			TRACE(0);
 			return -1;
 		}
-		for (i=0; i<index->capacity; ++i) {
-			if (index->maps[i].key) {
-				*(update(&index_, index->maps[i].key)) =
-					index->maps[i].off;
-			}
-		}
-		destroy(index);
-		(*index) = index_;
 	}
 	return 0;
 }
@@ -134,12 +205,123 @@ index_open(void)
 	return index;
 }
 
+struct index *
+index_open_scm(const char *pathname)
+{
+	struct index *index;
+	uint64_t n;
+
+	assert( safe_strlen(pathname) );
+
+	if (!(index = index_open())) {
+		TRACE(0);
+		return NULL;
+	}
+	n = safe_strlen(pathname) + 1;
+	if (!(index->pathname = malloc(n))) {
+		index_close(index);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memcpy(index->pathname, pathname, n);
+	if (index_reserve(index, 0)) {
+		index_close(index);
+		TRACE(0);
+		return NULL;
+	}
+	return index;
+}
+
+struct index *
+index_attach_scm(const char *pathname, void **extra, uint64_t *len)
+{
+	struct index *index;
+	struct header *header;
+	uint64_t n, mapped;
+
+	assert( safe_strlen(pathname) );
+	assert( extra && len );
+
+	(*extra) = NULL;
+	(*len) = 0;
+	if (!(header = file_attach(pathname, &mapped))) {
+		return NULL;
+	}
+	n = 2 * sizeof (uint64_t); /* a slot */
+	if ((HEADER > mapped) ||
+	    (MAGIC != header->magic) ||
+	    !header->saved ||
+	    (header->size > header->capacity) ||
+	    (header->capacity > ((mapped - HEADER) / n)) ||
+	    (header->extra != (mapped - HEADER - header->capacity * n))) {
+		file_unmap(header, mapped);
+		return NULL;
+	}
+	if (!(index = index_open()) ||
+	    !(index->pathname = malloc(safe_strlen(pathname) + 1)) ||
+	    !((*extra) = malloc(MAX(header->extra, 1)))) {
+		index_close(index);
+		file_unmap(header, mapped);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memcpy(index->pathname, pathname, safe_strlen(pathname) + 1);
+	index->header = header;
+	index->mapped = mapped;
+	index->size = header->size;
+	index->capacity = header->capacity;
+	index->maps = (void *)((char *)header + HEADER);
+	(*len) = header->extra;
+	n *= index->capacity;
+	memcpy((*extra), (char *)header + HEADER + n, (*len));
+
+	/* in use from here on, a crash leaves nothing to attach */
+
+	header->saved = 0;
+	if (file_sync(header, HEADER)) {
+		FREE((*extra));
+		index_close(index);
+		TRACE(0);
+		return NULL;
+	}
+	return index;
+}
+
+int
+index_save_scm(struct index *index, const void *extra, uint64_t len)
+{
+	uint64_t n;
+
+	assert( index && index->pathname );
+	assert( !len || extra );
+
+	/* the slots and the extra bytes durable before the header says so */
+
+	n = HEADER + index->capacity * sizeof (index->maps[0]);
+	index->header->size = index->size;
+	index->header->extra = len;
+	if (file_sync(index->header, n) ||
+	    file_write(index->pathname, extra, len, n)) {
+		TRACE(0);
+		return -1;
+	}
+	index->header->saved = 1;
+	if (file_sync(index->header, HEADER)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
 void
 index_close(struct index *index)
 {
+	char *pathname;
+
 	if (index) {
-		FREE(index->maps);
-		memset(index, 0, sizeof (struct index));
+		pathname = index->pathname;
+		destroy(index);
+		FREE(pathname);
 	}
 	FREE(index);
 }
@@ -155,11 +337,28 @@ index_update(struct index *index, const void *key_, uint64_t key_len)
 		TRACE(0);
 		return NULL;
 	}
-	key = hash(key_, key_len);
+	key = index_hash(key_, key_len);
 	key = key ? key : (key + 1);
 	return update(index, key);
 }
 
+int
+index_reserve(struct index *index, uint64_t n)
+{
+	uint64_t capacity;
+
+	assert( index );
+
+	capacity = (uint64_t)((index->size + n) / LOAD) + 97;
+	if (capacity > index->capacity) {
+		if (resize(index, capacity)) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 uint64_t *
 index_lookup(struct index *index, const char *key_, uint64_t key_len)
 {
@@ -167,7 +366,7 @@ index_lookup(struct index *index, const char *key_, uint64_t key_len)
 
 	assert( key_ && key_len );
 
-	key = hash(key_, key_len);
+	key = index_hash(key_, key_len);
 	key = key ? key : (key + 1);
 	for (i=0; i<index->capacity; ++i) {
 		j = (key + i) % index->capacity;
@@ -175,8 +374,40 @@ index_lookup(struct index *index, const char *key_, uint64_t key_len)
 			break;
 		}
 		if (index->maps[j].key == key) {
+			probed(index, i + 1);
 			return &index->maps[j].off;
 		}
 	}
+	probed(index, i + 1);
 	return NULL;
 }
+
+uint64_t
+index_slots(const struct index *index)
+{
+	assert( index );
+
+	return index->capacity;
+}
+
+uint64_t
+index_slot(const struct index *index, uint64_t i)
+{
+	assert( index );
+	assert( i < index->capacity );
+
+	return index->maps[i].key ? index->maps[i].off : 0;
+}
+
+void
+index_stats(const struct index *index, struct index_stats *stats)
+{
+	assert( index );
+	assert( stats );
+
+	stats->size = index->size;
+	stats->capacity = index->capacity;
+	stats->lookups = index->lookups;
+	stats->probes = index->probes;
+	stats->probe_max = index->probe_max;
+}
@@ -14,12 +14,68 @@
 
 struct index;
 
+struct index_stats {
+	uint64_t size;      /* entries */
+	uint64_t capacity;  /* slots */
+	uint64_t lookups;
+	uint64_t probes;    /* slots (pages for dindex) visited, all lookups */
+	uint64_t probe_max; /* longest single lookup */
+};
+
 struct index *index_open(void);
 
+/**
+ * Opens an index whose slots live in the file specified in pathname, mapped
+ * shared, e.g. on storage class memory. The file is created, or replaced,
+ * and the index starts out empty.
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct index *index_open_scm(const char *pathname);
+
+/**
+ * Reattaches the index last saved with index_save_scm() in the file
+ * specified in pathname. A file in use, or left behind by a crash, is not
+ * attached.
+ *
+ * extra: out, a malloc'd copy of the bytes saved with the index
+ * len  : out, their length
+ *
+ * return: an opaque handle or NULL if there is nothing to attach, or on
+ *         error
+ */
+
+struct index *index_attach_scm(const char *pathname,
+			       void **extra,
+			       uint64_t *len);
+
+/**
+ * Makes the slots, and len bytes from extra, durable in the file so that
+ * index_attach_scm() can pick them up once the index is closed. Call it
+ * last, right before index_close().
+ *
+ * return: 0 on success, -1 on error
+ */
+
+int index_save_scm(struct index *index, const void *extra, uint64_t len);
+
 void index_close(struct index *index);
 
 uint64_t *index_update(struct index *index, const void *key, uint64_t key_len);
 
 uint64_t *index_lookup(struct index *index, const char *key, uint64_t key_len);
 
+int index_reserve(struct index *index, uint64_t n);
+
+/* the number of slots, and the reference held by slot i, 0 if empty */
+
+uint64_t index_slots(const struct index *index);
+
+uint64_t index_slot(const struct index *index, uint64_t i);
+
+void index_stats(const struct index *index, struct index_stats *stats);
+
+uint64_t index_hash(const void *buf, uint64_t len);
+
 #endif /* _INDEX_H_ */
@@ -7,8 +7,11 @@
  * kvdb.c
  */
 
+#include <pthread.h>
 #include "kvraw.h"
 #include "index.h"
+#include "dindex.h"
+#include "lsm.h"
 #include "kvdb.h"
 
 #define MUTATE_REMOVE  1
@@ -16,27 +19,295 @@
 #define MUTATE_UPDATE  3
 #define MUTATE_REPLACE 4
 
+#define INDEX_MEMORY (64 * 1024 * 1024)
+#define LSM_MEMTABLE (4 * 1024 * 1024)
+#define FOLD_LIMIT 16 /* operands folded before a lookup writes the value */
+#define BULK_EXTENT (1024 * 1024)
+#define FOREACH_SLOTS 8192 /* memory index slots claimed at a time */
+#define FOREACH_PAGES 16   /* device index pages claimed at a time */
+#define CLEAN_LIVE 90      /* percent, fuller segments are not worth it */
+#define LOOKUP_WINDOW 32   /* batched lookups whose reads overlap */
+#define CHECKPOINT 0x31544e494f504b43 /* "CKPOINT1" */
+
 struct kvdb {
 	uint64_t size;
 	uint64_t waste;
+	uint64_t live; /* log bytes, hash engine */
+	uint64_t snapshots;
+	uint64_t generation; /* of the SCM index, see detach() */
+	int scm;
+	struct kvdb_snapshot *newest; /* open snapshots, newest first */
 	struct kvraw *kvraw;
 	struct index *index;
+	struct dindex *dindex;
+	struct lsm *lsm;
+	struct {
+		kvdb_merge_fnc_t fnc;
+		void *arg;
+	} merge;
+	struct kvdb_stats stats;
+};
+
+struct foreach {
+	struct kvdb *kvdb;
+	const struct filter *filter;
+	kvdb_foreach_fnc_t fnc;
+	void *arg;
+	uint64_t pin;   /* log size when the scan started */
+	uint64_t units; /* memory index slots or device index pages */
+	uint64_t chunk;
+	uint64_t next;  /* next unit not yet claimed */
+	int stop;       /* +1 stopped by fnc, -1 error */
+	pthread_mutex_t mutex; /* next, stop, dindex and lookup() */
+};
+
+/* one per thread, the chains of the units claimed last */
+
+struct scanner {
+	pthread_t thread;
+	struct foreach *foreach;
+	uint64_t n;
+	uint64_t capacity;
+	struct cursor {
+		uint64_t off;   /* next record, 0 at the end of the chain */
+		uint64_t chain;
+	} *cursors;
+	struct chain {
+		char *key;      /* keys already decided, newest first */
+		uint64_t key_len;
+		struct chain *next;
+	} *chains;
+	uint64_t *offs;
+	struct {
+		char *buf;
+		uint64_t capacity;
+	} key, val;
+};
+
+/*
+ * An SCM index outlives the store. A clean close appends a check record,
+ * key "\0" and the generation as its value, then saves the counts and the
+ * image of the log with the index. An open reattaches both, but only if
+ * the check record reads back at its offset: the log is the one the index
+ * was saved with. Otherwise the store starts empty.
+ */
+
+struct checkpoint {
+	uint64_t magic;
+	uint64_t generation;
+	uint64_t check; /* log offset of the check record */
+	uint64_t size;
+	uint64_t live;
+	uint64_t waste;
+};                      /* followed by the log image */
+
+struct kvdb_snapshot {
+	struct kvdb *kvdb;
+	struct kvdb_snapshot *older;
+	struct kvdb_snapshot *newer;
+	uint64_t pin; /* log offset (hash) or sequence number (lsm) */
 };
 
 static int
+account(struct kvdb *kvdb, enum kvdb_op op, uint64_t t, int r)
+{
+	hist_add(&kvdb->stats.ops[op].latency, ref_time_ns() - t);
+	if (0 > r) {
+		++kvdb->stats.ops[op].errors;
+	}
+	else if (r) {
+		++kvdb->stats.ops[op].misses;
+	}
+	return r;
+}
+
+static void
+live(struct kvdb *kvdb,
+     uint64_t key_len,
+     uint64_t val_len,     /* appended, 0 if none */
+     uint64_t old_val_len) /* superseded, 0 if none */
+{
+	uint64_t n;
+
+	if (kvdb->kvraw) {
+		if (val_len) {
+			kvdb->live += kvraw_footprint(key_len, val_len);
+		}
+		if (old_val_len) {
+			n = kvraw_footprint(key_len, old_val_len);
+			kvdb->live -= MIN(kvdb->live, n);
+		}
+	}
+}
+
+static uint64_t
+pinned(const struct kvdb *kvdb)
+{
+	/*
+	 * Records below the newest snapshot's pin may be read by a snapshot
+	 * and stay put. Those at or above it are invisible to every snapshot,
+	 * released and cleaned as if none were open.
+	 */
+
+	return kvdb->newest ? kvdb->newest->pin : 0;
+}
+
+static uint64_t *
+ref_update(struct kvdb *kvdb, const void *key, uint64_t key_len)
+{
+	if (kvdb->dindex) {
+		return dindex_update(kvdb->dindex, key, key_len);
+	}
+	return index_update(kvdb->index, key, key_len);
+}
+
+static uint64_t *
+ref_lookup(struct kvdb *kvdb, const void *key, uint64_t key_len)
+{
+	if (kvdb->dindex) {
+		return dindex_lookup(kvdb->dindex, key, key_len);
+	}
+	return index_lookup(kvdb->index, key, key_len);
+}
+
+static int /* -1|0|+1, +1 ==> a version of key */
+version(struct kvdb *kvdb,
+	const void *key,
+	uint64_t key_len,
+	uint64_t off,
+	uint64_t *len,  /* out, footprint */
+	uint64_t *prev) /* out */
+{
+	uint64_t key_len_, val_len_;
+	char buf[256];
+	void *key_;
+
+	key_ = buf;
+	if ((key_len > sizeof (buf)) && !(key_ = malloc(key_len))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	key_len_ = key_len;
+	val_len_ = 0;
+	(*prev) = off;
+	if (0 > kvraw_lookup(kvdb->kvraw,
+			     key_,
+			     &key_len_,
+			     NULL,
+			     &val_len_,
+			     prev)) {
+		if (buf != key_) {
+			FREE(key_);
+		}
+		TRACE(0);
+		return -1;
+	}
+	(*len) = kvraw_footprint(key_len_, val_len_);
+	key_len_ = (key_len_ == key_len) && !memcmp(key_, key, key_len);
+	if (buf != key_) {
+		FREE(key_);
+	}
+	return key_len_ ? +1 : 0;
+}
+
+static int
+cut(struct kvdb *kvdb,
+    const void *key,
+    uint64_t key_len,
+    uint64_t off,    /* chain head */
+    int release,
+    uint64_t *end,   /* out, the first version kept */
+    uint64_t *bytes) /* out, footprint of the versions cut */
+{
+	uint64_t len, prev;
+	int r;
+
+	/*
+	 * Walk the versions of key at the head of its chain, down to the first
+	 * one open snapshots may still read, and release their log space if
+	 * asked to.
+	 */
+
+	(*bytes) = 0;
+	for (; off && (off >= pinned(kvdb)); off=prev) {
+		if (0 > (r = version(kvdb, key, key_len, off, &len, &prev))) {
+			TRACE(0);
+			return -1;
+		}
+		if (!r) {
+			break;
+		}
+		if (release && kvraw_release(kvdb->kvraw, off, len)) {
+			TRACE(0);
+			return -1;
+		}
+		(*bytes) += len;
+	}
+	(*end) = off;
+	return 0;
+}
+
+static int
+supersede(struct kvdb *kvdb,
+	  const void *key,
+	  uint64_t key_len,
+	  uint64_t *ref)
+{
+	uint64_t bytes;
+
+	/*
+	 * Cut the versions of key off the head of its chain and release their
+	 * log space, the record about to be appended takes their place. Open
+	 * snapshots may still read those below the pin, so they stay.
+	 */
+
+	if (kvdb->lsm) {
+		return 0;
+	}
+	if (cut(kvdb, key, key_len, (*ref), 1, ref, &bytes)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static int /* -1|0|+1, +1 ==> merge operand */
 chain_lookup(struct kvdb *kvdb,
 	     const void *key,
 	     uint64_t key_len,
 	     void *val,
 	     uint64_t *val_len, /* in/out */
-	     uint64_t *off)     /* in/out */
+	     uint64_t *off,     /* in/out */
+	     uint64_t pin)
 {
 	uint64_t key_len_, val_len_, off_;
 	void *key_, *val_;
 	char buf[256];
+	uint64_t n;
+	int r;
 
 	off_ = (*off);
-	while (off_) {
+	kvdb->stats.chain.walks += off_ ? 1 : 0;
+	for (n=1; off_; ++n) {
+		++kvdb->stats.chain.hops;
+		kvdb->stats.chain.hop_max = MAX(kvdb->stats.chain.hop_max, n);
+
+		/* appended after the snapshot ? */
+
+		if (off_ >= pin) {
+			key_len_ = val_len_ = 0;
+			if (0 > kvraw_lookup(kvdb->kvraw,
+					     NULL,
+					     &key_len_,
+					     NULL,
+					     &val_len_,
+					     &off_)) {
+				TRACE(0);
+				return -1;
+			}
+			(*off) = off_;
+			continue;
+		}
 
 		/* speculate with a small key read into a stack buffer */
 
@@ -44,12 +315,12 @@ chain_lookup(struct kvdb *kvdb,
 		val_ = val;
 		key_len_ = MIN(key_len, sizeof (buf));
 		val_len_ = val_len ? (*val_len) : 0;
-		if (kvraw_lookup(kvdb->kvraw,
-				 key_,
-				 &key_len_,
-				 val_,
-				 &val_len_,
-				 &off_)) {
+		if (0 > (r = kvraw_lookup(kvdb->kvraw,
+					  key_,
+					  &key_len_,
+					  val_,
+					  &val_len_,
+					  &off_))) {
 			TRACE(0);
 			return -1;
 		}
@@ -71,12 +342,12 @@ chain_lookup(struct kvdb *kvdb,
 			}
 			off_ = (*off);
 			val_len_ = 0; /* not needed */
-			if (kvraw_lookup(kvdb->kvraw,
-					 key_,
-					 &key_len_,
-					 val_,
-					 &val_len_,
-					 &off_)) {
+			if (0 > kvraw_lookup(kvdb->kvraw,
+					     key_,
+					     &key_len_,
+					     val_,
+					     &val_len_,
+					     &off_)) {
 				FREE(key_);
 				TRACE(0);
 				return -1;
@@ -92,7 +363,7 @@ chain_lookup(struct kvdb *kvdb,
 			if (val_len) {
 				(*val_len) = val_len_;
 			}
-			break;
+			return r;
 		}
 		if (buf != key_) {
 			FREE(key_);
@@ -102,258 +373,1842 @@ chain_lookup(struct kvdb *kvdb,
 	return 0;
 }
 
-static int /* -1|0|+1 */
-mutate(struct kvdb *kvdb,
-       const void *key,
-       uint64_t key_len,
-       void *val,
-       uint64_t *val_len,
-       int mode)
+static int
+combine(const struct kvdb *kvdb,
+	const void *val, /* NULL if absent */
+	uint64_t val_len,
+	const void *operand,
+	uint64_t operand_len,
+	void **out,      /* out, malloc'd */
+	uint64_t *out_len)
 {
-	uint64_t *ref, off;
-	uint64_t val_len_;
-	void *val_;
+	(*out) = NULL;
+	(*out_len) = 0;
+	if (!kvdb->merge.fnc) {
+		TRACE("no merge operator");
+		return -1;
+	}
+	if (kvdb->merge.fnc(kvdb->merge.arg,
+			    val,
+			    val_len,
+			    operand,
+			    operand_len,
+			    out,
+			    out_len) ||
+	    !(*out) ||
+	    !(*out_len) ||
+	    (KVDB_MAX_VAL_LEN < (*out_len))) {
+		FREE((*out));
+		TRACE("merge operator failed");
+		return -1;
+	}
+	return 0;
+}
 
-	/* index */
+static int /* -1|0|+1 */
+record(struct kvdb *kvdb,
+       uint64_t off,
+       void **val,        /* out, malloc'd, NULL if empty */
+       uint64_t *val_len, /* out */
+       uint64_t *prev)    /* out */
+{
+	uint64_t key_len;
+	int r;
 
-	if (!(ref = index_update(kvdb->index, key, key_len))) {
+	key_len = 0;
+	(*val) = NULL;
+	(*val_len) = 0;
+	(*prev) = off;
+	if (0 > kvraw_lookup(kvdb->kvraw,
+			     NULL,
+			     &key_len,
+			     NULL,
+			     val_len,
+			     prev)) {
 		TRACE(0);
 		return -1;
 	}
-	off = (*ref);
-
-	/* chained */
-
-	val_ = ((MUTATE_REMOVE == mode) && val_len) ? val : NULL;
-	val_len_ = ((MUTATE_REMOVE == mode) && val_len) ? (*val_len) : 0;
-	if (chain_lookup(kvdb, key, key_len, val_, &val_len_, &off)) {
+	if ((*val_len) && !((*val) = malloc((*val_len)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	key_len = 0;
+	(*prev) = off;
+	if (0 > (r = kvraw_lookup(kvdb->kvraw,
+				  NULL,
+				  &key_len,
+				  (*val),
+				  val_len,
+				  prev))) {
+		FREE((*val));
 		TRACE(0);
 		return -1;
 	}
+	return r;
+}
 
-	/* mutate */
+static int
+fold(struct kvdb *kvdb,
+     const void *key,
+     uint64_t key_len,
+     uint64_t off,      /* newest merge operand */
+     uint64_t pin,
+     void **val,        /* out, malloc'd */
+     uint64_t *val_len, /* out */
+     uint64_t *n)       /* out, operands folded */
+{
+	uint64_t len, out_len;
+	void *buf, *out;
+	int r;
 
-	if (MUTATE_REMOVE == mode) {
-		if (!off || !val_len_) {
-			return +1; /* invalid key */
-		}
-		if (kvraw_append(kvdb->kvraw,
-				 key,
-				 key_len,
-				 0,
-				 0,
-				 ref)) {
+	/* collect operands newest to oldest down to a value or tombstone */
+
+	(*val) = NULL;
+	(*val_len) = 0;
+	(*n) = 0;
+	for (;;) {
+		if (0 > (r = record(kvdb, off, &buf, &len, &off))) {
+			FREE((*val));
 			TRACE(0);
 			return -1;
 		}
-		if (val_len) {
-			(*val_len) = val_len_;
+		if (!(*val)) {
+			(*val) = buf;
+			(*val_len) = len;
 		}
-		--kvdb->size;
-		++kvdb->waste;
-	}
-	else if (MUTATE_INSERT == mode) {
-		if (off && val_len_) {
-			return +1; /* key exists */
+		else {
+			if (combine(kvdb, buf, len, (*val), (*val_len),
+				    &out, &out_len)) {
+				FREE(buf);
+				FREE((*val));
+				TRACE(0);
+				return -1;
+			}
+			FREE(buf);
+			FREE((*val));
+			(*val) = out;
+			(*val_len) = out_len;
 		}
-		if (kvraw_append(kvdb->kvraw,
-				 key,
-				 key_len,
-				 val,
-				 (*val_len),
-				 ref)) {
+		if (!r) {
+			return 0;
+		}
+		++(*n);
+
+		/* next older version */
+
+		len = 0;
+		r = chain_lookup(kvdb, key, key_len, NULL, &len, &off, pin);
+		if (0 > r) {
+			FREE((*val));
 			TRACE(0);
 			return -1;
 		}
-		++kvdb->size;
+		if (!off) {
+			break;
+		}
 	}
-	else if (MUTATE_UPDATE == mode) {
-		if (!off || !val_len_) {
-			++kvdb->size;
+
+	/* no base value */
+
+	if (combine(kvdb, NULL, 0, (*val), (*val_len), &out, &out_len)) {
+		FREE((*val));
+		TRACE(0);
+		return -1;
+	}
+	FREE((*val));
+	(*val) = out;
+	(*val_len) = out_len;
+	return 0;
+}
+
+struct rewrite {
+	void *key;
+	uint64_t key_len;
+	void *val;         /* NULL if removed */
+	uint64_t val_len;
+};
+
+static int
+rewrite(struct kvdb *kvdb, const void *key, uint64_t key_len)
+{
+	uint64_t off, prev, len, key_len_, val_len_, i, n, capacity, pin;
+	struct rewrite *keys, *keys_;
+	uint64_t *ref;
+	int e, r;
+
+	/*
+	 * Rebuild the chain holding key from the latest version of each of its
+	 * keys, oldest key first, and release every record of the old chain.
+	 * Nothing reaches the old records afterwards. With snapshots open only
+	 * the records above the pin are rebuilt, onto the rest of the chain,
+	 * and removed keys keep a tombstone over the versions below.
+	 */
+
+	if (!(ref = ref_lookup(kvdb, key, key_len))) {
+		TRACE("software");
+		return -1;
+	}
+	keys = NULL;
+	n = capacity = 0;
+	e = 0;
+	pin = pinned(kvdb);
+	for (off=(*ref); off && (off >= pin) && !e; off=prev) {
+		key_len_ = val_len_ = 0;
+		prev = off;
+		if (0 > (r = kvraw_lookup(kvdb->kvraw,
+					  NULL,
+					  &key_len_,
+					  NULL,
+					  &val_len_,
+					  &prev))) {
+			e = -1;
+			break;
+		}
+		if (n == capacity) {
+			capacity = MAX(4, capacity * 2);
+			if (!(keys_ = realloc(keys,
+					      capacity *
+					      sizeof (struct rewrite)))) {
+				TRACE("out of memory");
+				e = -1;
+				break;
+			}
+			keys = keys_;
+		}
+		memset(&keys[n], 0, sizeof (struct rewrite));
+		if (!(keys[n].key = malloc(key_len_))) {
+			TRACE("out of memory");
+			e = -1;
+			break;
+		}
+		keys[n].key_len = key_len_;
+		len = 0;
+		prev = off;
+		if (0 > kvraw_lookup(kvdb->kvraw,
+				     keys[n].key,
+				     &keys[n].key_len,
+				     NULL,
+				     &len,
+				     &prev)) {
+			FREE(keys[n].key);
+			e = -1;
+			break;
+		}
+
+		/* the newest record of a key decides, older ones are dropped */
+
+		for (i=0; i<n; ++i) {
+			if ((keys[i].key_len == key_len_) &&
+			    !memcmp(keys[i].key, keys[n].key, key_len_)) {
+				break;
+			}
+		}
+		if (i < n) {
+			FREE(keys[n].key);
+		}
+		else if (r) {
+			e = fold(kvdb,
+				 keys[n].key,
+				 key_len_,
+				 off,
+				 UINT64_MAX,
+				 &keys[n].val,
+				 &keys[n].val_len,
+				 &len);
+			++n;
+		}
+		else if (val_len_) {
+			e = (0 > record(kvdb,
+					off,
+					&keys[n].val,
+					&keys[n].val_len,
+					&len));
+			++n;
 		}
 		else {
-			++kvdb->waste;
+			++n; /* tombstone */
 		}
-		if (kvraw_append(kvdb->kvraw,
-				 key,
-				 key_len,
-				 val,
-				 (*val_len),
-				 ref)) {
-			TRACE(0);
-			return -1;
+		if (!e && kvraw_release(kvdb->kvraw,
+					off,
+					kvraw_footprint(key_len_, val_len_))) {
+			e = -1;
 		}
 	}
-	else if (MUTATE_REPLACE == mode) {
-		if (!off || !val_len_) {
-			return +1; /* invalid key */
+
+	/* the new chain, on the records kept below the pin */
+
+	for (prev=off, i=n; (0 < i) && !e; --i) {
+		if (keys[i - 1].val || off) {
+			e = kvraw_append(kvdb->kvraw,
+					 keys[i - 1].key,
+					 keys[i - 1].key_len,
+					 keys[i - 1].val,
+					 keys[i - 1].val_len,
+					 &prev);
+			kvdb->stats.clean.moved +=
+				kvraw_footprint(keys[i - 1].key_len,
+						keys[i - 1].val_len);
 		}
-		if (kvraw_append(kvdb->kvraw,
-				 key,
-				 key_len,
-				 val,
-				 (*val_len),
-				 ref)) {
-			TRACE(0);
-			return -1;
+	}
+	if (!e) {
+		if ((ref = ref_update(kvdb, key, key_len))) {
+			(*ref) = prev;
 		}
-		++kvdb->waste;
+		e = !ref;
+	}
+	for (i=0; i<n; ++i) {
+		FREE(keys[i].key);
+		FREE(keys[i].val);
+	}
+	FREE(keys);
+	if (e) {
+		TRACE(0);
+		return -1;
 	}
 	return 0;
 }
 
-struct kvdb *
-kvdb_open(const char *pathname)
+static int
+relocate(void *arg, uint64_t off, const void *key, uint64_t key_len)
 {
+	uint64_t key_len_, val_len_, off_;
 	struct kvdb *kvdb;
+	uint64_t *ref;
 
-	assert( safe_strlen(pathname) );
+	/* records not on their chain were released when they were cut off */
 
-	if (!(kvdb = malloc(sizeof (struct kvdb)))) {
-		TRACE("out of memory");
-		return NULL;
+	kvdb = (struct kvdb *)arg;
+	if (!(ref = ref_lookup(kvdb, key, key_len))) {
+		return 0;
 	}
-	memset(kvdb, 0, sizeof (struct kvdb));
-	if (!(kvdb->kvraw = kvraw_open(pathname)) ||
-	    !(kvdb->index = index_open())) {
-		kvdb_close(kvdb);
+	for (off_=(*ref); off_ > off; ) {
+		key_len_ = val_len_ = 0;
+		if (0 > kvraw_lookup(kvdb->kvraw,
+				     NULL,
+				     &key_len_,
+				     NULL,
+				     &val_len_,
+				     &off_)) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (off_ != off) {
+		return 0;
+	}
+	if (rewrite(kvdb, key, key_len)) {
 		TRACE(0);
-		return NULL;
+		return -1;
 	}
-	return kvdb;
+	return 0;
 }
 
-void
-kvdb_close(struct kvdb *kvdb)
+static int /* -1|0|+1, +1 ==> nothing worth cleaning */
+clean(struct kvdb *kvdb)
 {
-	if (kvdb) {
-		kvraw_close(kvdb->kvraw);
-		index_close(kvdb->index);
-		memset(kvdb, 0, sizeof (struct kvdb));
+	struct logfs_stats stats;
+	uint64_t off, end, live;
+	int r;
+
+	/* a segment snapshots cannot read */
+
+	if ((r = kvraw_victim(kvdb->kvraw, pinned(kvdb), &off, &end, &live))) {
+		return r;
 	}
-	FREE(kvdb);
+	kvraw_stats(kvdb->kvraw, &stats);
+	if ((live * 100) > (stats.segment * CLEAN_LIVE)) {
+		return +1;
+	}
+	if (kvraw_records(kvdb->kvraw, off, end, relocate, kvdb)) {
+		TRACE(0);
+		return -1;
+	}
+	++kvdb->stats.clean.segments;
+	return 0;
 }
 
-int /* -1|0|+1 */
-kvdb_remove(struct kvdb *kvdb,
-	    const void *key,
-	    uint64_t key_len,
-	    void *val,
-	    uint64_t *val_len)
+static int
+reclaim(struct kvdb *kvdb)
 {
-	assert( kvdb );
-	assert( key );
-	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
-	assert( !val_len || !!(*val_len) || val );
+	struct logfs_stats stats;
+	uint64_t reserve;
+	int i, r;
+
+	/* before a write, keep a few free segments for it and the cleaner */
 
-	return mutate(kvdb, key, key_len, val, val_len, MUTATE_REMOVE);
+	if (!kvdb->kvraw) {
+		return 0;
+	}
+	for (i=0; i<KVDB_CLEAN_RESERVE; ++i) {
+		kvraw_stats(kvdb->kvraw, &stats);
+		reserve = MIN(KVDB_CLEAN_RESERVE, stats.segments / 4);
+		if (stats.free >= reserve) {
+			break;
+		}
+		if (0 > (r = clean(kvdb))) {
+			TRACE(0);
+			return -1;
+		}
+		if (r) {
+			break;
+		}
+	}
+	return 0;
 }
 
-int /* -1|0|+1 */
-kvdb_insert(struct kvdb *kvdb,
-	    const void *key,
-	    uint64_t key_len,
-	    const void *val,
-	    uint64_t val_len)
+static int
+probe(struct kvdb *kvdb,
+      const void *key,
+      uint64_t key_len,
+      void *val,
+      uint64_t *val_len, /* in/out, 0 if absent */
+      uint64_t **ref,
+      uint64_t *version) /* out, may be NULL */
 {
-	assert( kvdb );
-	assert( key );
-	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	uint64_t off, len, n;
+	void *val_;
+	int r;
+
+	/* lsm */
+
+	if (kvdb->lsm) {
+		(*ref) = NULL;
+		r = lsm_lookup(kvdb->lsm,
+			       LSM_LATEST,
+			       key,
+			       key_len,
+			       val,
+			       val ? val_len : NULL,
+			       version);
+		if (0 > r) {
+			TRACE(0);
+			return -1;
+		}
+		if (r) {
+			(*val_len) = 0;
+		}
+		else if (!val) {
+			(*val_len) = 1; /* exists */
+		}
+		return 0;
+	}
+
+	/* index */
+
+	if (!((*ref) = ref_update(kvdb, key, key_len))) {
+		TRACE(0);
+		return -1;
+	}
+	off = (**ref);
+
+	/* chained */
+
+	len = (*val_len);
+	r = chain_lookup(kvdb, key, key_len, val, val_len, &off, UINT64_MAX);
+	if (0 > r) {
+		TRACE(0);
+		return -1;
+	}
+	if (!off) {
+		(*val_len) = 0;
+	}
+	else if (r && val) {
+		if (fold(kvdb,
+			 key,
+			 key_len,
+			 off,
+			 UINT64_MAX,
+			 &val_,
+			 val_len,
+			 &n)) {
+			TRACE(0);
+			return -1;
+		}
+		memcpy(val, val_, MIN(len, (*val_len)));
+		FREE(val_);
+	}
+	if (version) {
+		(*version) = (*val_len) ? off : 0;
+	}
+	return 0;
+}
+
+static int
+append(struct kvdb *kvdb,
+       const void *key,
+       uint64_t key_len,
+       const void *val,
+       uint64_t val_len,
+       uint64_t *ref)
+{
+	if (kvdb->lsm) {
+		return lsm_append(kvdb->lsm, key, key_len, val, val_len);
+	}
+	return kvraw_append(kvdb->kvraw, key, key_len, val, val_len, ref);
+}
+
+static int /* -1|0|+1 */
+mutate(struct kvdb *kvdb,
+       const void *key,
+       uint64_t key_len,
+       void *val,
+       uint64_t *val_len,
+       int mode)
+{
+	uint64_t val_len_;
+	uint64_t *ref;
+	void *val_;
+
+	/* current version */
+
+	if (reclaim(kvdb)) {
+		TRACE(0);
+		return -1;
+	}
+	val_ = ((MUTATE_REMOVE == mode) && val_len) ? val : NULL;
+	val_len_ = ((MUTATE_REMOVE == mode) && val_len) ? (*val_len) : 0;
+	if (probe(kvdb, key, key_len, val_, &val_len_, &ref, NULL)) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* mutate */
+
+	if (MUTATE_REMOVE == mode) {
+		if (!val_len_) {
+			return +1; /* invalid key */
+		}
+
+		/* a tombstone only if older records may still hold key */
+
+		if (supersede(kvdb, key, key_len, ref) ||
+		    ((!ref || (*ref)) &&
+		     append(kvdb, key, key_len, 0, 0, ref))) {
+			TRACE(0);
+			return -1;
+		}
+		if (val_len) {
+			(*val_len) = val_len_;
+		}
+		live(kvdb, key_len, 0, val_len_);
+		--kvdb->size;
+		++kvdb->waste;
+	}
+	else if (MUTATE_INSERT == mode) {
+		if (val_len_) {
+			return +1; /* key exists */
+		}
+		if (supersede(kvdb, key, key_len, ref) ||
+		    append(kvdb, key, key_len, val, (*val_len), ref)) {
+			TRACE(0);
+			return -1;
+		}
+		live(kvdb, key_len, (*val_len), 0);
+		++kvdb->size;
+	}
+	else if (MUTATE_UPDATE == mode) {
+		if (!val_len_) {
+			++kvdb->size;
+		}
+		else {
+			++kvdb->waste;
+		}
+		if (supersede(kvdb, key, key_len, ref) ||
+		    append(kvdb, key, key_len, val, (*val_len), ref)) {
+			TRACE(0);
+			return -1;
+		}
+		live(kvdb, key_len, (*val_len), val_len_);
+	}
+	else if (MUTATE_REPLACE == mode) {
+		if (!val_len_) {
+			return +1; /* invalid key */
+		}
+		if (supersede(kvdb, key, key_len, ref) ||
+		    append(kvdb, key, key_len, val, (*val_len), ref)) {
+			TRACE(0);
+			return -1;
+		}
+		live(kvdb, key_len, (*val_len), val_len_);
+		++kvdb->waste;
+	}
+	return 0;
+}
+
+static int
+writeback(struct kvdb *kvdb,
+	  const void *key,
+	  uint64_t key_len,
+	  const void *val,
+	  uint64_t val_len,
+	  uint64_t *off) /* out, the folded value */
+{
+	uint64_t end, bytes, prev, *ref;
+
+	/*
+	 * Replace the operand chain of key with its folded value. The versions
+	 * it replaces are released only once the value is on the log, a read
+	 * that fails to write loses nothing.
+	 */
+
+	if (reclaim(kvdb) ||
+	    !(ref = ref_update(kvdb, key, key_len)) ||
+	    cut(kvdb, key, key_len, (*ref), 0, &end, &bytes)) {
+		TRACE(0);
+		return -1;
+	}
+	prev = end;
+	if (kvraw_append(kvdb->kvraw, key, key_len, val, val_len, &prev)) {
+		TRACE(0);
+		return -1;
+	}
+	(*off) = prev;
+	prev = (*ref);
+	(*ref) = (*off);
+	if (cut(kvdb, key, key_len, prev, 1, &end, &bytes)) {
+		TRACE(0);
+		return -1;
+	}
+	live(kvdb, key_len, val_len, 0);
+	kvdb->live -= MIN(kvdb->live, bytes);
+	++kvdb->waste;
+	return 0;
+}
+
+static int /* -1|0|+1 */
+lookup(struct kvdb *kvdb,
+       uint64_t pin,
+       const void *key,
+       uint64_t key_len,
+       void *val,
+       uint64_t *val_len,
+       uint64_t *version)
+{
+	uint64_t val_len_, off, len, n;
+	uint64_t *ref;
+	void *val_;
+	int r;
+
+	/* lsm */
+
+	if (kvdb->lsm) {
+		return lsm_lookup(kvdb->lsm,
+				  (UINT64_MAX == pin) ? LSM_LATEST : pin,
+				  key,
+				  key_len,
+				  val,
+				  val_len,
+				  version);
+	}
+
+	/* index */
+
+	if (version) {
+		(*version) = 0;
+	}
+	ref = ref_lookup(kvdb, key, key_len);
+	if (!ref || !(*ref)) {
+		return +1; /* invalid key */
+	}
+	off = (*ref);
+
+	/* chained */
+
+	val_ = val_len ? val : NULL;
+	val_len_ = val_len ? (*val_len) : 0;
+	r = chain_lookup(kvdb, key, key_len, val_, &val_len_, &off, pin);
+	if (0 > r) {
+		TRACE(0);
+		return -1;
+	}
+	if (!off || !val_len_) {
+		return +1; /* invalid key */
+	}
+	if (version) {
+		(*version) = off;
+	}
+
+	/* merge operands */
+
+	if (r && val_len) {
+		len = (*val_len);
+		if (fold(kvdb, key, key_len, off, pin, &val_, &val_len_, &n)) {
+			TRACE(0);
+			return -1;
+		}
+		memcpy(val, val_, MIN(len, val_len_));
+
+		/* bound the operand chain of a hot key */
+
+		if ((FOLD_LIMIT < n) && (UINT64_MAX == pin)) {
+			if (writeback(kvdb,
+				      key,
+				      key_len,
+				      val_,
+				      val_len_,
+				      &off)) {
+				FREE(val_);
+				TRACE(0);
+				return -1;
+			}
+			if (version) {
+				(*version) = off;
+			}
+		}
+		FREE(val_);
+	}
+	if (val_len) {
+		(*val_len) = val_len_;
+	}
+	return 0;
+}
+
+static int /* 0|+1, +1 ==> nothing to attach, opened neither */
+attach(struct kvdb *kvdb,
+       const char *pathname,
+       int flags,
+       const char *index_pathname)
+{
+	uint64_t len, key_len, val_len, off, generation;
+	struct checkpoint *checkpoint;
+	void *extra;
+	char key;
+
+	if (!(kvdb->index = index_attach_scm(index_pathname, &extra, &len))) {
+		return +1;
+	}
+	checkpoint = (struct checkpoint *)extra;
+	if ((sizeof (struct checkpoint) <= len) &&
+	    (CHECKPOINT == checkpoint->magic) &&
+	    checkpoint->check &&
+	    (kvdb->kvraw = kvraw_reopen(pathname,
+					flags,
+					checkpoint + 1,
+					len - sizeof (struct checkpoint)))) {
+		key = 1; /* must read back as "\0" */
+		key_len = sizeof (key);
+		val_len = sizeof (generation);
+		off = checkpoint->check;
+		if ((kvraw_size(kvdb->kvraw) ==
+		     (off + kvraw_footprint(key_len, val_len))) &&
+		    !kvraw_lookup(kvdb->kvraw,
+				  &key,
+				  &key_len,
+				  &generation,
+				  &val_len,
+				  &off) &&
+		    (sizeof (key) == key_len) &&
+		    !key &&
+		    (sizeof (generation) == val_len) &&
+		    (checkpoint->generation == generation) &&
+		    !kvraw_release(kvdb->kvraw,
+				   checkpoint->check,
+				   kvraw_footprint(key_len, val_len))) {
+			kvdb->generation = checkpoint->generation;
+			kvdb->size = checkpoint->size;
+			kvdb->live = checkpoint->live;
+			kvdb->waste = checkpoint->waste;
+			FREE(extra);
+			return 0;
+		}
+	}
+	TRACE("stale SCM index, starting empty");
+	kvraw_close(kvdb->kvraw);
+	index_close(kvdb->index);
+	kvdb->kvraw = NULL;
+	kvdb->index = NULL;
+	FREE(extra);
+	return +1;
+}
+
+static int
+detach(struct kvdb *kvdb)
+{
+	struct checkpoint *checkpoint;
+	uint64_t len, off;
+	void *image;
+	int e;
+
+	/* closes the log, the index is the caller's */
+
+	++kvdb->generation;
+	off = 0;
+	if (kvraw_append(kvdb->kvraw,
+			 "",
+			 1,
+			 &kvdb->generation,
+			 sizeof (kvdb->generation),
+			 &off)) {
+		TRACE(0);
+		return -1;
+	}
+	image = kvraw_close_image(kvdb->kvraw, &len);
+	kvdb->kvraw = NULL;
+	if (!image) {
+		TRACE(0);
+		return -1;
+	}
+	if (!(checkpoint = malloc(sizeof (struct checkpoint) + len))) {
+		FREE(image);
+		TRACE("out of memory");
+		return -1;
+	}
+	checkpoint->magic = CHECKPOINT;
+	checkpoint->generation = kvdb->generation;
+	checkpoint->check = off;
+	checkpoint->size = kvdb->size;
+	checkpoint->live = kvdb->live;
+	checkpoint->waste = kvdb->waste;
+	memcpy(checkpoint + 1, image, len);
+	e = index_save_scm(kvdb->index,
+			   checkpoint,
+			   sizeof (struct checkpoint) + len);
+	FREE(checkpoint);
+	FREE(image);
+	if (e) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+struct kvdb *
+kvdb_open(const char *pathname)
+{
+	return kvdb_open_config(pathname, NULL);
+}
+
+struct kvdb *
+kvdb_open_config(const char *pathname, const struct kvdb_config *config)
+{
+	struct kvdb *kvdb;
+	int flags;
+
+	assert( safe_strlen(pathname) );
+	assert( !config ||
+		(KVDB_INDEX_MEMORY == config->index) ||
+		safe_strlen(config->index_pathname) );
+
+	if (!(kvdb = malloc(sizeof (struct kvdb)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(kvdb, 0, sizeof (struct kvdb));
+	flags = (config && config->log_compress) ? LOGFS_COMPRESS : 0;
+	if (config && (KVDB_ENGINE_LSM == config->engine)) {
+		if (!(kvdb->lsm = lsm_open(pathname,
+					   config->lsm_memtable ?
+					   config->lsm_memtable :
+					   LSM_MEMTABLE,
+					   flags))) {
+			kvdb_close(kvdb);
+			TRACE(0);
+			return NULL;
+		}
+		return kvdb;
+	}
+	if (config && (KVDB_INDEX_SCM == config->index)) {
+		kvdb->scm = 1;
+		if (!attach(kvdb, pathname, flags, config->index_pathname)) {
+			return kvdb;
+		}
+	}
+	if (!(kvdb->kvraw = kvraw_open(pathname, flags))) {
+		kvdb_close(kvdb);
+		TRACE(0);
+		return NULL;
+	}
+	if (config && (KVDB_INDEX_DEVICE == config->index)) {
+		kvdb->dindex = dindex_open(config->index_pathname,
+					   config->index_memory ?
+					   config->index_memory :
+					   INDEX_MEMORY);
+	}
+	else if (config && (KVDB_INDEX_SCM == config->index)) {
+		kvdb->index = index_open_scm(config->index_pathname);
+	}
+	else {
+		kvdb->index = index_open();
+	}
+	if (!kvdb->index && !kvdb->dindex) {
+		kvdb_close(kvdb);
+		TRACE(0);
+		return NULL;
+	}
+	return kvdb;
+}
+
+void
+kvdb_close(struct kvdb *kvdb)
+{
+	if (kvdb) {
+		assert( !kvdb->snapshots );
+		if (kvdb->scm && kvdb->kvraw && kvdb->index && detach(kvdb)) {
+			TRACE(0);
+		}
+		kvraw_close(kvdb->kvraw);
+		index_close(kvdb->index);
+		dindex_close(kvdb->dindex);
+		lsm_close(kvdb->lsm);
+		memset(kvdb, 0, sizeof (struct kvdb));
+	}
+	FREE(kvdb);
+}
+
+int /* -1|0|+1 */
+kvdb_remove(struct kvdb *kvdb,
+	    const void *key,
+	    uint64_t key_len,
+	    void *val,
+	    uint64_t *val_len)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	assert( !val_len || !!(*val_len) || val );
+
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_REMOVE,
+		       t,
+		       mutate(kvdb, key, key_len, val, val_len, MUTATE_REMOVE));
+}
+
+int /* -1|0|+1 */
+kvdb_insert(struct kvdb *kvdb,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	assert( val );
+	assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
+
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_INSERT,
+		       t,
+		       mutate(kvdb,
+			      key,
+			      key_len,
+			      (void *)val,
+			      &val_len,
+			      MUTATE_INSERT));
+}
+
+int /* -1|0|+1 */
+kvdb_update(struct kvdb *kvdb,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	assert( val );
+	assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
+
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_UPDATE,
+		       t,
+		       mutate(kvdb,
+			      key,
+			      key_len,
+			      (void *)val,
+			      &val_len,
+			      MUTATE_UPDATE));
+}
+
+int /* -1|0|+1 */
+kvdb_replace(struct kvdb *kvdb,
+	     const void *key,
+	     uint64_t key_len,
+	     const void *val,
+	     uint64_t val_len)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
 	assert( val );
 	assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
 
-	return mutate(kvdb,
-		      key,
-		      key_len,
-		      (void *)val,
-		      &val_len,
-		      MUTATE_INSERT);
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_UPDATE,
+		       t,
+		       mutate(kvdb,
+			      key,
+			      key_len,
+			      (void *)val,
+			      &val_len,
+			      MUTATE_REPLACE));
+}
+
+int /* -1|0|+1 */
+kvdb_lookup(struct kvdb *kvdb,
+	    const void *key,
+	    uint64_t key_len,
+	    void *val,
+	    uint64_t *val_len)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	assert( !val_len || !(*val_len) || val );
+
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_LOOKUP,
+		       t,
+		       lookup(kvdb,
+			      UINT64_MAX,
+			      key,
+			      key_len,
+			      val,
+			      val_len,
+			      NULL));
+}
+
+int
+kvdb_lookup_batch(struct kvdb *kvdb,
+		  struct kvdb_get *gets,
+		  int count,
+		  int threads)
+{
+	uint64_t offs[LOOKUP_WINDOW], *ref, t;
+	struct kvdb_get *get;
+	int i, j, k, n, e;
+
+	assert( kvdb );
+	assert( !count || gets );
+	assert( 0 < threads );
+
+	e = 0;
+	for (i=0; i<count; i+=n) {
+		n = MIN(count - i, LOOKUP_WINDOW);
+
+		/* the chain heads of the window, read in parallel */
+
+		if (kvdb->kvraw && (1 < threads)) {
+			for (k=0, j=0; j<n; ++j) {
+				get = &gets[i + j];
+				if ((ref = ref_lookup(kvdb,
+						      get->key,
+						      get->key_len)) &&
+				    (*ref)) {
+					offs[k++] = (*ref);
+				}
+			}
+			kvraw_prefetch(kvdb->kvraw, offs, k, threads);
+		}
+
+		/* the lookups, their first records now cached */
+
+		for (j=0; j<n; ++j) {
+			get = &gets[i + j];
+
+			assert( get->key );
+			assert( get->key_len &&
+				(KVDB_MAX_KEY_LEN >= get->key_len) );
+			assert( !get->val_len || get->val );
+
+			t = ref_time_ns();
+			get->r = account(kvdb,
+					 KVDB_OP_LOOKUP,
+					 t,
+					 lookup(kvdb,
+						UINT64_MAX,
+						get->key,
+						get->key_len,
+						get->val,
+						&get->val_len,
+						NULL));
+			e |= (0 > get->r);
+		}
+	}
+	return e ? -1 : 0;
+}
+
+int /* -1|0|+1 */
+kvdb_lookup_version(struct kvdb *kvdb,
+		    const void *key,
+		    uint64_t key_len,
+		    void *val,
+		    uint64_t *val_len,
+		    uint64_t *version)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	assert( !val_len || !(*val_len) || val );
+	assert( version );
+
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_LOOKUP,
+		       t,
+		       lookup(kvdb,
+			      UINT64_MAX,
+			      key,
+			      key_len,
+			      val,
+			      val_len,
+			      version));
+}
+
+static int /* -1|0|+1 */
+cas(struct kvdb *kvdb,
+    const void *key,
+    uint64_t key_len,
+    const void *val,
+    uint64_t val_len,
+    uint64_t *version)
+{
+	uint64_t val_len_, version_;
+	uint64_t *ref;
+	int r;
+
+	version_ = (*version);
+
+	/* lsm, compared and written under the lsm lock */
+
+	if (kvdb->lsm) {
+		r = lsm_cas(kvdb->lsm, key, key_len, val, val_len, version);
+		if (0 > r) {
+			TRACE(0);
+			return -1;
+		}
+	}
+
+	/* index, compared against the index entry it appends to */
+
+	else {
+		val_len_ = 0;
+		if (reclaim(kvdb) ||
+		    probe(kvdb, key, key_len, NULL, &val_len_, &ref, version)) {
+			TRACE(0);
+			return -1;
+		}
+		r = (version_ != (*version));
+		if (!r) {
+			if (supersede(kvdb, key, key_len, ref) ||
+			    kvraw_append(kvdb->kvraw,
+					 key,
+					 key_len,
+					 val,
+					 val_len,
+					 ref)) {
+				TRACE(0);
+				return -1;
+			}
+			(*version) = (*ref);
+			live(kvdb, key_len, val_len, val_len_);
+		}
+	}
+	if (!r) {
+		if (!version_) {
+			++kvdb->size;
+		}
+		else {
+			++kvdb->waste;
+		}
+	}
+	return r;
+}
+
+int /* -1|0|+1 */
+kvdb_cas(struct kvdb *kvdb,
+	 const void *key,
+	 uint64_t key_len,
+	 const void *val,
+	 uint64_t val_len,
+	 uint64_t *version)
+{
+	uint64_t t;
+
+	assert( kvdb );
+	assert( key );
+	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+	assert( val );
+	assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
+	assert( version );
+
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_UPDATE,
+		       t,
+		       cas(kvdb, key, key_len, val, val_len, version));
+}
+
+int
+kvdb_bulk_load(struct kvdb *kvdb,
+	       uint64_t count,
+	       int unique,
+	       kvdb_stream_fnc_t next,
+	       void *arg)
+{
+	const void *key, *val;
+	uint64_t key_len, val_len;
+	uint64_t *ref;
+	int r;
+
+	assert( kvdb );
+	assert( next );
+
+	/* pre-size the index, stage the log into large extents */
+
+	if ((kvdb->index && index_reserve(kvdb->index, count)) ||
+	    (kvdb->kvraw && kvraw_bulk_begin(kvdb->kvraw, BULK_EXTENT))) {
+		TRACE(0);
+		return -1;
+	}
+	for (;;) {
+		if ((r = next(arg, &key, &key_len, &val, &val_len))) {
+			break;
+		}
+		assert( key );
+		assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
+		assert( val );
+		assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
+
+		/* new keys need no existence read */
+
+		if (!unique) {
+			r = mutate(kvdb,
+				   key,
+				   key_len,
+				   (void *)val,
+				   &val_len,
+				   MUTATE_UPDATE);
+		}
+		else if (kvdb->lsm) {
+			r = lsm_append(kvdb->lsm, key, key_len, val, val_len);
+		}
+		else if (reclaim(kvdb) ||
+			 !(ref = ref_update(kvdb, key, key_len)) ||
+			 kvraw_append(kvdb->kvraw,
+				      key,
+				      key_len,
+				      val,
+				      val_len,
+				      ref)) {
+			r = -1;
+		}
+		if (r) {
+			break;
+		}
+		if (unique) {
+			live(kvdb, key_len, val_len, 0);
+			++kvdb->size;
+		}
+	}
+	if (kvdb->kvraw && kvraw_bulk_end(kvdb->kvraw)) {
+		r = -1;
+	}
+	if (0 > r) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
 }
 
-int /* -1|0|+1 */
-kvdb_update(struct kvdb *kvdb,
-	    const void *key,
-	    uint64_t key_len,
-	    const void *val,
-	    uint64_t val_len)
+void
+kvdb_merge_operator(struct kvdb *kvdb, kvdb_merge_fnc_t fnc, void *arg)
 {
 	assert( kvdb );
-	assert( key );
-	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
-	assert( val );
-	assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
 
-	return mutate(kvdb,
-		      key,
-		      key_len,
-		      (void *)val,
-		      &val_len,
-		      MUTATE_UPDATE);
+	kvdb->merge.fnc = fnc;
+	kvdb->merge.arg = arg;
+	if (kvdb->lsm) {
+		lsm_merge_operator(kvdb->lsm, fnc, arg);
+	}
 }
 
-int /* -1|0|+1 */
-kvdb_replace(struct kvdb *kvdb,
-	     const void *key,
-	     uint64_t key_len,
-	     const void *val,
-	     uint64_t val_len)
+static int
+merge(struct kvdb *kvdb,
+      const void *key,
+      uint64_t key_len,
+      const void *operand,
+      uint64_t operand_len)
+{
+	uint64_t val_len;
+	uint64_t *ref;
+
+	/* existence only, the operand is folded lazily */
+
+	val_len = 0;
+	if (reclaim(kvdb) ||
+	    probe(kvdb, key, key_len, NULL, &val_len, &ref, NULL)) {
+		TRACE(0);
+		return -1;
+	}
+	if (kvdb->lsm ?
+	    lsm_merge(kvdb->lsm, key, key_len, operand, operand_len) :
+	    kvraw_append_merge(kvdb->kvraw,
+			       key,
+			       key_len,
+			       operand,
+			       operand_len,
+			       ref)) {
+		TRACE(0);
+		return -1;
+	}
+	live(kvdb, key_len, operand_len, 0); /* the chain stays reachable */
+	if (!val_len) {
+		++kvdb->size;
+	}
+	else {
+		++kvdb->waste;
+	}
+	return 0;
+}
+
+int
+kvdb_merge(struct kvdb *kvdb,
+	   const void *key,
+	   uint64_t key_len,
+	   const void *operand,
+	   uint64_t operand_len)
 {
+	uint64_t t;
+
 	assert( kvdb );
 	assert( key );
 	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
-	assert( val );
-	assert( val_len && (KVDB_MAX_VAL_LEN >= val_len) );
+	assert( operand );
+	assert( operand_len && (KVDB_MAX_VAL_LEN >= operand_len) );
 
-	return mutate(kvdb,
-		      key,
-		      key_len,
-		      (void *)val,
-		      &val_len,
-		      MUTATE_REPLACE);
+	t = ref_time_ns();
+	return account(kvdb,
+		       KVDB_OP_UPDATE,
+		       t,
+		       merge(kvdb, key, key_len, operand, operand_len));
 }
 
-int /* -1|0|+1 */
-kvdb_lookup(struct kvdb *kvdb,
-	    const void *key,
-	    uint64_t key_len,
-	    void *val,
-	    uint64_t *val_len)
+struct kvdb_snapshot *
+kvdb_snapshot(struct kvdb *kvdb)
 {
-	const uint64_t *ref;
-	uint64_t val_len_;
-	uint64_t off;
-	void *val_;
+	struct kvdb_snapshot *snapshot;
 
 	assert( kvdb );
+
+	if (!(snapshot = malloc(sizeof (struct kvdb_snapshot)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(snapshot, 0, sizeof (struct kvdb_snapshot));
+	snapshot->kvdb = kvdb;
+	if (kvdb->lsm) {
+		if (lsm_snapshot(kvdb->lsm, &snapshot->pin)) {
+			FREE(snapshot);
+			TRACE(0);
+			return NULL;
+		}
+	}
+	else {
+		snapshot->pin = kvraw_size(kvdb->kvraw);
+	}
+	if ((snapshot->older = kvdb->newest)) {
+		snapshot->older->newer = snapshot;
+	}
+	kvdb->newest = snapshot;
+	++kvdb->snapshots;
+	return snapshot;
+}
+
+void
+kvdb_snapshot_release(struct kvdb_snapshot *snapshot)
+{
+	if (snapshot) {
+		if (snapshot->kvdb->lsm) {
+			lsm_release(snapshot->kvdb->lsm, snapshot->pin);
+		}
+		if (snapshot->newer) {
+			snapshot->newer->older = snapshot->older;
+		}
+		else {
+			snapshot->kvdb->newest = snapshot->older;
+		}
+		if (snapshot->older) {
+			snapshot->older->newer = snapshot->newer;
+		}
+		--snapshot->kvdb->snapshots;
+		memset(snapshot, 0, sizeof (struct kvdb_snapshot));
+	}
+	FREE(snapshot);
+}
+
+int /* -1|0|+1 */
+kvdb_snapshot_lookup(struct kvdb_snapshot *snapshot,
+		     const void *key,
+		     uint64_t key_len,
+		     void *val,
+		     uint64_t *val_len)
+{
+	uint64_t t;
+
+	assert( snapshot );
 	assert( key );
 	assert( key_len && (KVDB_MAX_KEY_LEN >= key_len) );
 	assert( !val_len || !(*val_len) || val );
 
-	/* index */
+	t = ref_time_ns();
+	return account(snapshot->kvdb,
+		       KVDB_OP_LOOKUP,
+		       t,
+		       lookup(snapshot->kvdb,
+			      snapshot->pin,
+			      key,
+			      key_len,
+			      val,
+			      val_len,
+			      NULL));
+}
 
-	ref = index_lookup(kvdb->index, key, key_len);
-	if (!ref || !(*ref)) {
-		return +1; /* invalid key */
+static int
+scanner_grow(char **buf, uint64_t *capacity, uint64_t n)
+{
+	char *buf_;
+
+	if (n > (*capacity)) {
+		n = MAX(n, (*capacity) * 2);
+		if (!(buf_ = realloc((*buf), n))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		(*buf) = buf_;
+		(*capacity) = n;
 	}
-	off = (*ref);
+	return 0;
+}
 
-	/* chained */
+static int
+scanner_add(struct scanner *scanner, uint64_t off)
+{
+	uint64_t capacity;
+	void *p;
 
-	val_ = val_len ? val : NULL;
-	val_len_ = val_len ? (*val_len) : 0;
-	if (chain_lookup(kvdb, key, key_len, val_, &val_len_, &off)) {
+	if (scanner->n == scanner->capacity) {
+		capacity = MAX(1024, scanner->capacity * 2);
+		if (!(p = realloc(scanner->cursors,
+				  capacity * sizeof (struct cursor)))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		scanner->cursors = (struct cursor *)p;
+		if (!(p = realloc(scanner->chains,
+				  capacity * sizeof (struct chain)))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		scanner->chains = (struct chain *)p;
+		scanner->capacity = capacity;
+	}
+	scanner->cursors[scanner->n].off = off;
+	scanner->cursors[scanner->n].chain = scanner->n;
+	memset(&scanner->chains[scanner->n], 0, sizeof (struct chain));
+	++scanner->n;
+	return 0;
+}
+
+static void
+scanner_reset(struct scanner *scanner, uint64_t chains)
+{
+	struct chain *chain, *next;
+	uint64_t i;
+
+	for (i=0; i<chains; ++i) {
+		chain = &scanner->chains[i];
+		FREE(chain->key);
+		for (chain=chain->next; chain; chain=next) {
+			next = chain->next;
+			FREE(chain->key);
+			FREE(chain);
+		}
+	}
+	scanner->n = 0;
+}
+
+static int /* -1|0|+1, +1 ==> nothing left to claim */
+scanner_claim(struct scanner *scanner)
+{
+	struct foreach *foreach;
+	struct kvdb *kvdb;
+	uint64_t i, j, k, lo, hi;
+	int e;
+
+	foreach = scanner->foreach;
+	kvdb = foreach->kvdb;
+	pthread_mutex_lock(&foreach->mutex);
+	if (foreach->stop || (foreach->next >= foreach->units)) {
+		pthread_mutex_unlock(&foreach->mutex);
+		return +1;
+	}
+	lo = foreach->next;
+	hi = MIN(lo + foreach->chunk, foreach->units);
+	foreach->next = hi;
+
+	/* device index pages go through its page cache, under the lock */
+
+	e = 0;
+	if (kvdb->dindex) {
+		for (i=lo; (i<hi) && !e; ++i) {
+			e = dindex_page(kvdb->dindex, i, scanner->offs, &k);
+			for (j=0; (j<k) && !e; ++j) {
+				if (scanner->offs[j]) {
+					e = scanner_add(scanner,
+							scanner->offs[j]);
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&foreach->mutex);
+	if (kvdb->index) {
+		for (i=lo; (i<hi) && !e; ++i) {
+			if ((j = index_slot(kvdb->index, i))) {
+				e = scanner_add(scanner, j);
+			}
+		}
+	}
+	if (e) {
 		TRACE(0);
 		return -1;
 	}
-	if (!off || !val_len_) {
-		return +1; /* invalid key */
+	return 0;
+}
+
+static int /* -1|0|+1, +1 ==> seen */
+scanner_seen(struct scanner *scanner, struct chain *chain, uint64_t key_len)
+{
+	struct chain *link;
+
+	/* keys sharing a chain share the 64-bit hash, almost always one */
+
+	for (link=chain; link && link->key; link=link->next) {
+		if ((link->key_len == key_len) &&
+		    !memcmp(link->key, scanner->key.buf, key_len)) {
+			return +1;
+		}
 	}
-	if (val_len) {
-		(*val_len) = val_len_;
+	link = chain;
+	if (chain->key) {
+		if (!(link = malloc(sizeof (struct chain)))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		link->next = chain->next;
+		chain->next = link;
+	}
+	if (!(link->key = malloc(key_len))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memcpy(link->key, scanner->key.buf, key_len);
+	link->key_len = key_len;
+	return 0;
+}
+
+static int /* -1|0|+1, +1 ==> stopped by fnc */
+scanner_visit(struct scanner *scanner, struct cursor *cursor)
+{
+	struct foreach *foreach;
+	uint64_t off, key_len, val_len, n;
+	int r;
+
+	foreach = scanner->foreach;
+	off = cursor->off;
+
+	/* key and lengths first, the value only if this version is live */
+
+	for (;;) {
+		key_len = scanner->key.capacity;
+		val_len = 0;
+		cursor->off = off;
+		if (0 > (r = kvraw_lookup(foreach->kvdb->kvraw,
+					  scanner->key.buf,
+					  &key_len,
+					  NULL,
+					  &val_len,
+					  &cursor->off))) {
+			TRACE(0);
+			return -1;
+		}
+		if (key_len <= scanner->key.capacity) {
+			break;
+		}
+		if (scanner_grow(&scanner->key.buf,
+				 &scanner->key.capacity,
+				 key_len)) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (off >= foreach->pin) {
+		return 0; /* appended after the scan started */
+	}
+	switch (scanner_seen(scanner,
+			     &scanner->chains[cursor->chain],
+			     key_len)) {
+	case 0:
+		break;
+	case +1:
+		return 0; /* superseded */
+	default:
+		TRACE(0);
+		return -1;
+	}
+
+	/* merge operand, folded by lookup() under the lock */
+
+	if (r) {
+		pthread_mutex_lock(&foreach->mutex);
+		for (;;) {
+			val_len = scanner->val.capacity;
+			r = lookup(foreach->kvdb,
+				   foreach->pin,
+				   scanner->key.buf,
+				   key_len,
+				   scanner->val.buf,
+				   &val_len,
+				   NULL);
+			if (r || (val_len <= scanner->val.capacity)) {
+				break;
+			}
+			if (scanner_grow(&scanner->val.buf,
+					 &scanner->val.capacity,
+					 val_len)) {
+				r = -1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&foreach->mutex);
+		if (0 > r) {
+			TRACE(0);
+			return -1;
+		}
+		if (r) {
+			return 0;
+		}
+	}
+	else {
+		if (!val_len) {
+			return 0; /* tombstone */
+		}
+		if (foreach->filter &&
+		    (val_len < filter_width(foreach->filter))) {
+			return 0; /* too short to match, not read */
+		}
+		n = 0;
+		if (scanner_grow(&scanner->val.buf,
+				 &scanner->val.capacity,
+				 val_len) ||
+		    (0 > kvraw_lookup(foreach->kvdb->kvraw,
+				      NULL,
+				      &n,
+				      scanner->val.buf,
+				      &val_len,
+				      &off))) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (foreach->filter &&
+	    !filter_match(foreach->filter, scanner->val.buf, val_len)) {
+		return 0;
+	}
+	return foreach->fnc(foreach->arg,
+			    scanner->key.buf,
+			    key_len,
+			    scanner->val.buf,
+			    val_len) ? +1 : 0;
+}
+
+static int
+scanner_order(const void *a_, const void *b_)
+{
+	const struct cursor *a, *b;
+
+	a = (const struct cursor *)a_;
+	b = (const struct cursor *)b_;
+	if (a->off != b->off) {
+		return (a->off < b->off) ? -1 : +1;
 	}
 	return 0;
 }
 
+static void *
+scanner_run(void *arg)
+{
+	struct scanner *scanner;
+	uint64_t i, m, chains;
+	int r;
+
+	scanner = (struct scanner *)arg;
+	for (;;) {
+		if ((r = scanner_claim(scanner))) {
+			scanner_reset(scanner, scanner->n);
+			r = (0 < r) ? 0 : r;
+			break;
+		}
+
+		/*
+		 * Each round reads the next record of every chain, sorted by
+		 * log offset. Chains run newest first, so the first record
+		 * read for a key is its live version.
+		 */
+
+		chains = scanner->n;
+		while (!r && scanner->n) {
+			qsort(scanner->cursors,
+			      scanner->n,
+			      sizeof (struct cursor),
+			      scanner_order);
+			for (m=0, i=0; (i<scanner->n) && !r; ++i) {
+				r = scanner_visit(scanner,
+						  &scanner->cursors[i]);
+				if (scanner->cursors[i].off) {
+					scanner->cursors[m++] =
+						scanner->cursors[i];
+				}
+			}
+			scanner->n = m;
+		}
+		scanner_reset(scanner, chains);
+		if (r) {
+			break;
+		}
+	}
+	if (r) {
+		pthread_mutex_lock(&scanner->foreach->mutex);
+		if (0 > r) {
+			scanner->foreach->stop = -1;
+		}
+		else if (!scanner->foreach->stop) {
+			scanner->foreach->stop = +1;
+		}
+		pthread_mutex_unlock(&scanner->foreach->mutex);
+	}
+	return NULL;
+}
+
+int
+kvdb_foreach(struct kvdb *kvdb,
+	     int threads,
+	     kvdb_foreach_fnc_t fnc,
+	     void *arg)
+{
+	return kvdb_foreach_filter(kvdb, threads, NULL, fnc, arg);
+}
+
+int
+kvdb_foreach_filter(struct kvdb *kvdb,
+		    int threads,
+		    const struct filter *filter,
+		    kvdb_foreach_fnc_t fnc,
+		    void *arg)
+{
+	struct scanner *scanners;
+	struct foreach foreach;
+	uint64_t n;
+	int i, k;
+
+	assert( kvdb );
+	assert( 0 < threads );
+	assert( fnc );
+
+	if (kvdb->lsm) {
+		TRACE("no index table to partition under the lsm engine");
+		return -1;
+	}
+
+	/* ranges of the index table, claimed by the threads as they go */
+
+	memset(&foreach, 0, sizeof (struct foreach));
+	foreach.kvdb = kvdb;
+	foreach.filter = filter;
+	foreach.fnc = fnc;
+	foreach.arg = arg;
+	foreach.pin = kvraw_size(kvdb->kvraw);
+	if (kvdb->dindex) {
+		foreach.units = dindex_pages(kvdb->dindex);
+		foreach.chunk = FOREACH_PAGES;
+		n = dindex_entries(kvdb->dindex);
+	}
+	else {
+		foreach.units = index_slots(kvdb->index);
+		foreach.chunk = FOREACH_SLOTS;
+		n = 0;
+	}
+	if (!(scanners = malloc(threads * sizeof (struct scanner)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(scanners, 0, threads * sizeof (struct scanner));
+	for (i=0; i<threads; ++i) {
+		scanners[i].foreach = &foreach;
+		if (n && !(scanners[i].offs = malloc(n * sizeof (uint64_t)))) {
+			foreach.stop = -1;
+		}
+	}
+	if (pthread_mutex_init(&foreach.mutex, NULL)) {
+		for (i=0; i<threads; ++i) {
+			FREE(scanners[i].offs);
+		}
+		FREE(scanners);
+		TRACE("pthread_mutex_init()");
+		return -1;
+	}
+
+	/* a thread that cannot start fails the scan, the others stop early */
+
+	for (k=0; k<threads; ++k) {
+		if (pthread_create(&scanners[k].thread,
+				   NULL,
+				   scanner_run,
+				   &scanners[k])) {
+			pthread_mutex_lock(&foreach.mutex);
+			foreach.stop = -1;
+			pthread_mutex_unlock(&foreach.mutex);
+			TRACE("pthread_create()");
+			break;
+		}
+	}
+	for (i=0; i<threads; ++i) {
+		if (i < k) {
+			pthread_join(scanners[i].thread, NULL);
+		}
+		FREE(scanners[i].cursors);
+		FREE(scanners[i].chains);
+		FREE(scanners[i].offs);
+		FREE(scanners[i].key.buf);
+		FREE(scanners[i].val.buf);
+	}
+	pthread_mutex_destroy(&foreach.mutex);
+	FREE(scanners);
+	if (0 > foreach.stop) {
+		TRACE(0);
+		return -1;
+	}
+	return foreach.stop;
+}
+
 uint64_t
 kvdb_size(const struct kvdb *kvdb)
 {
@@ -369,3 +2224,75 @@ kvdb_waste(const struct kvdb *kvdb)
 
 	return kvdb->waste;
 }
+
+void
+kvdb_stats(struct kvdb *kvdb, struct kvdb_stats *stats)
+{
+	assert( kvdb );
+	assert( stats );
+
+	(*stats) = kvdb->stats;
+	stats->size = kvdb->size;
+	stats->waste = kvdb->waste;
+	memset(&stats->index, 0, sizeof (stats->index));
+	if (kvdb->index) {
+		index_stats(kvdb->index, &stats->index);
+	}
+	else if (kvdb->dindex) {
+		dindex_stats(kvdb->dindex, &stats->index);
+	}
+	if (kvdb->lsm) {
+		lsm_stats(kvdb->lsm,
+			  &stats->log.appended,
+			  &stats->log.live,
+			  &stats->logfs);
+	}
+	else {
+		stats->log.appended = kvraw_size(kvdb->kvraw);
+		stats->log.live = kvdb->live;
+		kvraw_stats(kvdb->kvraw, &stats->logfs);
+	}
+}
+
+void
+kvdb_stats_merge(struct kvdb_stats *stats, const struct kvdb_stats *other)
+{
+	int i;
+
+	assert( stats );
+	assert( other );
+
+	stats->size += other->size;
+	stats->waste += other->waste;
+	for (i=0; i<KVDB_OP_END; ++i) {
+		stats->ops[i].misses += other->ops[i].misses;
+		stats->ops[i].errors += other->ops[i].errors;
+		hist_merge(&stats->ops[i].latency, &other->ops[i].latency);
+	}
+	stats->index.size += other->index.size;
+	stats->index.capacity += other->index.capacity;
+	stats->index.lookups += other->index.lookups;
+	stats->index.probes += other->index.probes;
+	stats->index.probe_max = MAX(stats->index.probe_max,
+				     other->index.probe_max);
+	stats->chain.walks += other->chain.walks;
+	stats->chain.hops += other->chain.hops;
+	stats->chain.hop_max = MAX(stats->chain.hop_max,
+				   other->chain.hop_max);
+	stats->log.appended += other->log.appended;
+	stats->log.live += other->log.live;
+	stats->logfs.appended += other->logfs.appended;
+	stats->logfs.pending += other->logfs.pending;
+	stats->logfs.ring += other->logfs.ring;
+	stats->logfs.stalls += other->logfs.stalls;
+	stats->logfs.stall_us += other->logfs.stall_us;
+	stats->logfs.stored += other->logfs.stored;
+	stats->logfs.segment = MAX(stats->logfs.segment, other->logfs.segment);
+	stats->logfs.segments += other->logfs.segments;
+	stats->logfs.free += other->logfs.free;
+	stats->logfs.prefetched += other->logfs.prefetched;
+	stats->logfs.prefetch_hits += other->logfs.prefetch_hits;
+	device_stats_merge(&stats->logfs.device, &other->logfs.device);
+	stats->clean.segments += other->clean.segments;
+	stats->clean.moved += other->clean.moved;
+}
@@ -10,15 +10,58 @@
 #ifndef _KVDB_H_
 #define _KVDB_H_
 
-#include "system.h"
+#include "hist.h"
+#include "filter.h"
+#include "index.h"
+#include "logfs.h"
 
 #define KVDB_MAX_KEY_LEN 0xffff
 #define KVDB_MAX_VAL_LEN 0xffffffff
+#define KVDB_CLEAN_RESERVE 8 /* free log segments kept, at most a quarter */
 
 struct kvdb;
 
+struct kvdb_snapshot;
+
+/* associative, val is NULL if absent, *out is malloc'd by the callee */
+
+typedef int (*kvdb_merge_fnc_t)(void *arg,
+				const void *val,
+				uint64_t val_len,
+				const void *operand,
+				uint64_t operand_len,
+				void **out,
+				uint64_t *out_len);
+
+struct kvdb_config {
+	enum kvdb_engine {
+		KVDB_ENGINE_HASH, /* hash index over an append-only log */
+		KVDB_ENGINE_LSM   /* log-structured merge tree */
+	} engine;
+	uint64_t lsm_memtable; /* memtable size in bytes, KVDB_ENGINE_LSM */
+	enum kvdb_index {
+		KVDB_INDEX_MEMORY, /* hash table in RAM (default) */
+		KVDB_INDEX_DEVICE, /* bucket pages on index_pathname */
+		KVDB_INDEX_SCM     /* table mapped, index_pathname, kept */
+	} index;
+	const char *index_pathname;
+	uint64_t index_memory; /* RAM budget in bytes, KVDB_INDEX_DEVICE */
+	int log_compress;      /* LZ-compress log blocks on the device */
+};
+
 struct kvdb *kvdb_open(const char *pathname);
 
+/**
+ * Opens a store as configured. With KVDB_INDEX_SCM and the hash engine the
+ * store survives a clean close: kvdb_close() saves the index and the log
+ * table in index_pathname, and the next open over the same log device
+ * reattaches them instead of formatting. After a crash, or if the tail of
+ * the log no longer reads back as saved, the store starts empty.
+ */
+
+struct kvdb *kvdb_open_config(const char *pathname,
+			      const struct kvdb_config *config);
+
 void kvdb_close(struct kvdb *kvdb);
 
 int /* -1|0|+1 */
@@ -56,8 +99,200 @@ kvdb_lookup(struct kvdb *kvdb,
 	    void *val,
 	    uint64_t *val_len); /* in/out */
 
+/* one lookup of a batch, val and val_len as in kvdb_lookup() */
+
+struct kvdb_get {
+	const void *key;
+	uint64_t key_len;
+	void *val;
+	uint64_t val_len; /* in/out */
+	int r;            /* out, -1|0|+1 as kvdb_lookup() returns */
+};
+
+/**
+ * Runs count lookups, overlapping their device reads. The gets go in
+ * windows of a few dozen: the index is probed for every key of a window,
+ * the first log record of each is read into the log's read cache on up to
+ * threads threads at once, then the lookups run one by one and mostly find
+ * their records there. A device that serves several reads at a time then
+ * answers a window in about the time of one read. Results are as if
+ * kvdb_lookup() were called for each get in order. The lsm engine runs
+ * them one by one.
+ *
+ * return: 0 if no get returned -1, otherwise -1
+ */
+
+int kvdb_lookup_batch(struct kvdb *kvdb,
+		      struct kvdb_get *gets,
+		      int count,
+		      int threads);
+
+/* 0 and a pair, +1 at the end or -1 on error, pair valid until next call */
+
+typedef int (*kvdb_stream_fnc_t)(void *arg,
+				 const void **key,
+				 uint64_t *key_len,
+				 const void **val,
+				 uint64_t *val_len);
+
+/* unique: no pair repeats a key or names a key already present */
+
+int kvdb_bulk_load(struct kvdb *kvdb,
+		   uint64_t count, /* expected pairs */
+		   int unique,
+		   kvdb_stream_fnc_t next,
+		   void *arg);
+
+/* version: log offset (hash) or sequence number (lsm), 0 if absent */
+
+int /* -1|0|+1 */
+kvdb_lookup_version(struct kvdb *kvdb,
+		    const void *key,
+		    uint64_t key_len,
+		    void *val,
+		    uint64_t *val_len, /* in/out */
+		    uint64_t *version);
+
+int /* -1|0|+1, +1 ==> version mismatch */
+kvdb_cas(struct kvdb *kvdb,
+	 const void *key,
+	 uint64_t key_len,
+	 const void *val,
+	 uint64_t val_len,
+	 uint64_t *version); /* in/out */
+
+void kvdb_merge_operator(struct kvdb *kvdb, kvdb_merge_fnc_t fnc, void *arg);
+
+int kvdb_merge(struct kvdb *kvdb,
+	       const void *key,
+	       uint64_t key_len,
+	       const void *operand,
+	       uint64_t operand_len);
+
+/**
+ * Opens a read-only view of kvdb as it is now, writers carry on. On the
+ * hash engine the open snapshots pin the log written before the newest of
+ * them: the versions appended since are released and cleaned as usual,
+ * the older log stays, including versions superseded after the snapshot.
+ * While snapshots are open the device must hold that log plus the live
+ * pairs written since, else writes fail with out of space. Release
+ * snapshots that are no longer read.
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct kvdb_snapshot *kvdb_snapshot(struct kvdb *kvdb);
+
+void kvdb_snapshot_release(struct kvdb_snapshot *snapshot);
+
+int /* -1|0|+1 */
+kvdb_snapshot_lookup(struct kvdb_snapshot *snapshot,
+		     const void *key,
+		     uint64_t key_len,
+		     void *val,
+		     uint64_t *val_len); /* in/out */
+
+/* a live pair, called concurrently from the scan threads, nonzero stops */
+
+typedef int (*kvdb_foreach_fnc_t)(void *arg,
+				  const void *key,
+				  uint64_t key_len,
+				  const void *val,
+				  uint64_t val_len);
+
+/**
+ * Visits every live key once, in no particular order. The index table is
+ * cut into ranges that the threads claim as they go. A thread reads the
+ * chains of its range in rounds, sorted by log offset, so device access
+ * stays close to sequential. Superseded versions and removed keys are
+ * skipped, merge operands are folded. kvdb must not be modified until the
+ * call returns. Hash engine only.
+ *
+ * kvdb   : an opaque handle previously obtained by calling kvdb_open()
+ * threads: the number of scan threads
+ * fnc    : the visitor, must be safe to call from several threads at once
+ * arg    : passed to fnc
+ *
+ * return: 0 when every key was visited, +1 if fnc stopped the scan,
+ *         -1 on error
+ */
+
+int kvdb_foreach(struct kvdb *kvdb,
+		 int threads,
+		 kvdb_foreach_fnc_t fnc,
+		 void *arg);
+
+/**
+ * kvdb_foreach() with a compiled predicate applied in the scan threads, as
+ * each value comes off the device. fnc sees only the matching pairs. Values
+ * shorter than filter_width() are skipped without being read.
+ *
+ * filter: an opaque handle previously obtained by calling filter_open(),
+ *         NULL visits every pair
+ */
+
+int kvdb_foreach_filter(struct kvdb *kvdb,
+			int threads,
+			const struct filter *filter,
+			kvdb_foreach_fnc_t fnc,
+			void *arg);
+
 uint64_t kvdb_size(const struct kvdb *kvdb);
 
 uint64_t kvdb_waste(const struct kvdb *kvdb);
 
+/* replace, cas and merge count as updates, snapshot lookups as lookups */
+
+enum kvdb_op {
+	KVDB_OP_INSERT,
+	KVDB_OP_LOOKUP,
+	KVDB_OP_UPDATE,
+	KVDB_OP_REMOVE,
+	KVDB_OP_END
+};
+
+struct kvdb_stats {
+	uint64_t size;
+	uint64_t waste;
+	struct {
+		uint64_t misses; /* +1 returns */
+		uint64_t errors;
+		struct hist latency; /* ns, latency.count is the call count */
+	} ops[KVDB_OP_END];
+	struct index_stats index; /* hash engine */
+	struct {
+		uint64_t walks;
+		uint64_t hops;    /* records visited, all walks */
+		uint64_t hop_max; /* longest single walk */
+	} chain;                  /* hash engine */
+	struct {
+		uint64_t appended; /* bytes */
+		uint64_t live;     /* bytes still reachable, see below */
+	} log;
+	struct logfs_stats logfs;
+	struct {
+		uint64_t segments; /* log segments emptied by the cleaner */
+		uint64_t moved;    /* bytes it appended again */
+	} clean;                   /* hash engine */
+};
+
+/**
+ * Reports the counters of a kvdb handle. A handle is used by one thread at
+ * a time, so counting is plain increments on memory no other thread
+ * touches, and is always on. Callers that run one handle per thread (or
+ * per shard) merge the per-handle results with kvdb_stats_merge().
+ *
+ * Live bytes are the log records the index still reaches (hash engine,
+ * exact without merge operands, an upper bound with them) or the data
+ * bytes of the runs in the tree (lsm engine).
+ *
+ * kvdb : an opaque handle previously obtained by calling kvdb_open()
+ * stats: out, the statistics
+ */
+
+void kvdb_stats(struct kvdb *kvdb, struct kvdb_stats *stats);
+
+void kvdb_stats_merge(struct kvdb_stats *stats,
+		      const struct kvdb_stats *other);
+
 #endif /* _KVDB_H_ */
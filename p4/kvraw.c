@@ -7,6 +7,7 @@
  * kvraw.c
  */
 
+#include "device.h"
 #include "logfs.h"
 #include "kvraw.h"
 
@@ -18,6 +19,12 @@
 struct kvraw {
 	uint64_t size;
 	struct logfs *logfs;
+	struct {
+		uint64_t off; /* log offset of buf[0] */
+		uint64_t len;
+		uint64_t capacity;
+		char *buf;
+	} stage;
 };
 
 #pragma pack(push, 1)
@@ -29,6 +36,38 @@ struct meta {
 };
 #pragma pack(pop)
 
+static int
+fetch(struct kvraw *kvraw, void *buf, uint64_t off, uint64_t len)
+{
+	/* records are either entirely staged or entirely in the log */
+
+	if (kvraw->stage.len && (off >= kvraw->stage.off)) {
+		memcpy(buf, kvraw->stage.buf + (off - kvraw->stage.off), len);
+		return 0;
+	}
+	if (logfs_read(kvraw->logfs, buf, off, len)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+drain(struct kvraw *kvraw)
+{
+	if (kvraw->stage.len) {
+		if (logfs_append(kvraw->logfs,
+				 kvraw->stage.buf,
+				 kvraw->stage.len)) {
+			TRACE(0);
+			return -1;
+		}
+		kvraw->stage.len = 0;
+	}
+	kvraw->stage.off = kvraw->size;
+	return 0;
+}
+
 static int
 read_meta(struct kvraw *kvraw, uint64_t off, struct meta *meta)
 {
@@ -37,12 +76,12 @@ read_meta(struct kvraw *kvraw, uint64_t off, struct meta *meta)
 		TRACE("corrupt data");
 		return -1;
 	}
-	if (logfs_read(kvraw->logfs, meta, off, META_LEN)) {
+	if (fetch(kvraw, meta, off, META_LEN)) {
 		TRACE(0);
 		return -1;
 	}
 	if (('K' != meta->mark[0]) ||
-	    ('V' != meta->mark[1]) ||
+	    (('V' != meta->mark[1]) && ('M' != meta->mark[1])) ||
 	    ((off + META_LEN + meta->key_len + meta->val_len) > kvraw->size)) {
 		TRACE("corrupt data");
 		return -1;
@@ -50,8 +89,77 @@ read_meta(struct kvraw *kvraw, uint64_t off, struct meta *meta)
 	return 0;
 }
 
+static int
+append(struct kvraw *kvraw,
+       char mark,
+       const void *key,
+       uint64_t key_len,
+       const void *val,
+       uint64_t val_len,
+       uint64_t *off)
+{
+	const void *bufs[3];
+	uint64_t lens[3];
+	struct meta meta;
+	uint64_t off_, n;
+	char *p;
+
+	assert( kvraw );
+	assert( key && key_len && (0xffff >= key_len) );
+	assert( (!val_len || val) && (0xffffffff >= val_len) );
+	assert( off );
+
+	off_ = kvraw->size;
+	meta.mark[0] = 'K';
+	meta.mark[1] = mark;
+	meta.off = (*off);
+	meta.key_len = (uint16_t)key_len;
+	meta.val_len = (uint32_t)val_len;
+	n = META_LEN + meta.key_len + meta.val_len;
+
+	/* staged into an extent */
+
+	if (kvraw->stage.buf && (n <= kvraw->stage.capacity)) {
+		if (((kvraw->stage.len + n) > kvraw->stage.capacity) &&
+		    drain(kvraw)) {
+			TRACE(0);
+			return -1;
+		}
+		if (!kvraw->stage.len) {
+			kvraw->stage.off = off_;
+		}
+		p = kvraw->stage.buf + kvraw->stage.len;
+		memcpy(p, &meta, META_LEN);
+		memcpy(p + META_LEN, key, meta.key_len);
+		if (meta.val_len) {
+			memcpy(p + META_LEN + meta.key_len, val, meta.val_len);
+		}
+		kvraw->stage.len += n;
+		kvraw->size += n;
+		(*off) = off_;
+		return 0;
+	}
+
+	/* direct, one unit so that a segment starts on a record */
+
+	bufs[0] = &meta;
+	bufs[1] = key;
+	bufs[2] = val;
+	lens[0] = META_LEN;
+	lens[1] = meta.key_len;
+	lens[2] = meta.val_len;
+	if (drain(kvraw) || logfs_appendv(kvraw->logfs, bufs, lens, 3)) {
+		TRACE(0);
+		return -1;
+	}
+	kvraw->size += n;
+	kvraw->stage.off = kvraw->size;
+	(*off) = off_;
+	return 0;
+}
+
 struct kvraw *
-kvraw_open(const char *pathname)
+kvraw_open(const char *pathname, int flags)
 {
 	struct kvraw *kvraw;
 	uint64_t off;
@@ -63,7 +171,7 @@ kvraw_open(const char *pathname)
 		return NULL;
 	}
 	memset(kvraw, 0, sizeof (struct kvraw));
-	if (!(kvraw->logfs = logfs_open(pathname))) {
+	if (!(kvraw->logfs = logfs_open(pathname, flags))) {
 		kvraw_close(kvraw);
 		TRACE(0);
 		return NULL;
@@ -75,20 +183,71 @@ kvraw_open(const char *pathname)
 		return NULL;
 	}
 	assert( 0 == off );
+	logfs_release(kvraw->logfs, 0, kvraw->size); /* never referenced */
 	return kvraw;
 }
 
+struct kvraw *
+kvraw_reopen(const char *pathname,
+	     int flags,
+	     const void *image,
+	     uint64_t len)
+{
+	struct logfs_stats stats;
+	struct kvraw *kvraw;
+
+	assert( safe_strlen(pathname) );
+
+	if (!(kvraw = malloc(sizeof (struct kvraw)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(kvraw, 0, sizeof (struct kvraw));
+	if (!(kvraw->logfs = logfs_reopen(pathname, flags, image, len))) {
+		kvraw_close(kvraw);
+		TRACE(0);
+		return NULL;
+	}
+	logfs_stats(kvraw->logfs, &stats);
+	kvraw->size = stats.appended;
+	kvraw->stage.off = kvraw->size;
+	return kvraw;
+}
+
+void *
+kvraw_close_image(struct kvraw *kvraw, uint64_t *len)
+{
+	void *image;
+
+	assert( kvraw );
+
+	image = NULL;
+	if (!drain(kvraw)) {
+		image = logfs_close_image(kvraw->logfs, len);
+		kvraw->logfs = NULL;
+	}
+	if (!image) {
+		TRACE(0);
+	}
+	kvraw_close(kvraw);
+	return image;
+}
+
 void
 kvraw_close(struct kvraw *kvraw)
 {
 	if (kvraw) {
+		if (kvraw->logfs && drain(kvraw)) {
+			TRACE(0);
+		}
+		FREE(kvraw->stage.buf);
 		logfs_close(kvraw->logfs);
 		memset(kvraw, 0, sizeof (struct kvraw));
 	}
 	FREE(kvraw);
 }
 
-int
+int /* -1|0|+1 */
 kvraw_lookup(struct kvraw *kvraw,
 	     void *key,
 	     uint64_t *key_len, /* in/out */
@@ -110,15 +269,26 @@ kvraw_lookup(struct kvraw *kvraw,
 	}
 	key_len_ = MIN(meta.key_len, (*key_len));
 	val_len_ = MIN(meta.val_len, (*val_len));
-	if (logfs_read(kvraw->logfs, key, KEY_OFF(*off), key_len_) ||
-	    logfs_read(kvraw->logfs, val, VAL_OFF(*off), val_len_)) {
+	if (fetch(kvraw, key, KEY_OFF(*off), key_len_) ||
+	    fetch(kvraw, val, VAL_OFF(*off), val_len_)) {
 		TRACE(0);
 		return -1;
 	}
 	(*key_len) = meta.key_len;
 	(*val_len) = meta.val_len;
 	(*off) = meta.off;
-	return 0;
+	return ('M' == meta.mark[1]) ? +1 : 0;
+}
+
+void
+kvraw_prefetch(struct kvraw *kvraw,
+	       const uint64_t *offs,
+	       int count,
+	       int threads)
+{
+	assert( kvraw );
+
+	logfs_prefetch(kvraw->logfs, offs, count, threads);
 }
 
 int
@@ -128,28 +298,164 @@ kvraw_append(struct kvraw *kvraw,
 	     const void *val,
 	     uint64_t val_len,
 	     uint64_t *off)
+{
+	return append(kvraw, 'V', key, key_len, val, val_len, off);
+}
+
+int
+kvraw_append_merge(struct kvraw *kvraw,
+		   const void *key,
+		   uint64_t key_len,
+		   const void *val,
+		   uint64_t val_len,
+		   uint64_t *off)
+{
+	assert( val_len );
+
+	return append(kvraw, 'M', key, key_len, val, val_len, off);
+}
+
+int
+kvraw_bulk_begin(struct kvraw *kvraw, uint64_t extent)
+{
+	assert( kvraw );
+	assert( extent );
+
+	if (drain(kvraw)) {
+		TRACE(0);
+		return -1;
+	}
+	FREE(kvraw->stage.buf);
+	if (!(kvraw->stage.buf = malloc(extent))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	kvraw->stage.capacity = extent;
+	return 0;
+}
+
+int
+kvraw_bulk_end(struct kvraw *kvraw)
+{
+	assert( kvraw );
+
+	if (drain(kvraw)) {
+		TRACE(0);
+		return -1;
+	}
+	FREE(kvraw->stage.buf);
+	kvraw->stage.capacity = 0;
+	return 0;
+}
+
+uint64_t
+kvraw_size(const struct kvraw *kvraw)
+{
+	assert( kvraw );
+
+	return kvraw->size;
+}
+
+uint64_t
+kvraw_footprint(uint64_t key_len, uint64_t val_len)
+{
+	return META_LEN + key_len + val_len;
+}
+
+void
+kvraw_stats(struct kvraw *kvraw, struct logfs_stats *stats)
+{
+	assert( kvraw );
+	assert( stats );
+
+	logfs_stats(kvraw->logfs, stats);
+}
+
+int
+kvraw_release(struct kvraw *kvraw, uint64_t off, uint64_t len)
+{
+	assert( kvraw );
+	assert( (off + len) <= kvraw->size );
+
+	if (kvraw->stage.len && ((off + len) > kvraw->stage.off) &&
+	    drain(kvraw)) {
+		TRACE(0);
+		return -1;
+	}
+	logfs_release(kvraw->logfs, off, len);
+	return 0;
+}
+
+int
+kvraw_victim(struct kvraw *kvraw,
+	     uint64_t from,
+	     uint64_t *off,
+	     uint64_t *end,
+	     uint64_t *live)
+{
+	assert( kvraw );
+
+	return logfs_victim(kvraw->logfs, from, off, end, live);
+}
+
+int
+kvraw_records(struct kvraw *kvraw,
+	      uint64_t off,
+	      uint64_t end,
+	      kvraw_record_fnc_t fnc,
+	      void *arg)
 {
 	struct meta meta;
-	uint64_t off_;
+	const char *key;
+	char *buf, *tmp;
+	uint64_t n;
 
 	assert( kvraw );
-	assert( key && key_len && (0xffff >= key_len) );
-	assert( (!val_len || val) && (0xffffffff >= val_len) );
-	assert( off );
+	assert( off <= end );
+	assert( end <= kvraw->size );
+	assert( fnc );
 
-	off_ = kvraw->size;
-	meta.mark[0] = 'K';
-	meta.mark[1] = 'V';
-	meta.off = (*off);
-	meta.key_len = (uint16_t)key_len;
-	meta.val_len = (uint32_t)val_len;
-	if (logfs_append(kvraw->logfs, &meta, META_LEN) ||
-	    logfs_append(kvraw->logfs, key, meta.key_len) ||
-	    logfs_append(kvraw->logfs, val, meta.val_len)) {
+	/* the segment in one read, records running past its end one by one */
+
+	if (!(buf = device_alloc(MAX(end - off, 1))) ||
+	    !(tmp = device_alloc(0xffff))) {
+		device_free(buf);
+		TRACE(0);
+		return -1;
+	}
+	if (logfs_read(kvraw->logfs, buf, off, end - off)) {
+		device_free(buf);
+		device_free(tmp);
+		TRACE(0);
+		return -1;
+	}
+	for (n=off; n<end; n+=META_LEN + meta.key_len + meta.val_len) {
+		if ((n + META_LEN) <= end) {
+			memcpy(&meta, buf + (n - off), META_LEN);
+			if (('K' != meta.mark[0]) ||
+			    (('V' != meta.mark[1]) && ('M' != meta.mark[1]))) {
+				break;
+			}
+		}
+		else if (read_meta(kvraw, n, &meta)) {
+			break;
+		}
+		key = buf + (n - off) + META_LEN;
+		if ((n + META_LEN + meta.key_len) > end) {
+			if (fetch(kvraw, tmp, KEY_OFF(n), meta.key_len)) {
+				break;
+			}
+			key = tmp;
+		}
+		if (fnc(arg, n, key, meta.key_len)) {
+			break;
+		}
+	}
+	device_free(buf);
+	device_free(tmp);
+	if (n < end) {
 		TRACE(0);
 		return -1;
 	}
-	kvraw->size += META_LEN + meta.key_len + meta.val_len;
-	(*off) = off_;
 	return 0;
 }
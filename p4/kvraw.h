@@ -10,20 +10,39 @@
 #ifndef _KVRAW_H_
 #define _KVRAW_H_
 
-#include "system.h"
+#include "logfs.h"
 
 struct kvraw;
 
-struct kvraw *kvraw_open(const char *pathname);
+/* flags as in logfs_open() */
+
+struct kvraw *kvraw_open(const char *pathname, int flags);
 
 void kvraw_close(struct kvraw *kvraw);
 
-int kvraw_lookup(struct kvraw *kvraw,
-		 void *key,
-		 uint64_t *key_len, /* in/out */
-		 void *val,
-		 uint64_t *val_len, /* in/out */
-		 uint64_t *off);    /* in/out */
+/* the log picked up where kvraw_close_image() left it, see logfs_reopen() */
+
+struct kvraw *kvraw_reopen(const char *pathname,
+			   int flags,
+			   const void *image,
+			   uint64_t len);
+
+void *kvraw_close_image(struct kvraw *kvraw, uint64_t *len);
+
+int /* -1|0|+1, +1 ==> merge operand */
+kvraw_lookup(struct kvraw *kvraw,
+	     void *key,
+	     uint64_t *key_len, /* in/out */
+	     void *val,
+	     uint64_t *val_len, /* in/out */
+	     uint64_t *off);    /* in/out */
+
+/* the records at offs into the read cache, see logfs_prefetch() */
+
+void kvraw_prefetch(struct kvraw *kvraw,
+		    const uint64_t *offs,
+		    int count,
+		    int threads);
 
 int kvraw_append(struct kvraw *kvraw,
 		 const void *key,
@@ -32,4 +51,50 @@ int kvraw_append(struct kvraw *kvraw,
 		 uint64_t val_len,
 		 uint64_t *off);
 
+int kvraw_append_merge(struct kvraw *kvraw,
+		       const void *key,
+		       uint64_t key_len,
+		       const void *val,
+		       uint64_t val_len,
+		       uint64_t *off);
+
+/* appends are staged and written in extents of the given size until end */
+
+int kvraw_bulk_begin(struct kvraw *kvraw, uint64_t extent);
+
+int kvraw_bulk_end(struct kvraw *kvraw);
+
+uint64_t kvraw_size(const struct kvraw *kvraw);
+
+/* log bytes taken by a record with the given key and value lengths */
+
+uint64_t kvraw_footprint(uint64_t key_len, uint64_t val_len);
+
+void kvraw_stats(struct kvraw *kvraw, struct logfs_stats *stats);
+
+/* the log bytes of a record no longer reachable, see logfs_release() */
+
+int kvraw_release(struct kvraw *kvraw, uint64_t off, uint64_t len);
+
+/* the segment to clean next, see logfs_victim() */
+
+int kvraw_victim(struct kvraw *kvraw,
+		 uint64_t from,
+		 uint64_t *off,
+		 uint64_t *end,
+		 uint64_t *live);
+
+/* calls fnc for each record starting in [off, end), nonzero is an error */
+
+typedef int (*kvraw_record_fnc_t)(void *arg,
+				  uint64_t off,
+				  const void *key,
+				  uint64_t key_len);
+
+int kvraw_records(struct kvraw *kvraw,
+		  uint64_t off,
+		  uint64_t end,
+		  kvraw_record_fnc_t fnc,
+		  void *arg);
+
 #endif /* _KVRAW_H_ */
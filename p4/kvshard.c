@@ -0,0 +1,309 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * kvshard.c
+ */
+
+#include <pthread.h>
+#include "index.h"
+#include "kvshard.h"
+
+struct part {
+	uint64_t ops;
+	struct kvdb *kvdb;
+	pthread_mutex_t mutex;
+};
+
+struct kvshard {
+	int n;
+	struct part *parts;
+};
+
+static struct part *
+route(struct kvshard *kvshard, const void *key, uint64_t key_len)
+{
+	uint64_t h;
+
+	/* high bits, the shard's index buckets on the low bits */
+
+	h = index_hash(key, key_len);
+	return &kvshard->parts[(h >> 32) % (uint64_t)kvshard->n];
+}
+
+static struct part *
+enter(struct kvshard *kvshard, const void *key, uint64_t key_len)
+{
+	struct part *part;
+
+	part = route(kvshard, key, key_len);
+	pthread_mutex_lock(&part->mutex);
+	++part->ops;
+	return part;
+}
+
+static void
+leave(struct part *part)
+{
+	pthread_mutex_unlock(&part->mutex);
+}
+
+struct kvshard *
+kvshard_open(const char * const *pathnames,
+	     int n,
+	     const struct kvdb_config *configs)
+{
+	struct kvshard *kvshard;
+	int i;
+
+	assert( pathnames );
+	assert( 0 < n );
+
+	if (!(kvshard = malloc(sizeof (struct kvshard)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(kvshard, 0, sizeof (struct kvshard));
+	if (!(kvshard->parts = malloc(n * sizeof (struct part)))) {
+		kvshard_close(kvshard);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(kvshard->parts, 0, n * sizeof (struct part));
+	for (i=0; i<n; ++i) {
+		if (pthread_mutex_init(&kvshard->parts[i].mutex, NULL)) {
+			kvshard_close(kvshard);
+			TRACE("pthread_mutex_init()");
+			return NULL;
+		}
+		++kvshard->n;
+		if (!(kvshard->parts[i].kvdb =
+		      kvdb_open_config(pathnames[i],
+				       configs ? &configs[i] : NULL))) {
+			kvshard_close(kvshard);
+			TRACE(0);
+			return NULL;
+		}
+	}
+	return kvshard;
+}
+
+void
+kvshard_close(struct kvshard *kvshard)
+{
+	int i;
+
+	if (kvshard) {
+		for (i=0; i<kvshard->n; ++i) {
+			kvdb_close(kvshard->parts[i].kvdb);
+			pthread_mutex_destroy(&kvshard->parts[i].mutex);
+		}
+		FREE(kvshard->parts);
+		memset(kvshard, 0, sizeof (struct kvshard));
+	}
+	FREE(kvshard);
+}
+
+int /* -1|0|+1 */
+kvshard_remove(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       void *val,
+	       uint64_t *val_len)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_remove(part->kvdb, key, key_len, val, val_len);
+	leave(part);
+	return r;
+}
+
+int /* -1|0|+1 */
+kvshard_insert(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       const void *val,
+	       uint64_t val_len)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_insert(part->kvdb, key, key_len, val, val_len);
+	leave(part);
+	return r;
+}
+
+int /* -1|0|+1 */
+kvshard_update(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       const void *val,
+	       uint64_t val_len)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_update(part->kvdb, key, key_len, val, val_len);
+	leave(part);
+	return r;
+}
+
+int /* -1|0|+1 */
+kvshard_replace(struct kvshard *kvshard,
+		const void *key,
+		uint64_t key_len,
+		const void *val,
+		uint64_t val_len)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_replace(part->kvdb, key, key_len, val, val_len);
+	leave(part);
+	return r;
+}
+
+int /* -1|0|+1 */
+kvshard_lookup(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       void *val,
+	       uint64_t *val_len)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_lookup(part->kvdb, key, key_len, val, val_len);
+	leave(part);
+	return r;
+}
+
+int /* -1|0|+1 */
+kvshard_lookup_version(struct kvshard *kvshard,
+		       const void *key,
+		       uint64_t key_len,
+		       void *val,
+		       uint64_t *val_len,
+		       uint64_t *version)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_lookup_version(part->kvdb,
+				key,
+				key_len,
+				val,
+				val_len,
+				version);
+	leave(part);
+	return r;
+}
+
+int /* -1|0|+1 */
+kvshard_cas(struct kvshard *kvshard,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len,
+	    uint64_t *version)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_cas(part->kvdb, key, key_len, val, val_len, version);
+	leave(part);
+	return r;
+}
+
+int
+kvshard_merge(struct kvshard *kvshard,
+	      const void *key,
+	      uint64_t key_len,
+	      const void *operand,
+	      uint64_t operand_len)
+{
+	struct part *part;
+	int r;
+
+	assert( kvshard );
+
+	part = enter(kvshard, key, key_len);
+	r = kvdb_merge(part->kvdb, key, key_len, operand, operand_len);
+	leave(part);
+	return r;
+}
+
+void
+kvshard_merge_operator(struct kvshard *kvshard,
+		       kvdb_merge_fnc_t fnc,
+		       void *arg)
+{
+	int i;
+
+	assert( kvshard );
+
+	for (i=0; i<kvshard->n; ++i) {
+		pthread_mutex_lock(&kvshard->parts[i].mutex);
+		kvdb_merge_operator(kvshard->parts[i].kvdb, fnc, arg);
+		pthread_mutex_unlock(&kvshard->parts[i].mutex);
+	}
+}
+
+int
+kvshard_count(const struct kvshard *kvshard)
+{
+	assert( kvshard );
+
+	return kvshard->n;
+}
+
+void
+kvshard_stats(struct kvshard *kvshard, int shard, struct kvshard_stats *stats)
+{
+	struct kvdb_stats kvdb;
+	struct part *part;
+	int i;
+
+	assert( kvshard );
+	assert( (-1 <= shard) && (shard < kvshard->n) );
+	assert( stats );
+
+	memset(stats, 0, sizeof (struct kvshard_stats));
+	for (i=0; i<kvshard->n; ++i) {
+		if ((-1 != shard) && (shard != i)) {
+			continue;
+		}
+		part = &kvshard->parts[i];
+		pthread_mutex_lock(&part->mutex);
+		stats->size += kvdb_size(part->kvdb);
+		stats->waste += kvdb_waste(part->kvdb);
+		stats->ops += part->ops;
+		kvdb_stats(part->kvdb, &kvdb);
+		pthread_mutex_unlock(&part->mutex);
+		kvdb_stats_merge(&stats->kvdb, &kvdb);
+	}
+}
@@ -0,0 +1,138 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * kvshard.h
+ */
+
+#ifndef _KVSHARD_H_
+#define _KVSHARD_H_
+
+#include "kvdb.h"
+
+struct kvshard;
+
+struct kvshard_stats {
+	uint64_t size;  /* live keys */
+	uint64_t waste; /* superseded records */
+	uint64_t ops;   /* operations routed */
+	struct kvdb_stats kvdb; /* merged over the shards reported */
+};
+
+/**
+ * Opens n independent kvdb shards, one per block device in pathnames. Keys
+ * are hashed across the shards. Every shard has its own log, logfs worker
+ * and index, and its own lock, so callers on different threads only
+ * contend when their keys land in the same shard.
+ *
+ * pathnames: the pathnames of the n block devices
+ * n        : the number of shards
+ * configs  : n kvdb configurations, one per shard, or NULL for defaults
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct kvshard *kvshard_open(const char * const *pathnames,
+			     int n,
+			     const struct kvdb_config *configs);
+
+/**
+ * Closes a previously opened kvshard handle.
+ *
+ * kvshard: an opaque handle previously obtained by calling kvshard_open()
+ *
+ * Note: kvshard may be NULL.
+ */
+
+void kvshard_close(struct kvshard *kvshard);
+
+/**
+ * Same as the kvdb function of the same name, on the shard owning key.
+ */
+
+int /* -1|0|+1 */
+kvshard_remove(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       void *val,
+	       uint64_t *val_len); /* in/out */
+
+int /* -1|0|+1 */
+kvshard_insert(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       const void *val,
+	       uint64_t val_len);
+
+int /* -1|0|+1 */
+kvshard_update(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       const void *val,
+	       uint64_t val_len);
+
+int /* -1|0|+1 */
+kvshard_replace(struct kvshard *kvshard,
+		const void *key,
+		uint64_t key_len,
+		const void *val,
+		uint64_t val_len);
+
+int /* -1|0|+1 */
+kvshard_lookup(struct kvshard *kvshard,
+	       const void *key,
+	       uint64_t key_len,
+	       void *val,
+	       uint64_t *val_len); /* in/out */
+
+int /* -1|0|+1 */
+kvshard_lookup_version(struct kvshard *kvshard,
+		       const void *key,
+		       uint64_t key_len,
+		       void *val,
+		       uint64_t *val_len, /* in/out */
+		       uint64_t *version);
+
+int /* -1|0|+1 */
+kvshard_cas(struct kvshard *kvshard,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len,
+	    uint64_t *version); /* in/out */
+
+int kvshard_merge(struct kvshard *kvshard,
+		  const void *key,
+		  uint64_t key_len,
+		  const void *operand,
+		  uint64_t operand_len);
+
+/**
+ * Registers the merge function with every shard.
+ */
+
+void kvshard_merge_operator(struct kvshard *kvshard,
+			    kvdb_merge_fnc_t fnc,
+			    void *arg);
+
+/**
+ * Returns the number of shards.
+ */
+
+int kvshard_count(const struct kvshard *kvshard);
+
+/**
+ * Reports the statistics of one shard, or the sum over all shards.
+ *
+ * kvshard: an opaque handle previously obtained by calling kvshard_open()
+ * shard  : the shard, [0, kvshard_count()), or -1 for all shards
+ * stats  : out, the statistics
+ */
+
+void kvshard_stats(struct kvshard *kvshard,
+		   int shard,
+		   struct kvshard_stats *stats);
+
+#endif /* _KVSHARD_H_ */
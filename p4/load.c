@@ -0,0 +1,329 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * load.c
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "resp.h"
+
+/**
+ * Needs:
+ *   socket()
+ *   connect()
+ *   recv()
+ *   send()
+ */
+
+struct config {
+	const char *address;
+	const char *unix_pathname;
+	int port;
+	int conns;
+	uint64_t requests; /* per connection */
+	uint64_t depth;    /* pipelined requests per batch */
+	uint64_t keys;
+	uint64_t val_len;
+	int reads;         /* percent */
+};
+
+struct client {
+	pthread_t thread;
+	const struct config *config;
+	uint64_t seed;
+	uint64_t batches;
+	uint64_t latency;  /* us, summed over batches */
+	uint64_t errors;
+	int failed;
+};
+
+static uint64_t
+next(uint64_t *seed)
+{
+	(*seed) ^= (*seed) << 13;
+	(*seed) ^= (*seed) >> 7;
+	(*seed) ^= (*seed) << 17;
+	return (*seed);
+}
+
+static int
+dial(const struct config *config)
+{
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	uint64_t n;
+	int fd, one;
+
+	if (config->unix_pathname) {
+		memset(&un, 0, sizeof (un));
+		un.sun_family = AF_UNIX;
+		if ((n = safe_strlen(config->unix_pathname)) >=
+		    sizeof (un.sun_path)) {
+			TRACE("socket pathname too long");
+			return -1;
+		}
+		memcpy(un.sun_path, config->unix_pathname, n);
+		if (0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+			TRACE("socket()");
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr *)&un, sizeof (un))) {
+			close(fd);
+			TRACE("connect()");
+			return -1;
+		}
+		return fd;
+	}
+	memset(&in, 0, sizeof (in));
+	in.sin_family = AF_INET;
+	in.sin_port = htons((uint16_t)config->port);
+	if (1 != inet_pton(AF_INET, config->address, &in.sin_addr)) {
+		TRACE("bad address");
+		return -1;
+	}
+	if (0 > (fd = socket(AF_INET, SOCK_STREAM, 0))) {
+		TRACE("socket()");
+		return -1;
+	}
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+	if (connect(fd, (struct sockaddr *)&in, sizeof (in))) {
+		close(fd);
+		TRACE("connect()");
+		return -1;
+	}
+	return fd;
+}
+
+static int
+batch(struct client *client,
+      int fd,
+      struct resp_buf *out,
+      struct resp_buf *in,
+      const char *val)
+{
+	const struct config *config;
+	const void *argv[3];
+	uint64_t i, k, lens[3];
+	char key[32];
+	ssize_t n;
+	long m;
+
+	/* d requests, one send */
+
+	config = client->config;
+	for (i=0; i<config->depth; ++i) {
+		k = next(&client->seed) % config->keys;
+		safe_sprintf(key, sizeof (key), "key%012lu", (unsigned long)k);
+		argv[1] = key;
+		lens[1] = safe_strlen(key);
+		if ((int)(next(&client->seed) % 100) < config->reads) {
+			argv[0] = "GET";
+			lens[0] = 3;
+			m = resp_command(out, 2, argv, lens);
+		}
+		else {
+			argv[0] = "SET";
+			lens[0] = 3;
+			argv[2] = val;
+			lens[2] = config->val_len;
+			m = resp_command(out, 3, argv, lens);
+		}
+		if (m) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	while (out->len) {
+		if (0 >= (n = send(fd, out->buf, out->len, MSG_NOSIGNAL))) {
+			TRACE("send()");
+			return -1;
+		}
+		resp_drop(out, (uint64_t)n);
+	}
+
+	/* d replies */
+
+	for (i=0; i<config->depth; ) {
+		if (0 > (m = resp_reply(in->buf, in->len))) {
+			TRACE("malformed reply");
+			return -1;
+		}
+		if (m) {
+			client->errors += ('-' == in->buf[0]) ? 1 : 0;
+			resp_drop(in, (uint64_t)m);
+			++i;
+			continue;
+		}
+		if (resp_reserve(in, 64 * 1024)) {
+			TRACE(0);
+			return -1;
+		}
+		n = recv(fd, in->buf + in->len, in->capacity - in->len, 0);
+		if (0 >= n) {
+			TRACE("recv()");
+			return -1;
+		}
+		in->len += (uint64_t)n;
+	}
+	return 0;
+}
+
+static void *
+run(void *arg)
+{
+	struct resp_buf out, in;
+	struct client *client;
+	uint64_t i, t;
+	char *val;
+	int fd;
+
+	client = (struct client *)arg;
+	memset(&out, 0, sizeof (out));
+	memset(&in, 0, sizeof (in));
+	if (!(val = malloc(client->config->val_len))) {
+		client->failed = 1;
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(val, 'v', client->config->val_len);
+	if (0 > (fd = dial(client->config))) {
+		client->failed = 1;
+		FREE(val);
+		TRACE(0);
+		return NULL;
+	}
+	for (i=0; i<client->config->requests; i+=client->config->depth) {
+		t = ref_time();
+		if (batch(client, fd, &out, &in, val)) {
+			client->failed = 1;
+			break;
+		}
+		client->latency += ref_time() - t;
+		++client->batches;
+	}
+	close(fd);
+	resp_free(&out);
+	resp_free(&in);
+	FREE(val);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct client *clients;
+	struct config config;
+	uint64_t t, ops, batches, latency, errors;
+	int i, failed;
+
+	/* arguments */
+
+	memset(&config, 0, sizeof (config));
+	config.address = "127.0.0.1";
+	config.conns = 4;
+	config.requests = 100000;
+	config.depth = 16;
+	config.keys = 100000;
+	config.val_len = 100;
+	config.reads = 90;
+	for (i=1; (i + 1) < argc; i+=2) {
+		if (!strcmp(argv[i], "-a")) {
+			config.address = argv[i + 1];
+		}
+		else if (!strcmp(argv[i], "-p")) {
+			config.port = atoi(argv[i + 1]);
+		}
+		else if (!strcmp(argv[i], "-u")) {
+			config.unix_pathname = argv[i + 1];
+		}
+		else if (!strcmp(argv[i], "-c")) {
+			config.conns = atoi(argv[i + 1]);
+		}
+		else if (!strcmp(argv[i], "-n")) {
+			config.requests = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "-d")) {
+			config.depth = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "-k")) {
+			config.keys = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "-v")) {
+			config.val_len = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "-r")) {
+			config.reads = atoi(argv[i + 1]);
+		}
+		else {
+			break;
+		}
+	}
+	if ((i < argc) ||
+	    (!config.port && !config.unix_pathname) ||
+	    (0 >= config.conns) ||
+	    !config.depth ||
+	    !config.keys ||
+	    !config.val_len) {
+		printf("usage: %s [-a address] [-p port] [-u unix-socket] "
+		       "[-c conns] [-n requests] [-d depth] [-k keys] "
+		       "[-v val-len] [-r read-percent]\n",
+		       argv[0]);
+		return -1;
+	}
+
+	/* run */
+
+	if (!(clients = malloc(config.conns * sizeof (struct client)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(clients, 0, config.conns * sizeof (struct client));
+	t = ref_time();
+	for (i=0; i<config.conns; ++i) {
+		clients[i].config = &config;
+		clients[i].seed = (uint64_t)2654435761u * (uint64_t)(i + 1);
+		if (pthread_create(&clients[i].thread,
+				   NULL,
+				   run,
+				   &clients[i])) {
+			TRACE("pthread_create()");
+			exit(-1);
+		}
+	}
+	ops = batches = latency = errors = 0;
+	failed = 0;
+	for (i=0; i<config.conns; ++i) {
+		pthread_join(clients[i].thread, NULL);
+		ops += clients[i].batches * config.depth;
+		batches += clients[i].batches;
+		latency += clients[i].latency;
+		errors += clients[i].errors;
+		failed |= clients[i].failed;
+	}
+	t = ref_time() - t;
+	FREE(clients);
+
+	/* report */
+
+	printf("%lu ops in %.3f s: %.0f ops/s, %.1f us/batch of %lu, "
+	       "%lu errors\n",
+	       (unsigned long)ops,
+	       t / 1e6,
+	       t ? ops / (t / 1e6) : 0.0,
+	       batches ? (double)latency / batches : 0.0,
+	       (unsigned long)config.depth,
+	       (unsigned long)errors);
+	return failed ? -1 : 0;
+}
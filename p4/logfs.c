@@ -9,10 +9,17 @@
 
 #include <pthread.h>
 #include "device.h"
+#include "lz.h"
 #include "logfs.h"
 
 #define WCACHE_BLOCKS 32
 #define RCACHE_BLOCKS 256
+#define SEGMENT (1024 * 1024)
+#define CHUNK (64 * 1024)
+#define CHUNKS (SEGMENT / CHUNK)
+#define NONE UINT64_MAX
+#define RA_MIN 4  /* readahead window in blocks, first sequential step */
+#define RA_MAX 64 /* largest window, doubled on each sequential step */
 
 /**
  * Needs:
@@ -26,257 +33,1725 @@
  *   pthread_cond_destroy()
  *   pthread_cond_wait()
  *   pthread_cond_signal()
+ *   pthread_cond_broadcast()
  */
 
-/* research the above Needed API and design accordingly */
+/*
+ * Log offsets are logical and never reused. The log is cut into segments,
+ * each given device chunks when the head enters it and handing them back
+ * once every byte in it has been released and written out. A segment is
+ * stored as a stream of blocks over its chunks: the log blocks themselves,
+ * or with compression their LZ images packed back to back, located through
+ * the block map. Chunks the compressed stream leaves unused are returned as
+ * soon as the segment is written out.
+ */
+
+struct segment {
+	uint64_t chunks[CHUNKS];
+	uint64_t held;   /* chunks held, 0 once released */
+	uint64_t live;   /* bytes appended minus bytes released */
+	uint64_t first;  /* first unit starting here, NONE if none */
+	uint64_t into;   /* unit running in from before, NONE if none */
+	uint64_t stored; /* stream bytes written */
+	struct {
+		uint32_t off; /* into the stream */
+		uint32_t len; /* block ==> stored as is */
+	} *map;          /* per block, compressed only */
+};
 
+/*
+ * A clean close can hand back an image of the table: enough to reopen the
+ * log over the same device, without formatting it, at the same head. It is
+ * the header below, the segments from base on, the block maps of those
+ * still held, and the free chunks.
+ */
+
+struct image {
+	uint64_t capacity;
+	uint64_t block;
+	uint64_t compress;
+	uint64_t head;
+	uint64_t base;
+	uint64_t n;      /* segments */
+	uint64_t free_n; /* chunks */
+};
+
+/*
+ * A prefetch of scattered offsets queues the blocks missing from the read
+ * cache as one batch. They are claimed one at a time under rmutex, by the
+ * caller and by a pool of helper threads kept for the life of the handle,
+ * each reading its own block off the lock.
+ */
+
+struct warm {
+	struct warm *link;
+	uint64_t *blocks; /* missing, stable */
+	uint64_t n;
+	uint64_t claimed; /* under rmutex, as are the rest */
+	uint64_t left;    /* not yet read */
+};
+
+/*
+ * An async append waits in a queue, in log order, until the worker has the
+ * bytes on the device and a device flush has followed.
+ */
+
+struct completion {
+	struct completion *next;
+	uint64_t off;
+	uint64_t end;
+	logfs_complete_t complete;
+	void *arg;
+};
 
 struct logfs {
-    struct device *dev;         // Block device handle
-    void *buffer;              // Circular buffer
-    size_t head;              // Write pointer
-    size_t tail;              // Read/flush pointer
-    size_t BS;                // Buffer size
-    size_t block;             // Block size
-    size_t capacity;          // Total device capacity
-    pthread_t worker;         // Worker thread
-    pthread_mutex_t lock;     // Mutex for synchronization
-    pthread_cond_t data_avail; // Condition for data availability
-    pthread_cond_t space_avail; // Condition for space availability
-    int done;                 // Flag to mark completion
+	int done;
+	int error;         /* the worker failed to store, under mutex */
+	int compress;      /* immutable */
+	uint64_t head;     /* bytes appended */
+	uint64_t tail;     /* bytes on the device, block aligned */
+	uint64_t block;    /* immutable */
+	uint64_t align;    /* immutable, of device transfers */
+	uint64_t capacity; /* immutable */
+	uint64_t stalls;
+	uint64_t stall_us;
+	uint64_t stored;
+	struct device *device;
+	struct {
+		struct segment *segments; /* segments base, base + 1, ... */
+		uint64_t base;
+		uint64_t n;
+		uint64_t capacity;
+		uint64_t *free; /* device chunks */
+		uint64_t free_n;
+		uint64_t chunks;
+	} table;
+	struct {
+		void *buf;
+		uint64_t size;
+	} wcache;
+	struct {
+		void *buf;
+		uint64_t off; /* stream offset of buf[0], block aligned */
+		uint64_t len;
+	} pack;           /* compressed stream of the segment at tail */
+	struct {
+		void *buf;
+		void *zbuf;   /* two blocks of compressed stream, under mutex */
+		struct {
+			int valid;
+			int prefetched; /* not yet read */
+			uint64_t tag;
+		} meta[RCACHE_BLOCKS];
+	} rcache;
+	struct {
+		uint64_t next;    /* block a sequential reader goes to next */
+		uint64_t window;  /* 0 ==> not sequential */
+		uint64_t issued;  /* blocks requested, exclusive */
+		uint64_t lo;      /* requested, not yet started */
+		uint64_t hi;
+		uint64_t busy_lo; /* being read */
+		uint64_t busy_hi;
+		uint64_t blocks;
+		uint64_t hits;
+		void *buf;        /* stream, RA_MAX + 2 blocks */
+		void *out;        /* decompressed, RA_MAX blocks */
+		pthread_t thread;
+		pthread_cond_t work;
+		pthread_cond_t done;
+	} ra;
+	struct {
+		struct warm *head; /* batches with blocks to claim, rmutex */
+		struct warm *tail;
+		pthread_t threads[LOGFS_PREFETCH_THREADS];
+		int n;             /* threads started, on first need */
+		pthread_cond_t work;
+		pthread_cond_t done;
+	} pool;
+	struct {
+		struct completion *head; /* queue, under mutex */
+		struct completion *tail;
+	} async;
+	pthread_t thread;
+	pthread_mutex_t mutex;  /* the append side, taken before rmutex */
+	pthread_mutex_t rmutex; /* tail, the table, the read side */
+	pthread_cond_t data_avail;
+	pthread_cond_t space_avail;
 };
 
-static void *worker_thread(void *arg) {
-    struct logfs *fs = (struct logfs *)arg;
-    size_t size;
-    
-    pthread_mutex_lock(&fs->lock);
-    
-    while (!fs->done) {
-        // Calculate available data size
-        size = fs->head - fs->tail;
-        
-        // Assert conditions
-        assert(fs->tail <= fs->head);
-        assert(0 <= (fs->tail % fs->block));
-        assert(fs->capacity >= fs->head);
-        
-        // Wait if not enough data
-        if (size < fs->block) {
-            pthread_cond_wait(&fs->data_avail, &fs->lock);
-            continue;
-        }
-        
-        // Write block to device block storage
-        void *src = (char *)fs->buffer + (fs->tail % fs->BS);
-        if (device_write(fs->dev, src, fs->tail, fs->block)) {
-            // Handle error - in this case we'll just continue
-            continue;
-        }
-        
-        // Update tail and available size
-        fs->tail += fs->block;
-        size -= fs->block;
-        
-        // Signal that space is available
-        pthread_cond_signal(&fs->space_avail);
-    }
-    
-    pthread_mutex_unlock(&fs->lock);
-    return NULL;
-}
-
-struct logfs *logfs_open(const char *pathname) {
-    struct logfs *fs;
-    
-    if (!(fs = calloc(1, sizeof(struct logfs)))) {
-        return NULL;
-    }
-    
-    // Open device
-    if (!(fs->dev = device_open(pathname))) {
-        FREE(fs);
-        return NULL;
-    }
-    
-    // Initialize sizes
-    fs->block = device_block(fs->dev);
-    fs->capacity = device_size(fs->dev);
-    fs->BS = fs->block * WCACHE_BLOCKS;  // Buffer size is multiple of block size
-    
-    // Allocate and align buffer
-    void *raw_buffer = malloc(fs->BS + fs->block); // Extra space for alignment
-    if (!raw_buffer) {
-        device_close(fs->dev);
-        FREE(fs);
-        return NULL;
-    }
-    fs->buffer = memory_align(raw_buffer, fs->block);
-    
-    // Initialize synchronization primitives
-    if (pthread_mutex_init(&fs->lock, NULL) ||
-        pthread_cond_init(&fs->data_avail, NULL) ||
-        pthread_cond_init(&fs->space_avail, NULL)) {
-        FREE(raw_buffer);
-        device_close(fs->dev);
-        FREE(fs);
-        return NULL;
-    }
-    
-    // Initialize pointers
-    fs->head = 0;
-    fs->tail = 0;
-    fs->done = 0;
-    
-    // Start worker thread
-    if (pthread_create(&fs->worker, NULL, worker_thread, fs)) {
-        pthread_mutex_destroy(&fs->lock);
-        pthread_cond_destroy(&fs->data_avail);
-        pthread_cond_destroy(&fs->space_avail);
-        FREE(raw_buffer);
-        device_close(fs->dev);
-        FREE(fs);
-        return NULL;
-    }
-    
-    return fs;
-}
-
-void logfs_close(struct logfs *fs) {
-    if (!fs) {
-        return;
-    }
-    
-    // Signal worker to finish
-    pthread_mutex_lock(&fs->lock);
-    fs->done = 1;
-    pthread_cond_signal(&fs->data_avail);
-    pthread_mutex_unlock(&fs->lock);
-    
-    // Wait for worker to complete
-    pthread_join(fs->worker, NULL);
-    
-    // Cleanup
-    pthread_mutex_destroy(&fs->lock);
-    pthread_cond_destroy(&fs->data_avail);
-    pthread_cond_destroy(&fs->space_avail);
-    FREE(fs->buffer);
-    device_close(fs->dev);
-    FREE(fs);
-}
-
-int logfs_read(struct logfs *fs, void *buf, uint64_t off, size_t len) {
-    if (!fs || !buf || len == 0) {
-        return -1;
-    }
-    
-    pthread_mutex_lock(&fs->lock);
-    
-    // Verify offset is within written range
-    if (off >= fs->head) {
-        pthread_mutex_unlock(&fs->lock);
-        return -1;
-    }
-    
-    // Read from device
-    if (device_read(fs->dev, buf, off, len)) {
-        pthread_mutex_unlock(&fs->lock);
-        return -1;
-    }
-    
-    pthread_mutex_unlock(&fs->lock);
-    return 0;
-}
-
-int logfs_read(struct logfs *fs, void *buf, uint64_t off, size_t len) {
-    if (!fs || !buf || len == 0 || off >= fs->capacity) {
-        return -1;
-    }
-
-    pthread_mutex_lock(&fs->lock);
-
-    size_t block_size = fs->block_size;
-    size_t blocks_to_read = (len + block_size - 1) / block_size; // Round up to nearest block
-    uint64_t start_block = off / block_size;
-    uint64_t end_block = start_block + blocks_to_read;
-
-    for (uint64_t block = start_block; block < end_block; block++) {
-        // Check if block is in cache
-        int cache_index = block % fs->rblocks; // Cache index (modulo buffer size)
-        struct cache_block *meta = &fs->rmeta[cache_index];
-        void *cache_data = (char *)fs->rbuffer + cache_index * block_size;
-
-        if (meta->valid && meta->tag == block) {
-            // Cache hit: copy data from cache
-            size_t offset_in_block = (block == start_block) ? off % block_size : 0;
-            size_t bytes_to_copy = (block == end_block - 1) 
-                                   ? (off + len) % block_size 
-                                   : block_size - offset_in_block;
-
-            memcpy(buf, (char *)cache_data + offset_in_block, bytes_to_copy);
-            buf = (char *)buf + bytes_to_copy;
-            len -= bytes_to_copy;
-        } else {
-            // Cache miss: read block from device
-            if (device_read(fs->dev, cache_data, block * block_size, block_size)) {
-                pthread_mutex_unlock(&fs->lock);
-                return -1; // Device read error
-            }
-
-            // Update cache metadata
-            meta->tag = block;
-            meta->valid = 1;
-
-            // Copy data from cache
-            size_t offset_in_block = (block == start_block) ? off % block_size : 0;
-            size_t bytes_to_copy = (block == end_block - 1) 
-                                   ? (off + len) % block_size 
-                                   : block_size - offset_in_block;
-
-            memcpy(buf, (char *)cache_data + offset_in_block, bytes_to_copy);
-            buf = (char *)buf + bytes_to_copy;
-            len -= bytes_to_copy;
-        }
-    }
-
-    pthread_mutex_unlock(&fs->lock);
-    return 0;
-}
-
-int logfs_append(struct logfs *fs, const void *buf, uint64_t len) {
-    if (!fs || (!buf && len)) {
-        return -1;
-    }
-    
-    pthread_mutex_lock(&fs->lock);
-    
-    while (len > 0) {
-        // Wait if buffer is full
-        while ((fs->head - fs->tail) >= fs->BS) {
-            pthread_cond_wait(&fs->space_avail, &fs->lock);
-        }
-        
-        // Calculate how much we can write
-        size_t available = fs->BS - (fs->head - fs->tail);
-        size_t write_size = MIN(len, available);
-        size_t buffer_pos = fs->head % fs->BS;
-        
-        // Copy data to buffer
-        memcpy((char *)fs->buffer + buffer_pos, buf, write_size);
-        
-        // Update pointers
-        fs->head += write_size;
-        buf = (const char *)buf + write_size;
-        len -= write_size;
-        
-        // Assert conditions
-        assert(fs->tail <= fs->head);
-        assert(fs->capacity >= fs->head);
-        
-        // Signal worker that data is available
-        pthread_cond_signal(&fs->data_avail);
-    }
-    
-    pthread_mutex_unlock(&fs->lock);
-    return 0;
-}
\ No newline at end of file
+static struct segment *
+segment(struct logfs *logfs, uint64_t off)
+{
+	uint64_t s;
+
+	s = off / SEGMENT;
+	if ((s < logfs->table.base) ||
+	    (s >= (logfs->table.base + logfs->table.n))) {
+		return NULL;
+	}
+	return &logfs->table.segments[s - logfs->table.base];
+}
+
+static uint64_t
+physical(const struct segment *segment_, uint64_t off) /* stream offset */
+{
+	assert( (off / CHUNK) < segment_->held );
+
+	return segment_->chunks[off / CHUNK] * CHUNK + (off % CHUNK);
+}
+
+static void
+trim(struct logfs *logfs, struct segment *segment_, uint64_t keep)
+{
+	while (segment_->held > keep) {
+		logfs->table.free[logfs->table.free_n++] =
+			segment_->chunks[--segment_->held];
+	}
+}
+
+static void
+retire(struct logfs *logfs, uint64_t s)
+{
+	struct segment *segment_;
+	uint64_t n;
+
+	/* dead and on the device, the chunks can take a new segment */
+
+	segment_ = segment(logfs, s * SEGMENT);
+	if (!segment_ ||
+	    !segment_->held ||
+	    segment_->live ||
+	    (((s + 1) * SEGMENT) > logfs->tail)) {
+		return;
+	}
+	for (n=0; n<segment_->held; ++n) {
+		device_advise(logfs->device,
+			      segment_->chunks[n] * CHUNK,
+			      CHUNK,
+			      DEVICE_ADVISE_DONTNEED);
+	}
+	pthread_mutex_lock(&logfs->rmutex);
+	trim(logfs, segment_, 0);
+	FREE(segment_->map);
+
+	/* drop released segments off the front of the table */
+
+	for (n=0; n<logfs->table.n; ++n) {
+		if (logfs->table.segments[n].held) {
+			break;
+		}
+	}
+	if (n) {
+		memmove(logfs->table.segments,
+			logfs->table.segments + n,
+			(logfs->table.n - n) * sizeof (struct segment));
+		logfs->table.base += n;
+		logfs->table.n -= n;
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+}
+
+static int
+grow(struct logfs *logfs, uint64_t end)
+{
+	struct segment *segments;
+	uint64_t n, capacity;
+
+	/* map every segment up to the one holding end - 1 */
+
+	n = (end + SEGMENT - 1) / SEGMENT - logfs->table.base;
+	if (n <= logfs->table.n) {
+		return 0;
+	}
+	if (((n - logfs->table.n) * CHUNKS) > logfs->table.free_n) {
+		TRACE("out of space");
+		return -1;
+	}
+	pthread_mutex_lock(&logfs->rmutex);
+	if (n > logfs->table.capacity) {
+		capacity = MAX(n, logfs->table.capacity * 2);
+		if (!(segments = realloc(logfs->table.segments,
+					 capacity * sizeof (struct segment)))) {
+			pthread_mutex_unlock(&logfs->rmutex);
+			TRACE("out of memory");
+			return -1;
+		}
+		logfs->table.segments = segments;
+		logfs->table.capacity = capacity;
+	}
+	for (; logfs->table.n<n; ++logfs->table.n) {
+		segments = &logfs->table.segments[logfs->table.n];
+		memset(segments, 0, sizeof (struct segment));
+		segments->first = NONE;
+		segments->into = NONE;
+		if (logfs->compress &&
+		    !(segments->map = malloc((SEGMENT / logfs->block) *
+					     sizeof (segments->map[0])))) {
+			pthread_mutex_unlock(&logfs->rmutex);
+			TRACE("out of memory");
+			return -1;
+		}
+		while (CHUNKS > segments->held) {
+			segments->chunks[segments->held++] =
+				logfs->table.free[--logfs->table.free_n];
+		}
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+	return 0;
+}
+
+static void
+written(struct logfs *logfs, const struct segment *segment_, uint64_t end)
+{
+	/* the stream filled a chunk up to end, start writing it out */
+
+	if (!(end % CHUNK)) {
+		device_writeback(logfs->device,
+				 physical(segment_, end - CHUNK),
+				 CHUNK);
+	}
+}
+
+static int
+pack(struct logfs *logfs, struct segment *segment_, const char *buf)
+{
+	uint64_t n, i;
+	char *p;
+
+	/* compress one block onto the stream, write out full stream blocks */
+
+	i = (logfs->tail % SEGMENT) / logfs->block;
+	p = (char *)logfs->pack.buf + logfs->pack.len;
+	if (!(n = lz_compress(buf, logfs->block, p, logfs->block - 1))) {
+		memcpy(p, buf, logfs->block);
+		n = logfs->block;
+	}
+	segment_->map[i].off = (uint32_t)segment_->stored;
+	segment_->map[i].len = (uint32_t)n;
+	segment_->stored += n;
+	logfs->stored += n;
+	logfs->pack.len += n;
+	if (logfs->pack.len >= logfs->block) {
+		if (device_write(logfs->device,
+				 logfs->pack.buf,
+				 physical(segment_, logfs->pack.off),
+				 logfs->block)) {
+			TRACE(0);
+			return -1;
+		}
+		logfs->pack.off += logfs->block;
+		logfs->pack.len -= logfs->block;
+		written(logfs, segment_, logfs->pack.off);
+		memmove(logfs->pack.buf,
+			(char *)logfs->pack.buf + logfs->block,
+			logfs->pack.len);
+	}
+	return 0;
+}
+
+static int
+seal(struct logfs *logfs, struct segment *segment_)
+{
+	uint64_t n;
+
+	/* the partial stream block, zero padded to the device alignment */
+
+	if (logfs->pack.len) {
+		n = (logfs->pack.len + logfs->align - 1) / logfs->align *
+			logfs->align;
+		memset((char *)logfs->pack.buf + logfs->pack.len,
+		       0,
+		       n - logfs->pack.len);
+		if (device_write(logfs->device,
+				 logfs->pack.buf,
+				 physical(segment_, logfs->pack.off),
+				 n)) {
+			TRACE(0);
+			return -1;
+		}
+		device_writeback(logfs->device,
+				 physical(segment_,
+					  logfs->pack.off / CHUNK * CHUNK),
+				 logfs->pack.off % CHUNK + n);
+	}
+	logfs->pack.off = 0;
+	logfs->pack.len = 0;
+	return 0;
+}
+
+static int
+store(struct logfs *logfs, const char *buf, uint64_t len)
+{
+	struct segment *segment_;
+	const void *bufs[2];
+	uint64_t lens[2];
+
+	/* the blocks at tail, one at a time when compressing */
+
+	assert( !logfs->compress || (len == logfs->block) );
+
+	segment_ = segment(logfs, logfs->tail);
+	if (!logfs->compress) {
+
+		/* one call, in two pieces when the bytes wrap the ring */
+
+		bufs[0] = buf;
+		bufs[1] = logfs->wcache.buf;
+		lens[0] = MIN(len, logfs->wcache.size -
+			      (logfs->tail % logfs->wcache.size));
+		lens[1] = len - lens[0];
+		if (device_writev(logfs->device,
+				  bufs,
+				  lens,
+				  lens[1] ? 2 : 1,
+				  physical(segment_, logfs->tail % SEGMENT))) {
+			TRACE(0);
+			return -1;
+		}
+		logfs->stored += len;
+		written(logfs, segment_, logfs->tail % SEGMENT + len);
+		return 0;
+	}
+	if (pack(logfs, segment_, buf)) {
+		TRACE(0);
+		return -1;
+	}
+	if (!((logfs->tail + logfs->block) % SEGMENT)) {
+		if (seal(logfs, segment_)) {
+			TRACE(0);
+			return -1;
+		}
+		trim(logfs,
+		     segment_,
+		     (segment_->stored + CHUNK - 1) / CHUNK);
+	}
+	return 0;
+}
+
+static int flush(struct logfs *logfs, int last);
+
+static void
+complete(struct logfs *logfs, uint64_t end, int e)
+{
+	struct completion *head, *last, *completion;
+
+	/* the queued appends ending by end, called without the mutex */
+
+	head = logfs->async.head;
+	last = NULL;
+	for (completion=head; completion; completion=completion->next) {
+		if (completion->end > end) {
+			break;
+		}
+		last = completion;
+	}
+	if (!last) {
+		return;
+	}
+	if (!(logfs->async.head = last->next)) {
+		logfs->async.tail = NULL;
+	}
+	last->next = NULL;
+	pthread_mutex_unlock(&logfs->mutex);
+	while (head) {
+		completion = head;
+		head = head->next;
+		completion->complete(completion->arg, completion->off, e);
+		FREE(completion);
+	}
+	pthread_mutex_lock(&logfs->mutex);
+}
+
+static uint64_t
+reachable(const struct logfs *logfs)
+{
+	/* how far the worker can make the log durable without new bytes */
+
+	if (logfs->compress || (logfs->head - logfs->tail) >= logfs->block) {
+		return logfs->tail;
+	}
+	return logfs->head;
+}
+
+static void
+settle(struct logfs *logfs)
+{
+	uint64_t end;
+	int e;
+
+	/* the trailing partial block if waited on, one device flush */
+
+	end = reachable(logfs);
+	e = 0;
+	if (end > logfs->tail) {
+		e = flush(logfs, 0);
+	}
+	if (e || device_flush(logfs->device)) {
+		TRACE(0);
+		e = -1;
+	}
+	complete(logfs, end, e);
+}
+
+static void *
+worker(void *arg)
+{
+	struct logfs *logfs;
+	const void *buf;
+	uint64_t n;
+
+	logfs = (struct logfs *)arg;
+	pthread_mutex_lock(&logfs->mutex);
+	for (;;) {
+		assert( logfs->tail <= logfs->head );
+		assert( 0 == (logfs->tail % logfs->block) );
+
+		if (logfs->async.head &&
+		    (logfs->async.head->end <= reachable(logfs))) {
+			settle(logfs);
+			continue;
+		}
+		if ((logfs->head - logfs->tail) < logfs->block) {
+			if (logfs->done) {
+				break;
+			}
+			pthread_cond_wait(&logfs->data_avail, &logfs->mutex);
+			continue;
+		}
+		buf = (const char *)logfs->wcache.buf +
+			(logfs->tail % logfs->wcache.size);
+
+		/* full blocks up to the end of the chunk */
+
+		n = logfs->block;
+		if (!logfs->compress) {
+			n = (logfs->head - logfs->tail) / logfs->block;
+			n *= logfs->block;
+			n = MIN(n, CHUNK - (logfs->tail % CHUNK));
+		}
+		if (store(logfs, buf, n)) {
+			TRACE(0);
+			logfs->error = 1;
+			break;
+		}
+		pthread_mutex_lock(&logfs->rmutex);
+		logfs->tail += n;
+		pthread_mutex_unlock(&logfs->rmutex);
+		if (!(logfs->tail % SEGMENT)) {
+			retire(logfs, logfs->tail / SEGMENT - 1);
+		}
+		pthread_cond_signal(&logfs->space_avail);
+	}
+
+	/* a dead log, appenders and completions must not wait on it */
+
+	if (logfs->error) {
+		TRACE("logfs worker failed");
+		pthread_cond_broadcast(&logfs->space_avail);
+		complete(logfs, NONE, -1);
+	}
+	pthread_mutex_unlock(&logfs->mutex);
+	return NULL;
+}
+
+static int
+flush(struct logfs *logfs, int last) /* last ==> on close */
+{
+	uint64_t n;
+	char *buf;
+
+	/*
+	 * Write out the trailing partial block, zero padded. The worker stores
+	 * it again once it fills, so only the last one counts as stored. With
+	 * compression, also the stream packed short of a block.
+	 */
+
+	n = logfs->head - logfs->tail;
+	assert( n < logfs->block );
+	if (!n && logfs->pack.len) {
+		if (seal(logfs, segment(logfs, logfs->tail))) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (n) {
+		buf = (char *)logfs->wcache.buf +
+			(logfs->tail % logfs->wcache.size);
+		memset(buf + n, 0, logfs->block - n);
+		if (logfs->compress) {
+			if (store(logfs, buf, logfs->block) ||
+			    seal(logfs, segment(logfs, logfs->tail))) {
+				TRACE(0);
+				return -1;
+			}
+			return 0;
+		}
+		n = (n + logfs->align - 1) / logfs->align * logfs->align;
+		if (device_write(logfs->device,
+				 buf,
+				 physical(segment(logfs, logfs->tail),
+					  logfs->tail % SEGMENT),
+				 n)) {
+			TRACE(0);
+			return -1;
+		}
+		logfs->stored += last ? n : 0;
+	}
+	return 0;
+}
+
+static int
+load(struct logfs *logfs, uint64_t block, char *buf)
+{
+	struct segment *segment_;
+	uint64_t off, len, i, n;
+	char *z;
+
+	segment_ = segment(logfs, block * logfs->block);
+	if (!segment_ || !segment_->held) {
+		TRACE("released offset");
+		return -1;
+	}
+	if (!logfs->compress) {
+		return device_read(logfs->device,
+				   buf,
+				   physical(segment_,
+					    (block * logfs->block) % SEGMENT),
+				   logfs->block);
+	}
+
+	/* the stream blocks holding its image, the newest still packing */
+
+	i = ((block * logfs->block) % SEGMENT) / logfs->block;
+	off = segment_->map[i].off;
+	len = segment_->map[i].len;
+	z = (char *)logfs->rcache.zbuf;
+	for (n=off/logfs->block; (n*logfs->block)<(off + len); ++n) {
+		if ((segment_ == segment(logfs, logfs->tail)) &&
+		    ((n * logfs->block) >= logfs->pack.off)) {
+			memcpy(z,
+			       (char *)logfs->pack.buf +
+			       (n * logfs->block - logfs->pack.off),
+			       logfs->block);
+		}
+		else if (device_read(logfs->device,
+				     z,
+				     physical(segment_, n * logfs->block),
+				     logfs->block)) {
+			TRACE(0);
+			return -1;
+		}
+		z += logfs->block;
+	}
+	z = (char *)logfs->rcache.zbuf + (off % logfs->block);
+	if (len == logfs->block) {
+		memcpy(buf, z, len);
+	}
+	else if ((long)logfs->block !=
+		 lz_decompress(z, len, buf, logfs->block)) {
+		TRACE("corrupt block");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t
+stable(const struct logfs *logfs)
+{
+	/* bytes readable off the device alone, not from a buffer */
+
+	return logfs->compress ? logfs->tail / SEGMENT * SEGMENT : logfs->tail;
+}
+
+static int /* -1|0|+1, +1 ==> released, returns with rmutex held */
+transfer(struct logfs *logfs,
+	 uint64_t lo,
+	 uint64_t n,
+	 char *buf,      /* n + 2 blocks, aligned */
+	 char *out,      /* n blocks */
+	 int prefetched)
+{
+	uint64_t runs[2 * (RA_MAX + 3)], offs[RA_MAX], lens[RA_MAX];
+	const char *src[RA_MAX];
+	const struct segment *segment_;
+	uint64_t i, j, k, m, a, b, skip;
+	int e;
+
+	assert( (0 < n) && (RA_MAX >= n) );
+
+	/* the stream bytes of blocks [lo, lo + n), cut at chunk boundaries */
+
+	segment_ = segment(logfs, lo * logfs->block);
+	if (!segment_ || !segment_->held) {
+		return +1;
+	}
+	i = (lo * logfs->block % SEGMENT) / logfs->block;
+	for (j=0; j<n; ++j) {
+		offs[j] = (i + j) * logfs->block;
+		lens[j] = logfs->block;
+		if (logfs->compress) {
+			offs[j] = segment_->map[i + j].off;
+			lens[j] = segment_->map[i + j].len;
+		}
+	}
+	skip = offs[0] % logfs->block;
+	a = offs[0] - skip;
+	b = offs[n - 1] + lens[n - 1];
+	b = (b + logfs->block - 1) / logfs->block * logfs->block;
+	for (m=0; a<b; m+=2) {
+		runs[m + 0] = physical(segment_, a);
+		runs[m + 1] = MIN(b - a, CHUNK - (a % CHUNK));
+		a += runs[m + 1];
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+
+	/* the device read and decompression off the lock */
+
+	for (e=0, a=0, k=0; (k<m) && !e; k+=2) {
+		e = device_read(logfs->device, buf + a, runs[k], runs[k + 1]);
+		a += runs[k + 1];
+	}
+	for (j=0; (j<n) && !e; ++j) {
+		src[j] = buf + (offs[j] - offs[0] + skip);
+		if (lens[j] < logfs->block) {
+			if ((long)logfs->block != lz_decompress(src[j],
+								lens[j],
+								out,
+								logfs->block)) {
+				TRACE("corrupt block");
+				e = -1;
+			}
+			src[j] = out;
+			out += logfs->block;
+		}
+	}
+	pthread_mutex_lock(&logfs->rmutex);
+	if (e) {
+		TRACE(0);
+		return -1;
+	}
+	segment_ = segment(logfs, lo * logfs->block);
+	if (!segment_ || !segment_->held) {
+		return +1; /* the chunks may have been rewritten */
+	}
+
+	/* into the read cache, unless already there */
+
+	for (j=0; j<n; ++j) {
+		k = (lo + j) % RCACHE_BLOCKS;
+		if (logfs->rcache.meta[k].valid &&
+		    ((lo + j) == logfs->rcache.meta[k].tag)) {
+			continue;
+		}
+		memcpy((char *)logfs->rcache.buf + k * logfs->block,
+		       src[j],
+		       logfs->block);
+		logfs->rcache.meta[k].valid = 1;
+		logfs->rcache.meta[k].prefetched = prefetched;
+		logfs->rcache.meta[k].tag = lo + j;
+		logfs->ra.blocks += prefetched ? 1 : 0;
+	}
+	return 0;
+}
+
+static char *
+scratch(const struct logfs *logfs, void **buf)
+{
+	/* room for a transfer of one block, taken on the first miss */
+
+	if (!(*buf) && !((*buf) = device_alloc(4 * logfs->block))) {
+		TRACE(0);
+		return NULL;
+	}
+	return (char *)(*buf);
+}
+
+static int
+fetch(struct logfs *logfs,
+      uint64_t block,
+      void **scratch_,
+      char *buf,
+      uint64_t off, /* within the block */
+      uint64_t len)
+{
+	char *p, *z;
+	uint64_t i;
+	int r;
+
+	/* a stable block, through the read cache under rmutex alone */
+
+	r = -1;
+	pthread_mutex_lock(&logfs->rmutex);
+	while ((block >= logfs->ra.busy_lo) && (block < logfs->ra.busy_hi)) {
+		pthread_cond_wait(&logfs->ra.done, &logfs->rmutex);
+	}
+	i = block % RCACHE_BLOCKS;
+	if (!logfs->rcache.meta[i].valid ||
+	    (block != logfs->rcache.meta[i].tag)) {
+		if (!(z = scratch(logfs, scratch_)) ||
+		    (r = transfer(logfs,
+				  block,
+				  1,
+				  z,
+				  z + 3 * logfs->block,
+				  0))) {
+			pthread_mutex_unlock(&logfs->rmutex);
+			TRACE((0 < r) ? "released offset" : 0);
+			return -1;
+		}
+	}
+	if (logfs->rcache.meta[i].prefetched) {
+		logfs->rcache.meta[i].prefetched = 0;
+		++logfs->ra.hits;
+	}
+	p = (char *)logfs->rcache.buf + i * logfs->block;
+	memcpy(buf, p + off, len);
+	pthread_mutex_unlock(&logfs->rmutex);
+	return 0;
+}
+
+static int /* -1|0|+1, +1 ==> stable, fetch it */
+resolve(struct logfs *logfs,
+	uint64_t block,
+	void **scratch_,
+	char *buf,
+	uint64_t off, /* within the block */
+	uint64_t len)
+{
+	const char *p;
+	char *z;
+
+	/* a block not yet stable, under the append mutex */
+
+	pthread_mutex_lock(&logfs->mutex);
+	if (((block + 1) * logfs->block) > logfs->tail) {
+		p = (const char *)logfs->wcache.buf +
+			((block * logfs->block) % logfs->wcache.size);
+		memcpy(buf, p + off, len);
+		pthread_mutex_unlock(&logfs->mutex);
+		return 0;
+	}
+	if ((block * logfs->block) < stable(logfs)) {
+		pthread_mutex_unlock(&logfs->mutex);
+		return +1;
+	}
+	if (!(z = scratch(logfs, scratch_)) || load(logfs, block, z)) {
+		pthread_mutex_unlock(&logfs->mutex);
+		TRACE(0);
+		return -1;
+	}
+	pthread_mutex_unlock(&logfs->mutex);
+	memcpy(buf, z + off, len);
+	return 0;
+}
+
+static void *
+prefetcher(void *arg)
+{
+	struct logfs *logfs;
+	uint64_t lo, n;
+
+	logfs = (struct logfs *)arg;
+	pthread_mutex_lock(&logfs->rmutex);
+	for (;;) {
+		if (logfs->ra.lo >= logfs->ra.hi) {
+			if (logfs->done) {
+				break;
+			}
+			pthread_cond_wait(&logfs->ra.work, &logfs->rmutex);
+			continue;
+		}
+
+		/* the next run of blocks within one segment */
+
+		lo = logfs->ra.lo;
+		n = MIN(logfs->ra.hi - lo, RA_MAX);
+		n = MIN(n, (SEGMENT - (lo * logfs->block % SEGMENT)) /
+			logfs->block);
+		logfs->ra.lo += n;
+		logfs->ra.busy_lo = lo;
+		logfs->ra.busy_hi = lo + n;
+		transfer(logfs,
+			 lo,
+			 n,
+			 (char *)logfs->ra.buf,
+			 (char *)logfs->ra.out,
+			 1);
+		logfs->ra.busy_lo = logfs->ra.busy_hi = 0;
+		pthread_cond_broadcast(&logfs->ra.done);
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+	return NULL;
+}
+
+static int
+cached(const struct logfs *logfs, uint64_t block)
+{
+	const uint64_t i = block % RCACHE_BLOCKS;
+
+	return logfs->rcache.meta[i].valid &&
+		(block == logfs->rcache.meta[i].tag);
+}
+
+static int
+block_order(const void *a_, const void *b_)
+{
+	uint64_t a, b;
+
+	a = *(const uint64_t *)a_;
+	b = *(const uint64_t *)b_;
+	if (a != b) {
+		return (a < b) ? -1 : +1;
+	}
+	return 0;
+}
+
+static void
+warm(struct logfs *logfs, void **buf)
+{
+	struct warm *warm_;
+	uint64_t block;
+	char *z;
+
+	/* the next block queued, claimed under rmutex and read off it */
+
+	warm_ = logfs->pool.head;
+	block = warm_->blocks[warm_->claimed++];
+	if (warm_->claimed == warm_->n) {
+		logfs->pool.head = warm_->link;
+	}
+	if (!cached(logfs, block) &&
+	    ((block < logfs->ra.busy_lo) || (block >= logfs->ra.busy_hi)) &&
+	    (z = scratch(logfs, buf))) {
+		/* advisory, the reads that follow will tell */
+		transfer(logfs, block, 1, z, z + 3 * logfs->block, 1);
+	}
+	if (!--warm_->left) {
+		pthread_cond_broadcast(&logfs->pool.done);
+	}
+}
+
+static void *
+warmer(void *arg)
+{
+	struct logfs *logfs;
+	void *buf;
+
+	logfs = (struct logfs *)arg;
+	buf = NULL;
+	pthread_mutex_lock(&logfs->rmutex);
+	for (;;) {
+		if (!logfs->pool.head) {
+			if (logfs->done) {
+				break;
+			}
+			pthread_cond_wait(&logfs->pool.work, &logfs->rmutex);
+			continue;
+		}
+		warm(logfs, &buf);
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+	device_free(buf);
+	return NULL;
+}
+
+static void
+readahead(struct logfs *logfs, uint64_t first, uint64_t last)
+{
+	uint64_t limit, hi;
+
+	/* sequential: within the last block read or the one after it */
+
+	if (first == logfs->ra.next) {
+		logfs->ra.window = MIN(MAX(logfs->ra.window * 2, RA_MIN),
+				       RA_MAX);
+	}
+	else if ((first + 1) != logfs->ra.next) {
+		logfs->ra.window = 0;
+		logfs->ra.issued = 0;
+	}
+	logfs->ra.next = last + 1;
+	if (!logfs->ra.window) {
+		return;
+	}
+
+	/*
+	 * Keep a window of blocks requested ahead of the reader, topped up once
+	 * half of it is consumed. Only stable blocks qualify.
+	 */
+
+	limit = stable(logfs) / logfs->block;
+	logfs->ra.issued = MAX(logfs->ra.issued, last + 1);
+	if ((logfs->ra.issued - (last + 1)) >= (logfs->ra.window / 2)) {
+		return;
+	}
+	hi = MIN(last + 1 + logfs->ra.window, limit);
+	if (logfs->ra.issued >= hi) {
+		return;
+	}
+	if (logfs->ra.lo >= logfs->ra.hi) {
+		logfs->ra.lo = logfs->ra.issued;
+	}
+	logfs->ra.hi = hi;
+	logfs->ra.issued = hi;
+	pthread_cond_signal(&logfs->ra.work);
+}
+
+static void *
+save(const struct logfs *logfs, uint64_t *len)
+{
+	struct segment segment_;
+	struct image *image;
+	uint64_t i, m;
+	char *p;
+
+	m = (SEGMENT / logfs->block) * sizeof (segment_.map[0]);
+	(*len) = sizeof (struct image) +
+		logfs->table.n * sizeof (struct segment) +
+		logfs->table.free_n * sizeof (uint64_t);
+	for (i=0; i<logfs->table.n; ++i) {
+		if (logfs->compress && logfs->table.segments[i].held) {
+			(*len) += m;
+		}
+	}
+	if (!(image = malloc(*len))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	image->capacity = logfs->capacity;
+	image->block = logfs->block;
+	image->compress = (uint64_t)logfs->compress;
+	image->head = logfs->head;
+	image->base = logfs->table.base;
+	image->n = logfs->table.n;
+	image->free_n = logfs->table.free_n;
+	p = (char *)(image + 1);
+	for (i=0; i<logfs->table.n; ++i) {
+		segment_ = logfs->table.segments[i];
+		segment_.map = NULL;
+		memcpy(p, &segment_, sizeof (struct segment));
+		p += sizeof (struct segment);
+		if (logfs->compress && segment_.held) {
+			memcpy(p, logfs->table.segments[i].map, m);
+			p += m;
+		}
+	}
+	memcpy(p, logfs->table.free, logfs->table.free_n * sizeof (uint64_t));
+	return image;
+}
+
+static int
+restore(struct logfs *logfs, const void *image_, uint64_t len)
+{
+	const struct image *image;
+	struct segment *segment_;
+	uint64_t i, j, m, held;
+	const char *p, *end;
+	char *buf;
+
+	/* the table as saved, checked against the device before use */
+
+	image = (const struct image *)image_;
+	m = (SEGMENT / logfs->block) * sizeof (segment_->map[0]);
+	if ((sizeof (struct image) > len) ||
+	    (image->capacity != logfs->capacity) ||
+	    (image->block != logfs->block) ||
+	    (image->compress != (uint64_t)logfs->compress) ||
+	    (image->n > logfs->table.chunks) ||
+	    (image->free_n > logfs->table.chunks) ||
+	    (image->head < (image->base * SEGMENT)) ||
+	    (image->head > ((image->base + image->n) * SEGMENT)) ||
+	    ((len - sizeof (struct image)) <
+	     (image->n * sizeof (struct segment) +
+	      image->free_n * sizeof (uint64_t))) ||
+	    !(logfs->table.segments = malloc(MAX(image->n, 1) *
+					     sizeof (struct segment)))) {
+		TRACE("bad log image");
+		return -1;
+	}
+	logfs->table.capacity = MAX(image->n, 1);
+	logfs->table.base = image->base;
+	p = (const char *)(image + 1);
+	end = (const char *)image_ + len;
+	for (held=0, i=0; i<image->n; ++i) {
+		segment_ = &logfs->table.segments[i];
+		memcpy(segment_, p, sizeof (struct segment));
+		p += sizeof (struct segment);
+		logfs->table.n = i + 1;
+		if (CHUNKS < segment_->held) {
+			TRACE("bad log image");
+			return -1;
+		}
+		for (j=0; j<segment_->held; ++j) {
+			if (segment_->chunks[j] >= logfs->table.chunks) {
+				TRACE("bad log image");
+				return -1;
+			}
+		}
+		held += segment_->held;
+		if (logfs->compress && segment_->held) {
+			if (((uint64_t)(end - p) < m) ||
+			    !(segment_->map = malloc(m))) {
+				TRACE("bad log image");
+				return -1;
+			}
+			memcpy(segment_->map, p, m);
+			p += m;
+		}
+	}
+	if (((uint64_t)(end - p) != (image->free_n * sizeof (uint64_t))) ||
+	    ((held + image->free_n) != logfs->table.chunks)) {
+		TRACE("bad log image");
+		return -1;
+	}
+	memcpy(logfs->table.free, p, image->free_n * sizeof (uint64_t));
+	logfs->table.free_n = image->free_n;
+	for (i=0; i<logfs->table.free_n; ++i) {
+		if (logfs->table.free[i] >= logfs->table.chunks) {
+			TRACE("bad log image");
+			return -1;
+		}
+	}
+
+	/* the trailing partial block back into the write ring */
+
+	logfs->head = image->head;
+	logfs->tail = image->head / logfs->block * logfs->block;
+	if (!(segment_ = segment(logfs, logfs->tail))) {
+		return 0;
+	}
+	if (!segment_->held) {
+		TRACE("bad log image");
+		return -1;
+	}
+	buf = (char *)logfs->wcache.buf + (logfs->tail % logfs->wcache.size);
+	if (!logfs->compress) {
+		if ((logfs->head > logfs->tail) &&
+		    device_read(logfs->device,
+				buf,
+				physical(segment_, logfs->tail % SEGMENT),
+				logfs->block)) {
+			TRACE(0);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* unpacked again once it fills, the stream resumes where it began */
+
+	logfs->pack.off = NONE; /* nothing packing, load() reads the device */
+	if (logfs->head > logfs->tail) {
+		if (load(logfs, logfs->tail / logfs->block, buf)) {
+			TRACE(0);
+			return -1;
+		}
+		i = (logfs->tail % SEGMENT) / logfs->block;
+		segment_->stored = segment_->map[i].off;
+	}
+	while (CHUNKS > segment_->held) { /* given back if sealed at its end */
+		if (!logfs->table.free_n) {
+			TRACE("out of space");
+			return -1;
+		}
+		segment_->chunks[segment_->held++] =
+			logfs->table.free[--logfs->table.free_n];
+	}
+	logfs->pack.off = segment_->stored / logfs->block * logfs->block;
+	logfs->pack.len = segment_->stored % logfs->block;
+	if (logfs->pack.len &&
+	    device_read(logfs->device,
+			logfs->pack.buf,
+			physical(segment_, logfs->pack.off),
+			logfs->block)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static struct logfs *
+create(const char *pathname, int flags, const void *image, uint64_t len)
+{
+	struct logfs *logfs;
+	pthread_t thread;
+	uint64_t i;
+
+	assert( safe_strlen(pathname) );
+
+	if (!(logfs = malloc(sizeof (struct logfs)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(logfs, 0, sizeof (struct logfs));
+	if (!(logfs->device = device_open(pathname))) {
+		logfs_close(logfs);
+		TRACE(0);
+		return NULL;
+	}
+	logfs->compress = !!(flags & LOGFS_COMPRESS);
+	logfs->block = device_block(logfs->device);
+	logfs->align = device_align(logfs->device);
+	logfs->capacity = device_size(logfs->device);
+	logfs->wcache.size = logfs->block * WCACHE_BLOCKS;
+	logfs->table.chunks = logfs->capacity / CHUNK;
+	if ((CHUNK % logfs->block) ||
+	    (DEVICE_ALIGN % logfs->align) ||
+	    (CHUNKS > logfs->table.chunks) ||
+	    (logfs->compress && (LZ_MAX_LEN < logfs->block))) {
+		logfs_close(logfs);
+		TRACE("bad device geometry");
+		return NULL;
+	}
+	if (!(logfs->wcache.buf = device_alloc(logfs->wcache.size)) ||
+	    !(logfs->rcache.buf = device_alloc((RCACHE_BLOCKS + 2) *
+					       logfs->block)) ||
+	    !(logfs->pack.buf = device_alloc(2 * logfs->block)) ||
+	    !(logfs->ra.buf = device_alloc((2 * RA_MAX + 2) * logfs->block)) ||
+	    !(logfs->table.free = malloc(logfs->table.chunks *
+					 sizeof (uint64_t)))) {
+		logfs_close(logfs);
+		TRACE("out of memory");
+		return NULL;
+	}
+	logfs->rcache.zbuf = (char *)logfs->rcache.buf +
+		RCACHE_BLOCKS * logfs->block;
+	logfs->ra.out = (char *)logfs->ra.buf + (RA_MAX + 2) * logfs->block;
+	if (image) {
+		if (restore(logfs, image, len)) {
+			logfs_close(logfs);
+			TRACE(0);
+			return NULL;
+		}
+	}
+	else {
+		for (i=0; i<logfs->table.chunks; ++i) {
+			logfs->table.free[i] = logfs->table.chunks - 1 - i;
+		}
+		logfs->table.free_n = logfs->table.chunks;
+	}
+	device_advise(logfs->device,
+		      0,
+		      logfs->capacity,
+		      DEVICE_ADVISE_SEQUENTIAL);
+	if (pthread_mutex_init(&logfs->mutex, NULL) ||
+	    pthread_mutex_init(&logfs->rmutex, NULL) ||
+	    pthread_cond_init(&logfs->data_avail, NULL) ||
+	    pthread_cond_init(&logfs->space_avail, NULL) ||
+	    pthread_cond_init(&logfs->ra.work, NULL) ||
+	    pthread_cond_init(&logfs->ra.done, NULL) ||
+	    pthread_cond_init(&logfs->pool.work, NULL) ||
+	    pthread_cond_init(&logfs->pool.done, NULL)) {
+		logfs_close(logfs);
+		TRACE("pthread_*()");
+		return NULL;
+	}
+
+	/* set once running, logfs_close() stops what did start */
+
+	if (pthread_create(&thread, NULL, worker, logfs)) {
+		logfs_close(logfs);
+		TRACE("pthread_create()");
+		return NULL;
+	}
+	logfs->thread = thread;
+	if (pthread_create(&thread, NULL, prefetcher, logfs)) {
+		logfs_close(logfs);
+		TRACE("pthread_create()");
+		return NULL;
+	}
+	logfs->ra.thread = thread;
+	return logfs;
+}
+
+static int
+stop(struct logfs *logfs)
+{
+	uint64_t i;
+	int e;
+
+	/* the threads joined, the log flushed, -1 if it did not make it */
+
+	e = 0;
+	if (logfs->thread) {
+		pthread_mutex_lock(&logfs->mutex);
+		pthread_mutex_lock(&logfs->rmutex);
+		logfs->done = 1;
+		logfs->ra.lo = logfs->ra.hi = 0;
+		pthread_cond_signal(&logfs->ra.work);
+		pthread_cond_broadcast(&logfs->pool.work);
+		pthread_mutex_unlock(&logfs->rmutex);
+		pthread_cond_signal(&logfs->data_avail);
+		pthread_mutex_unlock(&logfs->mutex);
+		pthread_join(logfs->thread, NULL);
+		if (logfs->ra.thread) {
+			pthread_join(logfs->ra.thread, NULL);
+		}
+		for (i=0; i<(uint64_t)logfs->pool.n; ++i) {
+			pthread_join(logfs->pool.threads[i], NULL);
+		}
+		e = logfs->error ? -1 : 0;
+		if (!e &&
+		    (flush(logfs, 1) || device_flush(logfs->device))) {
+			TRACE(0);
+			e = -1;
+		}
+		pthread_mutex_lock(&logfs->mutex);
+		complete(logfs, NONE, e);
+		pthread_mutex_unlock(&logfs->mutex);
+		pthread_mutex_destroy(&logfs->mutex);
+		pthread_mutex_destroy(&logfs->rmutex);
+		pthread_cond_destroy(&logfs->data_avail);
+		pthread_cond_destroy(&logfs->space_avail);
+		pthread_cond_destroy(&logfs->ra.work);
+		pthread_cond_destroy(&logfs->ra.done);
+		pthread_cond_destroy(&logfs->pool.work);
+		pthread_cond_destroy(&logfs->pool.done);
+		logfs->thread = 0;
+	}
+	return e;
+}
+
+struct logfs *
+logfs_open(const char *pathname, int flags)
+{
+	return create(pathname, flags, NULL, 0);
+}
+
+struct logfs *
+logfs_reopen(const char *pathname,
+	     int flags,
+	     const void *image,
+	     uint64_t len)
+{
+	assert( image );
+
+	return create(pathname, flags, image, len);
+}
+
+void
+logfs_close(struct logfs *logfs)
+{
+	uint64_t i;
+
+	if (logfs) {
+		stop(logfs);
+		device_close(logfs->device);
+		for (i=0; i<logfs->table.n; ++i) {
+			FREE(logfs->table.segments[i].map);
+		}
+		device_free(logfs->wcache.buf);
+		device_free(logfs->rcache.buf);
+		device_free(logfs->pack.buf);
+		device_free(logfs->ra.buf);
+		FREE(logfs->table.segments);
+		FREE(logfs->table.free);
+		memset(logfs, 0, sizeof (struct logfs));
+	}
+	FREE(logfs);
+}
+
+void *
+logfs_close_image(struct logfs *logfs, uint64_t *len)
+{
+	void *image;
+
+	assert( logfs );
+	assert( len );
+
+	image = NULL;
+	if (stop(logfs) || !(image = save(logfs, len))) {
+		TRACE(0);
+	}
+	logfs_close(logfs);
+	return image;
+}
+
+int
+logfs_read(struct logfs *logfs, void *buf_, uint64_t off, size_t len)
+{
+	uint64_t block, i, n;
+	void *scratch_;
+	char *buf;
+	int fast, r;
+
+	assert( logfs );
+	assert( !len || buf_ );
+
+	/* stable ranges never touch the append mutex */
+
+	buf = (char *)buf_;
+	pthread_mutex_lock(&logfs->rmutex);
+	fast = ((off + len) <= stable(logfs));
+	if (len) {
+		readahead(logfs,
+			  off / logfs->block,
+			  (off + len - 1) / logfs->block);
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+	if (!fast) {
+		pthread_mutex_lock(&logfs->mutex);
+		r = ((off + len) > logfs->head);
+		pthread_mutex_unlock(&logfs->mutex);
+		if (r) {
+			TRACE("invalid offset");
+			return -1;
+		}
+	}
+	scratch_ = NULL;
+	while (len) {
+		block = off / logfs->block;
+		i = off % logfs->block;
+		n = MIN(len, logfs->block - i);
+		r = fast ? +1 : resolve(logfs, block, &scratch_, buf, i, n);
+		if (0 < r) {
+			r = fetch(logfs, block, &scratch_, buf, i, n);
+		}
+		if (r) {
+			device_free(scratch_);
+			TRACE(0);
+			return -1;
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	device_free(scratch_);
+	return 0;
+}
+
+void
+logfs_prefetch(struct logfs *logfs,
+	       const uint64_t *offs,
+	       int count,
+	       int threads)
+{
+	struct warm warm_;
+	uint64_t block;
+	void *buf;
+	int i, k;
+
+	assert( logfs );
+	assert( !count || offs );
+
+	if (!count) {
+		return;
+	}
+	memset(&warm_, 0, sizeof (warm_));
+	if (!(warm_.blocks = malloc(count * sizeof (warm_.blocks[0])))) {
+		TRACE("out of memory");
+		return;
+	}
+
+	/* the stable blocks not cached */
+
+	pthread_mutex_lock(&logfs->rmutex);
+	for (i=0; i<count; ++i) {
+		block = offs[i] / logfs->block;
+		if ((((block + 1) * logfs->block) <= stable(logfs)) &&
+		    !cached(logfs, block)) {
+			warm_.blocks[warm_.n++] = block;
+		}
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+
+	/* each block once, in device order */
+
+	qsort(warm_.blocks, warm_.n, sizeof (warm_.blocks[0]), block_order);
+	for (k=0, i=0; i<(int)warm_.n; ++i) {
+		if (!k || (warm_.blocks[k - 1] != warm_.blocks[i])) {
+			warm_.blocks[k++] = warm_.blocks[i];
+		}
+	}
+	warm_.n = warm_.left = (uint64_t)k;
+	threads = MIN(threads, LOGFS_PREFETCH_THREADS);
+	threads = MIN(threads, (int)warm_.n);
+	if (!warm_.n) {
+		FREE(warm_.blocks);
+		return;
+	}
+
+	/* queue the batch, wake helpers, claim blocks until it is all taken */
+
+	buf = NULL;
+	pthread_mutex_lock(&logfs->rmutex);
+	while ((logfs->pool.n < (threads - 1)) &&
+	       !pthread_create(&logfs->pool.threads[logfs->pool.n],
+			       NULL,
+			       warmer,
+			       logfs)) {
+		++logfs->pool.n;
+	}
+	if (logfs->pool.head) {
+		logfs->pool.tail->link = &warm_;
+	}
+	else {
+		logfs->pool.head = &warm_;
+	}
+	logfs->pool.tail = &warm_;
+	for (k=1; k<threads; ++k) {
+		pthread_cond_signal(&logfs->pool.work);
+	}
+	while (warm_.claimed < warm_.n) {
+		warm(logfs, &buf);
+	}
+	while (warm_.left) {
+		pthread_cond_wait(&logfs->pool.done, &logfs->rmutex);
+	}
+	pthread_mutex_unlock(&logfs->rmutex);
+	device_free(buf);
+	FREE(warm_.blocks);
+}
+
+static int
+append(struct logfs *logfs,
+       const void * const *bufs,
+       const uint64_t *lens,
+       int count,
+       int wait,
+       struct completion *completion)
+{
+	uint64_t i, n, t, len, total, off;
+	struct segment *segment_;
+	const char *buf;
+	int k;
+
+	assert( logfs );
+	assert( 0 < count );
+	assert( bufs && lens );
+
+	for (total=0, k=0; k<count; ++k) {
+		assert( !lens[k] || bufs[k] );
+		total += lens[k];
+	}
+	if (!wait && (total > logfs->wcache.size)) {
+		TRACE("larger than the write ring");
+		return -1;
+	}
+	pthread_mutex_lock(&logfs->mutex);
+	if (logfs->error) {
+		pthread_mutex_unlock(&logfs->mutex);
+		TRACE("logfs worker failed");
+		return -1;
+	}
+	if (!wait &&
+	    ((logfs->wcache.size - (logfs->head - logfs->tail)) < total)) {
+		pthread_mutex_unlock(&logfs->mutex);
+		return EAGAIN;
+	}
+	if (!total && !completion) {
+		pthread_mutex_unlock(&logfs->mutex);
+		return 0;
+	}
+	if (grow(logfs, logfs->head + total)) {
+		pthread_mutex_unlock(&logfs->mutex);
+		TRACE(0);
+		return -1;
+	}
+	segment_ = segment(logfs, logfs->head);
+	if (total && (NONE == segment_->first)) {
+		segment_->first = logfs->head;
+	}
+	off = logfs->head;
+	for (k=0; k<count; ++k) {
+		buf = (const char *)bufs[k];
+		len = lens[k];
+		while (len) {
+			if ((logfs->head - logfs->tail) >= logfs->wcache.size) {
+				t = ref_time();
+				while (!logfs->error &&
+				       ((logfs->head - logfs->tail) >=
+					logfs->wcache.size)) {
+					pthread_cond_wait(&logfs->space_avail,
+							  &logfs->mutex);
+				}
+				++logfs->stalls;
+				logfs->stall_us += ref_time() - t;
+				if (logfs->error) {
+					pthread_mutex_unlock(&logfs->mutex);
+					TRACE("logfs worker failed");
+					return -1;
+				}
+			}
+			i = logfs->head % logfs->wcache.size;
+			n = logfs->wcache.size - (logfs->head - logfs->tail);
+			n = MIN(n, logfs->wcache.size - i);
+			n = MIN(n, SEGMENT - (logfs->head % SEGMENT));
+			n = MIN(n, len);
+			memcpy((char *)logfs->wcache.buf + i, buf, n);
+			segment_ = segment(logfs, logfs->head);
+			if ((off != logfs->head) && !(logfs->head % SEGMENT)) {
+				segment_->into = off;
+			}
+			segment_->live += n;
+			logfs->head += n;
+			buf += n;
+			len -= n;
+			pthread_cond_signal(&logfs->data_avail);
+		}
+	}
+	if (completion) {
+		completion->off = logfs->head - total;
+		completion->end = logfs->head;
+		if (logfs->async.tail) {
+			logfs->async.tail->next = completion;
+		}
+		else {
+			logfs->async.head = completion;
+		}
+		logfs->async.tail = completion;
+		pthread_cond_signal(&logfs->data_avail);
+	}
+	pthread_mutex_unlock(&logfs->mutex);
+	return 0;
+}
+
+int
+logfs_append(struct logfs *logfs, const void *buf, uint64_t len)
+{
+	return append(logfs, &buf, &len, 1, 1, NULL);
+}
+
+int
+logfs_appendv(struct logfs *logfs,
+	      const void * const *bufs,
+	      const uint64_t *lens,
+	      int count)
+{
+	return append(logfs, bufs, lens, count, 1, NULL);
+}
+
+int
+logfs_try_append(struct logfs *logfs, const void *buf, uint64_t len)
+{
+	return append(logfs, &buf, &len, 1, 0, NULL);
+}
+
+int
+logfs_append_async(struct logfs *logfs,
+		   const void *buf,
+		   uint64_t len,
+		   logfs_complete_t complete_,
+		   void *arg)
+{
+	struct completion *completion;
+	int r;
+
+	assert( complete_ );
+
+	if (!(completion = malloc(sizeof (struct completion)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(completion, 0, sizeof (struct completion));
+	completion->complete = complete_;
+	completion->arg = arg;
+	if ((r = append(logfs, &buf, &len, 1, 0, completion))) {
+		FREE(completion);
+		if (0 > r) {
+			TRACE(0);
+		}
+		return r;
+	}
+	return 0;
+}
+
+void
+logfs_release(struct logfs *logfs, uint64_t off, uint64_t len)
+{
+	struct segment *segment_;
+	uint64_t n;
+
+	assert( logfs );
+
+	pthread_mutex_lock(&logfs->mutex);
+	assert( (off + len) <= logfs->head );
+	while (len) {
+		n = MIN(len, SEGMENT - (off % SEGMENT));
+		segment_ = segment(logfs, off);
+		assert( segment_ && (n <= segment_->live) );
+		segment_->live -= n;
+		retire(logfs, off / SEGMENT);
+		off += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&logfs->mutex);
+}
+
+int
+logfs_victim(struct logfs *logfs,
+	     uint64_t from,
+	     uint64_t *off,
+	     uint64_t *end,
+	     uint64_t *live)
+{
+	struct segment *segment_;
+	uint64_t i, j, best, start, best_start;
+
+	assert( logfs );
+	assert( off && end && live );
+
+	/*
+	 * The emptiest segment that is full and written out. Its units start
+	 * with the one running into it, unless that crosses a segment already
+	 * retired and so was released whole.
+	 */
+
+	pthread_mutex_lock(&logfs->mutex);
+	best = best_start = NONE;
+	for (i=0; i<logfs->table.n; ++i) {
+		segment_ = &logfs->table.segments[i];
+		if (((logfs->table.base + i + 1) * SEGMENT) > logfs->tail) {
+			break;
+		}
+		start = segment_->first;
+		for (j=segment_->into/SEGMENT; NONE!=segment_->into; ++j) {
+			if (j == (logfs->table.base + i)) {
+				start = segment_->into;
+				break;
+			}
+			if (!segment(logfs, j * SEGMENT) ||
+			    !segment(logfs, j * SEGMENT)->held) {
+				break;
+			}
+		}
+		if (segment_->held &&
+		    (NONE != segment_->first) &&
+		    (start >= from) &&
+		    ((NONE == best) ||
+		     (segment_->live < logfs->table.segments[best].live))) {
+			best = i;
+			best_start = start;
+		}
+	}
+	if (NONE != best) {
+		(*off) = best_start;
+		(*end) = (logfs->table.base + best + 1) * SEGMENT;
+		(*live) = logfs->table.segments[best].live;
+	}
+	pthread_mutex_unlock(&logfs->mutex);
+	return (NONE == best) ? +1 : 0;
+}
+
+void
+logfs_stats(struct logfs *logfs, struct logfs_stats *stats)
+{
+	assert( logfs );
+	assert( stats );
+
+	pthread_mutex_lock(&logfs->mutex);
+	stats->appended = logfs->head;
+	stats->pending = logfs->head - logfs->tail;
+	stats->ring = logfs->wcache.size;
+	stats->stalls = logfs->stalls;
+	stats->stall_us = logfs->stall_us;
+	stats->stored = logfs->stored;
+	stats->segment = SEGMENT;
+	stats->segments = logfs->table.chunks / CHUNKS;
+	stats->free = logfs->table.free_n / CHUNKS;
+	pthread_mutex_lock(&logfs->rmutex);
+	stats->prefetched = logfs->ra.blocks;
+	stats->prefetch_hits = logfs->ra.hits;
+	pthread_mutex_unlock(&logfs->rmutex);
+	pthread_mutex_unlock(&logfs->mutex);
+	device_stats(logfs->device, &stats->device);
+}
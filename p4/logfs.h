@@ -10,20 +10,54 @@
 #ifndef _LOGFS_H_
 #define _LOGFS_H_
 
-#include "system.h"
+#include "device.h"
+
+#define LOGFS_COMPRESS 1 /* LZ-compress each block on the device */
+#define LOGFS_PREFETCH_THREADS 16
 
 struct logfs;
 
+/**
+ * Called once the bytes of an async append are durable, see
+ * logfs_append_async().
+ *
+ * arg: as passed to logfs_append_async()
+ * off: the log offset of the first byte appended
+ * e  : 0 if durable, otherwise error
+ */
+
+typedef void (*logfs_complete_t)(void *arg, uint64_t off, int e);
+
+struct logfs_stats {
+	uint64_t appended;  /* bytes */
+	uint64_t pending;   /* bytes in the write ring, not yet on the device */
+	uint64_t ring;      /* write ring size in bytes */
+	uint64_t stalls;    /* appends that waited for ring space */
+	uint64_t stall_us;  /* total time spent waiting */
+	uint64_t stored;    /* bytes written to the device, compressed */
+	uint64_t segment;   /* segment size in bytes */
+	uint64_t segments;  /* device slots, one segment each */
+	uint64_t free;      /* slots not holding a segment */
+	uint64_t prefetched;    /* blocks read ahead of a sequential reader */
+	uint64_t prefetch_hits; /* of those, blocks the reader then read */
+	struct device_stats device; /* the device under the log */
+};
+
 /**
  * Opens the block device specified in pathname for buffered I/O using an
- * append only log structure.
+ * append only log structure. Log offsets grow without bound, the device is
+ * reused one segment at a time as its bytes are released. With compression
+ * the device holds about stored/appended of the bytes, reads decompress
+ * through the read cache. Once a device write fails the log is dead: every
+ * append fails, and pending async appends complete with an error.
  *
  * pathname: the pathname of the block device
+ * flags   : 0 or LOGFS_COMPRESS
  *
  * return: an opaque handle or NULL on error
  */
 
-struct logfs *logfs_open(const char *pathname);
+struct logfs *logfs_open(const char *pathname, int flags);
 
 /**
  * Closes a previously opened logfs handle.
@@ -35,8 +69,42 @@ struct logfs *logfs_open(const char *pathname);
 
 void logfs_close(struct logfs *logfs);
 
+/**
+ * Closes a logfs handle, as logfs_close(), and hands back an image of its
+ * table: where each segment lives on the device and the log head.
+ *
+ * len: out, the image length
+ *
+ * return: the image, to free, or NULL if the log did not close cleanly
+ */
+
+void *logfs_close_image(struct logfs *logfs, uint64_t *len);
+
+/**
+ * Opens the block device specified in pathname without formatting it,
+ * picking the log up where logfs_close_image() left it: the same head and
+ * every unreleased byte readable at its old offset. Nothing may have
+ * written the device in between.
+ *
+ * image: as returned by logfs_close_image()
+ * len  : its length
+ *
+ * return: an opaque handle or NULL on error, or if the image does not match
+ *         the device or flags
+ */
+
+struct logfs *logfs_reopen(const char *pathname,
+			   int flags,
+			   const void *image,
+			   uint64_t len);
+
 /**
  * Random read of len bytes at location specified in off from the logfs.
+ * Reads that move forward block by block are detected as a stream, the
+ * blocks ahead of it are read into the read cache in the background with a
+ * window that doubles on every step. Bytes already on the device are read
+ * in parallel with other readers and with appends; only bytes still in the
+ * write cache wait on the append side.
  *
  * logfs: an opaque handle previously obtained by calling logfs_open()
  * buf  : a region of memory large enough to receive len bytes
@@ -48,6 +116,26 @@ void logfs_close(struct logfs *logfs);
 
 int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len);
 
+/**
+ * Reads the blocks holding the count offsets in offs into the read cache,
+ * up to threads of them at once (at most LOGFS_PREFETCH_THREADS), so that
+ * the reads that follow find them there. Reads beyond the caller's own go
+ * to helper threads started on first need and kept until logfs_close().
+ * Blocks already cached or not yet on the device are skipped. Advisory: a
+ * failed read is left for the read that follows to report. The read cache
+ * holds a few hundred blocks, fewer offsets than that at a time are best.
+ *
+ * logfs  : an opaque handle previously obtained by calling logfs_open()
+ * offs   : log offsets
+ * count  : the number of offsets
+ * threads: the number of reads in flight, the caller's thread included
+ */
+
+void logfs_prefetch(struct logfs *logfs,
+		    const uint64_t *offs,
+		    int count,
+		    int threads);
+
 /**
  * Append len bytes to the logfs.
  *
@@ -60,4 +148,88 @@ int logfs_read(struct logfs *logfs, void *buf, uint64_t off, size_t len);
 
 int logfs_append(struct logfs *logfs, const void *buf, uint64_t len);
 
+/**
+ * Appends len bytes without waiting: the bytes go into the write ring or,
+ * if it lacks room for all of them, nothing is appended.
+ *
+ * return: 0 on success, EAGAIN if the write ring is full, otherwise error
+ *         (len larger than the write ring can never fit)
+ */
+
+int logfs_try_append(struct logfs *logfs, const void *buf, uint64_t len);
+
+/**
+ * logfs_try_append() with a completion: complete is called, from the logfs
+ * worker thread and in append order, once the bytes are on the device and
+ * a device flush has followed. Appends waiting together share one flush.
+ * The callback may append with logfs_try_append() or logfs_append_async()
+ * but must not wait on the log. With compression, bytes in a partially
+ * filled block complete when the block fills or the log is closed.
+ *
+ * A zero length append completes once everything before it is durable.
+ *
+ * return: 0 on success (complete will be called), EAGAIN if the write ring
+ *         is full (it will not), otherwise error
+ */
+
+int logfs_append_async(struct logfs *logfs,
+		       const void *buf,
+		       uint64_t len,
+		       logfs_complete_t complete,
+		       void *arg);
+
+/**
+ * Appends count buffers back to back as one unit. A segment remembers where
+ * the first unit starting in it begins, which is where its contents can be
+ * parsed from.
+ *
+ * return: 0 on success, otherwise error (out of space if no device slot is
+ *         free for a segment the unit reaches into)
+ */
+
+int logfs_appendv(struct logfs *logfs,
+		  const void * const *bufs,
+		  const uint64_t *lens,
+		  int count);
+
+/**
+ * Marks len bytes at off as no longer needed. A segment whose bytes are all
+ * released is dropped once written out, its offsets can no longer be read.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * off  : the starting byte offset
+ * len  : the number of bytes, each released at most once
+ */
+
+void logfs_release(struct logfs *logfs, uint64_t off, uint64_t len);
+
+/**
+ * Picks the written out segment holding the fewest unreleased bytes. The
+ * units in it, including one running into it from before, are those
+ * starting at [off, end). Only segments with off at or after from count.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * from : the lowest log offset a unit may start at, 0 for any
+ * off  : out, the first unit in the segment
+ * end  : out, the end of the segment
+ * live : out, the unreleased bytes in the segment
+ *
+ * return: 0 on success, +1 if there is no such segment
+ */
+
+int logfs_victim(struct logfs *logfs,
+		 uint64_t from,
+		 uint64_t *off,
+		 uint64_t *end,
+		 uint64_t *live);
+
+/**
+ * Reports the write ring occupancy and how long appends waited on it.
+ *
+ * logfs: an opaque handle previously obtained by calling logfs_open()
+ * stats: out, the statistics
+ */
+
+void logfs_stats(struct logfs *logfs, struct logfs_stats *stats);
+
 #endif /* _LOGFS_H_ */
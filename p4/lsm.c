@@ -0,0 +1,1800 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * lsm.c
+ */
+
+#include <pthread.h>
+#include "logfs.h"
+#include "index.h"
+#include "lsm.h"
+
+#define SKIP_LEVELS 12
+#define BLOCK_SIZE 4096
+#define BLOOM_BITS 10 /* per key */
+#define BLOOM_HASHES 7
+#define L0_RUNS 4
+#define LEVELS 7
+#define FANOUT 10
+
+#define TYPE_VALUE 0 /* zero length ==> tombstone */
+#define TYPE_MERGE 1 /* merge operand */
+
+/**
+ * Run layout in the log:
+ *
+ *   [block]...[block][index][bloom][trailer]
+ *
+ * A block is a sequence of records (struct rec, key, val) sorted by key,
+ * versions of the same key newest (highest seq) first. A record is either a
+ * value or a merge operand that still has to be folded into the older
+ * versions below it, by lookups and by compaction. The index holds the
+ * first key and the extent of every block. The index and the Bloom filter
+ * are also kept in RAM for as long as the run lives.
+ *
+ * Every write is stamped with a sequence number. A snapshot is the sequence
+ * number at the time it was taken and sees the newest version at or below
+ * it. The memtable and compaction keep an older version only while a live
+ * snapshot can still see it.
+ */
+
+#pragma pack(push, 1)
+struct rec {
+	uint8_t type;
+	uint16_t key_len;
+	uint32_t val_len; /* 0 ==> tombstone */
+	uint64_t seq;
+};
+
+struct trailer {
+	char mark[2];
+	uint64_t keys;
+	uint64_t blocks;
+	uint64_t index_off;
+	uint64_t bloom_off;
+	uint64_t bloom_len;
+};
+#pragma pack(pop)
+
+struct node {
+	int type;
+	char *key;
+	char *val;
+	uint64_t seq;
+	uint64_t key_len;
+	uint64_t val_len;
+	struct node *next[1];
+};
+
+struct skiplist {
+	uint64_t seed;
+	uint64_t bytes;
+	struct node *head;
+};
+
+struct run {
+	int refs;
+	int obsolete;
+	uint64_t size; /* data bytes */
+	uint64_t keys;
+	uint64_t blocks;
+	struct {
+		uint64_t off;
+		uint64_t len;
+		uint64_t key_len;
+		char *key;
+	} *index;
+	char *last;
+	uint64_t last_len;
+	uint64_t bits;
+	uint8_t *bloom;
+};
+
+struct level {
+	uint64_t size;
+	uint64_t count;
+	uint64_t capacity;
+	uint64_t cursor;
+	struct run **runs; /* L0: oldest first, otherwise by key */
+};
+
+struct lsm {
+	int done;
+	int error;
+	uint64_t seq;
+	uint64_t generation; /* memtable rotations */
+	uint64_t size;     /* log bytes, owned by the worker */
+	uint64_t memtable; /* immutable */
+	struct {
+		uint64_t count;
+		uint64_t capacity;
+		uint64_t *seqs; /* ascending */
+	} snapshots;
+	struct logfs *logfs;
+	struct skiplist *mem;
+	struct skiplist *imm;
+	struct level levels[LEVELS];
+	struct {
+		lsm_merge_fnc_t fnc;
+		void *arg;
+	} merge;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t space;
+};
+
+struct writer {
+	struct lsm *lsm;
+	struct run *run;
+	char *buf;
+	uint64_t len;
+	uint64_t capacity;
+	uint64_t *hashes;
+	uint64_t hashes_capacity;
+};
+
+struct cursor {
+	struct lsm *lsm;
+	const struct run *run;
+	uint64_t block;
+	char *buf;
+	uint64_t len;
+	uint64_t pos;
+	int type;
+	const char *key;
+	const char *val;
+	uint64_t seq;
+	uint64_t key_len;
+	uint64_t val_len;
+};
+
+struct version {
+	int type;
+	uint64_t seq;
+	char *val; /* malloc'd */
+	uint64_t val_len;
+};
+
+struct expect {
+	uint64_t version;    /* in/out */
+	uint64_t current;    /* newest version outside the memtables */
+	uint64_t generation; /* lsm->generation when current was read */
+};
+
+static int
+compare(const void *a, uint64_t a_len, const void *b, uint64_t b_len)
+{
+	int r;
+
+	if ((r = memcmp(a, b, MIN(a_len, b_len)))) {
+		return r;
+	}
+	return (a_len < b_len) ? -1 : (a_len > b_len);
+}
+
+static int
+compare_seq(const void *a,
+	    uint64_t a_len,
+	    uint64_t a_seq,
+	    const void *b,
+	    uint64_t b_len,
+	    uint64_t b_seq)
+{
+	int r;
+
+	if ((r = compare(a, a_len, b, b_len))) {
+		return r;
+	}
+	return (a_seq > b_seq) ? -1 : (a_seq < b_seq);
+}
+
+static void *
+grow(void *p, uint64_t *capacity, uint64_t n, uint64_t size)
+{
+	uint64_t capacity_;
+
+	if (n <= (*capacity)) {
+		return p;
+	}
+	capacity_ = MAX(n, (*capacity) * 2);
+	if (!(p = realloc(p, capacity_ * size))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	(*capacity) = capacity_;
+	return p;
+}
+
+/*-----------------------------------------------------------------------------
+ * skiplist
+ *---------------------------------------------------------------------------*/
+
+static struct node *
+node_new(int height, const void *key, uint64_t key_len)
+{
+	struct node *node;
+	uint64_t n;
+
+	n = sizeof (struct node) + (height - 1) * sizeof (struct node *);
+	if (!(node = malloc(n + key_len))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(node, 0, n);
+	node->key = (char *)node + n;
+	node->key_len = key_len;
+	memcpy(node->key, key, key_len);
+	return node;
+}
+
+static void
+skiplist_close(struct skiplist *skiplist)
+{
+	struct node *node, *next;
+
+	if (skiplist) {
+		for (node=skiplist->head; node; node=next) {
+			next = node->next[0];
+			FREE(node->val);
+			FREE(node);
+		}
+		memset(skiplist, 0, sizeof (struct skiplist));
+	}
+	FREE(skiplist);
+}
+
+static struct skiplist *
+skiplist_open(void)
+{
+	struct skiplist *skiplist;
+
+	if (!(skiplist = malloc(sizeof (struct skiplist)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(skiplist, 0, sizeof (struct skiplist));
+	skiplist->seed = 88172645463325252;
+	if (!(skiplist->head = node_new(SKIP_LEVELS, "", 0))) {
+		skiplist_close(skiplist);
+		TRACE(0);
+		return NULL;
+	}
+	return skiplist;
+}
+
+static int
+skiplist_height(struct skiplist *skiplist)
+{
+	int height;
+
+	height = 1;
+	for (;;) {
+		skiplist->seed ^= skiplist->seed << 13;
+		skiplist->seed ^= skiplist->seed >> 7;
+		skiplist->seed ^= skiplist->seed << 17;
+		if ((SKIP_LEVELS <= height) || (skiplist->seed & 3)) {
+			break;
+		}
+		++height;
+	}
+	return height;
+}
+
+static struct node *
+skiplist_find(const struct skiplist *skiplist,
+	      const void *key,
+	      uint64_t key_len,
+	      uint64_t seq,
+	      struct node **prev)
+{
+	struct node *node;
+	int i;
+
+	/* first node at or after (key, seq), i.e., newest version <= seq */
+
+	node = skiplist->head;
+	for (i=SKIP_LEVELS-1; 0<=i; --i) {
+		while (node->next[i] &&
+		       (0 > compare_seq(node->next[i]->key,
+					node->next[i]->key_len,
+					node->next[i]->seq,
+					key,
+					key_len,
+					seq))) {
+			node = node->next[i];
+		}
+		if (prev) {
+			prev[i] = node;
+		}
+	}
+	node = node->next[0];
+	if (node && !compare(node->key, node->key_len, key, key_len)) {
+		return node;
+	}
+	return NULL;
+}
+
+static int
+skiplist_put(struct skiplist *skiplist,
+	     int type,
+	     const void *key,
+	     uint64_t key_len,
+	     const void *val,
+	     uint64_t val_len,
+	     uint64_t seq,
+	     uint64_t pinned) /* newest snapshot, 0 if none */
+{
+	struct node *prev[SKIP_LEVELS], *node;
+	char *val_;
+	int i, height;
+
+	val_ = NULL;
+	if (val_len) {
+		if (!(val_ = malloc(val_len))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		memcpy(val_, val, val_len);
+	}
+	node = skiplist_find(skiplist, key, key_len, UINT64_MAX, prev);
+	if (node && (node->seq > pinned)) { /* invisible to all snapshots */
+		skiplist->bytes -= node->val_len;
+		FREE(node->val);
+	}
+	else {
+		height = skiplist_height(skiplist);
+		if (!(node = node_new(height, key, key_len))) {
+			FREE(val_);
+			TRACE(0);
+			return -1;
+		}
+		for (i=0; i<height; ++i) {
+			node->next[i] = prev[i]->next[i];
+			prev[i]->next[i] = node;
+		}
+		skiplist->bytes += sizeof (struct rec) + key_len;
+	}
+	node->type = type;
+	node->val = val_;
+	node->seq = seq;
+	node->val_len = val_len;
+	skiplist->bytes += val_len;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * run
+ *---------------------------------------------------------------------------*/
+
+static void
+run_close(struct run *run)
+{
+	uint64_t i;
+
+	if (run) {
+		for (i=0; run->index && (i<run->blocks); ++i) {
+			FREE(run->index[i].key);
+		}
+		FREE(run->index);
+		FREE(run->last);
+		FREE(run->bloom);
+		memset(run, 0, sizeof (struct run));
+	}
+	FREE(run);
+}
+
+static void
+bloom_bits(uint64_t h, uint64_t bits, uint64_t *bit)
+{
+	uint64_t h2;
+	int i;
+
+	h2 = ((h >> 33) ^ (h << 31)) | 1;
+	for (i=0; i<BLOOM_HASHES; ++i) {
+		bit[i] = (h + i * h2) % bits;
+	}
+}
+
+static int
+run_may_contain(const struct run *run, const void *key, uint64_t key_len)
+{
+	uint64_t bit[BLOOM_HASHES];
+	int i;
+
+	if (!run->blocks ||
+	    (0 > compare(key, key_len,
+			 run->index[0].key, run->index[0].key_len)) ||
+	    (0 < compare(key, key_len, run->last, run->last_len))) {
+		return 0;
+	}
+	bloom_bits(index_hash(key, key_len), run->bits, bit);
+	for (i=0; i<BLOOM_HASHES; ++i) {
+		if (!((run->bloom[bit[i] / 8] >> (bit[i] % 8)) & 1)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+run_overlaps(const struct run *run,
+	     const void *lo,
+	     uint64_t lo_len,
+	     const void *hi,
+	     uint64_t hi_len)
+{
+	return (0 <= compare(run->last, run->last_len, lo, lo_len)) &&
+		(0 >= compare(run->index[0].key, run->index[0].key_len,
+			      hi, hi_len));
+}
+
+/*-----------------------------------------------------------------------------
+ * writer
+ *---------------------------------------------------------------------------*/
+
+static int
+writer_open(struct writer *writer, struct lsm *lsm)
+{
+	memset(writer, 0, sizeof (struct writer));
+	writer->lsm = lsm;
+	if (!(writer->run = malloc(sizeof (struct run)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(writer->run, 0, sizeof (struct run));
+	return 0;
+}
+
+static void
+writer_abort(struct writer *writer)
+{
+	run_close(writer->run);
+	FREE(writer->buf);
+	FREE(writer->hashes);
+	memset(writer, 0, sizeof (struct writer));
+}
+
+static int
+writer_block(struct writer *writer)
+{
+	struct run *run;
+	struct rec rec;
+	uint64_t n;
+
+	run = writer->run;
+	if (!writer->len) {
+		return 0;
+	}
+	n = run->blocks + 1;
+	if (!(run->index = realloc(run->index, n * sizeof (run->index[0])))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	run->index[run->blocks].off = writer->lsm->size;
+	run->index[run->blocks].len = writer->len;
+	memcpy(&rec, writer->buf, sizeof (struct rec));
+	run->index[run->blocks].key_len = rec.key_len;
+	if (!(run->index[run->blocks].key =
+	      malloc(run->index[run->blocks].key_len + 1))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memcpy(run->index[run->blocks].key,
+	       writer->buf + sizeof (struct rec),
+	       run->index[run->blocks].key_len);
+	++run->blocks;
+	if (logfs_append(writer->lsm->logfs, writer->buf, writer->len)) {
+		TRACE(0);
+		return -1;
+	}
+	writer->lsm->size += writer->len;
+	run->size += writer->len;
+	writer->len = 0;
+	return 0;
+}
+
+static int
+writer_add(struct writer *writer,
+	   int type,
+	   const void *key,
+	   uint64_t key_len,
+	   const void *val,
+	   uint64_t val_len,
+	   uint64_t seq)
+{
+	struct run *run;
+	struct rec rec;
+	uint64_t n;
+
+	run = writer->run;
+	n = writer->len + sizeof (struct rec) + key_len + val_len;
+	if (!(writer->buf = grow(writer->buf, &writer->capacity, n, 1)) ||
+	    !(writer->hashes = grow(writer->hashes,
+				    &writer->hashes_capacity,
+				    run->keys + 1,
+				    sizeof (uint64_t))) ||
+	    !(run->last = realloc(run->last, key_len + 1))) {
+		TRACE(0);
+		return -1;
+	}
+	rec.type = (uint8_t)type;
+	rec.key_len = (uint16_t)key_len;
+	rec.val_len = (uint32_t)val_len;
+	rec.seq = seq;
+	memcpy(writer->buf + writer->len, &rec, sizeof (struct rec));
+	memcpy(writer->buf + writer->len + sizeof (struct rec), key, key_len);
+	memcpy(writer->buf + writer->len + sizeof (struct rec) + key_len,
+	       val,
+	       val_len);
+	writer->len = n;
+	memcpy(run->last, key, key_len);
+	run->last_len = key_len;
+	writer->hashes[run->keys++] = index_hash(key, key_len);
+	if (BLOCK_SIZE <= writer->len) {
+		if (writer_block(writer)) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static struct run *
+writer_finish(struct writer *writer)
+{
+	uint64_t i, j, bit[BLOOM_HASHES];
+	struct trailer trailer;
+	struct run *run;
+	struct lsm *lsm;
+	struct rec rec;
+
+	lsm = writer->lsm;
+	run = writer->run;
+	if (writer_block(writer)) {
+		writer_abort(writer);
+		TRACE(0);
+		return NULL;
+	}
+
+	/* bloom */
+
+	run->bits = MAX(64, run->keys * BLOOM_BITS);
+	run->bits = (run->bits + 7) / 8 * 8;
+	if (!(run->bloom = malloc(run->bits / 8))) {
+		writer_abort(writer);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(run->bloom, 0, run->bits / 8);
+	for (i=0; i<run->keys; ++i) {
+		bloom_bits(writer->hashes[i], run->bits, bit);
+		for (j=0; j<BLOOM_HASHES; ++j) {
+			run->bloom[bit[j] / 8] |= (uint8_t)(1 << (bit[j] % 8));
+		}
+	}
+
+	/* index, bloom, trailer */
+
+	memset(&trailer, 0, sizeof (struct trailer));
+	trailer.mark[0] = 'R';
+	trailer.mark[1] = 'N';
+	trailer.keys = run->keys;
+	trailer.blocks = run->blocks;
+	trailer.index_off = lsm->size;
+	for (i=0; i<run->blocks; ++i) {
+		rec.type = TYPE_VALUE;
+		rec.key_len = (uint16_t)run->index[i].key_len;
+		rec.val_len = 0;
+		rec.seq = 0;
+		if (logfs_append(lsm->logfs, &rec, sizeof (struct rec)) ||
+		    logfs_append(lsm->logfs, &run->index[i].off, 8) ||
+		    logfs_append(lsm->logfs, &run->index[i].len, 8) ||
+		    logfs_append(lsm->logfs,
+				 run->index[i].key,
+				 run->index[i].key_len)) {
+			writer_abort(writer);
+			TRACE(0);
+			return NULL;
+		}
+		lsm->size += sizeof (struct rec) + 16 + run->index[i].key_len;
+	}
+	trailer.bloom_off = lsm->size;
+	trailer.bloom_len = run->bits / 8;
+	if (logfs_append(lsm->logfs, run->bloom, trailer.bloom_len) ||
+	    logfs_append(lsm->logfs, &trailer, sizeof (struct trailer))) {
+		writer_abort(writer);
+		TRACE(0);
+		return NULL;
+	}
+	lsm->size += trailer.bloom_len + sizeof (struct trailer);
+	FREE(writer->buf);
+	FREE(writer->hashes);
+	memset(writer, 0, sizeof (struct writer));
+	return run;
+}
+
+/*-----------------------------------------------------------------------------
+ * cursor
+ *---------------------------------------------------------------------------*/
+
+static int /* -1|0|+1 */
+cursor_next(struct cursor *cursor)
+{
+	const struct run *run;
+	struct rec rec;
+
+	run = cursor->run;
+	while (cursor->pos >= cursor->len) {
+		if (cursor->block >= run->blocks) {
+			return +1; /* end */
+		}
+		if (!(cursor->buf = realloc(cursor->buf,
+					    run->index[cursor->block].len))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		if (logfs_read(cursor->lsm->logfs,
+			       cursor->buf,
+			       run->index[cursor->block].off,
+			       run->index[cursor->block].len)) {
+			TRACE(0);
+			return -1;
+		}
+		cursor->len = run->index[cursor->block].len;
+		cursor->pos = 0;
+		++cursor->block;
+	}
+	memcpy(&rec, cursor->buf + cursor->pos, sizeof (struct rec));
+	cursor->key = cursor->buf + cursor->pos + sizeof (struct rec);
+	cursor->val = cursor->key + rec.key_len;
+	cursor->type = rec.type;
+	cursor->key_len = rec.key_len;
+	cursor->val_len = rec.val_len;
+	cursor->seq = rec.seq;
+	cursor->pos += sizeof (struct rec) + rec.key_len + rec.val_len;
+	return 0;
+}
+
+static uint64_t
+version_of(int type, uint64_t seq, uint64_t val_len)
+{
+	return ((TYPE_VALUE == type) && !val_len) ? 0 : seq;
+}
+
+static int
+version_set(struct version *version,
+	    int type,
+	    uint64_t seq,
+	    const void *val,
+	    uint64_t val_len)
+{
+	version->type = type;
+	version->seq = seq;
+	version->val_len = val_len;
+	version->val = NULL;
+	if (val_len) {
+		if (!(version->val = malloc(val_len))) {
+			TRACE("out of memory");
+			return -1;
+		}
+		memcpy(version->val, val, val_len);
+	}
+	return 0;
+}
+
+static int /* -1|0|+2 */
+run_lookup(struct lsm *lsm,
+	   const struct run *run,
+	   uint64_t seq,
+	   const void *key,
+	   uint64_t key_len,
+	   struct version *version)
+{
+	struct cursor cursor;
+	uint64_t lo, hi, mid;
+	int r;
+
+	/* last block whose first key < key, versions may span blocks */
+
+	lo = 0;
+	hi = run->blocks;
+	while (1 < (hi - lo)) {
+		mid = lo + (hi - lo) / 2;
+		if (0 >= compare(key,
+				 key_len,
+				 run->index[mid].key,
+				 run->index[mid].key_len)) {
+			hi = mid;
+		}
+		else {
+			lo = mid;
+		}
+	}
+	memset(&cursor, 0, sizeof (struct cursor));
+	cursor.lsm = lsm;
+	cursor.run = run;
+	cursor.block = lo;
+	for (;;) {
+		if ((r = cursor_next(&cursor))) {
+			r = (0 > r) ? -1 : +2; /* end of run */
+			break;
+		}
+		r = compare_seq(cursor.key, cursor.key_len, cursor.seq,
+				key, key_len, seq);
+		if (0 > r) {
+			continue;
+		}
+		if ((0 < r) &&
+		    compare(cursor.key, cursor.key_len, key, key_len)) {
+			r = +2; /* not in this run */
+			break;
+		}
+		r = version_set(version,
+				cursor.type,
+				cursor.seq,
+				cursor.val,
+				cursor.val_len);
+		break;
+	}
+	FREE(cursor.buf);
+	if (0 > r) {
+		TRACE(0);
+		return -1;
+	}
+	return r;
+}
+
+/*-----------------------------------------------------------------------------
+ * levels
+ *---------------------------------------------------------------------------*/
+
+static void
+release(struct run *run)
+{
+	if (run->obsolete && !run->refs) {
+		run_close(run);
+	}
+}
+
+static int
+level_add(struct level *level, struct run *run)
+{
+	if (!(level->runs = grow(level->runs,
+				 &level->capacity,
+				 level->count + 1,
+				 sizeof (struct run *)))) {
+		TRACE(0);
+		return -1;
+	}
+	level->runs[level->count++] = run;
+	level->size += run->size;
+	return 0;
+}
+
+static void
+level_remove(struct level *level, const struct run *run)
+{
+	uint64_t i;
+
+	for (i=0; i<level->count; ++i) {
+		if (run == level->runs[i]) {
+			memmove(&level->runs[i],
+				&level->runs[i + 1],
+				(level->count - i - 1) * sizeof (struct run *));
+			--level->count;
+			level->size -= run->size;
+			return;
+		}
+	}
+	assert( 0 );
+}
+
+static int
+level_order(const void *a_, const void *b_)
+{
+	const struct run *a, *b;
+
+	a = *(const struct run * const *)a_;
+	b = *(const struct run * const *)b_;
+	return compare(a->index[0].key, a->index[0].key_len,
+		       b->index[0].key, b->index[0].key_len);
+}
+
+static uint64_t
+level_limit(const struct lsm *lsm, int i)
+{
+	uint64_t limit;
+
+	limit = lsm->memtable * FANOUT;
+	while (1 < i--) {
+		limit *= FANOUT;
+	}
+	return limit;
+}
+
+static int
+pick(const struct lsm *lsm)
+{
+	int i;
+
+	if (L0_RUNS <= lsm->levels[0].count) {
+		return 0;
+	}
+	for (i=1; i<(LEVELS-1); ++i) {
+		if (lsm->levels[i].size > level_limit(lsm, i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*-----------------------------------------------------------------------------
+ * worker
+ *---------------------------------------------------------------------------*/
+
+static int
+flush(struct lsm *lsm, const struct skiplist *skiplist)
+{
+	struct writer writer;
+	struct node *node;
+	struct run *run;
+
+	if (writer_open(&writer, lsm)) {
+		TRACE(0);
+		return -1;
+	}
+	for (node=skiplist->head->next[0]; node; node=node->next[0]) {
+		if (writer_add(&writer,
+			       node->type,
+			       node->key,
+			       node->key_len,
+			       node->val,
+			       node->val_len,
+			       node->seq)) {
+			writer_abort(&writer);
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (!(run = writer_finish(&writer))) {
+		TRACE(0);
+		return -1;
+	}
+	pthread_mutex_lock(&lsm->mutex);
+	if (!run->keys || level_add(&lsm->levels[0], run)) {
+		run->obsolete = 1;
+		release(run);
+	}
+	skiplist_close(lsm->imm);
+	lsm->imm = NULL;
+	pthread_cond_broadcast(&lsm->space);
+	pthread_mutex_unlock(&lsm->mutex);
+	return 0;
+}
+
+static int
+combine(const struct lsm *lsm,
+	const void *val, /* NULL if absent */
+	uint64_t val_len,
+	const void *operand,
+	uint64_t operand_len,
+	char **out,      /* out, malloc'd */
+	uint64_t *out_len)
+{
+	void *out_;
+
+	out_ = NULL;
+	(*out) = NULL;
+	(*out_len) = 0;
+	if (!lsm->merge.fnc) {
+		TRACE("no merge operator");
+		return -1;
+	}
+	if (lsm->merge.fnc(lsm->merge.arg,
+			   val,
+			   val_len,
+			   operand,
+			   operand_len,
+			   &out_,
+			   out_len) ||
+	    !out_ ||
+	    !(*out_len) ||
+	    (0xffffffff < (*out_len))) {
+		FREE(out_);
+		TRACE("merge operator failed");
+		return -1;
+	}
+	(*out) = out_;
+	return 0;
+}
+
+static uint64_t
+stripe(const uint64_t *seqs, uint64_t n, uint64_t seq)
+{
+	uint64_t lo, hi, mid;
+
+	/* oldest snapshot that sees seq, UINT64_MAX if none */
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (seqs[mid] < seq) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return (lo < n) ? seqs[lo] : UINT64_MAX;
+}
+
+static int
+cut(struct writer *writer, struct run ***outputs, uint64_t *m, uint64_t *n)
+{
+	struct run *run;
+
+	if (!(run = writer_finish(writer))) {
+		TRACE(0);
+		return -1;
+	}
+	if (!((*outputs) = grow((*outputs), n, (*m) + 1, sizeof (run)))) {
+		run_close(run);
+		TRACE(0);
+		return -1;
+	}
+	(*outputs)[(*m)++] = run;
+	return 0;
+}
+
+static int
+emit(struct writer *writer,
+     struct lsm *lsm,
+     const void *key,
+     uint64_t key_len,
+     struct version *version)
+{
+	if (!writer->run && writer_open(writer, lsm)) {
+		TRACE(0);
+		return -1;
+	}
+	if (writer_add(writer,
+		       version->type,
+		       key,
+		       key_len,
+		       version->val,
+		       version->val_len,
+		       version->seq)) {
+		TRACE(0);
+		return -1;
+	}
+	FREE(version->val);
+	return 0;
+}
+
+static int
+merge(struct lsm *lsm,
+      struct run **inputs, /* newest first */
+      uint64_t n,
+      const uint64_t *seqs, /* live snapshots, ascending */
+      uint64_t seqs_n,
+      int drop,
+      struct run ***outputs,
+      uint64_t *m)
+{
+	uint64_t i, w, capacity, prev_len, prev_capacity, prev_stripe, stripe_;
+	uint64_t val_len;
+	struct cursor *cursors, *cursor;
+	struct version pending;
+	struct writer writer;
+	char *prev, *val;
+	int r, e, held, fresh;
+
+	(*outputs) = NULL;
+	(*m) = capacity = 0;
+	if (!(cursors = malloc(n * sizeof (struct cursor)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(cursors, 0, n * sizeof (struct cursor));
+	memset(&writer, 0, sizeof (struct writer));
+	memset(&pending, 0, sizeof (struct version));
+	prev = NULL;
+	prev_len = prev_capacity = prev_stripe = 0;
+	e = held = 0;
+	for (i=0; i<n; ++i) {
+		cursors[i].lsm = lsm;
+		cursors[i].run = inputs[i];
+		if (0 > (r = cursor_next(&cursors[i]))) {
+			e = -1;
+		}
+		if (r) {
+			cursors[i].run = NULL;
+		}
+	}
+	while (!e) {
+
+		/* smallest (key, newest version) */
+
+		for (w=n, i=0; i<n; ++i) {
+			if (cursors[i].run &&
+			    ((w == n) ||
+			     (0 > compare_seq(cursors[i].key,
+					      cursors[i].key_len,
+					      cursors[i].seq,
+					      cursors[w].key,
+					      cursors[w].key_len,
+					      cursors[w].seq)))) {
+				w = i;
+			}
+		}
+		if (w == n) {
+			break;
+		}
+		cursor = &cursors[w];
+
+		/* keep the newest version per snapshot stripe */
+
+		stripe_ = stripe(seqs, seqs_n, cursor->seq);
+		fresh = !prev ||
+			compare(cursor->key, cursor->key_len, prev, prev_len) ||
+			(stripe_ != prev_stripe);
+		if (fresh && held) {
+			held = 0;
+			if (emit(&writer, lsm, prev, prev_len, &pending)) {
+				e = -1;
+				break;
+			}
+		}
+		if (!prev ||
+		    compare(cursor->key, cursor->key_len, prev, prev_len)) {
+
+			/* cut runs at key boundaries only */
+
+			if (writer.run &&
+			    (writer.run->size >= lsm->memtable) &&
+			    cut(&writer, outputs, m, &capacity)) {
+				e = -1;
+				break;
+			}
+			if (!(prev = grow(prev,
+					  &prev_capacity,
+					  cursor->key_len + 1,
+					  1))) {
+				e = -1;
+				break;
+			}
+			memcpy(prev, cursor->key, cursor->key_len);
+			prev_len = cursor->key_len;
+		}
+		prev_stripe = stripe_;
+
+		/* a bottom tombstone no snapshot predates hides nothing */
+
+		if (fresh &&
+		    (!drop ||
+		     (TYPE_VALUE != cursor->type) ||
+		     cursor->val_len ||
+		     (seqs_n && (seqs[0] < cursor->seq)))) {
+			if (version_set(&pending,
+					cursor->type,
+					cursor->seq,
+					cursor->val,
+					cursor->val_len)) {
+				e = -1;
+				break;
+			}
+			held = 1;
+		}
+
+		/* fold older versions of the stripe into a held operand */
+
+		else if (!fresh && held && (TYPE_MERGE == pending.type)) {
+			if (combine(lsm,
+				    cursor->val_len ? cursor->val : NULL,
+				    cursor->val_len,
+				    pending.val,
+				    pending.val_len,
+				    &val,
+				    &val_len)) {
+				e = -1;
+				break;
+			}
+			FREE(pending.val);
+			pending.type = cursor->type;
+			pending.val = val;
+			pending.val_len = val_len;
+		}
+		if (0 > (r = cursor_next(cursor))) {
+			e = -1;
+		}
+		if (r) {
+			cursor->run = NULL;
+		}
+	}
+	if (!e && held) {
+		if (emit(&writer, lsm, prev, prev_len, &pending)) {
+			e = -1;
+		}
+	}
+	if (!e && writer.run && writer.run->keys) {
+		if (cut(&writer, outputs, m, &capacity)) {
+			e = -1;
+		}
+	}
+	if (writer.run) {
+		writer_abort(&writer);
+	}
+	for (i=0; i<n; ++i) {
+		FREE(cursors[i].buf);
+	}
+	FREE(cursors);
+	FREE(pending.val);
+	FREE(prev);
+	if (e) {
+		for (i=0; i<(*m); ++i) {
+			run_close((*outputs)[i]);
+		}
+		FREE((*outputs));
+		(*m) = 0;
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+compact(struct lsm *lsm, int level)
+{
+	struct run **inputs, **outputs;
+	uint64_t i, k, n, m, seqs_n;
+	struct level *src, *dst;
+	uint64_t lo_len, hi_len;
+	const char *lo, *hi;
+	uint64_t *seqs;
+	int drop;
+
+	/* pick inputs, newest first (L0 runs may overlap each other) */
+
+	pthread_mutex_lock(&lsm->mutex);
+	src = &lsm->levels[level];
+	dst = &lsm->levels[level + 1];
+	seqs_n = lsm->snapshots.count;
+	inputs = malloc((src->count + dst->count) * sizeof (struct run *));
+	seqs = malloc((seqs_n + 1) * sizeof (uint64_t));
+	if (!inputs || !seqs) {
+		pthread_mutex_unlock(&lsm->mutex);
+		FREE(inputs);
+		FREE(seqs);
+		TRACE("out of memory");
+		return -1;
+	}
+	memcpy(seqs, lsm->snapshots.seqs, seqs_n * sizeof (uint64_t));
+	n = 0;
+	if (!level) {
+		for (i=src->count; 0<i; --i) {
+			inputs[n++] = src->runs[i - 1];
+		}
+	}
+	else {
+		src->cursor %= src->count;
+		inputs[n++] = src->runs[src->cursor++];
+	}
+	lo = inputs[0]->index[0].key;
+	lo_len = inputs[0]->index[0].key_len;
+	hi = inputs[0]->last;
+	hi_len = inputs[0]->last_len;
+	for (i=1; i<n; ++i) {
+		if (0 > compare(inputs[i]->index[0].key,
+				inputs[i]->index[0].key_len,
+				lo,
+				lo_len)) {
+			lo = inputs[i]->index[0].key;
+			lo_len = inputs[i]->index[0].key_len;
+		}
+		if (0 < compare(inputs[i]->last, inputs[i]->last_len,
+				hi, hi_len)) {
+			hi = inputs[i]->last;
+			hi_len = inputs[i]->last_len;
+		}
+	}
+	k = n;
+	for (i=0; i<dst->count; ++i) {
+		if (run_overlaps(dst->runs[i], lo, lo_len, hi, hi_len)) {
+			inputs[n++] = dst->runs[i];
+		}
+	}
+	drop = 1;
+	for (i=level+2; i<LEVELS; ++i) {
+		if (lsm->levels[i].count) {
+			drop = 0;
+		}
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+
+	/* merge, inputs are immutable and only this thread retires them */
+
+	if (merge(lsm, inputs, n, seqs, seqs_n, drop, &outputs, &m)) {
+		FREE(inputs);
+		FREE(seqs);
+		TRACE(0);
+		return -1;
+	}
+	FREE(seqs);
+
+	/* install */
+
+	pthread_mutex_lock(&lsm->mutex);
+	if (!(dst->runs = grow(dst->runs,
+			       &dst->capacity,
+			       dst->count + m,
+			       sizeof (struct run *)))) {
+		pthread_mutex_unlock(&lsm->mutex);
+		for (i=0; i<m; ++i) {
+			run_close(outputs[i]);
+		}
+		FREE(outputs);
+		FREE(inputs);
+		TRACE(0);
+		return -1;
+	}
+	for (i=0; i<n; ++i) {
+		level_remove((i < k) ? src : dst, inputs[i]);
+		inputs[i]->obsolete = 1;
+	}
+	for (i=0; i<m; ++i) {
+		level_add(dst, outputs[i]);
+	}
+	qsort(dst->runs, dst->count, sizeof (struct run *), level_order);
+	for (i=0; i<n; ++i) {
+		release(inputs[i]);
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+	FREE(inputs);
+	FREE(outputs);
+	return 0;
+}
+
+static void *
+worker(void *arg)
+{
+	struct lsm *lsm;
+	int level;
+
+	lsm = (struct lsm *)arg;
+	pthread_mutex_lock(&lsm->mutex);
+	while (!lsm->done) {
+		if (lsm->imm) {
+			pthread_mutex_unlock(&lsm->mutex);
+			if (flush(lsm, lsm->imm)) {
+				pthread_mutex_lock(&lsm->mutex);
+				break;
+			}
+			pthread_mutex_lock(&lsm->mutex);
+			continue;
+		}
+		if (0 <= (level = pick(lsm))) {
+			pthread_mutex_unlock(&lsm->mutex);
+			if (compact(lsm, level)) {
+				pthread_mutex_lock(&lsm->mutex);
+				break;
+			}
+			pthread_mutex_lock(&lsm->mutex);
+			continue;
+		}
+		pthread_cond_wait(&lsm->work, &lsm->mutex);
+	}
+	if (!lsm->done) {
+		TRACE("lsm worker failed");
+		lsm->error = 1;
+		pthread_cond_broadcast(&lsm->space);
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * lsm
+ *---------------------------------------------------------------------------*/
+
+static int /* -1|0|+1 */
+find(struct lsm *lsm,
+     uint64_t seq,
+     const void *key,
+     uint64_t key_len,
+     struct version *version)
+{
+	const struct skiplist *skiplists[2];
+	struct run **runs;
+	struct level *level;
+	struct node *node;
+	uint64_t i, n;
+	int j, r;
+
+	pthread_mutex_lock(&lsm->mutex);
+
+	/* memtables */
+
+	skiplists[0] = lsm->mem;
+	skiplists[1] = lsm->imm;
+	for (j=0; j<2; ++j) {
+		if (skiplists[j] &&
+		    (node = skiplist_find(skiplists[j],
+					  key,
+					  key_len,
+					  seq,
+					  NULL))) {
+			r = version_set(version,
+					node->type,
+					node->seq,
+					node->val,
+					node->val_len);
+			pthread_mutex_unlock(&lsm->mutex);
+			if (r) {
+				TRACE(0);
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	/* candidate runs, newest first, pinned while searched unlocked */
+
+	n = 0;
+	for (j=0; j<LEVELS; ++j) {
+		n += lsm->levels[j].count;
+	}
+	if (!(runs = malloc((n + 1) * sizeof (struct run *)))) {
+		pthread_mutex_unlock(&lsm->mutex);
+		TRACE("out of memory");
+		return -1;
+	}
+	n = 0;
+	for (j=0; j<LEVELS; ++j) {
+		level = &lsm->levels[j];
+		for (i=level->count; 0<i; --i) {
+			if (run_may_contain(level->runs[i - 1], key, key_len)) {
+				runs[n] = level->runs[i - 1];
+				++runs[n++]->refs;
+			}
+		}
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+	r = +1;
+	for (i=0; i<n; ++i) {
+		r = run_lookup(lsm, runs[i], seq, key, key_len, version);
+		if (+2 != r) {
+			break;
+		}
+		r = +1;
+	}
+	pthread_mutex_lock(&lsm->mutex);
+	for (i=0; i<n; ++i) {
+		--runs[i]->refs;
+		release(runs[i]);
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+	FREE(runs);
+	if (0 > r) {
+		TRACE(0);
+		return -1;
+	}
+	return r;
+}
+
+static int /* -1|0|+1|+2 */
+put(struct lsm *lsm,
+    int type,
+    const void *key,
+    uint64_t key_len,
+    const void *val,
+    uint64_t val_len,
+    struct expect *expect) /* NULL ==> unconditional */
+{
+	struct skiplist *skiplist;
+	struct node *node;
+	uint64_t pinned, out_len, current;
+	char *out;
+
+	pthread_mutex_lock(&lsm->mutex);
+	while (!lsm->error && lsm->imm && (lsm->mem->bytes >= lsm->memtable)) {
+		pthread_cond_wait(&lsm->space, &lsm->mutex);
+	}
+	pinned = lsm->snapshots.count ?
+		lsm->snapshots.seqs[lsm->snapshots.count - 1] : 0;
+
+	/* compare, a newer version can only be in a memtable */
+
+	if (expect) {
+		if ((node = skiplist_find(lsm->mem,
+					  key,
+					  key_len,
+					  UINT64_MAX,
+					  NULL)) ||
+		    (lsm->imm && (node = skiplist_find(lsm->imm,
+							key,
+							key_len,
+							UINT64_MAX,
+							NULL)))) {
+			current = version_of(node->type,
+					     node->seq,
+					     node->val_len);
+		}
+		else if (expect->generation != lsm->generation) {
+			pthread_mutex_unlock(&lsm->mutex);
+			return +2; /* flushed since read, retry */
+		}
+		else {
+			current = expect->current;
+		}
+		if (current != expect->version) {
+			pthread_mutex_unlock(&lsm->mutex);
+			expect->version = current;
+			return +1;
+		}
+		expect->version = lsm->seq + 1;
+	}
+
+	/* fold an operand into a version no snapshot can see */
+
+	out = NULL;
+	if ((TYPE_MERGE == type) &&
+	    (node = skiplist_find(lsm->mem, key, key_len, UINT64_MAX, NULL)) &&
+	    (node->seq > pinned)) {
+		if (combine(lsm,
+			    node->val,
+			    node->val_len,
+			    val,
+			    val_len,
+			    &out,
+			    &out_len)) {
+			pthread_mutex_unlock(&lsm->mutex);
+			TRACE(0);
+			return -1;
+		}
+		type = node->type;
+		val = out;
+		val_len = out_len;
+	}
+	if (lsm->error ||
+	    skiplist_put(lsm->mem,
+			 type,
+			 key,
+			 key_len,
+			 val,
+			 val_len,
+			 lsm->seq + 1,
+			 pinned)) {
+		pthread_mutex_unlock(&lsm->mutex);
+		FREE(out);
+		TRACE(0);
+		return -1;
+	}
+	FREE(out);
+	if (!lsm->imm && (lsm->mem->bytes >= lsm->memtable)) {
+		if (!(skiplist = skiplist_open())) {
+			pthread_mutex_unlock(&lsm->mutex);
+			TRACE(0);
+			return -1;
+		}
+		lsm->imm = lsm->mem;
+		lsm->mem = skiplist;
+		++lsm->generation;
+		pthread_cond_signal(&lsm->work);
+	}
+	++lsm->seq;
+	pthread_mutex_unlock(&lsm->mutex);
+	return 0;
+}
+
+struct lsm *
+lsm_open(const char *pathname, uint64_t memtable, int flags)
+{
+	struct lsm *lsm;
+	pthread_t thread;
+
+	assert( safe_strlen(pathname) );
+	assert( memtable );
+
+	if (!(lsm = malloc(sizeof (struct lsm)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(lsm, 0, sizeof (struct lsm));
+	lsm->memtable = memtable;
+	if (!(lsm->logfs = logfs_open(pathname, flags)) ||
+	    !(lsm->mem = skiplist_open())) {
+		lsm_close(lsm);
+		TRACE(0);
+		return NULL;
+	}
+	if (pthread_mutex_init(&lsm->mutex, NULL) ||
+	    pthread_cond_init(&lsm->work, NULL) ||
+	    pthread_cond_init(&lsm->space, NULL) ||
+	    pthread_create(&thread, NULL, worker, lsm)) {
+		lsm_close(lsm);
+		TRACE("pthread_*()");
+		return NULL;
+	}
+	lsm->thread = thread;
+	return lsm;
+}
+
+void
+lsm_close(struct lsm *lsm)
+{
+	uint64_t i;
+	int j;
+
+	if (lsm) {
+		if (lsm->thread) {
+			pthread_mutex_lock(&lsm->mutex);
+			lsm->done = 1;
+			pthread_cond_signal(&lsm->work);
+			pthread_mutex_unlock(&lsm->mutex);
+			pthread_join(lsm->thread, NULL);
+			pthread_mutex_destroy(&lsm->mutex);
+			pthread_cond_destroy(&lsm->work);
+			pthread_cond_destroy(&lsm->space);
+		}
+		for (j=0; j<LEVELS; ++j) {
+			for (i=0; i<lsm->levels[j].count; ++i) {
+				run_close(lsm->levels[j].runs[i]);
+			}
+			FREE(lsm->levels[j].runs);
+		}
+		skiplist_close(lsm->mem);
+		skiplist_close(lsm->imm);
+		logfs_close(lsm->logfs);
+		FREE(lsm->snapshots.seqs);
+		memset(lsm, 0, sizeof (struct lsm));
+	}
+	FREE(lsm);
+}
+
+int /* -1|0|+1 */
+lsm_lookup(struct lsm *lsm,
+	   uint64_t seq,
+	   const void *key,
+	   uint64_t key_len,
+	   void *val,
+	   uint64_t *val_len,
+	   uint64_t *version_)
+{
+	struct version version;
+	uint64_t acc_len, out_len;
+	char *acc, *out;
+	int r;
+
+	assert( lsm );
+	assert( key && key_len );
+	assert( !val_len || !(*val_len) || val );
+
+	/* newest version, then older ones while it is a merge operand */
+
+	acc = NULL;
+	acc_len = 0;
+	for (;;) {
+		memset(&version, 0, sizeof (struct version));
+		if (0 > (r = find(lsm, seq, key, key_len, &version))) {
+			FREE(acc);
+			TRACE(0);
+			return -1;
+		}
+		if (!acc) {
+			if (version_ && r) {
+				(*version_) = 0;
+			}
+			else if (version_) {
+				(*version_) = version_of(version.type,
+							 version.seq,
+							 version.val_len);
+			}
+			if (r || (TYPE_MERGE != version.type)) {
+				break;
+			}
+			if (!val_len) { /* an operand always folds to a value */
+				FREE(version.val);
+				return 0;
+			}
+			acc = version.val;
+			acc_len = version.val_len;
+			version.val = NULL;
+		}
+		else {
+			if (combine(lsm,
+				    version.val,
+				    version.val_len,
+				    acc,
+				    acc_len,
+				    &out,
+				    &out_len)) {
+				FREE(version.val);
+				FREE(acc);
+				TRACE(0);
+				return -1;
+			}
+			FREE(acc);
+			acc = out;
+			acc_len = out_len;
+			if (r || (TYPE_MERGE != version.type)) {
+				FREE(version.val);
+				break;
+			}
+			FREE(version.val);
+		}
+		seq = version.seq - 1;
+	}
+	if (acc) {
+		r = 0;
+		version.val = acc;
+		version.val_len = acc_len;
+	}
+	if (r || !version.val_len) {
+		FREE(version.val);
+		return +1;
+	}
+	if (val_len) {
+		memcpy(val, version.val, MIN((*val_len), version.val_len));
+		(*val_len) = version.val_len;
+	}
+	FREE(version.val);
+	return 0;
+}
+
+int
+lsm_append(struct lsm *lsm,
+	   const void *key,
+	   uint64_t key_len,
+	   const void *val,
+	   uint64_t val_len)
+{
+	assert( lsm );
+	assert( key && key_len && (0xffff >= key_len) );
+	assert( (!val_len || val) && (0xffffffff >= val_len) );
+
+	if (put(lsm, TYPE_VALUE, key, key_len, val, val_len, NULL)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+int
+lsm_merge(struct lsm *lsm,
+	  const void *key,
+	  uint64_t key_len,
+	  const void *operand,
+	  uint64_t operand_len)
+{
+	assert( lsm );
+	assert( key && key_len && (0xffff >= key_len) );
+	assert( operand && operand_len && (0xffffffff >= operand_len) );
+
+	if (put(lsm, TYPE_MERGE, key, key_len, operand, operand_len, NULL)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+int /* -1|0|+1 */
+lsm_cas(struct lsm *lsm,
+	const void *key,
+	uint64_t key_len,
+	const void *val,
+	uint64_t val_len,
+	uint64_t *version_)
+{
+	struct version version;
+	struct expect expect;
+	int r;
+
+	assert( lsm );
+	assert( key && key_len && (0xffff >= key_len) );
+	assert( (!val_len || val) && (0xffffffff >= val_len) );
+	assert( version_ );
+
+	expect.version = (*version_);
+	do {
+		pthread_mutex_lock(&lsm->mutex);
+		expect.generation = lsm->generation;
+		pthread_mutex_unlock(&lsm->mutex);
+		memset(&version, 0, sizeof (struct version));
+		if (0 > (r = find(lsm, LSM_LATEST, key, key_len, &version))) {
+			TRACE(0);
+			return -1;
+		}
+		expect.current = r ? 0 : version_of(version.type,
+						    version.seq,
+						    version.val_len);
+		FREE(version.val);
+		r = put(lsm, TYPE_VALUE, key, key_len, val, val_len, &expect);
+	} while (+2 == r);
+	if (0 > r) {
+		TRACE(0);
+		return -1;
+	}
+	(*version_) = expect.version;
+	return r;
+}
+
+void
+lsm_merge_operator(struct lsm *lsm, lsm_merge_fnc_t fnc, void *arg)
+{
+	assert( lsm );
+
+	pthread_mutex_lock(&lsm->mutex);
+	lsm->merge.fnc = fnc;
+	lsm->merge.arg = arg;
+	pthread_mutex_unlock(&lsm->mutex);
+}
+
+int
+lsm_snapshot(struct lsm *lsm, uint64_t *seq)
+{
+	uint64_t n;
+
+	assert( lsm );
+	assert( seq );
+
+	pthread_mutex_lock(&lsm->mutex);
+	n = lsm->snapshots.count + 1;
+	if (!(lsm->snapshots.seqs = grow(lsm->snapshots.seqs,
+					 &lsm->snapshots.capacity,
+					 n,
+					 sizeof (uint64_t)))) {
+		pthread_mutex_unlock(&lsm->mutex);
+		TRACE(0);
+		return -1;
+	}
+	lsm->snapshots.seqs[lsm->snapshots.count++] = lsm->seq;
+	(*seq) = lsm->seq;
+	pthread_mutex_unlock(&lsm->mutex);
+	return 0;
+}
+
+void
+lsm_release(struct lsm *lsm, uint64_t seq)
+{
+	uint64_t i, n;
+
+	assert( lsm );
+
+	pthread_mutex_lock(&lsm->mutex);
+	n = lsm->snapshots.count;
+	for (i=0; i<n; ++i) {
+		if (seq == lsm->snapshots.seqs[i]) {
+			memmove(&lsm->snapshots.seqs[i],
+				&lsm->snapshots.seqs[i + 1],
+				(n - i - 1) * sizeof (uint64_t));
+			--lsm->snapshots.count;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+}
+
+void
+lsm_stats(struct lsm *lsm,
+	  uint64_t *appended,
+	  uint64_t *live,
+	  struct logfs_stats *stats)
+{
+	int i;
+
+	assert( lsm );
+	assert( appended && live && stats );
+
+	pthread_mutex_lock(&lsm->mutex);
+	(*appended) = lsm->size;
+	for ((*live)=0, i=0; i<LEVELS; ++i) {
+		(*live) += lsm->levels[i].size;
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+	logfs_stats(lsm->logfs, stats);
+}
@@ -0,0 +1,192 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * lsm.h
+ */
+
+#ifndef _LSM_H_
+#define _LSM_H_
+
+#include "logfs.h"
+
+#define LSM_LATEST UINT64_MAX
+
+struct lsm;
+
+/**
+ * An associative merge function. Folds operand into val and returns the
+ * result in *out, allocated by the callee with malloc(). val is NULL if the
+ * key is absent. Two operands may be folded into one, so the function must
+ * be associative. It may be called from the background thread.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+typedef int (*lsm_merge_fnc_t)(void *arg,
+			       const void *val,
+			       uint64_t val_len,
+			       const void *operand,
+			       uint64_t operand_len,
+			       void **out,
+			       uint64_t *out_len);
+
+/**
+ * Opens a log-structured merge tree on the block device specified in
+ * pathname. Writes go to a skiplist memtable, full memtables are written
+ * through logfs as sorted immutable runs (with a block index and a Bloom
+ * filter each) and a background thread compacts the runs level by level.
+ * The tree starts out empty.
+ *
+ * pathname: the pathname of the block device
+ * memtable: the memtable size in bytes, also the target size of a run
+ * flags   : as in logfs_open()
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct lsm *lsm_open(const char *pathname, uint64_t memtable, int flags);
+
+/**
+ * Closes a previously opened lsm handle.
+ *
+ * lsm: an opaque handle previously obtained by calling lsm_open()
+ *
+ * Note: lsm may be NULL.
+ */
+
+void lsm_close(struct lsm *lsm);
+
+/**
+ * Looks up the newest version of key visible at sequence number seq.
+ *
+ * lsm    : an opaque handle previously obtained by calling lsm_open()
+ * seq    : LSM_LATEST or a sequence number obtained from lsm_snapshot()
+ * key    : the key
+ * key_len: the key length in bytes
+ * val    : a region of memory large enough to receive *val_len bytes
+ * val_len: in, the size of val; out, the length of the value; NULL to only
+ *          test for existence
+ * version: out, the sequence number of the newest version, 0 if absent or
+ *          removed; may be NULL
+ *
+ * return: 0 if found, +1 if absent or removed, -1 on error
+ */
+
+int lsm_lookup(struct lsm *lsm,
+	       uint64_t seq,
+	       const void *key,
+	       uint64_t key_len,
+	       void *val,
+	       uint64_t *val_len, /* in/out */
+	       uint64_t *version);
+
+/**
+ * Writes a new version of key. A zero length value is a tombstone.
+ *
+ * lsm    : an opaque handle previously obtained by calling lsm_open()
+ * key    : the key
+ * key_len: the key length in bytes
+ * val    : the value
+ * val_len: the value length in bytes
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int lsm_append(struct lsm *lsm,
+	       const void *key,
+	       uint64_t key_len,
+	       const void *val,
+	       uint64_t val_len);
+
+/**
+ * Writes a new version of key if the newest version is still *version, as
+ * returned by lsm_lookup() (0 for an absent key). The comparison and the
+ * write are atomic.
+ *
+ * lsm    : an opaque handle previously obtained by calling lsm_open()
+ * key    : the key
+ * key_len: the key length in bytes
+ * val    : the value
+ * val_len: the value length in bytes
+ * version: in, the expected version; out, the new version on success or the
+ *          current version on a mismatch
+ *
+ * return: 0 on success, +1 on a version mismatch, -1 on error
+ */
+
+int lsm_cas(struct lsm *lsm,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len,
+	    uint64_t *version); /* in/out */
+
+/**
+ * Writes a merge operand for key. The operand is folded into the older
+ * versions of key by lookups and by compaction.
+ *
+ * lsm        : an opaque handle previously obtained by calling lsm_open()
+ * key        : the key
+ * key_len    : the key length in bytes
+ * operand    : the operand
+ * operand_len: the operand length in bytes
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int lsm_merge(struct lsm *lsm,
+	      const void *key,
+	      uint64_t key_len,
+	      const void *operand,
+	      uint64_t operand_len);
+
+/**
+ * Registers the merge function used to fold merge operands.
+ *
+ * lsm: an opaque handle previously obtained by calling lsm_open()
+ * fnc: the merge function
+ * arg: passed through to fnc
+ */
+
+void lsm_merge_operator(struct lsm *lsm, lsm_merge_fnc_t fnc, void *arg);
+
+/**
+ * Pins the current sequence number. Versions visible at the pinned sequence
+ * number survive memtable updates and compaction until released.
+ *
+ * lsm: an opaque handle previously obtained by calling lsm_open()
+ * seq: out, the pinned sequence number
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int lsm_snapshot(struct lsm *lsm, uint64_t *seq);
+
+/**
+ * Releases a sequence number previously pinned by lsm_snapshot().
+ *
+ * lsm: an opaque handle previously obtained by calling lsm_open()
+ * seq: the pinned sequence number
+ */
+
+void lsm_release(struct lsm *lsm, uint64_t seq);
+
+/**
+ * Reports the log bytes written so far, the data bytes of the runs in the
+ * tree, and the state of the log's write ring.
+ *
+ * lsm     : an opaque handle previously obtained by calling lsm_open()
+ * appended: out, log bytes
+ * live    : out, data bytes of the runs referenced by the levels
+ * stats   : out, the log's write ring
+ */
+
+void lsm_stats(struct lsm *lsm,
+	       uint64_t *appended,
+	       uint64_t *live,
+	       struct logfs_stats *stats);
+
+#endif /* _LSM_H_ */
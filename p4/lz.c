@@ -0,0 +1,213 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * lz.c
+ */
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+
+static uint32_t
+load(const unsigned char *p)
+{
+	uint32_t u32;
+
+	memcpy(&u32, p, sizeof (u32));
+	return u32;
+}
+
+static unsigned
+hash(uint32_t u32)
+{
+	return (unsigned)((u32 * 2654435761u) >> (32 - HASH_BITS));
+}
+
+static int
+length(unsigned char **out, const unsigned char *end, uint64_t n)
+{
+	/* the part of a length past its nibble, in 255 steps */
+
+	for (; 255 <= n; n-=255) {
+		if ((*out) >= end) {
+			return -1;
+		}
+		*(*out)++ = 255;
+	}
+	if ((*out) >= end) {
+		return -1;
+	}
+	*(*out)++ = (unsigned char)n;
+	return 0;
+}
+
+static int
+sequence(unsigned char **out,
+	 const unsigned char *end,
+	 const unsigned char *literals,
+	 uint64_t literal_len,
+	 uint64_t offset,  /* 0 ==> last sequence, no match */
+	 uint64_t match_len)
+{
+	unsigned char *token;
+
+	if ((*out) >= end) {
+		return -1;
+	}
+	token = (*out)++;
+	(*token) = (unsigned char)(MIN(literal_len, 15) << 4);
+	if ((15 <= literal_len) && length(out, end, literal_len - 15)) {
+		return -1;
+	}
+	if ((uint64_t)(end - (*out)) < literal_len) {
+		return -1;
+	}
+	memcpy((*out), literals, literal_len);
+	(*out) += literal_len;
+	if (offset) {
+		if (2 > (end - (*out))) {
+			return -1;
+		}
+		*(*out)++ = (unsigned char)(offset & 0xff);
+		*(*out)++ = (unsigned char)(offset >> 8);
+		match_len -= MIN_MATCH;
+		(*token) |= (unsigned char)MIN(match_len, 15);
+		if ((15 <= match_len) && length(out, end, match_len - 15)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+uint64_t
+lz_compress(const void *in_, uint64_t len, void *out_, uint64_t capacity)
+{
+	uint16_t table[1 << HASH_BITS];
+	const unsigned char *in, *p, *anchor, *match, *limit;
+	unsigned char *out, *end;
+	uint64_t n;
+	unsigned h;
+
+	assert( !len || in_ );
+	assert( LZ_MAX_LEN >= len );
+	assert( !capacity || out_ );
+
+	in = (const unsigned char *)in_;
+	out = (unsigned char *)out_;
+	end = out + capacity;
+	memset(table, 0, sizeof (table));
+	anchor = p = in;
+	limit = in + len - MIN(len, MIN_MATCH);
+	while (p < limit) {
+		h = hash(load(p));
+		match = in + table[h];
+		table[h] = (uint16_t)(p - in);
+		if ((match >= p) || (load(match) != load(p))) {
+			++p;
+			continue;
+		}
+
+		/* extend, then emit the literals before it and the match */
+
+		for (n=MIN_MATCH; (p + n) < (in + len); ++n) {
+			if (match[n] != p[n]) {
+				break;
+			}
+		}
+		if (sequence(&out,
+			     end,
+			     anchor,
+			     (uint64_t)(p - anchor),
+			     (uint64_t)(p - match),
+			     n)) {
+			return 0;
+		}
+		p += n;
+		anchor = p;
+	}
+	if (sequence(&out, end, anchor, (uint64_t)(in + len - anchor), 0, 0)) {
+		return 0;
+	}
+	return (uint64_t)(out - (unsigned char *)out_);
+}
+
+static int
+extend(const unsigned char **in, const unsigned char *end, uint64_t *n)
+{
+	unsigned char c;
+
+	do {
+		if ((*in) >= end) {
+			return -1;
+		}
+		c = *(*in)++;
+		(*n) += c;
+	} while (255 == c);
+	return 0;
+}
+
+long
+lz_decompress(const void *in_, uint64_t len, void *out_, uint64_t capacity)
+{
+	const unsigned char *in, *end;
+	unsigned char *out, *match;
+	uint64_t n, offset, i;
+	unsigned char token;
+
+	assert( !len || in_ );
+	assert( !capacity || out_ );
+
+	in = (const unsigned char *)in_;
+	end = in + len;
+	out = (unsigned char *)out_;
+	while (in < end) {
+		token = *in++;
+
+		/* literals */
+
+		n = token >> 4;
+		if ((15 == n) && extend(&in, end, &n)) {
+			return -1;
+		}
+		if (((uint64_t)(end - in) < n) ||
+		    ((capacity - (uint64_t)(out - (unsigned char *)out_)) <
+		     n)) {
+			return -1;
+		}
+		memcpy(out, in, n);
+		in += n;
+		out += n;
+		if (in == end) {
+			break; /* the last sequence has no match */
+		}
+
+		/* match, possibly overlapping its own output */
+
+		if (2 > (end - in)) {
+			return -1;
+		}
+		offset = (uint64_t)in[0] | ((uint64_t)in[1] << 8);
+		in += 2;
+		n = token & 15;
+		if ((15 == n) && extend(&in, end, &n)) {
+			return -1;
+		}
+		n += MIN_MATCH;
+		if (!offset ||
+		    (offset > (uint64_t)(out - (unsigned char *)out_)) ||
+		    ((capacity - (uint64_t)(out - (unsigned char *)out_)) <
+		     n)) {
+			return -1;
+		}
+		match = out - offset;
+		for (i=0; i<n; ++i) {
+			out[i] = match[i];
+		}
+		out += n;
+	}
+	return (long)(out - (unsigned char *)out_);
+}
@@ -0,0 +1,48 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * lz.h
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include "system.h"
+
+#define LZ_MAX_LEN 65535
+
+/**
+ * A byte-oriented LZ77 codec in the manner of LZ4. Each sequence is a token
+ * (literal and match length nibbles), extra length bytes, the literals and
+ * a 16-bit match offset. Matches are found through a single-probe hash of
+ * the next four bytes, so compression is one pass with no allocation.
+ */
+
+/**
+ * Compresses len bytes of in into out.
+ *
+ * in      : the bytes to compress, at most LZ_MAX_LEN of them
+ * len     : the number of bytes in in
+ * out     : receives the compressed bytes
+ * capacity: the size of out
+ *
+ * return: the compressed length, 0 if it does not fit in capacity
+ */
+
+uint64_t lz_compress(const void *in,
+		     uint64_t len,
+		     void *out,
+		     uint64_t capacity);
+
+/**
+ * Decompresses len bytes of in into out.
+ *
+ * return: the decompressed length, -1 if in is malformed or out too small
+ */
+
+long lz_decompress(const void *in, uint64_t len, void *out, uint64_t capacity);
+
+#endif /* _LZ_H_ */
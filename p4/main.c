@@ -7,14 +7,20 @@
  * main.c
  */
 
+#include <pthread.h>
 #include "term.h"
-#include "kvdb.h"
+#include "resp.h"
+#include "lz.h"
+#include "device.h"
+#include "kvshard.h"
+#include "tier.h"
 
 #define SLEN(s) ( safe_strlen(s) + 1 )
 
 #define TEST(f,m)						\
 	do {							\
 		uint64_t t = ref_time();			\
+		fresh();					\
 		if (f()) {					\
 			t = ref_time() - t;			\
 			term_color(TERM_COLOR_RED);		\
@@ -34,6 +40,19 @@
 	} while (0)
 
 static const char *PATHNAME;
+static const struct kvdb_config *CONFIG;
+static const char * const *SHARDS;
+static int SHARDS_N;
+
+static void
+fresh(void)
+{
+	/* every test starts on an empty store, not one a test before saved */
+
+	if (CONFIG && (KVDB_INDEX_SCM == CONFIG->index)) {
+		remove(CONFIG->index_pathname);
+	}
+}
 
 static void
 mk_object(char *key,
@@ -76,7 +95,7 @@ read_write(const uint64_t N, const uint64_t K, const uint64_t V)
 	struct kvdb *kvdb;
 
 	key = val = val_ = NULL;
-	if (!(kvdb = kvdb_open(PATHNAME))) {
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
 		TRACE(0);
 		return -1;
 	}
@@ -148,7 +167,7 @@ heavy_rewrite(void)
 	struct kvdb *kvdb;
 
 	n = 9876;
-	if (!(kvdb = kvdb_open(PATHNAME))) {
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
 		TRACE(0);
 		return -1;
 	}
@@ -170,6 +189,471 @@ heavy_rewrite(void)
 	return 0;
 }
 
+struct stream {
+	uint64_t i;
+	uint64_t n;
+	uint64_t mod;
+	char key[32];
+	char val[32];
+};
+
+static int
+stream_next(void *arg,
+	    const void **key,
+	    uint64_t *key_len,
+	    const void **val,
+	    uint64_t *val_len)
+{
+	struct stream *stream;
+
+	stream = (struct stream *)arg;
+	if (stream->i >= stream->n) {
+		return +1;
+	}
+	safe_sprintf(stream->key,
+		     sizeof (stream->key),
+		     "b%lu",
+		     (unsigned long)(stream->i % stream->mod));
+	safe_sprintf(stream->val,
+		     sizeof (stream->val),
+		     "v%lu",
+		     (unsigned long)stream->i);
+	(*key) = stream->key;
+	(*key_len) = SLEN(stream->key);
+	(*val) = stream->val;
+	(*val_len) = SLEN(stream->val);
+	++stream->i;
+	return 0;
+}
+
+static int
+bulk_load(void)
+{
+	const uint64_t N = 23456;
+	const uint64_t M = 321;
+	struct stream stream;
+	struct kvdb *kvdb;
+	uint64_t i, val_len;
+	char key[32], val[32], val_[32];
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* distinct keys, then a stream with repeats on top */
+
+	memset(&stream, 0, sizeof (stream));
+	stream.n = stream.mod = N;
+	if (kvdb_bulk_load(kvdb, N, 1, stream_next, &stream) ||
+	    (N != kvdb_size(kvdb))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	memset(&stream, 0, sizeof (stream));
+	stream.n = N;
+	stream.mod = M;
+	if (kvdb_bulk_load(kvdb, N, 0, stream_next, &stream) ||
+	    (N != kvdb_size(kvdb))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "b%lu", (unsigned long)i);
+		safe_sprintf(val,
+			     sizeof (val),
+			     "v%lu",
+			     (unsigned long)((i < M) ?
+					     (i + (N - 1 - i) / M * M) :
+					     i));
+		val_len = sizeof (val_);
+		if (kvdb_lookup(kvdb, key, SLEN(key), val_, &val_len) ||
+		    (SLEN(val) != val_len) ||
+		    memcmp(val, val_, val_len)) {
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+	}
+	kvdb_close(kvdb);
+	return 0;
+}
+
+static int
+lookup_batch(void)
+{
+	const int N = 3000;
+	struct kvdb_get *gets;
+	struct kvdb *kvdb;
+	char (*keys)[32];
+	char (*vals)[128];
+	uint64_t i;
+	int e;
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+	gets = malloc(N * sizeof (gets[0]));
+	keys = malloc(N * sizeof (keys[0]));
+	vals = malloc(N * sizeof (vals[0]));
+	if (!gets || !keys || !vals) {
+		TRACE("out of memory");
+		exit(-1);
+	}
+
+	/* every third key absent, the rest with values spread over blocks */
+
+	e = 0;
+	for (i=0; (i<(uint64_t)N) && !e; ++i) {
+		safe_sprintf(keys[i],
+			     sizeof (keys[i]),
+			     "b%lu",
+			     (unsigned long)i);
+		memset(vals[i], (int)i, sizeof (vals[i]));
+		if (i % 3) {
+			e |= kvdb_insert(kvdb,
+					 keys[i],
+					 SLEN(keys[i]),
+					 vals[i],
+					 1 + i % sizeof (vals[i]));
+		}
+	}
+	for (i=0; i<(uint64_t)N; ++i) {
+		gets[i].key = keys[i];
+		gets[i].key_len = SLEN(keys[i]);
+		gets[i].val = vals[i];
+		gets[i].val_len = sizeof (vals[i]);
+		memset(vals[i], 0, sizeof (vals[i]));
+	}
+	e |= kvdb_lookup_batch(kvdb, gets, N, 4);
+	for (i=0; (i<(uint64_t)N) && !e; ++i) {
+		if (!(i % 3)) {
+			e |= (+1 != gets[i].r);
+			continue;
+		}
+		e |= (0 != gets[i].r);
+		e |= ((1 + i % sizeof (vals[i])) != gets[i].val_len);
+		e |= ((char)i != vals[i][0]) ||
+			((char)i != vals[i][gets[i].val_len - 1]);
+	}
+	kvdb_close(kvdb);
+	FREE(gets);
+	FREE(keys);
+	FREE(vals);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+cas_versions(void)
+{
+	const char * const KEY = "KEY";
+	const char * const VAL1 = "VAL1";
+	const char * const VAL2 = "VAL2";
+	uint64_t i, n, v, v1, v2, val_len;
+	struct kvdb *kvdb;
+	char key[32];
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* 0 expects an absent key */
+
+	v1 = v2 = 0;
+	if (kvdb_cas(kvdb, KEY, SLEN(KEY), VAL1, SLEN(VAL1), &v1) ||
+	    !v1 ||
+	    (+1 != kvdb_cas(kvdb, KEY, SLEN(KEY), VAL2, SLEN(VAL2), &v2)) ||
+	    (v1 != v2) ||
+	    kvdb_lookup_version(kvdb, KEY, SLEN(KEY), 0, 0, &v) ||
+	    (v1 != v)) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+
+	/* a stale version loses */
+
+	if (kvdb_cas(kvdb, KEY, SLEN(KEY), VAL2, SLEN(VAL2), &v2) ||
+	    (v1 == v2) ||
+	    (+1 != kvdb_cas(kvdb, KEY, SLEN(KEY), VAL1, SLEN(VAL1), &v1)) ||
+	    (v1 != v2) ||
+	    kvdb_update(kvdb, KEY, SLEN(KEY), VAL1, SLEN(VAL1)) ||
+	    (+1 != kvdb_cas(kvdb, KEY, SLEN(KEY), VAL2, SLEN(VAL2), &v1)) ||
+	    (v1 == v2) ||
+	    kvdb_remove(kvdb, KEY, SLEN(KEY), 0, 0) ||
+	    (+1 != kvdb_lookup_version(kvdb, KEY, SLEN(KEY), 0, 0, &v)) ||
+	    (0 != v) ||
+	    kvdb_cas(kvdb, KEY, SLEN(KEY), VAL2, SLEN(VAL2), &v) ||
+	    (1 != kvdb_size(kvdb))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+
+	/* read-modify-write counter under churn */
+
+	n = v = 0;
+	if (kvdb_cas(kvdb, "n", SLEN("n"), &n, sizeof (n), &v)) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; i<4321; ++i) {
+		safe_sprintf(key,
+			     sizeof (key),
+			     "k%lu",
+			     (unsigned long)(i % 99));
+		val_len = sizeof (n);
+		if (kvdb_update(kvdb, key, SLEN(key), key, SLEN(key)) ||
+		    kvdb_lookup_version(kvdb,
+					"n",
+					SLEN("n"),
+					&n,
+					&val_len,
+					&v) ||
+		    (++n, kvdb_cas(kvdb, "n", SLEN("n"), &n, sizeof (n), &v))) {
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+	}
+	val_len = sizeof (n);
+	if (kvdb_lookup(kvdb, "n", SLEN("n"), &n, &val_len) || (4321 != n)) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	kvdb_close(kvdb);
+	return 0;
+}
+
+static int
+add(void *arg,
+    const void *val,
+    uint64_t val_len,
+    const void *operand,
+    uint64_t operand_len,
+    void **out,
+    uint64_t *out_len)
+{
+	uint64_t a, b;
+
+	UNUSED(arg);
+
+	a = 0;
+	if ((val && (sizeof (a) != val_len)) || (sizeof (b) != operand_len)) {
+		TRACE("software");
+		return -1;
+	}
+	if (val) {
+		memcpy(&a, val, sizeof (a));
+	}
+	memcpy(&b, operand, sizeof (b));
+	if (!((*out) = malloc(sizeof (a)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	a += b;
+	memcpy((*out), &a, sizeof (a));
+	(*out_len) = sizeof (a);
+	return 0;
+}
+
+static int
+merge_counter(void)
+{
+	const uint64_t N = 39876;
+	const uint64_t K = 997;
+	struct kvdb_snapshot *snapshot;
+	uint64_t i, v, w, val_len, live, sum[997], old[997];
+	struct kvdb_stats stats;
+	struct kvdb *kvdb;
+	char key[32];
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+	kvdb_merge_operator(kvdb, add, NULL);
+
+	/* increments only, snapshot half way */
+
+	snapshot = NULL;
+	memset(sum, 0, sizeof (sum));
+	for (i=0; i<N; ++i) {
+		if ((N / 2) == i) {
+			memcpy(old, sum, sizeof (old));
+			if (!(snapshot = kvdb_snapshot(kvdb))) {
+				kvdb_close(kvdb);
+				TRACE("software");
+				return -1;
+			}
+		}
+		safe_sprintf(key, sizeof (key), "k%lu", (unsigned long)(i % K));
+		if (kvdb_merge(kvdb, key, SLEN(key), &i, sizeof (i))) {
+			kvdb_snapshot_release(snapshot);
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+		sum[i % K] += i;
+	}
+	if (K != kvdb_size(kvdb)) {
+		kvdb_snapshot_release(snapshot);
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+
+	/* folded values, now and at the snapshot */
+
+	for (i=0; i<K; ++i) {
+		safe_sprintf(key, sizeof (key), "k%lu", (unsigned long)i);
+		val_len = sizeof (v);
+		if (kvdb_lookup(kvdb, key, SLEN(key), &v, &val_len) ||
+		    (sizeof (v) != val_len) ||
+		    (sum[i] != v)) {
+			kvdb_snapshot_release(snapshot);
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+		val_len = sizeof (v);
+		if (kvdb_snapshot_lookup(snapshot,
+					 key,
+					 SLEN(key),
+					 &v,
+					 &val_len) ||
+		    (sizeof (v) != val_len) ||
+		    (old[i] != v)) {
+			kvdb_snapshot_release(snapshot);
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+	}
+	kvdb_snapshot_release(snapshot);
+
+	/* an operand on a removed key starts from nothing */
+
+	i = 5;
+	val_len = sizeof (v);
+	if (kvdb_remove(kvdb, "k0", SLEN("k0"), 0, 0) ||
+	    kvdb_merge(kvdb, "k0", SLEN("k0"), &i, sizeof (i)) ||
+	    kvdb_lookup(kvdb, "k0", SLEN("k0"), &v, &val_len) ||
+	    (sizeof (v) != val_len) ||
+	    (5 != v) ||
+	    (K != kvdb_size(kvdb))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+
+	/* a lookup folding a long chain writes one value in its place */
+
+	kvdb_stats(kvdb, &stats);
+	live = stats.log.live;
+	for (i=0, v=0; i<1000; ++i) {
+		v += i;
+		val_len = sizeof (w);
+		if (kvdb_merge(kvdb, "k1", SLEN("k1"), &i, sizeof (i)) ||
+		    (!((i + 1) % 20) &&
+		     (kvdb_lookup(kvdb, "k1", SLEN("k1"), &w, &val_len) ||
+		      ((sum[1] + v) != w)))) {
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+	}
+	kvdb_stats(kvdb, &stats);
+	if ((!CONFIG || (KVDB_ENGINE_LSM != CONFIG->engine)) &&
+	    (stats.log.live > (live + 1000))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	kvdb_close(kvdb);
+	return 0;
+}
+
+static int
+snapshot_isolation(void)
+{
+	const char * const KEY1 = "KEY1";
+	const char * const KEY2 = "KEY2";
+	const char * const VAL1 = "VAL1";
+	const char * const VAL2 = "VAL2";
+	struct kvdb_snapshot *snapshot;
+	char key[32], val[32];
+	struct kvdb *kvdb;
+	uint64_t i, val_len;
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* snapshot after the first version */
+
+	if (kvdb_insert(kvdb, KEY1, SLEN(KEY1), VAL1, SLEN(VAL1)) ||
+	    !(snapshot = kvdb_snapshot(kvdb))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+
+	/* newer versions, removals and enough churn to compact */
+
+	if (kvdb_replace(kvdb, KEY1, SLEN(KEY1), VAL2, SLEN(VAL2)) ||
+	    kvdb_remove(kvdb, KEY1, SLEN(KEY1), 0, 0) ||
+	    kvdb_insert(kvdb, KEY2, SLEN(KEY2), VAL2, SLEN(VAL2))) {
+		kvdb_snapshot_release(snapshot);
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; i<4321; ++i) {
+		safe_sprintf(key,
+			     sizeof (key),
+			     "k%lu",
+			     (unsigned long)(i % 321));
+		safe_sprintf(val, sizeof (val), "v%lu", (unsigned long)i);
+		if (kvdb_update(kvdb, key, SLEN(key), val, SLEN(val))) {
+			kvdb_snapshot_release(snapshot);
+			kvdb_close(kvdb);
+			TRACE("software");
+			return -1;
+		}
+	}
+
+	/* the snapshot still sees the old world */
+
+	val_len = sizeof (val);
+	if (kvdb_snapshot_lookup(snapshot, KEY1, SLEN(KEY1), val, &val_len) ||
+	    (SLEN(VAL1) != val_len) ||
+	    memcmp(VAL1, val, val_len) ||
+	    (+1 != kvdb_snapshot_lookup(snapshot, KEY2, SLEN(KEY2), 0, 0)) ||
+	    (+1 != kvdb_snapshot_lookup(snapshot, "k1", SLEN("k1"), 0, 0)) ||
+	    (+1 != kvdb_lookup(kvdb, KEY1, SLEN(KEY1), 0, 0)) ||
+	    kvdb_lookup(kvdb, KEY2, SLEN(KEY2), 0, 0)) {
+		kvdb_snapshot_release(snapshot);
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+	kvdb_snapshot_release(snapshot);
+	kvdb_close(kvdb);
+	return 0;
+}
+
 static int
 basic_logic(void)
 {
@@ -181,7 +665,7 @@ basic_logic(void)
 	uint64_t val_len;
 	char val[32];
 
-	if (!(kvdb = kvdb_open(PATHNAME))) {
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
 		TRACE(0);
 		return -1;
 	}
@@ -298,39 +782,1793 @@ basic_logic(void)
 	return 0;
 }
 
-int
-main(int argc, char *argv[])
+static int
+stats_counters(void)
 {
-	if (2 != argc) {
-		printf("usage: %s block-device\n", argv[0]);
+	const uint64_t N = 2345;
+	static struct kvdb_stats stats;
+	struct kvdb *kvdb;
+	char key[32];
+	uint64_t i;
+	int e, hash;
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
 		return -1;
 	}
+	hash = !CONFIG || (KVDB_ENGINE_LSM != CONFIG->engine);
 
-	/* initialize */
+	/* N inserts, N updates, 2N lookups of which N miss, N removes */
 
-	PATHNAME = argv[1];
-	term_init(0);
+	e = 0;
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "s%lu", (unsigned long)i);
+		e |= kvdb_insert(kvdb, key, SLEN(key), key, SLEN(key));
+		e |= kvdb_update(kvdb, key, SLEN(key), "0123456789", 11);
+		e |= kvdb_lookup(kvdb, key, SLEN(key), 0, 0);
+		key[0] = 'x';
+		e |= (+1 != kvdb_lookup(kvdb, key, SLEN(key), 0, 0));
+	}
+	kvdb_stats(kvdb, &stats);
+	if (e ||
+	    (N != stats.size) ||
+	    (N != stats.ops[KVDB_OP_INSERT].latency.count) ||
+	    (N != stats.ops[KVDB_OP_UPDATE].latency.count) ||
+	    (2 * N != stats.ops[KVDB_OP_LOOKUP].latency.count) ||
+	    (N != stats.ops[KVDB_OP_LOOKUP].misses) ||
+	    stats.ops[KVDB_OP_REMOVE].latency.count ||
+	    stats.ops[KVDB_OP_INSERT].errors ||
+	    (hist_percentile(&stats.ops[KVDB_OP_LOOKUP].latency, 0.5) >
+	     hist_percentile(&stats.ops[KVDB_OP_LOOKUP].latency, 0.99)) ||
+	    (hist_percentile(&stats.ops[KVDB_OP_LOOKUP].latency, 0.999) >
+	     stats.ops[KVDB_OP_LOOKUP].latency.max) ||
+	    (stats.log.live > stats.log.appended) ||
+	    (hash && (!stats.log.live ||
+		      (N != stats.index.size) ||
+		      (stats.index.size > stats.index.capacity) ||
+		      !stats.index.lookups || !stats.index.probes ||
+		      !stats.chain.walks ||
+		      (stats.chain.walks > stats.chain.hops)))) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
 
-	/* prelude */
+	/* nothing reachable once every key is removed */
 
-	term_bold();
-	term_color(TERM_COLOR_BLUE);
-	printf("---------- TEST BEG ----------\n");
-	term_reset();
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "s%lu", (unsigned long)i);
+		e |= kvdb_remove(kvdb, key, SLEN(key), 0, 0);
+	}
+	kvdb_stats(kvdb, &stats);
+	kvdb_close(kvdb);
+	if (e ||
+	    stats.size ||
+	    (N != stats.ops[KVDB_OP_REMOVE].latency.count) ||
+	    (hash && stats.log.live)) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
 
-	/* test */
+static int
+lz_codec(void)
+{
+	static char in[LZ_MAX_LEN], out[LZ_MAX_LEN + 1024], back[LZ_MAX_LEN];
+	static struct kvdb_stats stats;
+	struct kvdb_config config;
+	struct kvdb *kvdb;
+	uint64_t i, j, n, len;
+	char key[32];
+	int e;
 
-	TEST(basic_logic, "basic_logic");
-	TEST(heavy_rewrite, "heavy_rewrite");
-	TEST(read_write_single, "read_write_single");
-	TEST(read_write_small, "read_write_small");
-	TEST(read_write_large, "read_write_large");
+	/* random, runs, repeats, and every length up to a block */
 
-	/* postlude */
+	e = 0;
+	for (i=0; (i<4000) && !e; ++i) {
+		len = (i < 3000) ? i : (uint64_t)rand() % LZ_MAX_LEN;
+		for (j=0; j<len; ++j) {
+			if (!(i % 3)) {
+				in[j] = (char)rand();
+			}
+			else if (1 == (i % 3)) {
+				in[j] = (char)('a' + rand() % 2);
+			}
+			else {
+				in[j] = (char)('0' + (j * j) % 37);
+			}
+		}
+		n = lz_compress(in, len, out, sizeof (out));
+		e |= (len && !n);
+		e |= ((long)len != lz_decompress(out, n, back, sizeof (back)));
+		e |= !!memcmp(in, back, len);
+		e |= (1 < n) && lz_compress(in, len, out, n - 1);
+	}
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
 
-	term_bold();
-	term_color(TERM_COLOR_BLUE);
-	printf("---------- TEST END ----------\n");
-	term_reset();
+	/* JSON values, the device takes a fraction of the log */
+
+	memset(&config, 0, sizeof (config));
+	config.log_compress = 1;
+	if (!(kvdb = kvdb_open_config(PATHNAME, &config))) {
+		TRACE(0);
+		return -1;
+	}
+	for (i=0; i<5000; ++i) {
+		safe_sprintf(key, sizeof (key), "z%lu", (unsigned long)i);
+		safe_sprintf(in,
+			     sizeof (in),
+			     "{\"id\":%lu,\"name\":\"user%lu\",\"active\":true,"
+			     "\"tags\":[\"alpha\",\"beta\",\"gamma\"],"
+			     "\"score\":%lu}",
+			     (unsigned long)i,
+			     (unsigned long)i,
+			     (unsigned long)(i * 7919 % 1000));
+		e |= kvdb_update(kvdb, key, SLEN(key), in, safe_strlen(in));
+	}
+	for (i=0; i<5000; ++i) {
+		safe_sprintf(key, sizeof (key), "z%lu", (unsigned long)i);
+		len = sizeof (back);
+		e |= kvdb_lookup(kvdb, key, SLEN(key), back, &len);
+		e |= (len < 16) || memcmp(back, "{\"id\":", 6);
+	}
+	kvdb_stats(kvdb, &stats);
+	kvdb_close(kvdb);
+	if (e || ((2 * stats.logfs.stored) > stats.logfs.appended)) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+noise(char *buf, uint64_t len, uint64_t seed)
+{
+	uint64_t i;
+
+	/* incompressible, so a compressed log fills the device as well */
+
+	seed = seed * 2654435761u + 1;
+	for (i=0; i<len; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		buf[i] = (char)seed;
+	}
+}
+
+static int
+log_reuse_check(struct kvdb *kvdb,
+		struct kvdb_snapshot *snapshot, /* NULL ==> latest */
+		uint64_t k,
+		uint64_t seed,
+		char *val)
+{
+	static char buf[16 * 1024];
+	uint64_t val_len;
+	char key[32];
+	int r;
+
+	/* seed is writes + 1, 0 if removed */
+
+	safe_sprintf(key, sizeof (key), "r%lu", (unsigned long)k);
+	val_len = sizeof (buf);
+	r = snapshot ?
+		kvdb_snapshot_lookup(snapshot, key, SLEN(key), buf, &val_len) :
+		kvdb_lookup(kvdb, key, SLEN(key), buf, &val_len);
+	if (!seed) {
+		return +1 != r;
+	}
+	noise(val, sizeof (buf), seed - 1);
+	return r || (sizeof (buf) != val_len) || memcmp(buf, val, val_len);
+}
+
+static int
+log_reuse(void)
+{
+	const uint64_t HOT = 64;
+	const uint64_t V = 16 * 1024;
+	static struct kvdb_stats stats;
+	static uint64_t expect[64];
+	static char val[16 * 1024];
+	struct kvdb *kvdb;
+	uint64_t i, k, n, cold, reserve, per;
+	char key[32];
+	int e;
+
+	if (!(kvdb = kvdb_open_config("emu:size=64M", CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/*
+	 * Every segment gets half cold keys, written once, and half updates
+	 * of a few hot keys. No segment ever empties on its own, so once the
+	 * free segments run down to the reserve only the cleaner makes room.
+	 * That is about the device's worth of writes, then a few cleanings,
+	 * on a fixed size emulated device so the run time stays bounded.
+	 */
+
+	memset(expect, 0, sizeof (expect));
+	kvdb_stats(kvdb, &stats);
+	reserve = MIN(KVDB_CLEAN_RESERVE, stats.logfs.segments / 4);
+	per = stats.logfs.segment / (V + 64);
+	n = (stats.logfs.segments + 4 * reserve) * per;
+	e = 0;
+	for (i=0, cold=0; (i<n) && !e; ++i) {
+		if (!(i % per)) {
+			kvdb_stats(kvdb, &stats);
+			if (reserve <= stats.clean.segments) {
+				break;
+			}
+		}
+		k = (i % 2) ? (HOT + cold++) : ((i / 2) % HOT);
+		safe_sprintf(key, sizeof (key), "r%lu", (unsigned long)k);
+		if ((HOT > k) && !((i / 2) % 97) && expect[k]) {
+			e |= kvdb_remove(kvdb, key, SLEN(key), 0, 0);
+			expect[k] = 0;
+			continue;
+		}
+		noise(val, V, (HOT > k) ? i : k);
+		e |= kvdb_update(kvdb, key, SLEN(key), val, V);
+		if (HOT > k) {
+			expect[k] = i + 1;
+		}
+	}
+	for (k=0; (k<HOT) && !e; ++k) {
+		e |= log_reuse_check(kvdb, NULL, k, expect[k], val);
+	}
+	for (k=HOT; (k<(HOT + cold)) && !e; ++k) {
+		e |= log_reuse_check(kvdb, NULL, k, k + 1, val);
+	}
+	kvdb_stats(kvdb, &stats);
+	kvdb_close(kvdb);
+	if (e || !stats.clean.segments || !stats.clean.moved) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+log_snapshot_wrap(void)
+{
+	const uint64_t HOT = 64;
+	const uint64_t BASE = 64;
+	const uint64_t V = 16 * 1024;
+	static struct kvdb_stats stats;
+	static uint64_t expect[64];
+	static char val[16 * 1024];
+	struct kvdb_snapshot *snapshot;
+	struct kvdb *kvdb;
+	uint64_t i, k, n, hot, cold, device;
+	char key[32];
+	int e;
+
+	if (!(kvdb = kvdb_open_config("emu:size=32M", CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* hot and cold keys, then a snapshot of them */
+
+	e = 0;
+	for (k=0; (k<(HOT + BASE)) && !e; ++k) {
+		safe_sprintf(key, sizeof (key), "r%lu", (unsigned long)k);
+		noise(val, V, k);
+		e |= kvdb_update(kvdb, key, SLEN(key), val, V);
+	}
+	if (e || !(snapshot = kvdb_snapshot(kvdb))) {
+		kvdb_close(kvdb);
+		TRACE(0);
+		return -1;
+	}
+
+	/*
+	 * Held while twice the device's worth is written: every other cold key
+	 * removed, then three in four writes to the hot keys and the rest to
+	 * new cold keys. Versions newer than the snapshot are released or
+	 * cleaned, the older ones stay for it, and the log wraps.
+	 */
+
+	for (k=HOT; (k<(HOT + BASE)) && !e; k+=2) {
+		safe_sprintf(key, sizeof (key), "r%lu", (unsigned long)k);
+		e |= kvdb_remove(kvdb, key, SLEN(key), 0, 0);
+	}
+	kvdb_stats(kvdb, &stats);
+	device = stats.logfs.segments * stats.logfs.segment;
+	n = 2 * device / (V + 64);
+	for (i=0, hot=0, cold=0; (i<n) && !e; ++i) {
+		k = (3 == (i % 4)) ? (HOT + BASE + cold++) : (hot++ % HOT);
+		safe_sprintf(key, sizeof (key), "r%lu", (unsigned long)k);
+		noise(val, V, (HOT > k) ? (n + i) : k);
+		e |= kvdb_update(kvdb, key, SLEN(key), val, V);
+		if (HOT > k) {
+			expect[k] = n + i + 1;
+		}
+	}
+
+	/* the snapshot as it was, the latest as written */
+
+	for (k=0; (k<(HOT + BASE)) && !e; ++k) {
+		e |= log_reuse_check(kvdb, snapshot, k, k + 1, val);
+	}
+	for (k=0; (k<HOT) && !e; ++k) {
+		e |= log_reuse_check(kvdb, NULL, k, expect[k], val);
+	}
+	for (k=HOT; (k<(HOT + BASE + cold)) && !e; ++k) {
+		e |= log_reuse_check(kvdb,
+				     NULL,
+				     k,
+				     ((HOT + BASE) > k) && !((k - HOT) % 2) ?
+				     0 :
+				     (k + 1),
+				     val);
+	}
+	kvdb_stats(kvdb, &stats);
+	kvdb_snapshot_release(snapshot);
+	kvdb_close(kvdb);
+	if (e ||
+	    (stats.logfs.appended < (2 * device)) ||
+	    !stats.clean.segments) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+log_readahead(void)
+{
+	const uint64_t N = 16 * 1024 * 1024;
+	static char buf[4096], back[4096];
+	struct logfs_stats stats;
+	struct logfs *logfs;
+	uint64_t i, j, n;
+	int e, flags;
+
+	/* a pattern, read back front to back in record sized pieces */
+
+	e = 0;
+	for (flags=0; (flags<=LOGFS_COMPRESS) && !e; flags+=LOGFS_COMPRESS) {
+		if (!(logfs = logfs_open(PATHNAME, flags))) {
+			TRACE(0);
+			return -1;
+		}
+		for (i=0; (i<N) && !e; i+=sizeof (buf)) {
+			for (j=0; j<sizeof (buf); ++j) {
+				buf[j] = (char)((i + j) * 7 / 3);
+			}
+			e |= logfs_append(logfs, buf, sizeof (buf));
+		}
+		for (i=0; (i<N) && !e; i+=n) {
+			n = MIN(N - i, 100 + i % 57);
+			e |= logfs_read(logfs, back, i, n);
+			for (j=0; j<n; ++j) {
+				e |= (back[j] != (char)((i + j) * 7 / 3));
+			}
+		}
+		logfs_stats(logfs, &stats);
+		logfs_close(logfs);
+		e |= !stats.prefetched || !stats.prefetch_hits;
+	}
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+struct waiter {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t done;
+	uint64_t next; /* log offset the next completion must report */
+	int bad;
+};
+
+static void
+completed(void *arg, uint64_t off, int e)
+{
+	struct waiter *waiter;
+
+	waiter = (struct waiter *)arg;
+	pthread_mutex_lock(&waiter->mutex);
+	waiter->bad |= e || (off != waiter->next);
+	waiter->next = off + 100;
+	++waiter->done;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->mutex);
+}
+
+static int
+log_async(void)
+{
+	const uint64_t N = 2000;
+	static char buf[4096], back[100];
+	struct logfs_stats stats;
+	struct waiter waiter;
+	struct logfs *logfs;
+	uint64_t i, full;
+	int e, r, flags;
+
+	/* a slow device fills the ring, try_append says so */
+
+	if (!(logfs = logfs_open("emu:size=16M,wlat=2000", 0))) {
+		TRACE(0);
+		return -1;
+	}
+	e = 0;
+	for (full=0, i=0; (i<256) && !e; ++i) {
+		memset(buf, (int)i, sizeof (buf));
+		r = logfs_try_append(logfs, buf, sizeof (buf));
+		if (EAGAIN == r) {
+			++full;
+			--i;
+			us_sleep(500);
+			continue;
+		}
+		e |= r;
+	}
+	e |= !full;
+	for (i=0; (i<256) && !e; i+=17) {
+		e |= logfs_read(logfs, back, i * sizeof (buf) + 99, 1);
+		e |= ((char)i != back[0]);
+	}
+	logfs_close(logfs);
+
+	/* small async appends, completed in order once durable */
+
+	memset(&waiter, 0, sizeof (waiter));
+	if (pthread_mutex_init(&waiter.mutex, NULL) ||
+	    pthread_cond_init(&waiter.cond, NULL)) {
+		TRACE("pthread_*()");
+		exit(-1);
+	}
+	for (flags=0; (flags<=LOGFS_COMPRESS) && !e; flags+=LOGFS_COMPRESS) {
+		if (!(logfs = logfs_open("emu:size=16M,wlat=200", flags))) {
+			TRACE(0);
+			return -1;
+		}
+		waiter.done = waiter.next = 0;
+		for (i=0; (i<N) && !e; ++i) {
+			memset(buf, (int)i, 100);
+			r = logfs_append_async(logfs,
+					       buf,
+					       100,
+					       completed,
+					       &waiter);
+			if (EAGAIN == r) {
+				--i;
+				us_sleep(100);
+				continue;
+			}
+			e |= r;
+		}
+		if (!flags) {
+
+			/* the trailing partial block does not wait for more */
+
+			pthread_mutex_lock(&waiter.mutex);
+			while (!e && (N > waiter.done)) {
+				pthread_cond_wait(&waiter.cond, &waiter.mutex);
+			}
+			pthread_mutex_unlock(&waiter.mutex);
+			e |= logfs_read(logfs, back, (N - 1) * 100, 100);
+			e |= ((char)(N - 1) != back[0]) ||
+				((char)(N - 1) != back[99]);
+
+			/* a partial block written early counts once filled */
+
+			logfs_stats(logfs, &stats);
+			e |= (stats.stored > stats.appended);
+		}
+		logfs_close(logfs);
+		e |= (N != waiter.done) || waiter.bad;
+	}
+
+	/* a failed device write, nothing waits on the dead log */
+
+	if (e || !(logfs = logfs_open("emu:size=16M,wlat=2000,wfail=1", 0))) {
+		TRACE("software");
+		return -1;
+	}
+	waiter.done = waiter.next = 0;
+	waiter.bad = 0;
+	e |= logfs_append_async(logfs, buf, sizeof (buf), completed, &waiter);
+	pthread_mutex_lock(&waiter.mutex);
+	while (!e && !waiter.done) {
+		pthread_cond_wait(&waiter.cond, &waiter.mutex);
+	}
+	pthread_mutex_unlock(&waiter.mutex);
+	e |= !waiter.bad;
+	for (i=0, r=0; (i<1024) && !r && !e; ++i) {
+		r = logfs_append(logfs, buf, sizeof (buf));
+	}
+	e |= (0 <= r) ||
+		(0 <= logfs_try_append(logfs, buf, 100)) ||
+		(0 <= logfs_append_async(logfs, buf, 100, completed, &waiter));
+	logfs_close(logfs);
+	e |= (1 != waiter.done);
+	pthread_mutex_destroy(&waiter.mutex);
+	pthread_cond_destroy(&waiter.cond);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+emulated_device(void)
+{
+	static char buf[64 * 1024], back[64 * 1024];
+	struct device *device;
+	struct logfs *logfs;
+	uint64_t i, t;
+	int e;
+
+	/* 200 us per operation, one at a time */
+
+	if (!(device = device_open("emu:size=8M,lat=200,qd=1"))) {
+		TRACE(0);
+		return -1;
+	}
+	e = (8 * 1024 * 1024 != device_size(device)) ||
+		(4096 != device_block(device));
+	t = ref_time();
+	for (i=0; (i<50) && !e; ++i) {
+		memset(buf, (int)i, 4096);
+		e |= device_write(device, buf, i * 4096, 4096);
+	}
+	for (i=0; (i<50) && !e; ++i) {
+		e |= device_read(device, back, i * 4096, 4096);
+		e |= ((char)i != back[0]) || ((char)i != back[4095]);
+	}
+	t = ref_time() - t;
+	device_close(device);
+	e |= (t < 100 * 200);
+
+	/* 64 MB/s, 64 KiB transfers take a millisecond each */
+
+	if (e || !(device = device_open("emu:size=1M,bw=64,qd=4"))) {
+		TRACE("software");
+		return -1;
+	}
+	t = ref_time();
+	for (i=0; (i<16) && !e; ++i) {
+		e |= device_write(device, buf, i * sizeof (buf), sizeof (buf));
+	}
+	t = ref_time() - t;
+	device_close(device);
+	e |= (t < 16 * 1000);
+
+	/* a log on top of it */
+
+	if (e || !(logfs = logfs_open("emu:size=16M,lat=20,spike=100", 0))) {
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; (i<sizeof (buf)) && !e; ++i) {
+		buf[i] = (char)(i * 7 / 3);
+	}
+	for (i=0; (i<64) && !e; ++i) {
+		e |= logfs_append(logfs, buf, 1000 + i);
+	}
+	for (t=0, i=0; (i<64) && !e; t+=1000+i, ++i) {
+		e |= logfs_read(logfs, back, t, 1000 + i);
+		e |= !!memcmp(buf, back, 1000 + i);
+	}
+	logfs_close(logfs);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+buffered_device(void)
+{
+	static char buf[8192], back[8192];
+	struct logfs_stats stats;
+	struct device *device;
+	struct logfs *logfs;
+	char pathname[256];
+	uint64_t i, t;
+	int e, flags;
+
+	/* unaligned transfers through the page cache */
+
+	safe_sprintf(pathname, sizeof (pathname), "buf:%s", PATHNAME);
+	if (!(device = device_open(pathname))) {
+		TRACE(0);
+		return -1;
+	}
+	for (i=0; i<sizeof (buf); ++i) {
+		buf[i] = (char)(i * 7 / 3);
+	}
+	e = (1 != device_align(device));
+	e |= device_write(device, buf + 1, 4097, 1000);
+	e |= device_read(device, back + 3, 4097, 1000);
+	e |= !!memcmp(buf + 1, back + 3, 1000);
+	device_advise(device, 0, 65536, DEVICE_ADVISE_WILLNEED);
+	device_writeback(device, 0, 65536);
+	device_close(device);
+
+	/* a log on top of it */
+
+	for (flags=0; (flags<=LOGFS_COMPRESS) && !e; flags+=LOGFS_COMPRESS) {
+		if (!(logfs = logfs_open(pathname, flags))) {
+			TRACE(0);
+			return -1;
+		}
+		for (i=0; (i<2000) && !e; ++i) {
+			e |= logfs_append(logfs, buf, 1000 + i);
+		}
+		for (t=0, i=0; (i<2000) && !e; t+=1000+i, ++i) {
+			e |= logfs_read(logfs, back, t, 1000 + i);
+			e |= !!memcmp(buf, back, 1000 + i);
+		}
+		logfs_stats(logfs, &stats);
+		logfs_close(logfs);
+		e |= (stats.appended != t);
+	}
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+striped_device(void)
+{
+	static char buf[256 * 1024], back[256 * 1024];
+	const char *single, *striped;
+	struct device *device;
+	struct logfs *logfs;
+	uint64_t i, j, t, t1, t4;
+	int e;
+
+	/* four members at 64 MB/s each take about a quarter of the time */
+
+	single = "emu:size=4M,bw=64,qd=1";
+	striped = "stripe:unit=16K,"
+		"emu:size=4M,bw=64,qd=1+emu:size=4M,bw=64,qd=1+"
+		"emu:size=4M,bw=64,qd=1+emu:size=4M,bw=64,qd=1";
+	for (i=0; i<sizeof (buf); ++i) {
+		buf[i] = (char)(i * 7 / 3);
+	}
+	e = 0;
+	for (t1=t4=0; (!t1 || !t4) && !e; single=striped) {
+		if (!(device = device_open(single))) {
+			TRACE(0);
+			return -1;
+		}
+		t = ref_time();
+		for (i=0; (i<4) && !e; ++i) {
+			e |= device_write(device,
+					  buf,
+					  i * sizeof (buf),
+					  sizeof (buf));
+		}
+		t = ref_time() - t;
+		for (i=0; (i<64) && !e; ++i) {
+			e |= device_read(device, back, i * 12288, 12288);
+			for (j=0; j<12288; ++j) {
+				e |= (back[j] !=
+				      buf[(i * 12288 + j) % sizeof (buf)]);
+			}
+		}
+		if (single == striped) {
+			e |= (16 * 1024 * 1024 != device_size(device));
+			t4 = t;
+		}
+		else {
+			t1 = t;
+		}
+		device_close(device);
+	}
+	e |= ((2 * t4) > t1);
+
+	/* a log on top of it */
+
+	if (e || !(logfs = logfs_open(striped, 0))) {
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; (i<2000) && !e; ++i) {
+		e |= logfs_append(logfs, buf, 1000 + i);
+	}
+	for (t=0, i=0; (i<2000) && !e; t+=1000+i, ++i) {
+		e |= logfs_read(logfs, back, t, 1000 + i);
+		e |= !!memcmp(buf, back, 1000 + i);
+	}
+	logfs_close(logfs);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vectored_io(void)
+{
+	const char *pathnames[3];
+	uint64_t i, j, k, lens[40];
+	struct device *device;
+	void *bufs[40];
+	char *buf;
+	int e;
+
+	/* scattered pieces to consecutive bytes and back, on each kind */
+
+	pathnames[0] = PATHNAME;
+	pathnames[1] = "emu:size=4M";
+	pathnames[2] = "stripe:unit=8K,emu:size=4M+emu:size=4M+emu:size=4M";
+	e = 0;
+	for (k=0; (k<ARRAY_SIZE(pathnames)) && !e; ++k) {
+		if (!(device = device_open(pathnames[k]))) {
+			TRACE(0);
+			return -1;
+		}
+		for (i=0; i<ARRAY_SIZE(bufs); ++i) {
+			lens[i] = 4096 * (1 + i % 3);
+			if (!(bufs[i] = device_alloc(lens[i]))) {
+				TRACE(0);
+				exit(-1);
+			}
+			e |= !!((uint64_t)bufs[i] % DEVICE_ALIGN);
+			memset(bufs[i], (int)(i + k), lens[i]);
+		}
+		e |= device_writev(device,
+				   (const void * const *)bufs,
+				   lens,
+				   (int)ARRAY_SIZE(bufs),
+				   8192);
+		for (i=0; i<ARRAY_SIZE(bufs); ++i) {
+			memset(bufs[i], 0, lens[i]);
+		}
+		e |= device_readv(device,
+				  bufs,
+				  lens,
+				  (int)ARRAY_SIZE(bufs),
+				  8192);
+		for (i=0; i<ARRAY_SIZE(bufs); ++i) {
+			buf = (char *)bufs[i];
+			for (j=0; j<lens[i]; ++j) {
+				e |= ((char)(i + k) != buf[j]);
+			}
+			device_free(bufs[i]);
+		}
+		if (!e && !k) {
+			buf = (char *)device_alloc(4096);
+			e |= device_read(device, buf, 8192 + 4096, 4096);
+			e |= (1 != buf[0]) || (1 != buf[4095]);
+			device_free(buf);
+		}
+		device_close(device);
+	}
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+device_counters(void)
+{
+	struct device_stats *stats;
+	struct device *device;
+	const char *pathnames[2];
+	uint64_t i, k;
+	char line[256];
+	FILE *file;
+	char *buf;
+	int e;
+
+	/* counts, bytes and modeled latency, then the periodic dump */
+
+	pathnames[0] = "emu:size=4M,lat=200";
+	pathnames[1] = "stripe:unit=8K,emu:size=4M,lat=200+emu:size=4M,lat=200";
+	if (!(stats = malloc(sizeof (struct device_stats))) ||
+	    !(buf = device_alloc(16384))) {
+		TRACE("out of memory");
+		exit(-1);
+	}
+	memset(buf, 'd', 16384);
+	e = 0;
+	for (k=0; (k<ARRAY_SIZE(pathnames)) && !e; ++k) {
+		if (!(device = device_open(pathnames[k]))) {
+			TRACE(0);
+			exit(-1);
+		}
+		for (i=0; i<8; ++i) {
+			e |= device_write(device, buf, i * 16384, 16384);
+		}
+		for (i=0; i<4; ++i) {
+			e |= device_read(device, buf, i * 16384, 16384);
+		}
+		e |= device_flush(device);
+		device_stats(device, stats);
+		e |= (8 != stats->ops[DEVICE_OP_WRITE].latency.count);
+		e |= ((8 * 16384) != stats->ops[DEVICE_OP_WRITE].bytes);
+		e |= (4 != stats->ops[DEVICE_OP_READ].latency.count);
+		e |= ((4 * 16384) != stats->ops[DEVICE_OP_READ].bytes);
+		e |= (1 != stats->ops[DEVICE_OP_FLUSH].latency.count);
+		e |= (200000 > hist_percentile(
+			      &stats->ops[DEVICE_OP_READ].latency, 0.5));
+		e |= (13 != stats->depth.count);
+		e |= (stats->busy > stats->elapsed) || !stats->busy;
+		device_close(device);
+	}
+	if (!e) {
+		if (!(file = tmpfile()) ||
+		    !(device = device_open(pathnames[0]))) {
+			TRACE(0);
+			exit(-1);
+		}
+		e |= device_monitor(file, 20);
+		for (i=0; i<256; ++i) {
+			e |= device_read(device, buf, (i % 64) * 16384, 16384);
+		}
+		device_monitor(NULL, 0);
+		device_close(device);
+		rewind(file);
+		e |= !fgets(line, sizeof (line), file);
+		e |= strncmp(line, "emu:", 4) || !strstr(line, "busy");
+		fclose(file);
+	}
+	device_free(buf);
+	FREE(stats);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+struct reader {
+	pthread_t thread;
+	struct logfs *logfs;
+	pthread_mutex_t *mutex;
+	const uint64_t *appended;
+	uint64_t seed;
+	uint64_t reads;
+	int bad;
+};
+
+static void *
+reader(void *arg)
+{
+	const uint64_t N = 16 * 1024 * 1024;
+	struct reader *reader;
+	uint64_t i, j, n, end;
+	char buf[1000];
+
+	/* random ranges below the appended mark, until it is final */
+
+	reader = (struct reader *)arg;
+	do {
+		pthread_mutex_lock(reader->mutex);
+		end = (*reader->appended);
+		pthread_mutex_unlock(reader->mutex);
+		reader->seed ^= reader->seed << 13;
+		reader->seed ^= reader->seed >> 7;
+		reader->seed ^= reader->seed << 17;
+		n = 1 + reader->seed % sizeof (buf);
+		i = (reader->seed >> 16) % (end - n);
+		if (logfs_read(reader->logfs, buf, i, n)) {
+			reader->bad = 1;
+			break;
+		}
+		for (j=0; j<n; ++j) {
+			reader->bad |= (buf[j] != (char)((i + j) * 7 / 3));
+		}
+		++reader->reads;
+	} while ((end < N) && !reader->bad);
+	return NULL;
+}
+
+static int
+log_parallel_read(void)
+{
+	const uint64_t N = 16 * 1024 * 1024;
+	static struct reader readers[4];
+	static char buf[4096];
+	pthread_mutex_t mutex;
+	struct logfs *logfs;
+	uint64_t appended, i, j;
+	int e, k;
+
+	if (!(logfs = logfs_open(PATHNAME, 0))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* readers across flushed and unflushed bytes while appending */
+
+	e = 0;
+	appended = 0;
+	pthread_mutex_init(&mutex, NULL);
+	for (i=0; i<(N/4); i+=sizeof (buf)) {
+		for (j=0; j<sizeof (buf); ++j) {
+			buf[j] = (char)((i + j) * 7 / 3);
+		}
+		e |= logfs_append(logfs, buf, sizeof (buf));
+	}
+	appended = N / 4;
+	memset(readers, 0, sizeof (readers));
+	for (k=0; k<(int)ARRAY_SIZE(readers); ++k) {
+		readers[k].logfs = logfs;
+		readers[k].mutex = &mutex;
+		readers[k].appended = &appended;
+		readers[k].seed = 2654435761u * (uint64_t)(k + 1);
+		if (pthread_create(&readers[k].thread,
+				   NULL,
+				   reader,
+				   &readers[k])) {
+			TRACE("pthread_create()");
+			exit(-1);
+		}
+	}
+	for (; (i<N) && !e; i+=sizeof (buf)) {
+		for (j=0; j<sizeof (buf); ++j) {
+			buf[j] = (char)((i + j) * 7 / 3);
+		}
+		e |= logfs_append(logfs, buf, sizeof (buf));
+		pthread_mutex_lock(&mutex);
+		appended = i + sizeof (buf);
+		pthread_mutex_unlock(&mutex);
+	}
+	if (e) {
+		pthread_mutex_lock(&mutex);
+		appended = N;
+		pthread_mutex_unlock(&mutex);
+	}
+	for (k=0; k<(int)ARRAY_SIZE(readers); ++k) {
+		pthread_join(readers[k].thread, NULL);
+		e |= readers[k].bad || !readers[k].reads;
+	}
+	pthread_mutex_destroy(&mutex);
+	logfs_close(logfs);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+log_prefetch(void)
+{
+	const int N = 64;
+	static char buf[4096];
+	struct logfs_stats before, after;
+	struct logfs *logfs;
+	uint64_t offs[64], reads;
+	int e, i;
+
+	/* every read takes 2ms, a batch of them must overlap on the device */
+
+	if (!(logfs = logfs_open("emu:size=16M,rlat=2000", 0))) {
+		TRACE(0);
+		return -1;
+	}
+	e = 0;
+	for (i=0; (i<N) && !e; ++i) {
+		memset(buf, i, sizeof (buf));
+		e |= logfs_append(logfs, buf, sizeof (buf));
+		offs[i] = (uint64_t)i * sizeof (buf) + 7;
+	}
+	logfs_stats(logfs, &before);
+	while (before.pending && !e) {
+		us_sleep(1000);
+		logfs_stats(logfs, &before);
+	}
+	logfs_prefetch(logfs, offs, N, 8);
+	logfs_stats(logfs, &after);
+	reads = after.device.ops[DEVICE_OP_READ].latency.count -
+		before.device.ops[DEVICE_OP_READ].latency.count;
+	e |= ((uint64_t)N != reads);
+	e |= (2 > after.device.depth.max);
+	for (i=N-1; (0 <= i) && !e; --i) { /* backwards, no readahead */
+		e |= logfs_read(logfs, buf, offs[i], 1);
+		e |= ((char)i != buf[0]);
+	}
+
+	/* all from the read cache, the second batch reads nothing */
+
+	logfs_prefetch(logfs, offs, N, 8);
+	logfs_stats(logfs, &before);
+	e |= (after.device.ops[DEVICE_OP_READ].latency.count !=
+	      before.device.ops[DEVICE_OP_READ].latency.count);
+	logfs_close(logfs);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+struct tally {
+	pthread_mutex_t mutex;
+	unsigned char seen[3456];
+	uint64_t n;
+	uint64_t limit; /* stop after, 0 ==> never */
+	int bad;
+};
+
+static int
+tally(void *arg,
+      const void *key,
+      uint64_t key_len,
+      const void *val,
+      uint64_t val_len)
+{
+	struct tally *tally;
+	char buf[32];
+	uint64_t i, v;
+	int r;
+
+	tally = (struct tally *)arg;
+	memset(buf, 0, sizeof (buf));
+	memcpy(buf, key, MIN(key_len, sizeof (buf) - 1));
+	i = strtoul(buf + 1, NULL, 10);
+	v = 0;
+	if (sizeof (v) == val_len) {
+		memcpy(&v, val, sizeof (v));
+	}
+
+	/* the latest value: updated thirds, incremented sevenths */
+
+	pthread_mutex_lock(&tally->mutex);
+	if ((sizeof (tally->seen) <= i) ||
+	    tally->seen[i]++ ||
+	    !(i % 5) ||
+	    (sizeof (v) != val_len) ||
+	    (v != (((i % 3) ? i : i + 100000) + ((1 == (i % 7)) ? 1 : 0)))) {
+		tally->bad = 1;
+	}
+	r = (++tally->n == tally->limit);
+	pthread_mutex_unlock(&tally->mutex);
+	return r;
+}
+
+static int
+foreach_live(void)
+{
+	const uint64_t N = 3456;
+	static struct tally t;
+	struct kvdb *kvdb;
+	uint64_t i, v;
+	char key[32];
+	int e;
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+	kvdb_merge_operator(kvdb, add, NULL);
+
+	/* every key at least twice in the log, one in five removed */
+
+	e = 0;
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "f%lu", (unsigned long)i);
+		e |= kvdb_insert(kvdb, key, SLEN(key), &i, sizeof (i));
+	}
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "f%lu", (unsigned long)i);
+		v = i + 100000;
+		if (!(i % 3)) {
+			e |= kvdb_update(kvdb, key, SLEN(key), &v, sizeof (v));
+		}
+		if (!(i % 5)) {
+			e |= kvdb_remove(kvdb, key, SLEN(key), 0, 0);
+		}
+		else if (1 == (i % 7)) {
+			v = 1;
+			e |= kvdb_merge(kvdb, key, SLEN(key), &v, sizeof (v));
+		}
+	}
+	if (e || pthread_mutex_init(&t.mutex, NULL)) {
+		kvdb_close(kvdb);
+		TRACE("software");
+		return -1;
+	}
+
+	/* all of them, then an early stop */
+
+	memset(t.seen, 0, sizeof (t.seen));
+	t.n = t.limit = 0;
+	t.bad = 0;
+	e |= kvdb_foreach(kvdb, 4, tally, &t);
+	e |= (t.n != (N - (N + 4) / 5));
+	memset(t.seen, 0, sizeof (t.seen));
+	t.n = 0;
+	t.limit = 10;
+	e |= (+1 != kvdb_foreach(kvdb, 3, tally, &t));
+	e |= (t.n < t.limit);
+	pthread_mutex_destroy(&t.mutex);
+	kvdb_close(kvdb);
+	if (e || t.bad) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+struct picked {
+	pthread_mutex_t mutex;
+	uint64_t n;
+	int bad;
+};
+
+static int
+picked(void *arg,
+       const void *key,
+       uint64_t key_len,
+       const void *val,
+       uint64_t val_len)
+{
+	struct picked *picked;
+	uint32_t age;
+	double score;
+
+	picked = (struct picked *)arg;
+	UNUSED(key);
+	UNUSED(key_len);
+	age = 0;
+	score = 0.0;
+	if (16 <= val_len) {
+		memcpy(&age, val, sizeof (age));
+		memcpy(&score, (const char *)val + 8, sizeof (score));
+	}
+	pthread_mutex_lock(&picked->mutex);
+	if ((16 > val_len) || (90 > age) || (500.0 <= score)) {
+		picked->bad = 1;
+	}
+	++picked->n;
+	pthread_mutex_unlock(&picked->mutex);
+	return 0;
+}
+
+static int
+foreach_filter(void)
+{
+	const uint64_t N = 2000;
+	struct filter *filter;
+	struct picked p;
+	struct kvdb *kvdb;
+	unsigned char val[16];
+	uint64_t i, expect;
+	uint32_t age;
+	double score;
+	char key[32];
+	int e;
+
+	/* constant folding, guarded division, C precedence */
+
+	if (!(filter = filter_open("-7 / 2 == -3 && 7 % 0 == 0 && "
+				   "1 / 0 == 0 && 2.5 * 2 == 5 && "
+				   "!(1 + 2 * 3 != 7) || 0"))) {
+		TRACE(0);
+		return -1;
+	}
+	e = !filter_match(filter, NULL, 0) || filter_width(filter);
+	filter_close(filter);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+
+	/* records of u32 age @0, f64 score @8, every seventh truncated */
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, CONFIG))) {
+		TRACE(0);
+		return -1;
+	}
+	expect = 0;
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "r%lu", (unsigned long)i);
+		age = (uint32_t)(i % 100);
+		score = i * 0.5;
+		memset(val, 0, sizeof (val));
+		memcpy(val, &age, sizeof (age));
+		memcpy(val + 8, &score, sizeof (score));
+		e |= kvdb_insert(kvdb, key, SLEN(key), val, (i % 7) ? 16 : 4);
+		expect += ((i % 7) && (90 <= age) && (500.0 > score)) ? 1 : 0;
+	}
+	if (e || !(filter = filter_open("u32@0 >= 90 && f64@8 < 500.0"))) {
+		kvdb_close(kvdb);
+		TRACE(0);
+		return -1;
+	}
+	e |= (16 != filter_width(filter));
+	memset(&p, 0, sizeof (p));
+	if (pthread_mutex_init(&p.mutex, NULL)) {
+		TRACE("pthread_mutex_init()");
+		exit(-1);
+	}
+	e |= kvdb_foreach_filter(kvdb, 4, filter, picked, &p);
+	pthread_mutex_destroy(&p.mutex);
+	filter_close(filter);
+	kvdb_close(kvdb);
+	if (e || p.bad || (p.n != expect)) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+struct writer {
+	int id;
+	pthread_t thread;
+	struct kvshard *kvshard;
+};
+
+static void *
+sharded_writer(void *arg)
+{
+	struct writer *writer;
+	char key[32], val[32];
+	uint64_t i, val_len;
+
+	writer = (struct writer *)arg;
+	for (i=0; i<4321; ++i) {
+		safe_sprintf(key,
+			     sizeof (key),
+			     "t%d-%lu",
+			     writer->id,
+			     (unsigned long)i);
+		val_len = sizeof (val);
+		if (kvshard_insert(writer->kvshard,
+				   key,
+				   SLEN(key),
+				   key,
+				   SLEN(key)) ||
+		    kvshard_lookup(writer->kvshard,
+				   key,
+				   SLEN(key),
+				   val,
+				   &val_len) ||
+		    (SLEN(key) != val_len) ||
+		    memcmp(key, val, val_len)) {
+			TRACE("software");
+			return arg;
+		}
+	}
+	return NULL;
+}
+
+static int
+tiered_check(struct tier *tier, uint64_t i, uint64_t v)
+{
+	unsigned char val[100];
+	uint64_t val_len, w;
+	char key[32];
+
+	safe_sprintf(key, sizeof (key), "h%lu", (unsigned long)i);
+	val_len = sizeof (val);
+	if (tier_lookup(tier, key, SLEN(key), val, &val_len) ||
+	    (sizeof (val) != val_len)) {
+		return -1;
+	}
+	memcpy(&w, val, sizeof (w));
+	return (w != v) || (val[99] != (unsigned char)v);
+}
+
+static int
+tiered(void)
+{
+	const char * const SCM = "cs238.tier";
+	const uint64_t N = 2000;
+	struct tier_stats s;
+	struct tier *tier;
+	unsigned char val[100];
+	uint64_t i, j, hits;
+	char key[32];
+	int e;
+
+	/* 128 chunks of 128 bytes, 100 hot keys */
+
+	if (!(tier = tier_open(PATHNAME, CONFIG, SCM, 16 * 1024))) {
+		TRACE(0);
+		return -1;
+	}
+	e = 0;
+	for (i=0; i<N; ++i) {
+		safe_sprintf(key, sizeof (key), "h%lu", (unsigned long)i);
+		memset(val, (unsigned char)i, sizeof (val));
+		memcpy(val, &i, sizeof (i));
+		e |= tier_insert(tier, key, SLEN(key), val, sizeof (val));
+	}
+	for (j=0; j<5; ++j) {
+		for (i=0; i<100; ++i) {
+			e |= tiered_check(tier, i, i);
+		}
+	}
+
+	/* a cold pass does not displace them */
+
+	for (j=0; j<2; ++j) {
+		for (i=100; i<N; ++i) {
+			e |= tiered_check(tier, i, i);
+		}
+	}
+	tier_stats(tier, &s);
+	hits = s.hits;
+	for (i=0; i<100; ++i) {
+		e |= tiered_check(tier, i, i);
+	}
+	tier_stats(tier, &s);
+	e |= (hits + 100 != s.hits) || (128 < s.resident);
+	e |= (16 * 1024 < s.used) || !s.promotions;
+
+	/* updated in place, then demoted by hotter keys, written back */
+
+	for (i=0; i<100; ++i) {
+		safe_sprintf(key, sizeof (key), "h%lu", (unsigned long)i);
+		j = i + 5000;
+		memset(val, (unsigned char)j, sizeof (val));
+		memcpy(val, &j, sizeof (j));
+		e |= tier_update(tier, key, SLEN(key), val, sizeof (val));
+	}
+	tier_stats(tier, &s);
+	e |= (100 != s.absorbed);
+	for (j=0; j<12; ++j) {
+		for (i=1000; i<1128; ++i) {
+			e |= tiered_check(tier, i, i);
+		}
+	}
+	for (i=0; i<100; ++i) {
+		e |= tiered_check(tier, i, i + 5000);
+	}
+	tier_stats(tier, &s);
+	e |= !s.writebacks || !s.demotions;
+
+	/* remove and insert see the resident */
+
+	e |= tier_remove(tier, "h1000", SLEN("h1000"), NULL, NULL);
+	e |= (+1 != tier_lookup(tier, "h1000", SLEN("h1000"), NULL, NULL));
+	e |= (+1 != tier_insert(tier, "h1001", SLEN("h1001"), "x", 1));
+	tier_close(tier);
+	remove(SCM);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+scm_restart_val(char *val, uint64_t len, uint64_t i, uint64_t round)
+{
+	memset(val, (int)('a' + (i % 26)), len);
+	if (1 == (i % 3)) {
+		safe_sprintf(val,
+			     len,
+			     "u%lu-%lu",
+			     (unsigned long)i,
+			     (unsigned long)round);
+	}
+	else {
+		safe_sprintf(val, len, "v%lu", (unsigned long)i);
+	}
+}
+
+static int
+scm_restart_check(struct kvdb *kvdb, uint64_t n, uint64_t round)
+{
+	static char val[256], buf[256];
+	uint64_t i, size, val_len;
+	char key[32];
+	int r;
+
+	/* keys below n, every third removed, every third updated in round */
+
+	for (size=0, i=0; i<n; ++i) {
+		safe_sprintf(key, sizeof (key), "s%lu", (unsigned long)i);
+		val_len = sizeof (buf);
+		r = kvdb_lookup(kvdb, key, SLEN(key), buf, &val_len);
+		if (2 == (i % 3)) {
+			if (+1 != r) {
+				TRACE("software");
+				return -1;
+			}
+			continue;
+		}
+		scm_restart_val(val, sizeof (val), i, round);
+		if (r ||
+		    (sizeof (val) != val_len) ||
+		    memcmp(val, buf, sizeof (val))) {
+			TRACE("software");
+			return -1;
+		}
+		++size;
+	}
+	if (size != kvdb_size(kvdb)) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+scm_restart_round(const struct kvdb_config *config,
+		  uint64_t n,
+		  uint64_t round,
+		  uint64_t *appended)
+{
+	static struct kvdb_stats stats;
+	static char val[256];
+	struct kvdb *kvdb;
+	uint64_t i;
+	char key[32];
+	int e;
+
+	/* reopens the store the round before closed, adds n keys */
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, config))) {
+		TRACE(0);
+		return -1;
+	}
+	e = round ? scm_restart_check(kvdb, round * n, round - 1) : 0;
+	e |= round ? 0 : (0 != kvdb_size(kvdb));
+	for (i=round*n; (i<((round + 1) * n)) && !e; ++i) {
+		safe_sprintf(key, sizeof (key), "s%lu", (unsigned long)i);
+		scm_restart_val(val, sizeof (val), i, round);
+		e |= kvdb_insert(kvdb, key, SLEN(key), val, sizeof (val));
+	}
+	for (i=1; (i<((round + 1) * n)) && !e; i+=3) {
+		safe_sprintf(key, sizeof (key), "s%lu", (unsigned long)i);
+		scm_restart_val(val, sizeof (val), i, round);
+		e |= kvdb_update(kvdb, key, SLEN(key), val, sizeof (val));
+	}
+	for (i=round*n; (i<((round + 1) * n)) && !e; ++i) {
+		safe_sprintf(key, sizeof (key), "s%lu", (unsigned long)i);
+		if (2 == (i % 3)) {
+			e |= kvdb_remove(kvdb, key, SLEN(key), 0, 0);
+		}
+	}
+	kvdb_stats(kvdb, &stats);
+	kvdb_close(kvdb);
+	(*appended) = stats.logfs.appended;
+	return e ? -1 : 0;
+}
+
+static int
+scm_restart_overwrite(const struct kvdb_config *config, uint64_t appended)
+{
+	static struct kvdb_stats stats;
+	static char val[256];
+	struct kvdb *kvdb;
+	uint64_t i;
+	char key[32];
+	int e;
+
+	/* a plain store writes the log well past where the saved one ended */
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, config))) {
+		TRACE(0);
+		return -1;
+	}
+	memset(&stats, 0, sizeof (stats));
+	for (e=0, i=0; (stats.logfs.appended<(2 * appended)) && !e; ++i) {
+		safe_sprintf(key, sizeof (key), "p%lu", (unsigned long)i);
+		scm_restart_val(val, sizeof (val), i, 0);
+		e |= kvdb_insert(kvdb, key, SLEN(key), val, sizeof (val));
+		kvdb_stats(kvdb, &stats);
+	}
+	kvdb_close(kvdb);
+	return e ? -1 : 0;
+}
+
+static int
+scm_restart_empty(const struct kvdb_config *config)
+{
+	struct kvdb *kvdb;
+	int e;
+
+	if (!(kvdb = kvdb_open_config(PATHNAME, config))) {
+		TRACE(0);
+		return -1;
+	}
+	e = (0 != kvdb_size(kvdb));
+	e |= (+1 != kvdb_lookup(kvdb, "s0", SLEN("s0"), NULL, NULL));
+	e |= kvdb_insert(kvdb, "s0", SLEN("s0"), "x", 1);
+	kvdb_close(kvdb);
+	return e ? -1 : 0;
+}
+
+static int
+scm_restart(void)
+{
+	const char * const SCM = "cs238.restart.scm";
+	const uint64_t N = 2000;
+	struct kvdb_config config, plain;
+	uint64_t round, appended;
+	int e;
+
+	memset(&config, 0, sizeof (config));
+	config.index = KVDB_INDEX_SCM;
+	config.index_pathname = SCM;
+	e = 0;
+	for (config.log_compress=0;
+	     (2 > config.log_compress) && !e;
+	     ++config.log_compress) {
+		remove(SCM);
+		appended = 0;
+		for (round=0; (round<3) && !e; ++round) {
+			e |= scm_restart_round(&config, N, round, &appended);
+		}
+
+		/* the log rewritten under the saved index, not attached */
+
+		plain = config;
+		plain.index = KVDB_INDEX_MEMORY;
+		e |= scm_restart_overwrite(&plain, appended);
+		e |= scm_restart_empty(&config);
+
+		/* no index file, nothing to attach */
+
+		remove(SCM);
+		e |= scm_restart_empty(&config);
+	}
+	remove(SCM);
+	if (e) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+sharded(void)
+{
+	const int T = 4;
+	struct kvshard_stats stats;
+	struct writer writers[4];
+	struct kvshard *kvshard;
+	void *r;
+	int i, e;
+
+	if (!(kvshard = kvshard_open(SHARDS, SHARDS_N, NULL))) {
+		TRACE(0);
+		return -1;
+	}
+
+	/* concurrent writers */
+
+	for (i=0; i<T; ++i) {
+		writers[i].id = i;
+		writers[i].kvshard = kvshard;
+		if (pthread_create(&writers[i].thread,
+				   NULL,
+				   sharded_writer,
+				   &writers[i])) {
+			TRACE("pthread_create()");
+			exit(-1);
+		}
+	}
+	e = 0;
+	for (i=0; i<T; ++i) {
+		pthread_join(writers[i].thread, &r);
+		e |= !!r;
+	}
+
+	/* combined view adds up, every shard took a share */
+
+	kvshard_stats(kvshard, -1, &stats);
+	if (e || ((T * 4321) != stats.size) || ((T * 4321 * 2) != stats.ops)) {
+		kvshard_close(kvshard);
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; i<kvshard_count(kvshard); ++i) {
+		kvshard_stats(kvshard, i, &stats);
+		if (!stats.size) {
+			kvshard_close(kvshard);
+			TRACE("software");
+			return -1;
+		}
+	}
+	kvshard_close(kvshard);
+	return 0;
+}
+
+static int
+resp_protocol(void)
+{
+	const char *WIRE = "*1\r\n$4\r\nPING\r\n"
+			   "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$0\r\n\r\n"
+			   "*2\r\n$3\r\nGET\r\n$1\r\nk";
+	const void *argv[2];
+	struct resp_request request;
+	struct resp_buf out;
+	uint64_t i, lens[2];
+	long n, m;
+
+	/* pipelined requests, the last one incomplete at every cut */
+
+	n = resp_request(WIRE, safe_strlen(WIRE), &request);
+	if ((14 != n) || (1 != request.argc) ||
+	    (4 != request.lens[0]) || memcmp(request.argv[0], "PING", 4)) {
+		TRACE("software");
+		return -1;
+	}
+	m = resp_request(WIRE + n, safe_strlen(WIRE) - n, &request);
+	if ((26 != m) || (3 != request.argc) ||
+	    (1 != request.lens[1]) || ('k' != request.argv[1][0]) ||
+	    request.lens[2]) {
+		TRACE("software");
+		return -1;
+	}
+	for (i=0; i<=safe_strlen(WIRE + n + m); ++i) {
+		if (resp_request(WIRE + n + m, i, &request)) {
+			TRACE("software");
+			return -1;
+		}
+	}
+
+	/* malformed */
+
+	if ((-1 != resp_request("GET k\r\n", 7, &request)) ||
+	    (-1 != resp_request("*1\r\n$x\r\n", 8, &request)) ||
+	    (-1 != resp_request("*1\r\n$1\r\nab\r\n", 12, &request)) ||
+	    (-1 != resp_request("*99\r\n", 5, &request))) {
+		TRACE("software");
+		return -1;
+	}
+
+	/* encoders against the reply scanner */
+
+	memset(&out, 0, sizeof (out));
+	argv[0] = "GET";
+	argv[1] = "key";
+	lens[0] = lens[1] = 3;
+	if (resp_command(&out, 2, argv, lens) ||
+	    resp_simple(&out, "OK") ||
+	    resp_error(&out, "bad") ||
+	    resp_integer(&out, -42) ||
+	    resp_bulk(&out, NULL, 0) ||
+	    resp_bulk(&out, "a\r\nb", 4)) {
+		resp_free(&out);
+		TRACE(0);
+		return -1;
+	}
+	if ((22 != (n = resp_reply(out.buf, out.len))) ||
+	    (resp_request(out.buf, out.len, &request) != n)) {
+		resp_free(&out);
+		TRACE("software");
+		return -1;
+	}
+	resp_drop(&out, (uint64_t)n);
+	for (i=0; out.len; ++i) {
+		if (0 >= (n = resp_reply(out.buf, out.len)) ||
+		    resp_reply(out.buf, (uint64_t)n - 1)) {
+			resp_free(&out);
+			TRACE("software");
+			return -1;
+		}
+		resp_drop(&out, (uint64_t)n);
+	}
+	resp_free(&out);
+	if (5 != i) {
+		TRACE("software");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+test(const char *name, const struct kvdb_config *config)
+{
+	CONFIG = config;
+
+	/* prelude */
+
+	term_bold();
+	term_color(TERM_COLOR_BLUE);
+	printf("---------- TEST BEG ---------- %s\n", name);
+	term_reset();
+
+	/* test */
+
+	TEST(basic_logic, "basic_logic");
+	TEST(heavy_rewrite, "heavy_rewrite");
+	TEST(snapshot_isolation, "snapshot_isolation");
+	TEST(merge_counter, "merge_counter");
+	TEST(cas_versions, "cas_versions");
+	TEST(lookup_batch, "lookup_batch");
+	TEST(bulk_load, "bulk_load");
+	TEST(stats_counters, "stats_counters");
+	if (!config || (KVDB_ENGINE_LSM != config->engine)) {
+		TEST(foreach_live, "foreach_live");
+		TEST(foreach_filter, "foreach_filter");
+		TEST(log_reuse, "log_reuse");
+		TEST(log_snapshot_wrap, "log_snapshot_wrap");
+	}
+	if (SHARDS_N && !config) {
+		TEST(sharded, "sharded");
+	}
+	if (!config) {
+		TEST(resp_protocol, "resp_protocol");
+		TEST(lz_codec, "lz_codec");
+		TEST(log_readahead, "log_readahead");
+		TEST(log_parallel_read, "log_parallel_read");
+		TEST(log_prefetch, "log_prefetch");
+		TEST(emulated_device, "emulated_device");
+		TEST(buffered_device, "buffered_device");
+		TEST(striped_device, "striped_device");
+		TEST(vectored_io, "vectored_io");
+		TEST(device_counters, "device_counters");
+		TEST(log_async, "log_async");
+		TEST(tiered, "tiered");
+		TEST(scm_restart, "scm_restart");
+	}
+	TEST(read_write_single, "read_write_single");
+	TEST(read_write_small, "read_write_small");
+	TEST(read_write_large, "read_write_large");
+
+	/* postlude */
+
+	term_bold();
+	term_color(TERM_COLOR_BLUE);
+	printf("---------- TEST END ----------\n");
+	term_reset();
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct kvdb_config config;
+
+	if (2 > argc) {
+		printf("usage: %s block-device "
+		       "[index-device [shard-device...]]\n",
+		       argv[0]);
+		return -1;
+	}
+
+	/* initialize */
+
+	PATHNAME = argv[1];
+	SHARDS = (const char * const *)argv + 3;
+	SHARDS_N = MAX(argc - 3, 0);
+	term_init(0);
+	memset(&config, 0, sizeof (config));
+
+	/* test */
+
+	test("memory index", NULL);
+	config.log_compress = 1;
+	test("memory index (compressed log)", &config);
+	config.log_compress = 0;
+	if (3 <= argc) {
+		config.index = KVDB_INDEX_DEVICE;
+		config.index_pathname = argv[2];
+		test("device index", &config);
+		config.index_memory = 64 * 1024;
+		test("device index (64 KiB budget)", &config);
+	}
+	memset(&config, 0, sizeof (config));
+	config.index = KVDB_INDEX_SCM;
+	config.index_pathname = "cs238.scm";
+	test("scm index", &config);
+	remove(config.index_pathname);
+	memset(&config, 0, sizeof (config));
+	config.engine = KVDB_ENGINE_LSM;
+	test("lsm engine", &config);
+	config.lsm_memtable = 16 * 1024;
+	test("lsm engine (16 KiB memtable)", &config);
 	return 0;
 }
@@ -0,0 +1,293 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * resp.c
+ */
+
+#include "resp.h"
+
+#define MAX_DIGITS 18
+
+static int /* -1|0|+1 */
+number(const char *buf, uint64_t len, uint64_t *off, long *n)
+{
+	uint64_t i, digits;
+	int neg;
+
+	/* [-]digits\r\n */
+
+	i = (*off);
+	neg = 0;
+	if ((i < len) && ('-' == buf[i])) {
+		neg = 1;
+		++i;
+	}
+	(*n) = 0;
+	for (digits=0; (i < len) && isdigit((unsigned char)buf[i]); ++i) {
+		if (MAX_DIGITS < ++digits) {
+			return -1;
+		}
+		(*n) = (*n) * 10 + (buf[i] - '0');
+	}
+	if ((i + 1) >= len) {
+		return +1; /* incomplete */
+	}
+	if (('\r' != buf[i]) || ('\n' != buf[i + 1]) || !digits) {
+		return -1;
+	}
+	(*n) = neg ? -(*n) : (*n);
+	(*off) = i + 2;
+	return 0;
+}
+
+long
+resp_request(const char *buf, uint64_t len, struct resp_request *request)
+{
+	uint64_t off;
+	long n, m;
+	int i, r;
+
+	assert( !len || buf );
+	assert( request );
+
+	if (!len) {
+		return 0;
+	}
+	if ('*' != buf[0]) {
+		return -1;
+	}
+	off = 1;
+	if ((r = number(buf, len, &off, &n))) {
+		return (0 > r) ? -1 : 0;
+	}
+	if ((1 > n) || (RESP_MAX_ARGS < n)) {
+		return -1;
+	}
+	request->argc = (int)n;
+	for (i=0; i<n; ++i) {
+		if (off >= len) {
+			return 0;
+		}
+		if ('$' != buf[off++]) {
+			return -1;
+		}
+		if ((r = number(buf, len, &off, &m))) {
+			return (0 > r) ? -1 : 0;
+		}
+		if ((0 > m) || (RESP_MAX_BULK < m)) {
+			return -1;
+		}
+		if ((off + m + 2) > len) {
+			return 0;
+		}
+		if (('\r' != buf[off + m]) || ('\n' != buf[off + m + 1])) {
+			return -1;
+		}
+		request->argv[i] = buf + off;
+		request->lens[i] = (uint64_t)m;
+		off += m + 2;
+	}
+	return (long)off;
+}
+
+long
+resp_reply(const char *buf, uint64_t len)
+{
+	uint64_t off;
+	long n, m;
+	int r;
+
+	assert( !len || buf );
+
+	if (!len) {
+		return 0;
+	}
+	off = 1;
+	switch (buf[0]) {
+	case '+':
+	case '-':
+		for (; (off + 1) < len; ++off) {
+			if (('\r' == buf[off]) && ('\n' == buf[off + 1])) {
+				return (long)(off + 2);
+			}
+		}
+		return 0;
+	case ':':
+		if ((r = number(buf, len, &off, &n))) {
+			return (0 > r) ? -1 : 0;
+		}
+		return (long)off;
+	case '$':
+		if ((r = number(buf, len, &off, &n))) {
+			return (0 > r) ? -1 : 0;
+		}
+		if (-1 == n) {
+			return (long)off; /* null */
+		}
+		if ((0 > n) || (RESP_MAX_BULK < n)) {
+			return -1;
+		}
+		if ((off + n + 2) > len) {
+			return 0;
+		}
+		return (long)(off + n + 2);
+	case '*':
+		if ((r = number(buf, len, &off, &n))) {
+			return (0 > r) ? -1 : 0;
+		}
+		for (; 0<n; --n) {
+			if (0 >= (m = resp_reply(buf + off, len - off))) {
+				return m;
+			}
+			off += m;
+		}
+		return (long)off;
+	default:
+		break;
+	}
+	return -1;
+}
+
+int
+resp_reserve(struct resp_buf *b, uint64_t n)
+{
+	uint64_t capacity;
+	char *buf;
+
+	assert( b );
+
+	if ((b->len + n) <= b->capacity) {
+		return 0;
+	}
+	capacity = MAX(b->len + n, b->capacity * 2);
+	capacity = MAX(capacity, 4096);
+	if (!(buf = realloc(b->buf, capacity))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	b->buf = buf;
+	b->capacity = capacity;
+	return 0;
+}
+
+static int
+put(struct resp_buf *b, const void *buf, uint64_t len)
+{
+	if (resp_reserve(b, len)) {
+		TRACE(0);
+		return -1;
+	}
+	memcpy(b->buf + b->len, buf, len);
+	b->len += len;
+	return 0;
+}
+
+static int
+header(struct resp_buf *b, char type, long n)
+{
+	char buf[32];
+
+	safe_sprintf(buf, sizeof (buf), "%c%ld\r\n", type, n);
+	return put(b, buf, safe_strlen(buf));
+}
+
+int
+resp_command(struct resp_buf *out,
+	     int argc,
+	     const void * const *argv,
+	     const uint64_t *lens)
+{
+	int i;
+
+	assert( out );
+	assert( (0 < argc) && (RESP_MAX_ARGS >= argc) );
+
+	if (header(out, '*', argc)) {
+		TRACE(0);
+		return -1;
+	}
+	for (i=0; i<argc; ++i) {
+		if (resp_bulk(out, argv[i], lens[i])) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+resp_simple(struct resp_buf *out, const char *s)
+{
+	assert( out );
+	assert( s );
+
+	if (put(out, "+", 1) ||
+	    put(out, s, safe_strlen(s)) ||
+	    put(out, "\r\n", 2)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+int
+resp_error(struct resp_buf *out, const char *s)
+{
+	assert( out );
+	assert( s );
+
+	if (put(out, "-ERR ", 5) ||
+	    put(out, s, safe_strlen(s)) ||
+	    put(out, "\r\n", 2)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+int
+resp_integer(struct resp_buf *out, long n)
+{
+	assert( out );
+
+	return header(out, ':', n);
+}
+
+int
+resp_bulk(struct resp_buf *out, const void *buf, uint64_t len)
+{
+	assert( out );
+
+	if (!buf) {
+		return put(out, "$-1\r\n", 5);
+	}
+	if (header(out, '$', (long)len) ||
+	    put(out, buf, len) ||
+	    put(out, "\r\n", 2)) {
+		TRACE(0);
+		return -1;
+	}
+	return 0;
+}
+
+void
+resp_drop(struct resp_buf *b, uint64_t n)
+{
+	assert( b );
+	assert( n <= b->len );
+
+	memmove(b->buf, b->buf + n, b->len - n);
+	b->len -= n;
+}
+
+void
+resp_free(struct resp_buf *b)
+{
+	if (b) {
+		FREE(b->buf);
+		memset(b, 0, sizeof (struct resp_buf));
+	}
+}
@@ -0,0 +1,92 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * resp.h
+ */
+
+#ifndef _RESP_H_
+#define _RESP_H_
+
+#include "system.h"
+
+#define RESP_MAX_ARGS 8
+#define RESP_MAX_BULK (64 * 1024 * 1024)
+
+/**
+ * A subset of the Redis serialization protocol (RESP2). Requests are arrays
+ * of bulk strings, replies are simple strings, errors, integers, bulk
+ * strings or arrays. Any number of requests may be pipelined back to back.
+ */
+
+struct resp_request {
+	int argc;
+	const char *argv[RESP_MAX_ARGS]; /* into the parsed buffer */
+	uint64_t lens[RESP_MAX_ARGS];
+};
+
+struct resp_buf {
+	char *buf;
+	uint64_t len;
+	uint64_t capacity;
+};
+
+/**
+ * Parses one request from the front of buf.
+ *
+ * buf    : the received bytes
+ * len    : the number of received bytes
+ * request: out, the request, pointing into buf
+ *
+ * return: the number of bytes consumed, 0 if incomplete, -1 if malformed
+ */
+
+long resp_request(const char *buf, uint64_t len, struct resp_request *request);
+
+/**
+ * Measures one reply at the front of buf.
+ *
+ * return: the number of bytes in the reply, 0 if incomplete, -1 if malformed
+ */
+
+long resp_reply(const char *buf, uint64_t len);
+
+/**
+ * Appends a request or a reply to out. A NULL bulk string is the null
+ * reply.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int resp_command(struct resp_buf *out,
+		 int argc,
+		 const void * const *argv,
+		 const uint64_t *lens);
+
+int resp_simple(struct resp_buf *out, const char *s);
+
+int resp_error(struct resp_buf *out, const char *s);
+
+int resp_integer(struct resp_buf *out, long n);
+
+int resp_bulk(struct resp_buf *out, const void *buf, uint64_t len);
+
+/**
+ * Makes room for n more bytes at buf + len.
+ *
+ * return: 0 on success, otherwise error
+ */
+
+int resp_reserve(struct resp_buf *b, uint64_t n);
+
+/**
+ * Drops the first n bytes.
+ */
+
+void resp_drop(struct resp_buf *b, uint64_t n);
+
+void resp_free(struct resp_buf *b);
+
+#endif /* _RESP_H_ */
@@ -0,0 +1,525 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * server.c
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "resp.h"
+#include "kvshard.h"
+
+/**
+ * Needs:
+ *   socket()
+ *   bind()
+ *   listen()
+ *   accept4()
+ *   epoll_create1()
+ *   epoll_ctl()
+ *   epoll_wait()
+ *   recv()
+ *   send()
+ *   sigaction()
+ */
+
+#define EVENTS 64
+#define READ_CHUNK (64 * 1024)
+#define IN_LIMIT (4 * 1024 * 1024)  /* bytes read per event, at most */
+#define OUT_LIMIT (4 * 1024 * 1024) /* stop parsing, drain replies first */
+
+struct conn {
+	int fd;
+	int listener;
+	int reading; /* EPOLLIN armed */
+	int writing; /* EPOLLOUT armed */
+	struct resp_buf in;
+	struct resp_buf out;
+};
+
+struct server {
+	int epoll;
+	struct kvshard *kvshard;
+	struct resp_buf val; /* GET scratch */
+};
+
+static volatile sig_atomic_t done;
+
+static void
+stop(int signum)
+{
+	UNUSED(signum);
+
+	done = 1;
+}
+
+static int
+command(const struct resp_request *request, const char *name)
+{
+	uint64_t i, n;
+
+	n = safe_strlen(name);
+	if (n != request->lens[0]) {
+		return 0;
+	}
+	for (i=0; i<n; ++i) {
+		if (toupper((unsigned char)request->argv[0][i]) != name[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+execute(struct server *server,
+	const struct resp_request *request,
+	struct resp_buf *out)
+{
+	const char *key, *val;
+	uint64_t key_len, val_len;
+	int r;
+
+	/* PING */
+
+	if (command(request, "PING") && (1 == request->argc)) {
+		return resp_simple(out, "PONG");
+	}
+	if (2 > request->argc) {
+		return resp_error(out, "unknown command or wrong arguments");
+	}
+	key = request->argv[1];
+	key_len = request->lens[1];
+	if (!key_len || (KVDB_MAX_KEY_LEN < key_len)) {
+		return resp_error(out, "bad key");
+	}
+
+	/* GET key */
+
+	if (command(request, "GET") && (2 == request->argc)) {
+		for (;;) {
+			val_len = server->val.capacity;
+			r = kvshard_lookup(server->kvshard,
+					   key,
+					   key_len,
+					   server->val.buf,
+					   &val_len);
+			if (r || (val_len <= server->val.capacity)) {
+				break;
+			}
+			if (resp_reserve(&server->val, val_len)) {
+				return -1;
+			}
+		}
+		if (0 > r) {
+			return resp_error(out, "lookup failed");
+		}
+		val = server->val.buf ? server->val.buf : "";
+		return resp_bulk(out, r ? NULL : val, val_len);
+	}
+
+	/* SET key val */
+
+	if (command(request, "SET") && (3 == request->argc)) {
+		if (!request->lens[2]) {
+			return resp_error(out, "empty value");
+		}
+		if (kvshard_update(server->kvshard,
+				   key,
+				   key_len,
+				   request->argv[2],
+				   request->lens[2])) {
+			return resp_error(out, "update failed");
+		}
+		return resp_simple(out, "OK");
+	}
+
+	/* DEL key */
+
+	if (command(request, "DEL") && (2 == request->argc)) {
+		r = kvshard_remove(server->kvshard, key, key_len, 0, 0);
+		if (0 > r) {
+			return resp_error(out, "remove failed");
+		}
+		return resp_integer(out, r ? 0 : 1);
+	}
+
+	/* EXISTS key */
+
+	if (command(request, "EXISTS") && (2 == request->argc)) {
+		r = kvshard_lookup(server->kvshard, key, key_len, 0, 0);
+		if (0 > r) {
+			return resp_error(out, "lookup failed");
+		}
+		return resp_integer(out, r ? 0 : 1);
+	}
+	return resp_error(out, "unknown command or wrong arguments");
+}
+
+static void
+conn_close(struct server *server, struct conn *conn)
+{
+	epoll_ctl(server->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	resp_free(&conn->in);
+	resp_free(&conn->out);
+	memset(conn, 0, sizeof (struct conn));
+	FREE(conn);
+}
+
+static int
+conn_watch(struct server *server,
+	   struct conn *conn,
+	   int op,
+	   int reading,
+	   int writing)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof (event));
+	event.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+	event.data.ptr = conn;
+	if (epoll_ctl(server->epoll, op, conn->fd, &event)) {
+		TRACE("epoll_ctl()");
+		return -1;
+	}
+	conn->reading = reading;
+	conn->writing = writing;
+	return 0;
+}
+
+static int /* -1|0|+1 */
+conn_flush(struct conn *conn)
+{
+	ssize_t n;
+
+	/* one send for the whole batch of pipelined replies */
+
+	while (conn->out.len) {
+		n = send(conn->fd, conn->out.buf, conn->out.len, MSG_NOSIGNAL);
+		if (0 > n) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+				return +1; /* pending */
+			}
+			return -1;
+		}
+		resp_drop(&conn->out, (uint64_t)n);
+	}
+	return 0;
+}
+
+static int
+conn_serve(struct server *server, struct conn *conn)
+{
+	struct resp_request request;
+	uint64_t off, limit;
+	int eof, full, reading, r;
+	ssize_t n;
+	long m;
+
+	/*
+	 * A bounded read, only while replies fit: a client that pipelines
+	 * without reading its replies stops being read, it cannot grow the
+	 * buffers. Whatever is left in the socket raises another event.
+	 */
+
+	eof = 0;
+	limit = conn->in.len + IN_LIMIT;
+	while (conn->out.len < OUT_LIMIT) {
+		if (resp_reserve(&conn->in, READ_CHUNK)) {
+			return -1;
+		}
+		n = recv(conn->fd,
+			 conn->in.buf + conn->in.len,
+			 MIN(conn->in.capacity, limit) - conn->in.len,
+			 0);
+		if (0 < n) {
+			conn->in.len += (uint64_t)n;
+			if (conn->in.len >= limit) {
+				break;
+			}
+			continue;
+		}
+		if (!n) {
+			eof = 1;
+		}
+		else if (EINTR == errno) {
+			continue;
+		}
+		else if ((EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+			return -1;
+		}
+		break;
+	}
+	for (;;) {
+
+		/* every complete request, replies batched */
+
+		off = 0;
+		while (conn->out.len < OUT_LIMIT) {
+			m = resp_request(conn->in.buf + off,
+					 conn->in.len - off,
+					 &request);
+			if (0 > m) {
+				resp_error(&conn->out, "protocol error");
+				conn_flush(conn);
+				return -1;
+			}
+			if (!m) {
+				break;
+			}
+			if (execute(server, &request, &conn->out)) {
+				return -1;
+			}
+			off += (uint64_t)m;
+		}
+		resp_drop(&conn->in, off);
+		full = (conn->out.len >= OUT_LIMIT);
+
+		/* reply, then the requests the limit held back */
+
+		if (0 > (r = conn_flush(conn))) {
+			return -1;
+		}
+		if (r || !full) {
+			break;
+		}
+	}
+	if (!r && eof) {
+		return -1;
+	}
+
+	/* no reading while replies back up, or once the client is done */
+
+	reading = !eof && (conn->out.len < OUT_LIMIT);
+	if ((reading != conn->reading) || (r != conn->writing)) {
+		return conn_watch(server, conn, EPOLL_CTL_MOD, reading, r);
+	}
+	return 0;
+}
+
+static void
+conn_accept(struct server *server, struct conn *listener)
+{
+	struct conn *conn;
+	int fd, one;
+
+	for (;;) {
+		if (0 > (fd = accept4(listener->fd,
+				      NULL,
+				      NULL,
+				      SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return;
+		}
+		one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+		if (!(conn = malloc(sizeof (struct conn)))) {
+			close(fd);
+			TRACE("out of memory");
+			continue;
+		}
+		memset(conn, 0, sizeof (struct conn));
+		conn->fd = fd;
+		if (conn_watch(server, conn, EPOLL_CTL_ADD, 1, 0)) {
+			close(fd);
+			FREE(conn);
+		}
+	}
+}
+
+static int
+listen_tcp(const char *address, int port)
+{
+	struct sockaddr_in addr;
+	int fd, one;
+
+	memset(&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	if (1 != inet_pton(AF_INET, address, &addr.sin_addr)) {
+		TRACE("bad address");
+		return -1;
+	}
+	if (0 > (fd = socket(AF_INET,
+			     SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			     0))) {
+		TRACE("socket()");
+		return -1;
+	}
+	one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) ||
+	    listen(fd, SOMAXCONN)) {
+		close(fd);
+		TRACE("bind()/listen()");
+		return -1;
+	}
+	return fd;
+}
+
+static int
+listen_unix(const char *pathname)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (safe_strlen(pathname) >= sizeof (addr.sun_path)) {
+		TRACE("socket pathname too long");
+		return -1;
+	}
+	memcpy(addr.sun_path, pathname, safe_strlen(pathname));
+	if (0 > (fd = socket(AF_UNIX,
+			     SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			     0))) {
+		TRACE("socket()");
+		return -1;
+	}
+	file_delete(pathname);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) ||
+	    listen(fd, SOMAXCONN)) {
+		close(fd);
+		TRACE("bind()/listen()");
+		return -1;
+	}
+	return fd;
+}
+
+static int
+run(struct server *server, struct conn *listeners, int n)
+{
+	struct epoll_event events[EVENTS];
+	struct conn *conn;
+	int i, k;
+
+	for (i=0; i<n; ++i) {
+		if (conn_watch(server, &listeners[i], EPOLL_CTL_ADD, 1, 0)) {
+			return -1;
+		}
+	}
+	while (!done) {
+		if (0 > (k = epoll_wait(server->epoll, events, EVENTS, -1))) {
+			if (EINTR == errno) {
+				continue;
+			}
+			TRACE("epoll_wait()");
+			return -1;
+		}
+		for (i=0; i<k; ++i) {
+			conn = (struct conn *)events[i].data.ptr;
+			if (conn->listener) {
+				conn_accept(server, conn);
+			}
+			else if (conn_serve(server, conn)) {
+				conn_close(server, conn);
+			}
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *address, *unix_pathname;
+	struct conn listeners[2];
+	struct server server;
+	struct sigaction sa;
+	int i, n, port, e;
+
+	/* arguments */
+
+	address = "127.0.0.1";
+	unix_pathname = NULL;
+	port = 0;
+	for (i=1; (i + 1) < argc; i+=2) {
+		if (!strcmp(argv[i], "-p")) {
+			port = atoi(argv[i + 1]);
+		}
+		else if (!strcmp(argv[i], "-a")) {
+			address = argv[i + 1];
+		}
+		else if (!strcmp(argv[i], "-u")) {
+			unix_pathname = argv[i + 1];
+		}
+		else {
+			break;
+		}
+	}
+	if ((i >= argc) || (!port && !unix_pathname)) {
+		printf("usage: %s [-a address] [-p port] [-u unix-socket] "
+		       "block-device...\n",
+		       argv[0]);
+		return -1;
+	}
+
+	/* initialize */
+
+	memset(&sa, 0, sizeof (sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	memset(&server, 0, sizeof (server));
+	memset(listeners, 0, sizeof (listeners));
+	n = 0;
+	if (port) {
+		listeners[n].listener = 1;
+		if (0 > (listeners[n++].fd = listen_tcp(address, port))) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (unix_pathname) {
+		listeners[n].listener = 1;
+		if (0 > (listeners[n++].fd = listen_unix(unix_pathname))) {
+			TRACE(0);
+			return -1;
+		}
+	}
+	if (0 > (server.epoll = epoll_create1(EPOLL_CLOEXEC))) {
+		TRACE("epoll_create1()");
+		return -1;
+	}
+	if (!(server.kvshard = kvshard_open((const char * const *)argv + i,
+					    argc - i,
+					    NULL))) {
+		close(server.epoll);
+		TRACE(0);
+		return -1;
+	}
+
+	/* serve until SIGINT/SIGTERM */
+
+	e = run(&server, listeners, n);
+
+	/* cleanup */
+
+	for (i=0; i<n; ++i) {
+		close(listeners[i].fd);
+	}
+	if (unix_pathname) {
+		file_delete(unix_pathname);
+	}
+	close(server.epoll);
+	kvshard_close(server.kvshard);
+	resp_free(&server.val);
+	return e;
+}
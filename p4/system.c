@@ -10,14 +10,27 @@
 #define _GNU_SOURCE
 
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "system.h"
 
 /**
  * Needs:
  *   gettimeofday()
+ *   clock_gettime()
  *   nanosleep()
  *   unlink()
+ *   open()
+ *   close()
+ *   ftruncate()
+ *   fstat()
+ *   pwrite()
+ *   fsync()
+ *   mmap()
+ *   munmap()
+ *   msync()
  *   vsnprintf()
  *   sysconf()
  */
@@ -34,6 +47,19 @@ ref_time(void)
 	return (uint64_t)timeval.tv_sec * 1000000 + (uint64_t)timeval.tv_usec;
 }
 
+uint64_t
+ref_time_ns(void)
+{
+	struct timespec timespec;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &timespec)) {
+		TRACE("clock_gettime()");
+		return 0;
+	}
+	return (uint64_t)timespec.tv_sec * 1000000000 +
+		(uint64_t)timespec.tv_nsec;
+}
+
 void
 us_sleep(uint64_t us)
 {
@@ -56,6 +82,128 @@ file_delete(const char *pathname)
 	}
 }
 
+void *
+file_map(const char *pathname, uint64_t len)
+{
+	void *p;
+	int fd;
+
+	assert( safe_strlen(pathname) && len );
+
+	if (unlink(pathname) && (ENOENT != errno)) {
+		TRACE("unlink()");
+		return NULL;
+	}
+	if (0 > (fd = open(pathname, O_RDWR | O_CREAT | O_EXCL, 0644))) {
+		TRACE("open()");
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)len)) {
+		close(fd);
+		TRACE("ftruncate()");
+		return NULL;
+	}
+	p = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (close(fd)) {
+		TRACE("close()");
+	}
+	if (MAP_FAILED == p) {
+		TRACE("mmap()");
+		return NULL;
+	}
+	return p;
+}
+
+void *
+file_attach(const char *pathname, uint64_t *len)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	assert( safe_strlen(pathname) && len );
+
+	if (0 > (fd = open(pathname, O_RDWR))) {
+		if (ENOENT != errno) {
+			TRACE("open()");
+		}
+		return NULL;
+	}
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	(*len) = (uint64_t)st.st_size;
+	p = mmap(NULL,
+		 (size_t)(*len),
+		 PROT_READ | PROT_WRITE,
+		 MAP_SHARED,
+		 fd,
+		 0);
+	if (close(fd)) {
+		TRACE("close()");
+	}
+	if (MAP_FAILED == p) {
+		TRACE("mmap()");
+		return NULL;
+	}
+	return p;
+}
+
+int
+file_write(const char *pathname, const void *buf, uint64_t len, uint64_t off)
+{
+	const char *p;
+	ssize_t n;
+	int fd;
+
+	assert( safe_strlen(pathname) && (!len || buf) );
+
+	if (0 > (fd = open(pathname, O_WRONLY))) {
+		TRACE("open()");
+		return -1;
+	}
+	for (p=(const char *)buf; len; p+=n, off+=n, len-=n) {
+		if (0 > (n = pwrite(fd, p, (size_t)len, (off_t)off))) {
+			if (EINTR == errno) {
+				n = 0;
+				continue;
+			}
+			close(fd);
+			TRACE("pwrite()");
+			return -1;
+		}
+	}
+	if (fsync(fd)) {
+		close(fd);
+		TRACE("fsync()");
+		return -1;
+	}
+	if (close(fd)) {
+		TRACE("close()");
+		return -1;
+	}
+	return 0;
+}
+
+int
+file_sync(void *p, uint64_t len)
+{
+	if (msync(p, (size_t)len, MS_SYNC)) {
+		TRACE("msync()");
+		return -1;
+	}
+	return 0;
+}
+
+void
+file_unmap(void *p, uint64_t len)
+{
+	if (p && munmap(p, (size_t)len)) {
+		TRACE("munmap()");
+	}
+}
+
 void
 safe_sprintf(char *buf, size_t len, const char *format, ...)
 {
@@ -58,10 +58,45 @@
 
 uint64_t ref_time(void);
 
+uint64_t ref_time_ns(void); /* monotonic */
+
 void us_sleep(uint64_t us);
 
 void file_delete(const char *pathname);
 
+/**
+ * Maps a new file of len zero bytes, shared, in place of any file at
+ * pathname. The mapping outlives the name, e.g. once a newer file takes
+ * it, until file_unmap().
+ *
+ * return: the mapping or NULL on error
+ */
+
+void *file_map(const char *pathname, uint64_t len);
+
+/**
+ * Maps the whole of an existing file, shared.
+ *
+ * len: out, the file size
+ *
+ * return: the mapping or NULL if there is no such file, or on error
+ */
+
+void *file_attach(const char *pathname, uint64_t *len);
+
+/* len bytes at off into an existing file, durable on return */
+
+int file_write(const char *pathname,
+	       const void *buf,
+	       uint64_t len,
+	       uint64_t off);
+
+/* the mapped bytes [p, p + len) durable in the file, p page aligned */
+
+int file_sync(void *p, uint64_t len);
+
+void file_unmap(void *p, uint64_t len);
+
 void safe_sprintf(char *buf, size_t len, const char *format, ...);
 
 size_t safe_strlen(const char *s);
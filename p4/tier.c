@@ -0,0 +1,550 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * tier.c
+ */
+
+#include <pthread.h>
+#include "index.h"
+#include "tier.h"
+
+#define CLASS_MIN 6  /* 64-byte chunks */
+#define CLASSES 11   /* 64 B .. 64 KiB */
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH (64 * 1024) /* counters per row, a power of two */
+#define SKETCH_AGE (10 * SKETCH_WIDTH) /* accesses between halvings */
+#define PROMOTE 3    /* estimated accesses before a pair is promoted */
+#define SAMPLE 8     /* residents compared when picking a victim */
+#define HEADS 4096   /* hash chains of the residents, a power of two */
+#define NONE UINT64_MAX
+
+/**
+ * Needs:
+ *   pthread_mutex_init()
+ *   pthread_mutex_destroy()
+ *   pthread_mutex_lock()
+ *   pthread_mutex_unlock()
+ */
+
+/*
+ * The region is carved into power-of-two chunks, from the front as needed,
+ * one free list per size class threaded through the free chunks. A chunk
+ * holds the key then the value, the rest is DRAM metadata.
+ */
+
+struct entry {
+	struct entry *next; /* hash chain */
+	uint64_t hash;
+	uint64_t off;       /* chunk in the region */
+	uint64_t key_len;
+	uint64_t val_len;
+	uint64_t slot;      /* position among the residents of its class */
+	int class;
+	int dirty;          /* newer than the log */
+};
+
+struct tier {
+	struct kvdb *kvdb;
+	pthread_mutex_t mutex;
+	char *base;
+	uint64_t capacity;
+	uint64_t brk; /* region bytes carved so far */
+	struct {
+		uint64_t free; /* first free chunk, NONE if empty */
+		uint64_t n;
+		uint64_t capacity;
+		struct entry **residents;
+	} classes[CLASSES];
+	struct entry *heads[HEADS];
+	uint8_t *sketch;
+	uint64_t accesses; /* since the last halving */
+	uint64_t seed;
+	struct tier_stats stats;
+};
+
+static uint64_t
+next(uint64_t *seed)
+{
+	(*seed) ^= (*seed) << 13;
+	(*seed) ^= (*seed) >> 7;
+	(*seed) ^= (*seed) << 17;
+	return (*seed);
+}
+
+static int
+class_of(uint64_t n)
+{
+	int class;
+
+	for (class=0; class<CLASSES; ++class) {
+		if (n <= ((uint64_t)1 << (CLASS_MIN + class))) {
+			return class;
+		}
+	}
+	return -1;
+}
+
+static uint64_t
+chunk(struct tier *tier, int class)
+{
+	uint64_t off, size;
+
+	off = tier->classes[class].free;
+	if (NONE != off) {
+		memcpy(&tier->classes[class].free, tier->base + off, 8);
+		return off;
+	}
+	size = (uint64_t)1 << (CLASS_MIN + class);
+	if ((tier->brk + size) > tier->capacity) {
+		return NONE;
+	}
+	off = tier->brk;
+	tier->brk += size;
+	tier->stats.used = tier->brk;
+	return off;
+}
+
+static void
+release(struct tier *tier, int class, uint64_t off)
+{
+	memcpy(tier->base + off, &tier->classes[class].free, 8);
+	tier->classes[class].free = off;
+}
+
+/* count-min: an estimate never below the true count since the halving */
+
+static uint64_t
+sketch_slot(uint64_t hash, int row)
+{
+	uint64_t lo, hi;
+
+	lo = hash & 0xffffffff;
+	hi = (hash >> 32) | 1;
+	return row * SKETCH_WIDTH + ((lo + row * hi) & (SKETCH_WIDTH - 1));
+}
+
+static uint64_t
+sketch_get(const struct tier *tier, uint64_t hash)
+{
+	uint64_t estimate;
+	int row;
+
+	estimate = UINT8_MAX;
+	for (row=0; row<SKETCH_ROWS; ++row) {
+		estimate = MIN(estimate, tier->sketch[sketch_slot(hash, row)]);
+	}
+	return estimate;
+}
+
+static uint64_t
+sketch_add(struct tier *tier, uint64_t hash)
+{
+	uint64_t i, estimate;
+	uint8_t *counter;
+	int row;
+
+	/* conservative update: only the smallest counters grow */
+
+	estimate = sketch_get(tier, hash);
+	for (row=0; row<SKETCH_ROWS; ++row) {
+		counter = &tier->sketch[sketch_slot(hash, row)];
+		if (((*counter) == estimate) && (UINT8_MAX > (*counter))) {
+			++(*counter);
+		}
+	}
+	if (SKETCH_AGE <= ++tier->accesses) {
+		for (i=0; i<(SKETCH_ROWS * SKETCH_WIDTH); ++i) {
+			tier->sketch[i] >>= 1;
+		}
+		tier->accesses /= 2;
+	}
+	return sketch_get(tier, hash);
+}
+
+static struct entry **
+find(struct tier *tier, const void *key, uint64_t key_len, uint64_t hash)
+{
+	struct entry **link;
+
+	link = &tier->heads[hash & (HEADS - 1)];
+	while ((*link) && (((*link)->hash != hash) ||
+			   ((*link)->key_len != key_len) ||
+			   memcmp(tier->base + (*link)->off, key, key_len))) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static void
+drop(struct tier *tier, struct entry **link)
+{
+	struct entry *entry, *last;
+	int class;
+
+	entry = (*link);
+	(*link) = entry->next;
+	class = entry->class;
+	last = tier->classes[class].residents[--tier->classes[class].n];
+	last->slot = entry->slot;
+	tier->classes[class].residents[entry->slot] = last;
+	release(tier, class, entry->off);
+	--tier->stats.resident;
+	FREE(entry);
+}
+
+static int
+demote(struct tier *tier, struct entry *entry)
+{
+	const char *key;
+
+	/* clean pairs are already on the log */
+
+	key = tier->base + entry->off;
+	if (entry->dirty) {
+		if (kvdb_update(tier->kvdb,
+				key,
+				entry->key_len,
+				key + entry->key_len,
+				entry->val_len)) {
+			TRACE(0);
+			return -1;
+		}
+		++tier->stats.writebacks;
+	}
+	drop(tier, find(tier, key, entry->key_len, entry->hash));
+	++tier->stats.demotions;
+	return 0;
+}
+
+static struct entry *
+victim(struct tier *tier, int class)
+{
+	struct entry *entry, *coldest;
+	uint64_t i, j, n, estimate, least;
+
+	/* the least accessed of a few residents of the class */
+
+	coldest = NULL;
+	least = NONE;
+	n = tier->classes[class].n;
+	for (i=0; i<MIN(n, SAMPLE); ++i) {
+		j = (SAMPLE < n) ? (next(&tier->seed) % n) : i;
+		entry = tier->classes[class].residents[j];
+		if ((estimate = sketch_get(tier, entry->hash)) < least) {
+			least = estimate;
+			coldest = entry;
+		}
+	}
+	return coldest;
+}
+
+static int
+promote(struct tier *tier,
+	const void *key,
+	uint64_t key_len,
+	const void *val,
+	uint64_t val_len,
+	uint64_t hash,
+	uint64_t estimate)
+{
+	struct entry *entry, **residents;
+	uint64_t off, capacity;
+	int class;
+
+	if (0 > (class = class_of(key_len + val_len))) {
+		return 0;
+	}
+	if (NONE == (off = chunk(tier, class))) {
+		if (!(entry = victim(tier, class)) ||
+		    (sketch_get(tier, entry->hash) >= estimate)) {
+			return 0;
+		}
+		if (demote(tier, entry)) {
+			TRACE(0);
+			return -1;
+		}
+		off = chunk(tier, class);
+		assert( NONE != off );
+	}
+	if (tier->classes[class].n == tier->classes[class].capacity) {
+		capacity = MAX(16, tier->classes[class].capacity * 2);
+		if (!(residents = realloc(tier->classes[class].residents,
+					  capacity * sizeof (residents[0])))) {
+			release(tier, class, off);
+			TRACE("out of memory");
+			return -1;
+		}
+		tier->classes[class].residents = residents;
+		tier->classes[class].capacity = capacity;
+	}
+	if (!(entry = malloc(sizeof (struct entry)))) {
+		release(tier, class, off);
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(entry, 0, sizeof (struct entry));
+	entry->hash = hash;
+	entry->off = off;
+	entry->key_len = key_len;
+	entry->val_len = val_len;
+	entry->class = class;
+	memcpy(tier->base + off, key, key_len);
+	memcpy(tier->base + off + key_len, val, val_len);
+	entry->next = tier->heads[hash & (HEADS - 1)];
+	tier->heads[hash & (HEADS - 1)] = entry;
+	entry->slot = tier->classes[class].n++;
+	tier->classes[class].residents[entry->slot] = entry;
+	++tier->stats.resident;
+	++tier->stats.promotions;
+	return 0;
+}
+
+struct tier *
+tier_open(const char *pathname,
+	  const struct kvdb_config *config,
+	  const char *scm_pathname,
+	  uint64_t scm_capacity)
+{
+	struct tier *tier;
+	int class;
+
+	assert( pathname );
+	assert( scm_pathname );
+	assert( scm_capacity );
+
+	if (!(tier = malloc(sizeof (struct tier)))) {
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(tier, 0, sizeof (struct tier));
+	tier->capacity = scm_capacity;
+	tier->seed = 0x9e3779b97f4a7c15;
+	for (class=0; class<CLASSES; ++class) {
+		tier->classes[class].free = NONE;
+	}
+	if (pthread_mutex_init(&tier->mutex, NULL)) {
+		FREE(tier);
+		TRACE("pthread_mutex_init()");
+		return NULL;
+	}
+	if (!(tier->sketch = malloc(SKETCH_ROWS * SKETCH_WIDTH))) {
+		tier_close(tier);
+		TRACE("out of memory");
+		return NULL;
+	}
+	memset(tier->sketch, 0, SKETCH_ROWS * SKETCH_WIDTH);
+	if (!(tier->base = file_map(scm_pathname, tier->capacity)) ||
+	    !(tier->kvdb = kvdb_open_config(pathname, config))) {
+		tier_close(tier);
+		TRACE(0);
+		return NULL;
+	}
+	return tier;
+}
+
+void
+tier_close(struct tier *tier)
+{
+	struct entry *entry;
+	uint64_t i;
+	int class;
+
+	if (tier) {
+		for (class=0; class<CLASSES; ++class) {
+			while (tier->classes[class].n) {
+				entry = tier->classes[class].residents[0];
+				if (demote(tier, entry)) {
+					TRACE(0);
+					break;
+				}
+			}
+			for (i=0; i<tier->classes[class].n; ++i) {
+				FREE(tier->classes[class].residents[i]);
+			}
+			FREE(tier->classes[class].residents);
+		}
+		kvdb_close(tier->kvdb);
+		file_unmap(tier->base, tier->capacity);
+		pthread_mutex_destroy(&tier->mutex);
+		FREE(tier->sketch);
+		memset(tier, 0, sizeof (struct tier));
+	}
+	FREE(tier);
+}
+
+int /* -1|0|+1 */
+tier_remove(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    void *val,
+	    uint64_t *val_len)
+{
+	struct entry **link;
+	uint64_t hash;
+	int r;
+
+	assert( tier );
+
+	/* a resident may be newer than the log, its value is the answer */
+
+	pthread_mutex_lock(&tier->mutex);
+	hash = index_hash(key, key_len);
+	sketch_add(tier, hash);
+	if (!(*(link = find(tier, key, key_len, hash)))) {
+		r = kvdb_remove(tier->kvdb, key, key_len, val, val_len);
+		pthread_mutex_unlock(&tier->mutex);
+		return r;
+	}
+	if (val_len) {
+		if (val) {
+			memcpy(val,
+			       tier->base + (*link)->off + key_len,
+			       MIN((*val_len), (*link)->val_len));
+		}
+		(*val_len) = (*link)->val_len;
+	}
+	drop(tier, link);
+	r = kvdb_remove(tier->kvdb, key, key_len, NULL, NULL);
+	pthread_mutex_unlock(&tier->mutex);
+	return r;
+}
+
+static int /* -1|0|+1 */
+store(struct tier *tier,
+      const void *key,
+      uint64_t key_len,
+      const void *val,
+      uint64_t val_len,
+      int (*fnc)(struct kvdb *,
+		 const void *,
+		 uint64_t,
+		 const void *,
+		 uint64_t),
+      int exists)
+{
+	struct entry **link, *entry;
+	uint64_t hash;
+	int r;
+
+	assert( tier );
+
+	/* a resident's chunk takes the new value if it still fits */
+
+	pthread_mutex_lock(&tier->mutex);
+	hash = index_hash(key, key_len);
+	sketch_add(tier, hash);
+	if ((entry = (*(link = find(tier, key, key_len, hash))))) {
+		if (exists) {
+			pthread_mutex_unlock(&tier->mutex);
+			return +1;
+		}
+		if (entry->class == class_of(key_len + val_len)) {
+			memcpy(tier->base + entry->off + key_len, val, val_len);
+			entry->val_len = val_len;
+			entry->dirty = 1;
+			++tier->stats.absorbed;
+			pthread_mutex_unlock(&tier->mutex);
+			return 0;
+		}
+		drop(tier, link);
+	}
+	r = fnc(tier->kvdb, key, key_len, val, val_len);
+	pthread_mutex_unlock(&tier->mutex);
+	return r;
+}
+
+int /* -1|0|+1 */
+tier_insert(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len)
+{
+	return store(tier, key, key_len, val, val_len, kvdb_insert, 1);
+}
+
+int /* -1|0|+1 */
+tier_update(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len)
+{
+	return store(tier, key, key_len, val, val_len, kvdb_update, 0);
+}
+
+int /* -1|0|+1 */
+tier_replace(struct tier *tier,
+	     const void *key,
+	     uint64_t key_len,
+	     const void *val,
+	     uint64_t val_len)
+{
+	return store(tier, key, key_len, val, val_len, kvdb_replace, 0);
+}
+
+int /* -1|0|+1 */
+tier_lookup(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    void *val,
+	    uint64_t *val_len)
+{
+	struct entry *entry;
+	uint64_t hash, estimate, len;
+	int r;
+
+	assert( tier );
+
+	pthread_mutex_lock(&tier->mutex);
+	hash = index_hash(key, key_len);
+	estimate = sketch_add(tier, hash);
+	if ((entry = (*find(tier, key, key_len, hash)))) {
+		if (val_len) {
+			if (val) {
+				memcpy(val,
+				       tier->base + entry->off + key_len,
+				       MIN((*val_len), entry->val_len));
+			}
+			(*val_len) = entry->val_len;
+		}
+		++tier->stats.hits;
+		pthread_mutex_unlock(&tier->mutex);
+		return 0;
+	}
+
+	/* the log, then SCM if hot and the whole value came back */
+
+	++tier->stats.misses;
+	len = val_len ? (*val_len) : 0;
+	r = kvdb_lookup(tier->kvdb, key, key_len, val, val_len);
+	if (!r &&
+	    val &&
+	    val_len &&
+	    ((*val_len) <= len) &&
+	    (PROMOTE <= estimate) &&
+	    promote(tier, key, key_len, val, (*val_len), hash, estimate)) {
+		r = -1;
+	}
+	pthread_mutex_unlock(&tier->mutex);
+	if (0 > r) {
+		TRACE(0);
+	}
+	return r;
+}
+
+void
+tier_stats(struct tier *tier, struct tier_stats *stats)
+{
+	assert( tier );
+	assert( stats );
+
+	pthread_mutex_lock(&tier->mutex);
+	(*stats) = tier->stats;
+	stats->capacity = tier->capacity;
+	kvdb_stats(tier->kvdb, &stats->kvdb);
+	pthread_mutex_unlock(&tier->mutex);
+}
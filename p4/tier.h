@@ -0,0 +1,106 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * tier.h
+ */
+
+#ifndef _TIER_H_
+#define _TIER_H_
+
+#include "kvdb.h"
+
+struct tier;
+
+struct tier_stats {
+	uint64_t hits;       /* lookups served from SCM */
+	uint64_t misses;     /* lookups that went to the log */
+	uint64_t absorbed;   /* writes applied in place in SCM */
+	uint64_t promotions;
+	uint64_t demotions;
+	uint64_t writebacks; /* demotions that appended to the log */
+	uint64_t resident;   /* pairs in SCM */
+	uint64_t used;       /* SCM bytes carved into chunks */
+	uint64_t capacity;   /* SCM bytes */
+	struct kvdb_stats kvdb;
+};
+
+/**
+ * A two-tier store: a small SCM region, a memory-mapped file on tmpfs or
+ * pmem, in front of a kvdb whose log holds everything. Every access counts
+ * in a count-min sketch of recent access frequencies, halved now and then
+ * so old popularity fades. A lookup that misses SCM is served by kvdb and
+ * promotes the pair once it is hot enough: it takes a free SCM chunk, or
+ * the chunk of a sampled resident of its size class that is accessed less
+ * often. Hot pairs are then read at memory speed, and updated in place
+ * without touching the log. Such a dirty pair is written to the log when
+ * it is demoted, or on tier_close(). Pairs larger than 64 KiB stay on the
+ * log. The SCM file is created anew, as kvdb formats its device.
+ *
+ * pathname    : the block device of the kvdb
+ * config      : the kvdb configuration, NULL for defaults
+ * scm_pathname: the file backing the SCM region, replaced
+ * scm_capacity: the size of the SCM region in bytes
+ *
+ * return: an opaque handle or NULL on error
+ */
+
+struct tier *tier_open(const char *pathname,
+		       const struct kvdb_config *config,
+		       const char *scm_pathname,
+		       uint64_t scm_capacity);
+
+/**
+ * Writes the dirty pairs to the log and closes the kvdb.
+ *
+ * tier: an opaque handle previously obtained by calling tier_open()
+ *
+ * Note: tier may be NULL.
+ */
+
+void tier_close(struct tier *tier);
+
+/**
+ * Same as the kvdb function of the same name. One lock per handle.
+ */
+
+int /* -1|0|+1 */
+tier_remove(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    void *val,
+	    uint64_t *val_len); /* in/out */
+
+int /* -1|0|+1 */
+tier_insert(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len);
+
+int /* -1|0|+1 */
+tier_update(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    const void *val,
+	    uint64_t val_len);
+
+int /* -1|0|+1 */
+tier_replace(struct tier *tier,
+	     const void *key,
+	     uint64_t key_len,
+	     const void *val,
+	     uint64_t val_len);
+
+int /* -1|0|+1 */
+tier_lookup(struct tier *tier,
+	    const void *key,
+	    uint64_t key_len,
+	    void *val,
+	    uint64_t *val_len); /* in/out */
+
+void tier_stats(struct tier *tier, struct tier_stats *stats);
+
+#endif /* _TIER_H_ */
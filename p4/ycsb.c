@@ -0,0 +1,665 @@
+/**
+ * Tony Givargis
+ * Copyright (C), 2023
+ * University of California, Irvine
+ *
+ * CS 238P - Operating Systems
+ * ycsb.c
+ */
+
+#include <pthread.h>
+#include <math.h>
+#include "index.h"
+#include "hist.h"
+#include "kvshard.h"
+
+#define ZIPF_THETA 0.99
+
+enum op {
+	OP_READ,
+	OP_UPDATE,
+	OP_INSERT,
+	OP_SCAN,
+	OP_RMW,
+	OP_END
+};
+
+static const char * const OP_NAMES[] = {
+	"READ", "UPDATE", "INSERT", "SCAN", "READ-MODIFY-WRITE"
+};
+
+enum dist {
+	DIST_UNIFORM,
+	DIST_ZIPFIAN,
+	DIST_LATEST,
+	DIST_DEFAULT
+};
+
+static const char * const DIST_NAMES[] = {
+	"uniform", "zipfian", "latest"
+};
+
+/* the standard YCSB core workloads, proportions in percent */
+
+struct workload {
+	char name;
+	int mix[OP_END];
+	enum dist dist;
+};
+
+static const struct workload WORKLOADS[] = {
+	{ 'A', {  50, 50, 0,  0,  0 }, DIST_ZIPFIAN },
+	{ 'B', {  95,  5, 0,  0,  0 }, DIST_ZIPFIAN },
+	{ 'C', { 100,  0, 0,  0,  0 }, DIST_ZIPFIAN },
+	{ 'D', {  95,  0, 5,  0,  0 }, DIST_LATEST  },
+	{ 'E', {   0,  0, 5, 95,  0 }, DIST_ZIPFIAN },
+	{ 'F', {  50,  0, 0,  0, 50 }, DIST_ZIPFIAN }
+};
+
+struct zipf {
+	uint64_t n;
+	double zetan;
+	double alpha;
+	double eta;
+	double half; /* 1 + 0.5^theta */
+};
+
+struct bench {
+	const struct workload *workload;
+	enum dist dist;
+	uint64_t records;
+	uint64_t key_len;
+	uint64_t val_len;
+	uint64_t scan_len;
+	int threads;
+	struct zipf zipf;
+	struct kvshard *kvshard;
+	pthread_mutex_t mutex;
+	uint64_t inserted; /* next ordinal, guarded by mutex */
+};
+
+struct worker {
+	pthread_t thread;
+	struct bench *bench;
+	uint64_t seed;
+	uint64_t first; /* load phase, ordinals [first, last) */
+	uint64_t last;
+	uint64_t ops;   /* run phases */
+	int failed;
+	struct hist *hist; /* NULL while warming up */
+	char *key;
+	char *val;
+	char *buf;
+};
+
+static uint64_t
+next(uint64_t *seed)
+{
+	(*seed) ^= (*seed) >> 12;
+	(*seed) ^= (*seed) << 25;
+	(*seed) ^= (*seed) >> 27;
+	return (*seed) * 2685821657736338717ul;
+}
+
+static double
+uniform(uint64_t *seed)
+{
+	return (next(seed) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Gray et al., "Quickly Generating Billion-Record Synthetic Databases",
+ * as used by YCSB: ranks [0, n), rank 0 the most popular.
+ */
+
+static void
+zipf_init(struct zipf *zipf, uint64_t n)
+{
+	double zeta2;
+	uint64_t i;
+
+	zipf->n = n;
+	zipf->zetan = 0.0;
+	for (i=1; i<=n; ++i) {
+		zipf->zetan += 1.0 / pow((double)i, ZIPF_THETA);
+	}
+	zeta2 = 1.0 + 1.0 / pow(2.0, ZIPF_THETA);
+	zipf->alpha = 1.0 / (1.0 - ZIPF_THETA);
+	zipf->eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) /
+		(1.0 - zeta2 / zipf->zetan);
+	zipf->half = 1.0 + pow(0.5, ZIPF_THETA);
+}
+
+static uint64_t
+zipf_next(const struct zipf *zipf, uint64_t *seed)
+{
+	double u, uz;
+
+	u = uniform(seed);
+	uz = u * zipf->zetan;
+	if (1.0 > uz) {
+		return 0;
+	}
+	if (zipf->half > uz) {
+		return 1;
+	}
+	return MIN(zipf->n - 1,
+		   (uint64_t)(zipf->n *
+			      pow(zipf->eta * u - zipf->eta + 1.0,
+				  zipf->alpha)));
+}
+
+static uint64_t
+inserted(struct bench *bench)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&bench->mutex);
+	n = bench->inserted;
+	pthread_mutex_unlock(&bench->mutex);
+	return n;
+}
+
+static uint64_t
+choose(struct worker *worker)
+{
+	struct bench *bench;
+	uint64_t n, r;
+
+	bench = worker->bench;
+	n = inserted(bench);
+	switch (bench->dist) {
+	case DIST_UNIFORM:
+		return next(&worker->seed) % n;
+	case DIST_LATEST:
+		r = zipf_next(&bench->zipf, &worker->seed);
+		return n - 1 - (r % n);
+	default:
+		break;
+	}
+
+	/* scrambled so the popular ranks scatter over the key space */
+
+	r = zipf_next(&bench->zipf, &worker->seed);
+	return index_hash(&r, sizeof (r)) % MIN(n, bench->zipf.n);
+}
+
+static void
+mk_key(struct worker *worker, uint64_t ordinal)
+{
+	uint64_t n;
+
+	safe_sprintf(worker->key,
+		     worker->bench->key_len + 1,
+		     "user%012lu",
+		     (unsigned long)ordinal);
+	n = safe_strlen(worker->key);
+	memset(worker->key + n, 'x', worker->bench->key_len - n);
+}
+
+static void
+mk_val(struct worker *worker)
+{
+	uint64_t i, r;
+
+	r = 0;
+	for (i=0; i<worker->bench->val_len; ++i) {
+		if (!(i % 8)) {
+			r = next(&worker->seed);
+		}
+		worker->val[i] = (char)('a' + (r & 0xff) % 26);
+		r >>= 8;
+	}
+}
+
+static int
+execute(struct worker *worker, enum op op)
+{
+	struct bench *bench;
+	uint64_t i, n, len, version;
+	int r;
+
+	bench = worker->bench;
+	len = bench->val_len;
+	switch (op) {
+	case OP_READ:
+		mk_key(worker, choose(worker));
+		return 0 > kvshard_lookup(bench->kvshard,
+					  worker->key,
+					  bench->key_len,
+					  worker->buf,
+					  &len);
+	case OP_UPDATE:
+		mk_key(worker, choose(worker));
+		mk_val(worker);
+		return 0 > kvshard_update(bench->kvshard,
+					  worker->key,
+					  bench->key_len,
+					  worker->val,
+					  bench->val_len);
+	case OP_INSERT:
+		pthread_mutex_lock(&bench->mutex);
+		i = bench->inserted++;
+		pthread_mutex_unlock(&bench->mutex);
+		mk_key(worker, i);
+		mk_val(worker);
+		return 0 > kvshard_update(bench->kvshard,
+					  worker->key,
+					  bench->key_len,
+					  worker->val,
+					  bench->val_len);
+	case OP_SCAN:
+
+		/* no ordered iteration, a run of adjacent ordinals instead */
+
+		n = 1 + next(&worker->seed) % bench->scan_len;
+		i = choose(worker);
+		for (; n; --n, ++i) {
+			mk_key(worker, i);
+			len = bench->val_len;
+			if (0 > kvshard_lookup(bench->kvshard,
+					       worker->key,
+					       bench->key_len,
+					       worker->buf,
+					       &len)) {
+				return -1;
+			}
+		}
+		return 0;
+	case OP_RMW:
+		mk_key(worker, choose(worker));
+		do {
+			len = bench->val_len;
+			version = 0;
+			if (0 > kvshard_lookup_version(bench->kvshard,
+						       worker->key,
+						       bench->key_len,
+						       worker->buf,
+						       &len,
+						       &version)) {
+				return -1;
+			}
+			mk_val(worker);
+			r = kvshard_cas(bench->kvshard,
+					worker->key,
+					bench->key_len,
+					worker->val,
+					bench->val_len,
+					&version);
+		} while (0 < r);
+		return 0 > r;
+	default:
+		break;
+	}
+	return -1;
+}
+
+static void *
+load(void *arg)
+{
+	struct worker *worker;
+	uint64_t i;
+
+	worker = (struct worker *)arg;
+	for (i=worker->first; i<worker->last; ++i) {
+		mk_key(worker, i);
+		mk_val(worker);
+		if (kvshard_update(worker->bench->kvshard,
+				   worker->key,
+				   worker->bench->key_len,
+				   worker->val,
+				   worker->bench->val_len)) {
+			worker->failed = 1;
+			TRACE(0);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void *
+run(void *arg)
+{
+	struct worker *worker;
+	uint64_t i, t;
+	enum op op;
+	int p;
+
+	worker = (struct worker *)arg;
+	for (i=0; i<worker->ops; ++i) {
+		p = (int)(next(&worker->seed) % 100);
+		for (op=OP_READ; op<OP_END; ++op) {
+			if (p < worker->bench->workload->mix[op]) {
+				break;
+			}
+			p -= worker->bench->workload->mix[op];
+		}
+		t = ref_time_ns();
+		if (execute(worker, op)) {
+			worker->failed = 1;
+			TRACE(0);
+			break;
+		}
+		if (worker->hist) {
+			hist_add(&worker->hist[op], ref_time_ns() - t);
+		}
+	}
+	return NULL;
+}
+
+static int
+phase(struct bench *bench,
+      struct worker *workers,
+      void *(*fnc)(void *),
+      uint64_t *elapsed)
+{
+	int i, e;
+
+	(*elapsed) = ref_time_ns();
+	for (i=0; i<bench->threads; ++i) {
+		if (pthread_create(&workers[i].thread,
+				   NULL,
+				   fnc,
+				   &workers[i])) {
+			TRACE("pthread_create()");
+			exit(-1);
+		}
+	}
+	for (e=0, i=0; i<bench->threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		e |= workers[i].failed;
+	}
+	(*elapsed) = ref_time_ns() - (*elapsed);
+	return e;
+}
+
+static void
+report(const struct bench *bench,
+       const struct hist *hists,
+       uint64_t load_elapsed,
+       uint64_t elapsed,
+       int json)
+{
+	const struct hist *hist;
+	uint64_t n, total;
+	int op, first;
+
+	for (total=0, op=0; op<OP_END; ++op) {
+		total += hists[op].count;
+	}
+	if (json) {
+		printf("{\"workload\": \"%c\", \"distribution\": \"%s\", "
+		       "\"threads\": %d, \"records\": %lu, "
+		       "\"key_len\": %lu, \"val_len\": %lu,\n",
+		       bench->workload->name,
+		       DIST_NAMES[bench->dist],
+		       bench->threads,
+		       (unsigned long)bench->records,
+		       (unsigned long)bench->key_len,
+		       (unsigned long)bench->val_len);
+		printf(" \"load_ops_per_sec\": %.0f, \"operations\": %lu, "
+		       "\"ops_per_sec\": %.0f,\n \"ops\": [",
+		       bench->records / (load_elapsed * 1e-9),
+		       (unsigned long)total,
+		       total / (elapsed * 1e-9));
+	}
+	else {
+		printf("workload,distribution,threads,op,count,ops_per_sec,"
+		       "mean_us,p50_us,p99_us,p999_us,max_us\n");
+		printf("%c,%s,%d,LOAD,%lu,%.0f,,,,,\n",
+		       bench->workload->name,
+		       DIST_NAMES[bench->dist],
+		       bench->threads,
+		       (unsigned long)bench->records,
+		       bench->records / (load_elapsed * 1e-9));
+	}
+	for (first=1, op=0; op<OP_END; ++op) {
+		hist = &hists[op];
+		if (!(n = hist->count)) {
+			continue;
+		}
+		if (json) {
+			printf("%s\n  {\"op\": \"%s\", \"count\": %lu, "
+			       "\"mean_us\": %.2f, \"p50_us\": %.2f, "
+			       "\"p99_us\": %.2f, \"p999_us\": %.2f, "
+			       "\"max_us\": %.2f}",
+			       first ? "" : ",",
+			       OP_NAMES[op],
+			       (unsigned long)n,
+			       hist->sum * 1e-3 / n,
+			       hist_percentile(hist, 0.5) * 1e-3,
+			       hist_percentile(hist, 0.99) * 1e-3,
+			       hist_percentile(hist, 0.999) * 1e-3,
+			       hist->max * 1e-3);
+		}
+		else {
+			printf("%c,%s,%d,%s,%lu,%.0f,"
+			       "%.2f,%.2f,%.2f,%.2f,%.2f\n",
+			       bench->workload->name,
+			       DIST_NAMES[bench->dist],
+			       bench->threads,
+			       OP_NAMES[op],
+			       (unsigned long)n,
+			       n / (elapsed * 1e-9),
+			       hist->sum * 1e-3 / n,
+			       hist_percentile(hist, 0.5) * 1e-3,
+			       hist_percentile(hist, 0.99) * 1e-3,
+			       hist_percentile(hist, 0.999) * 1e-3,
+			       hist->max * 1e-3);
+		}
+		first = 0;
+	}
+	if (json) {
+		printf("\n ]}\n");
+	}
+	else {
+		printf("%c,%s,%d,ALL,%lu,%.0f,,,,,\n",
+		       bench->workload->name,
+		       DIST_NAMES[bench->dist],
+		       bench->threads,
+		       (unsigned long)total,
+		       total / (elapsed * 1e-9));
+	}
+}
+
+static void
+usage(const char *name)
+{
+	printf("usage: %s [-w A-F] [-d uniform|zipfian|latest] [-r records] "
+	       "[-o operations] [-W warmup-operations] [-t threads] "
+	       "[-k key-len] [-v val-len] [-s max-scan-len] [-e hash|lsm] "
+	       "[-f csv|json] [-m monitor-ms] block-device...\n",
+	       name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct kvshard_stats *stats;
+	struct kvdb_config *configs;
+	struct worker *workers;
+	struct hist *hists;
+	struct bench bench;
+	uint64_t ops, warmup, monitor, load_elapsed, elapsed;
+	enum kvdb_engine engine;
+	int i, j, n, json, e;
+	char *s;
+
+	/* arguments */
+
+	memset(&bench, 0, sizeof (bench));
+	bench.workload = &WORKLOADS[0];
+	bench.dist = DIST_DEFAULT;
+	bench.records = 100000;
+	bench.key_len = 24;
+	bench.val_len = 100;
+	bench.scan_len = 100;
+	bench.threads = 4;
+	ops = 100000;
+	warmup = 10000;
+	monitor = 0;
+	engine = KVDB_ENGINE_HASH;
+	json = 0;
+	for (i=1; (i + 1) < argc && ('-' == argv[i][0]); i+=2) {
+		s = argv[i + 1];
+		switch (argv[i][1]) {
+		case 'w':
+			for (j=0; j<(int)(sizeof (WORKLOADS) /
+					   sizeof (WORKLOADS[0])); ++j) {
+				if (toupper((unsigned char)s[0]) ==
+				    WORKLOADS[j].name) {
+					bench.workload = &WORKLOADS[j];
+				}
+			}
+			break;
+		case 'd':
+			for (j=0; j<DIST_DEFAULT; ++j) {
+				if (!strcmp(s, DIST_NAMES[j])) {
+					bench.dist = (enum dist)j;
+				}
+			}
+			break;
+		case 'r':
+			bench.records = strtoul(s, NULL, 10);
+			break;
+		case 'o':
+			ops = strtoul(s, NULL, 10);
+			break;
+		case 'W':
+			warmup = strtoul(s, NULL, 10);
+			break;
+		case 't':
+			bench.threads = atoi(s);
+			break;
+		case 'k':
+			bench.key_len = strtoul(s, NULL, 10);
+			break;
+		case 'v':
+			bench.val_len = strtoul(s, NULL, 10);
+			break;
+		case 's':
+			bench.scan_len = strtoul(s, NULL, 10);
+			break;
+		case 'e':
+			engine = strcmp(s, "lsm") ? KVDB_ENGINE_HASH :
+				KVDB_ENGINE_LSM;
+			break;
+		case 'f':
+			json = !strcmp(s, "json");
+			break;
+		case 'm':
+			monitor = strtoul(s, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if ((i >= argc) ||
+	    !bench.records ||
+	    (0 >= bench.threads) ||
+	    (16 > bench.key_len) ||
+	    (KVDB_MAX_KEY_LEN < bench.key_len) ||
+	    !bench.val_len ||
+	    !bench.scan_len) {
+		usage(argv[0]);
+		return -1;
+	}
+	if (DIST_DEFAULT == bench.dist) {
+		bench.dist = bench.workload->dist;
+	}
+
+	/* initialize */
+
+	n = argc - i;
+	if (!(configs = malloc(n * sizeof (struct kvdb_config)))) {
+		TRACE("out of memory");
+		return -1;
+	}
+	memset(configs, 0, n * sizeof (struct kvdb_config));
+	for (j=0; j<n; ++j) {
+		configs[j].engine = engine;
+	}
+	if (!(bench.kvshard = kvshard_open((const char * const *)argv + i,
+					   n,
+					   configs))) {
+		FREE(configs);
+		TRACE(0);
+		return -1;
+	}
+	FREE(configs);
+	if (pthread_mutex_init(&bench.mutex, NULL)) {
+		TRACE("pthread_mutex_init()");
+		exit(-1);
+	}
+	zipf_init(&bench.zipf, bench.records);
+	workers = malloc(bench.threads * sizeof (struct worker));
+	hists = malloc(bench.threads * OP_END * sizeof (struct hist));
+	if (!workers || !hists) {
+		TRACE("out of memory");
+		exit(-1);
+	}
+	memset(workers, 0, bench.threads * sizeof (struct worker));
+	memset(hists, 0, bench.threads * OP_END * sizeof (struct hist));
+	for (j=0; j<bench.threads; ++j) {
+		workers[j].bench = &bench;
+		workers[j].seed = 0x2545f491u * (uint64_t)(j + 1);
+		workers[j].first = bench.records * j / bench.threads;
+		workers[j].last = bench.records * (j + 1) / bench.threads;
+		workers[j].key = malloc(bench.key_len + 1);
+		workers[j].val = malloc(bench.val_len);
+		workers[j].buf = malloc(bench.val_len);
+		if (!workers[j].key || !workers[j].val || !workers[j].buf) {
+			TRACE("out of memory");
+			exit(-1);
+		}
+	}
+
+	/* load, warm up, measure, the devices to stderr meanwhile */
+
+	if (monitor && device_monitor(stderr, monitor)) {
+		TRACE(0);
+		exit(-1);
+	}
+	bench.inserted = bench.records;
+	e = phase(&bench, workers, load, &load_elapsed);
+	for (j=0; j<bench.threads; ++j) {
+		workers[j].ops = warmup / bench.threads;
+	}
+	e = e ? e : phase(&bench, workers, run, &elapsed);
+	for (j=0; j<bench.threads; ++j) {
+		workers[j].ops = ops / bench.threads;
+		workers[j].hist = &hists[j * OP_END];
+	}
+	e = e ? e : phase(&bench, workers, run, &elapsed);
+
+	/* report */
+
+	device_monitor(NULL, 0);
+	if (!e) {
+		for (j=1; j<bench.threads; ++j) {
+			for (i=0; i<OP_END; ++i) {
+				hist_merge(&hists[i], &hists[j * OP_END + i]);
+			}
+		}
+		report(&bench, hists, load_elapsed, elapsed, json);
+	}
+	if (monitor && (stats = malloc(sizeof (struct kvshard_stats)))) {
+		kvshard_stats(bench.kvshard, -1, stats);
+		device_stats_print(&stats->kvdb.logfs.device, "log", stderr);
+		FREE(stats);
+	}
+
+	/* cleanup */
+
+	for (j=0; j<bench.threads; ++j) {
+		FREE(workers[j].key);
+		FREE(workers[j].val);
+		FREE(workers[j].buf);
+	}
+	FREE(workers);
+	FREE(hists);
+	pthread_mutex_destroy(&bench.mutex);
+	kvshard_close(bench.kvshard);
+	return e ? -1 : 0;
+}